@@ -19,6 +19,8 @@
 #include <pthread.h>
 #include "interfaces.h"
 #include "pa_fwupdate.h"
+#include "pa_flash.h"
+#include "pa_flash_local.h"
 #include "cwe_local.h"
 #include "log.h"
 #include "sys_flash.h"
@@ -483,6 +485,7 @@ COMPONENT_INIT
             sscanf(le_arg_GetArg( 1 ), "%u", &suspendAtOffset);
             sys_flash_SetSizeInByte( "lefwkro", st.st_size, 2 );
             sys_flash_SetSizeInByte( "lefwkro2", st.st_size, 2 );
+            pa_flash_InvalidateMtdCache();
             Testpa_fwupdate_Download(imagePtr, suspendAtOffset);
         }
     }
@@ -7,13 +7,245 @@
 
 #include "legato.h"
 #include <pthread.h>
+#include <endian.h>
 #include "interfaces.h"
 #include "pa_fwupdate.h"
+#include "pa_fwupdate_dualsys.h"
+#include "pa_fwupdate_dualsys_local.h"
+#include "pa_flash.h"
+#include "pa_patch.h"
 #include "log.h"
 #include "sys_flash.h"
 
 #define FILE_PATH "/fwupdate/dwl_status.nfo"
 #define TEST_FILE "/tmp/test_file.txt"
+#define PACKAGE_FILE "/tmp/test_package.cwe"
+
+#define RESUME_CTX_FILENAME0   "/fwupdate/fwupdate_ResumeCtx_0"
+#define RESUME_CTX_FILENAME1   "/fwupdate/fwupdate_ResumeCtx_1"
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Length of the data chunks read from the package by the PA. Data are flashed and a checkpoint may
+ * be written after each chunk.
+ */
+//--------------------------------------------------------------------------------------------------
+#define CHUNK_LENGTH 65536
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Number of data chunks of the test package image, enough to fill the resume context journal
+ */
+//--------------------------------------------------------------------------------------------------
+#define PACKAGE_CHUNK_COUNT (RESUME_CTX_JOURNAL_MAX + 3)
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Size of the customer partitions in PEB, enough to hold the test package image
+ */
+//--------------------------------------------------------------------------------------------------
+#define CUSTOMER_PEB_COUNT 160
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Offset of the image data in the test package: an APPL header followed by a CUS0 header
+ */
+//--------------------------------------------------------------------------------------------------
+#define PACKAGE_DATA_OFFSET (2 * CWE_HEADER_SIZE)
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Number of segments of the patch written by the slice test, and number of erase blocks per
+ * segment
+ */
+//--------------------------------------------------------------------------------------------------
+#define PATCH_SEGMENT_COUNT  3
+#define PATCH_SEGMENT_BLOCKS 2
+
+#if PA_FWUPDATE_COMPARE_BEFORE_WRITE
+//--------------------------------------------------------------------------------------------------
+/**
+ * Number of good blocks erased by the PA after the image in the update partition
+ */
+//--------------------------------------------------------------------------------------------------
+#define ERASE_SPARE_BLOCKS 2
+#endif
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Length of the test package
+ */
+//--------------------------------------------------------------------------------------------------
+#define PACKAGE_LENGTH (PACKAGE_DATA_OFFSET + (PACKAGE_CHUNK_COUNT * CHUNK_LENGTH))
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Fill a CWE header for a body which follows it
+ */
+//--------------------------------------------------------------------------------------------------
+static void SetCweHeader
+(
+    uint8_t* hdrPtr,            ///< [OUT] CWE header
+    const char* imageTypePtr,   ///< [IN] image type, 4 characters
+    size_t bodyLength           ///< [IN] length of the body following the header
+)
+{
+    uint32_t value;
+
+    memset(hdrPtr, 0, CWE_HEADER_SIZE);
+    value = htobe32(CWE_HDRCURVER);
+    memcpy(hdrPtr + CWE_HDR_REV_NUM_OFST, &value, sizeof(value));
+    // image type, product type, image size and CRC32 follow each other
+    memcpy(hdrPtr + CWE_IMAGE_TYPE_OFST, imageTypePtr, sizeof(value));
+    value = htobe32(0x39583238);
+    memcpy(hdrPtr + CWE_IMAGE_TYPE_OFST + 4, &value, sizeof(value));
+    value = htobe32(bodyLength);
+    memcpy(hdrPtr + CWE_IMAGE_TYPE_OFST + 8, &value, sizeof(value));
+    value = htobe32(le_crc_Crc32(hdrPtr + CWE_HEADER_SIZE, bodyLength, LE_CRC_START_CRC32));
+    memcpy(hdrPtr + CWE_IMAGE_TYPE_OFST + 12, &value, sizeof(value));
+    value = htobe32(CWE_APPSIGN);
+    memcpy(hdrPtr + CWE_ENTRY_OFST + 4, &value, sizeof(value));
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Build the test package: an APPL composite holding a single CUS0 image
+ */
+//--------------------------------------------------------------------------------------------------
+static void BuildPackage
+(
+    uint8_t* pkgPtr     ///< [OUT] package, PACKAGE_LENGTH bytes
+)
+{
+    size_t i;
+
+    for (i = PACKAGE_DATA_OFFSET; i < PACKAGE_LENGTH; i++)
+    {
+        pkgPtr[i] = (uint8_t)((i * 7) + (i >> 12));
+    }
+    SetCweHeader(pkgPtr + CWE_HEADER_SIZE, "CUS0", PACKAGE_LENGTH - PACKAGE_DATA_OFFSET);
+    SetCweHeader(pkgPtr, "APPL", PACKAGE_LENGTH - CWE_HEADER_SIZE);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Download a part of the test package. The package file ends at endOffset, so the download is
+ * suspended there if it is not the package end.
+ *
+ * @return
+ *      - the result of pa_fwupdate_Download()
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t DownloadPackage
+(
+    const uint8_t* pkgPtr,  ///< [IN] package
+    size_t startOffset,     ///< [IN] offset where the download starts or resumes
+    size_t endOffset        ///< [IN] offset where the package file ends
+)
+{
+    int fd;
+
+    if ((-1 == unlink(PACKAGE_FILE)) && (ENOENT != errno))
+    {
+        LE_ERROR("unlink failed: %m");
+        exit(EXIT_FAILURE);
+    }
+
+    fd = open(PACKAGE_FILE, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    LE_TEST_ASSERT(-1 != fd, "");
+    LE_TEST_ASSERT((ssize_t)endOffset == write(fd, pkgPtr, endOffset), "");
+    LE_TEST_ASSERT((off_t)startOffset == lseek(fd, startOffset, SEEK_SET), "");
+
+    pa_fwupdateSimu_SetSystemState(true);
+    pa_fwupdateSimu_SetReturnVal(LE_OK);
+    pa_fwupdate_DisableSyncBeforeUpdate(true);
+
+    // the file descriptor is closed by pa_fwupdate_Download()
+    return pa_fwupdate_Download(fd);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Check that the CUS0 image of the test package has been written into the update partition
+ */
+//--------------------------------------------------------------------------------------------------
+static void CheckPackageImage
+(
+    const uint8_t* pkgPtr   ///< [IN] package
+)
+{
+    pa_flash_Desc_t desc;
+    pa_flash_Info_t* flashInfoPtr;
+    size_t imageLength = PACKAGE_LENGTH - PACKAGE_DATA_OFFSET;
+    size_t offset;
+    uint32_t crc32 = LE_CRC_START_CRC32;
+    int mtdNum;
+
+    mtdNum = partition_GetMtdFromImageType(CWE_IMAGE_TYPE_CUS0, true, NULL, NULL, NULL);
+    LE_TEST_ASSERT(-1 != mtdNum, "");
+    LE_TEST_ASSERT(LE_OK == pa_flash_Open(mtdNum, PA_FLASH_OPENMODE_READONLY, &desc,
+                                          &flashInfoPtr), "");
+    LE_TEST_ASSERT(LE_OK == pa_flash_Scan(desc, NULL), "");
+
+    uint8_t block[flashInfoPtr->eraseSize];
+
+    for (offset = 0; offset < imageLength; offset += flashInfoPtr->eraseSize)
+    {
+        size_t length = imageLength - offset;
+
+        if (length > flashInfoPtr->eraseSize)
+        {
+            length = flashInfoPtr->eraseSize;
+        }
+        LE_TEST_ASSERT(LE_OK == pa_flash_ReadAtBlock(desc, offset / flashInfoPtr->eraseSize,
+                                                     block, length), "");
+        crc32 = le_crc_Crc32(block, length, crc32);
+    }
+    LE_TEST_ASSERT(LE_OK == pa_flash_Close(desc), "");
+
+    LE_TEST_ASSERT(crc32 == le_crc_Crc32((uint8_t*)pkgPtr + PACKAGE_DATA_OFFSET, imageLength,
+                                         LE_CRC_START_CRC32), "image CRC 0x%08" PRIx32, crc32);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Alter the resume context file holding the delta records, as a power cut or a flash corruption
+ * would do. This is the largest of the two files as the other one only holds a full context.
+ */
+//--------------------------------------------------------------------------------------------------
+static void AlterResumeCtxJournal
+(
+    size_t cutLength,       ///< [IN] number of bytes to remove at the end of the file
+    ssize_t flipOffset      ///< [IN] offset of a byte to invert, -1 for none
+)
+{
+    const char* pathPtr;
+    le_fs_FileRef_t fileRef;
+    size_t size[2];
+    size_t readSize;
+
+    LE_TEST_ASSERT(LE_OK == le_fs_GetSize(RESUME_CTX_FILENAME0, &size[0]), "");
+    LE_TEST_ASSERT(LE_OK == le_fs_GetSize(RESUME_CTX_FILENAME1, &size[1]), "");
+    LE_TEST_ASSERT(size[0] != size[1], "");
+    pathPtr = (size[0] > size[1]) ? RESUME_CTX_FILENAME0 : RESUME_CTX_FILENAME1;
+    readSize = (size[0] > size[1]) ? size[0] : size[1];
+
+    uint8_t buffer[readSize];
+
+    LE_TEST_ASSERT(LE_OK == le_fs_Open(pathPtr, LE_FS_RDONLY, &fileRef), "");
+    LE_TEST_ASSERT(LE_OK == le_fs_Read(fileRef, buffer, &readSize), "");
+    LE_TEST_ASSERT(LE_OK == le_fs_Close(fileRef), "");
+    LE_TEST_ASSERT((readSize == sizeof(buffer)) && (cutLength < readSize), "");
+
+    if (flipOffset >= 0)
+    {
+        buffer[flipOffset] ^= 0xFF;
+    }
+
+    LE_TEST_ASSERT(LE_OK == le_fs_Open(pathPtr, LE_FS_WRONLY | LE_FS_TRUNC, &fileRef), "");
+    LE_TEST_ASSERT(LE_OK == le_fs_Write(fileRef, buffer, readSize - cutLength), "");
+    LE_TEST_ASSERT(LE_OK == le_fs_Close(fileRef), "");
+}
 
 
 //--------------------------------------------------------------------------------------------------
@@ -223,6 +455,458 @@ static void Testpa_fwupdate_GetUpdateStatus
                    "");
 }
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * This test checks the policies and values accepted by pa_fwupdate_SetCheckpointPolicy
+ *
+ * API Tested:
+ *  pa_fwupdate_SetCheckpointPolicy().
+ */
+//--------------------------------------------------------------------------------------------------
+static void Testpa_fwupdate_SetCheckpointPolicy
+(
+    void
+)
+{
+    LE_TEST_INFO ("======== Test: pa_fwupdate_SetCheckpointPolicy ========");
+
+    LE_TEST_ASSERT(LE_BAD_PARAMETER ==
+                   pa_fwupdate_SetCheckpointPolicy(PA_FWUPDATE_CHECKPOINT_MAX, 1), "");
+    LE_TEST_ASSERT(LE_BAD_PARAMETER ==
+                   pa_fwupdate_SetCheckpointPolicy(PA_FWUPDATE_CHECKPOINT_BYTES, 0), "");
+    LE_TEST_ASSERT(LE_BAD_PARAMETER ==
+                   pa_fwupdate_SetCheckpointPolicy(PA_FWUPDATE_CHECKPOINT_ADAPTIVE, 101), "");
+    LE_TEST_ASSERT(LE_OK ==
+                   pa_fwupdate_SetCheckpointPolicy(PA_FWUPDATE_CHECKPOINT_BYTES, 1048576), "");
+    LE_TEST_ASSERT(LE_OK ==
+                   pa_fwupdate_SetCheckpointPolicy(PA_FWUPDATE_CHECKPOINT_TIME, 5000), "");
+    LE_TEST_ASSERT(LE_OK ==
+                   pa_fwupdate_SetCheckpointPolicy(PA_FWUPDATE_CHECKPOINT_ADAPTIVE, 5), "");
+    LE_TEST_ASSERT(LE_OK ==
+                   pa_fwupdate_SetCheckpointPolicy(PA_FWUPDATE_CHECKPOINT_BLOCK, 0), "");
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This test suspends downloads, alters the resume context files and checks the position and the
+ * image after the resume context is read again and the download is resumed
+ *
+ * API Tested:
+ *  pa_fwupdate_LoadResumeCtx().
+ *  pa_fwupdate_GetResumePosition().
+ *  pa_fwupdate_Download().
+ */
+//--------------------------------------------------------------------------------------------------
+static void Testpa_fwupdate_ResumeCtxJournal
+(
+    void
+)
+{
+    uint8_t* pkgPtr = malloc(PACKAGE_LENGTH);
+    size_t position;
+    size_t nbChunks;
+
+    LE_TEST_INFO ("======== Test: resume context journal ========");
+
+    LE_TEST_ASSERT(NULL != pkgPtr, "");
+    BuildPackage(pkgPtr);
+    sys_flash_SetSizeInPeb("customer0", CUSTOMER_PEB_COUNT);
+    sys_flash_SetSizeInPeb("customer1", CUSTOMER_PEB_COUNT);
+    LE_TEST_ASSERT(LE_OK == pa_fwupdate_SetCheckpointPolicy(PA_FWUPDATE_CHECKPOINT_BLOCK, 0), "");
+
+    // The last delta record is torn: the position falls back to the previous record
+    LE_TEST_ASSERT(LE_OK == pa_fwupdate_InitDownload(), "");
+    LE_TEST_ASSERT(LE_CLOSED == DownloadPackage(pkgPtr, 0, PACKAGE_DATA_OFFSET +
+                                                (5 * CHUNK_LENGTH) + (CHUNK_LENGTH / 2)), "");
+    LE_TEST_ASSERT(LE_OK == pa_fwupdate_GetResumePosition(&position), "");
+    LE_TEST_ASSERT((PACKAGE_DATA_OFFSET + (5 * CHUNK_LENGTH)) == position, "");
+    AlterResumeCtxJournal(8, -1);
+    LE_TEST_ASSERT(LE_OK == pa_fwupdate_LoadResumeCtx(), "");
+    LE_TEST_ASSERT(LE_OK == pa_fwupdate_GetResumePosition(&position), "");
+    LE_TEST_ASSERT((PACKAGE_DATA_OFFSET + (4 * CHUNK_LENGTH)) == position, "");
+    LE_TEST_ASSERT(LE_OK == DownloadPackage(pkgPtr, position, PACKAGE_LENGTH), "");
+    CheckPackageImage(pkgPtr);
+
+    // The journal is full, then it has just been compacted into a full context
+    for (nbChunks = RESUME_CTX_JOURNAL_MAX; nbChunks <= (RESUME_CTX_JOURNAL_MAX + 1); nbChunks++)
+    {
+        LE_TEST_ASSERT(LE_OK == pa_fwupdate_InitDownload(), "");
+        LE_TEST_ASSERT(LE_CLOSED == DownloadPackage(pkgPtr, 0, PACKAGE_DATA_OFFSET +
+                                                    (nbChunks * CHUNK_LENGTH) +
+                                                    (CHUNK_LENGTH / 2)), "");
+        LE_TEST_ASSERT(LE_OK == pa_fwupdate_LoadResumeCtx(), "");
+        LE_TEST_ASSERT(LE_OK == pa_fwupdate_GetResumePosition(&position), "");
+        LE_TEST_ASSERT((PACKAGE_DATA_OFFSET + (nbChunks * CHUNK_LENGTH)) == position,
+                       "%zu chunks", nbChunks);
+        LE_TEST_ASSERT(LE_OK == DownloadPackage(pkgPtr, position, PACKAGE_LENGTH), "");
+        CheckPackageImage(pkgPtr);
+    }
+
+    // The latest full context is corrupted: the context written after the APPL header is used
+    LE_TEST_ASSERT(LE_OK == pa_fwupdate_InitDownload(), "");
+    LE_TEST_ASSERT(LE_CLOSED == DownloadPackage(pkgPtr, 0, PACKAGE_DATA_OFFSET +
+                                                (2 * CHUNK_LENGTH) + (CHUNK_LENGTH / 2)), "");
+    AlterResumeCtxJournal(0, sizeof(uint32_t));
+    LE_TEST_ASSERT(LE_OK == pa_fwupdate_LoadResumeCtx(), "");
+    LE_TEST_ASSERT(LE_OK == pa_fwupdate_GetResumePosition(&position), "");
+    LE_TEST_ASSERT(CWE_HEADER_SIZE == position, "");
+    LE_TEST_ASSERT(LE_OK == DownloadPackage(pkgPtr, position, PACKAGE_LENGTH), "");
+    CheckPackageImage(pkgPtr);
+
+    sys_flash_ResetSize("customer0");
+    sys_flash_ResetSize("customer1");
+    free(pkgPtr);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This test suspends a download made with the byte checkpoint policy and checks that it resumes
+ * from the latest checkpoint
+ *
+ * API Tested:
+ *  pa_fwupdate_SetCheckpointPolicy().
+ *  pa_fwupdate_GetResumePosition().
+ *  pa_fwupdate_Download().
+ */
+//--------------------------------------------------------------------------------------------------
+static void Testpa_fwupdate_CheckpointBytes
+(
+    void
+)
+{
+    uint8_t* pkgPtr = malloc(PACKAGE_LENGTH);
+    size_t position;
+
+    LE_TEST_INFO ("======== Test: checkpoint every %d bytes ========", 3 * CHUNK_LENGTH);
+
+    LE_TEST_ASSERT(NULL != pkgPtr, "");
+    BuildPackage(pkgPtr);
+    sys_flash_SetSizeInPeb("customer0", CUSTOMER_PEB_COUNT);
+    sys_flash_SetSizeInPeb("customer1", CUSTOMER_PEB_COUNT);
+    LE_TEST_ASSERT(LE_OK ==
+                   pa_fwupdate_SetCheckpointPolicy(PA_FWUPDATE_CHECKPOINT_BYTES,
+                                                   3 * CHUNK_LENGTH), "");
+
+    // Checkpoints are written after the 3rd and the 6th chunks, the 7th is not saved
+    LE_TEST_ASSERT(LE_OK == pa_fwupdate_InitDownload(), "");
+    LE_TEST_ASSERT(LE_CLOSED == DownloadPackage(pkgPtr, 0, PACKAGE_DATA_OFFSET +
+                                                (7 * CHUNK_LENGTH) + (CHUNK_LENGTH / 2)), "");
+    LE_TEST_ASSERT(LE_OK == pa_fwupdate_LoadResumeCtx(), "");
+    LE_TEST_ASSERT(LE_OK == pa_fwupdate_GetResumePosition(&position), "");
+    LE_TEST_ASSERT((PACKAGE_DATA_OFFSET + (6 * CHUNK_LENGTH)) == position, "position %zu",
+                   position);
+
+    LE_TEST_ASSERT(LE_OK == DownloadPackage(pkgPtr, position, PACKAGE_LENGTH), "");
+    CheckPackageImage(pkgPtr);
+
+    LE_TEST_ASSERT(LE_OK == pa_fwupdate_SetCheckpointPolicy(PA_FWUPDATE_CHECKPOINT_BLOCK, 0), "");
+    sys_flash_ResetSize("customer0");
+    sys_flash_ResetSize("customer1");
+    free(pkgPtr);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Check if the download reader thread of the PA is still alive in the process
+ *
+ * @return
+ *      - true if a thread named FwDwlReader is found
+ */
+//--------------------------------------------------------------------------------------------------
+static bool IsDownloadReaderRunning
+(
+    void
+)
+{
+    DIR* dirPtr = opendir("/proc/self/task");
+    struct dirent* entryPtr;
+    bool isRunning = false;
+
+    LE_TEST_ASSERT(NULL != dirPtr, "");
+    while ((!isRunning) && (NULL != (entryPtr = readdir(dirPtr))))
+    {
+        char path[PATH_MAX];
+        char name[32] = "";
+        FILE* filePtr;
+
+        if ('.' == entryPtr->d_name[0])
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/self/task/%s/comm", entryPtr->d_name);
+        filePtr = fopen(path, "r");
+        if (NULL == filePtr)
+        {
+            // The thread has just exited
+            continue;
+        }
+        if (NULL != fgets(name, sizeof(name), filePtr))
+        {
+            isRunning = (0 == strcmp(name, "FwDwlReader\n"));
+        }
+        fclose(filePtr);
+    }
+    closedir(dirPtr);
+
+    return isRunning;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This test stops the download reader thread on an early end of file, on a download failure
+ * while the reader waits for incoming data and at the package end. In each case, the reader has
+ * exited and has been joined when pa_fwupdate_Download() returns.
+ *
+ * API Tested:
+ *  pa_fwupdate_Download().
+ *  pa_fwupdate_GetResumePosition().
+ */
+//--------------------------------------------------------------------------------------------------
+static void Testpa_fwupdate_DownloadReader
+(
+    void
+)
+{
+    uint8_t* pkgPtr = malloc(PACKAGE_LENGTH + CHUNK_LENGTH);
+    uint8_t badHdr[PACKAGE_DATA_OFFSET];
+    size_t position;
+    size_t resumePosition;
+    int pipeFd[2];
+    int fd;
+    int dupFd;
+
+    LE_TEST_INFO ("======== Test: download reader ========");
+
+    LE_TEST_ASSERT(NULL != pkgPtr, "");
+    BuildPackage(pkgPtr);
+    // Data following the package in the file, never to be read by the PA
+    memset(pkgPtr + PACKAGE_LENGTH, 0xA5, CHUNK_LENGTH);
+    sys_flash_SetSizeInPeb("customer0", CUSTOMER_PEB_COUNT);
+    sys_flash_SetSizeInPeb("customer1", CUSTOMER_PEB_COUNT);
+    LE_TEST_ASSERT(LE_OK == pa_fwupdate_SetCheckpointPolicy(PA_FWUPDATE_CHECKPOINT_BLOCK, 0), "");
+
+    // The package file is truncated in the middle of a chunk
+    LE_TEST_ASSERT(LE_OK == pa_fwupdate_InitDownload(), "");
+    LE_TEST_ASSERT(LE_CLOSED == DownloadPackage(pkgPtr, 0, PACKAGE_DATA_OFFSET +
+                                                (3 * CHUNK_LENGTH) + (CHUNK_LENGTH / 2)), "");
+    LE_TEST_ASSERT(!IsDownloadReaderRunning(), "");
+    LE_TEST_ASSERT(LE_OK == pa_fwupdate_GetResumePosition(&resumePosition), "");
+    LE_TEST_ASSERT((PACKAGE_DATA_OFFSET + (3 * CHUNK_LENGTH)) == resumePosition, "position %zu",
+                   resumePosition);
+
+    // The download resumes from a pipe whose writer closes it before the next chunk is complete
+    LE_TEST_ASSERT(0 == pipe(pipeFd), "");
+    LE_TEST_ASSERT((CHUNK_LENGTH / 2) ==
+                   write(pipeFd[1], pkgPtr + resumePosition, CHUNK_LENGTH / 2), "");
+    close(pipeFd[1]);
+    LE_TEST_ASSERT(LE_CLOSED == pa_fwupdate_Download(pipeFd[0]), "");
+    LE_TEST_ASSERT(!IsDownloadReaderRunning(), "");
+    LE_TEST_ASSERT(LE_OK == pa_fwupdate_GetResumePosition(&position), "");
+    LE_TEST_ASSERT(resumePosition == position, "position %zu", position);
+
+    // The package file goes on after the package end: the reader is stopped while it waits at
+    // the package end and the data beyond it are left unread
+    LE_TEST_ASSERT((-1 != unlink(PACKAGE_FILE)) || (ENOENT == errno), "");
+    fd = open(PACKAGE_FILE, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    LE_TEST_ASSERT(-1 != fd, "");
+    LE_TEST_ASSERT((PACKAGE_LENGTH + CHUNK_LENGTH) ==
+                   write(fd, pkgPtr, PACKAGE_LENGTH + CHUNK_LENGTH), "");
+    LE_TEST_ASSERT((off_t)position == lseek(fd, position, SEEK_SET), "");
+    dupFd = dup(fd);
+    LE_TEST_ASSERT(-1 != dupFd, "");
+    LE_TEST_ASSERT(LE_OK == pa_fwupdate_Download(fd), "");
+    LE_TEST_ASSERT(!IsDownloadReaderRunning(), "");
+    LE_TEST_ASSERT(PACKAGE_LENGTH == lseek(dupFd, 0, SEEK_CUR), "");
+    close(dupFd);
+    CheckPackageImage(pkgPtr);
+
+    // The CUS0 header is invalid while the writer of the pipe keeps it open: the download fails
+    // and aborts the reader waiting for incoming data
+    memcpy(badHdr, pkgPtr, sizeof(badHdr));
+    memcpy(badHdr + CWE_HEADER_SIZE + CWE_IMAGE_TYPE_OFST, "XXXX", 4);
+    LE_TEST_ASSERT(LE_OK == pa_fwupdate_InitDownload(), "");
+    LE_TEST_ASSERT(0 == pipe(pipeFd), "");
+    LE_TEST_ASSERT((ssize_t)sizeof(badHdr) == write(pipeFd[1], badHdr, sizeof(badHdr)), "");
+    LE_TEST_ASSERT(LE_FAULT == pa_fwupdate_Download(pipeFd[0]), "");
+    LE_TEST_ASSERT(!IsDownloadReaderRunning(), "");
+    close(pipeFd[1]);
+
+    sys_flash_ResetSize("customer0");
+    sys_flash_ResetSize("customer1");
+    free(pkgPtr);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Check that the first segments of the slice test patch have been written into a partition
+ */
+//--------------------------------------------------------------------------------------------------
+static void CheckPatchSegments
+(
+    int mtdNum,                 ///< [IN] MTD of the patch destination
+    const uint8_t* dataPtr,     ///< [IN] patch segments
+    size_t length               ///< [IN] length of the segments to check
+)
+{
+    pa_flash_Desc_t desc;
+    pa_flash_Info_t* flashInfoPtr;
+    size_t offset;
+
+    LE_TEST_ASSERT(LE_OK == pa_flash_Open(mtdNum, PA_FLASH_OPENMODE_READONLY, &desc,
+                                          &flashInfoPtr), "");
+    LE_TEST_ASSERT(LE_OK == pa_flash_Scan(desc, NULL), "");
+
+    uint8_t block[flashInfoPtr->eraseSize];
+
+    for (offset = 0; offset < length; offset += flashInfoPtr->eraseSize)
+    {
+        LE_TEST_ASSERT(LE_OK == pa_flash_ReadAtBlock(desc, offset / flashInfoPtr->eraseSize,
+                                                     block, flashInfoPtr->eraseSize), "");
+        LE_TEST_ASSERT(0 == memcmp(block, dataPtr + offset, flashInfoPtr->eraseSize),
+                       "block %zu", offset / flashInfoPtr->eraseSize);
+    }
+    LE_TEST_ASSERT(LE_OK == pa_flash_Close(desc), "");
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This test writes a RAW flash patch in two slices, with a suspend between them, and checks that
+ * the segments of the first slice are in flash once it is flushed. A write failure is reported by
+ * the flush of the slice which has failed.
+ *
+ * API Tested:
+ *  pa_patch_WriteSegment().
+ *  pa_patch_Flush().
+ *  pa_patch_Close().
+ */
+//--------------------------------------------------------------------------------------------------
+static void Testpa_patch_FlushSlices
+(
+    void
+)
+{
+    pa_patch_Context_t ctx;
+    pa_patch_Desc_t desc, ctxDesc = NULL;
+    pa_flash_Desc_t flashDesc;
+    pa_flash_Info_t* flashInfoPtr;
+    uint8_t *origDataPtr, *destDataPtr, *segPtr;
+    char *origNamePtr, *destNamePtr;
+    size_t segmentSize, offset;
+    int origMtdNum, destMtdNum;
+
+    LE_TEST_INFO ("======== Test: pa_patch_Flush across slices ========");
+
+    memset(&ctx, 0, sizeof(ctx));
+    origMtdNum = partition_GetMtdFromImageType(CWE_IMAGE_TYPE_CUS0, false, &origNamePtr,
+                                               &ctx.origImageDesc.flash.isLogical,
+                                               &ctx.origImageDesc.flash.isDual);
+    destMtdNum = partition_GetMtdFromImageType(CWE_IMAGE_TYPE_CUS0, true, &destNamePtr,
+                                               &ctx.destImageDesc.flash.isLogical,
+                                               &ctx.destImageDesc.flash.isDual);
+    LE_TEST_ASSERT((-1 != origMtdNum) && (-1 != destMtdNum), "");
+
+    LE_TEST_ASSERT(LE_OK == pa_flash_Open(destMtdNum, PA_FLASH_OPENMODE_READONLY, &flashDesc,
+                                          &flashInfoPtr), "");
+    segmentSize = PATCH_SEGMENT_BLOCKS * flashInfoPtr->eraseSize;
+    LE_TEST_ASSERT(LE_OK == pa_flash_Close(flashDesc), "");
+
+    segPtr = malloc(PATCH_SEGMENT_COUNT * segmentSize);
+    LE_TEST_ASSERT(NULL != segPtr, "");
+    for (offset = 0; offset < (PATCH_SEGMENT_COUNT * segmentSize); offset++)
+    {
+        segPtr[offset] = (uint8_t)((offset * 7) ^ (offset >> 8));
+    }
+
+    ctx.segmentSize = segmentSize;
+    ctx.origImage = PA_PATCH_IMAGE_RAWFLASH;
+    ctx.origImageSize = PATCH_SEGMENT_COUNT * segmentSize;
+    ctx.origImageDesc.flash.mtdNum = origMtdNum;
+    ctx.origImageDesc.flash.ubiVolId = PA_PATCH_INVALID_UBI_VOL_ID;
+    ctx.destImage = PA_PATCH_IMAGE_RAWFLASH;
+    ctx.destImageSize = PATCH_SEGMENT_COUNT * segmentSize;
+    ctx.destImageDesc.flash.mtdNum = destMtdNum;
+    ctx.destImageDesc.flash.ubiVolId = PA_PATCH_INVALID_UBI_VOL_ID;
+    ctx.descPtr = &ctxDesc;
+
+    // First slice, then suspend: the patch is closed without update as on a forced close. The
+    // slice is flushed through the descriptor exposed by the context, as the delta update does.
+    LE_TEST_ASSERT(LE_OK == pa_patch_Open(&ctx, &desc, &origDataPtr, &destDataPtr), "");
+    LE_TEST(desc == ctxDesc);
+    LE_TEST_ASSERT(LE_OK == pa_patch_WriteSegment(desc, 0, segPtr, segmentSize), "");
+    LE_TEST_ASSERT(LE_OK == pa_patch_WriteSegment(desc, segmentSize, segPtr + segmentSize,
+                                                  segmentSize), "");
+    LE_TEST(LE_BAD_PARAMETER == pa_patch_Flush(NULL));
+    LE_TEST_ASSERT(LE_OK == pa_patch_Flush(ctxDesc), "");
+    LE_TEST_ASSERT(LE_OK == pa_patch_Close(desc, false, 0), "");
+    LE_TEST(NULL == ctxDesc);
+    CheckPatchSegments(destMtdNum, segPtr, 2 * segmentSize);
+
+    // Resume with the second slice
+    LE_TEST_ASSERT(LE_OK == pa_patch_Open(&ctx, &desc, &origDataPtr, &destDataPtr), "");
+    LE_TEST_ASSERT(LE_OK == pa_patch_WriteSegment(desc, 2 * segmentSize, segPtr + (2 * segmentSize),
+                                                  segmentSize), "");
+    LE_TEST_ASSERT(LE_OK == pa_patch_Flush(desc), "");
+    LE_TEST_ASSERT(LE_OK == pa_patch_Close(desc, true, PATCH_SEGMENT_COUNT * segmentSize), "");
+    CheckPatchSegments(destMtdNum, segPtr, PATCH_SEGMENT_COUNT * segmentSize);
+
+    // Every write fails: the failure is reported by the flush of the slice, not by the next one.
+    // The segment differs from the flash content, so it is programmed even if compared first.
+    sys_flash_SetBadBlockWrite(destNamePtr, -1ULL);
+    LE_TEST_ASSERT(LE_OK == pa_patch_Open(&ctx, &desc, &origDataPtr, &destDataPtr), "");
+    LE_TEST_ASSERT(LE_OK == pa_patch_WriteSegment(desc, 0, segPtr + segmentSize, segmentSize), "");
+    LE_TEST_ASSERT(LE_OK != pa_patch_Flush(ctxDesc), "");
+    LE_TEST_ASSERT(LE_OK != pa_patch_Close(desc, false, 0), "");
+    sys_flash_ResetBadBlock(destNamePtr);
+
+    free(segPtr);
+}
+
+#if PA_FWUPDATE_COMPARE_BEFORE_WRITE
+//--------------------------------------------------------------------------------------------------
+/**
+ * This test flashes the same package twice. As the update partition already holds the image, the
+ * second download neither erases nor programs its blocks: only the spare blocks after the image
+ * are erased.
+ *
+ * API Tested:
+ *  pa_fwupdate_Download().
+ */
+//--------------------------------------------------------------------------------------------------
+static void Testpa_fwupdate_CompareBeforeWrite
+(
+    void
+)
+{
+    uint8_t* pkgPtr = malloc(PACKAGE_LENGTH);
+    sys_flash_Stats_t stats;
+
+    LE_TEST_INFO ("======== Test: compare before write ========");
+
+    LE_TEST_ASSERT(NULL != pkgPtr, "");
+    BuildPackage(pkgPtr);
+    sys_flash_SetSizeInPeb("customer0", CUSTOMER_PEB_COUNT);
+    sys_flash_SetSizeInPeb("customer1", CUSTOMER_PEB_COUNT);
+
+    LE_TEST_ASSERT(LE_OK == pa_fwupdate_InitDownload(), "");
+    LE_TEST_ASSERT(LE_OK == DownloadPackage(pkgPtr, 0, PACKAGE_LENGTH), "");
+    CheckPackageImage(pkgPtr);
+
+    // Flash the identical package again
+    LE_TEST_ASSERT(LE_OK == pa_fwupdate_InitDownload(), "");
+    sys_flash_ResetStats();
+    LE_TEST_ASSERT(LE_OK == DownloadPackage(pkgPtr, 0, PACKAGE_LENGTH), "");
+    sys_flash_GetStats(&stats);
+    LE_TEST_ASSERT(0 == stats.pagesWritten, "%" PRIu64 " pages programmed", stats.pagesWritten);
+    LE_TEST_ASSERT(ERASE_SPARE_BLOCKS >= stats.blocksErased, "%" PRIu64 " blocks erased",
+                   stats.blocksErased);
+    CheckPackageImage(pkgPtr);
+
+    sys_flash_ResetSize("customer0");
+    sys_flash_ResetSize("customer1");
+    free(pkgPtr);
+}
+#endif
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Main of the test.
@@ -252,6 +936,14 @@ COMPONENT_INIT
     Testpa_fwupdate_SetSystem();
     Testpa_fwupdate_Install();
     Testpa_fwupdate_GetUpdateStatus();
+    Testpa_fwupdate_SetCheckpointPolicy();
+    Testpa_fwupdate_ResumeCtxJournal();
+    Testpa_fwupdate_CheckpointBytes();
+    Testpa_fwupdate_DownloadReader();
+    Testpa_patch_FlushSlices();
+#if PA_FWUPDATE_COMPARE_BEFORE_WRITE
+    Testpa_fwupdate_CompareBeforeWrite();
+#endif
 
     LE_TEST_INFO ("======== FW Update Dualsys tests end ========");
     LE_TEST_EXIT;
@@ -12,7 +12,10 @@
 #include "cwe_local.h"
 #include "log.h"
 #include "sys_flash.h"
+#include "imgpatch_utils.h"
+#include "partition_local.h"
 #include <endian.h>
+#include <bzlib.h>
 
 #define FILE_PATH      "/fwupdate/dwl_status.nfo"
 #define TEST_FILE      "/tmp/test_file.txt"
@@ -26,6 +29,25 @@
 #define LS2CP_UBI_CWE  "../data/ls2cp_ubi.cwe"
 #define CP2LS_UBI_CWE  "../data/cp2ls_ubi.cwe"
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Sizes of the data and of the BSDIFF40 patches built by the BsPatchBuffer tests
+ */
+//--------------------------------------------------------------------------------------------------
+#define BSPATCH_OLD_SIZE     64
+#define BSPATCH_NEW_SIZE     56
+#define BSPATCH_MAX_SIZE     1024
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Image written by the SWIFOTA on-demand erase test: 8 blocks and a half, in chunks of 4 KB. The
+ * emulated erase is slow enough for the writer to overtake the erase-ahead worker.
+ */
+//--------------------------------------------------------------------------------------------------
+#define SWIFOTA_IMAGE_BLOCKS 8
+#define SWIFOTA_CHUNK_SIZE   4096
+#define SWIFOTA_ERASE_US     20000
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Meta data structure
@@ -375,6 +397,438 @@ static void Testpa_fwupdate_GetUpdateStatus
     LE_TEST(LE_OK == pa_fwupdate_GetUpdateStatus(&statusPtr, statusLabel, 50));
 }
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Store a BSDIFF signed 64 bits value: little-endian magnitude with the sign in the most
+ * significant bit of the last byte
+ */
+//--------------------------------------------------------------------------------------------------
+static void BsOfftOut
+(
+    int64_t val,        ///< [IN] Value to store
+    uint8_t* bufPtr     ///< [OUT] Buffer of 8 bytes
+)
+{
+    uint64_t mag = (val < 0) ? (uint64_t)(-val) : (uint64_t)val;
+    int idx;
+
+    for (idx = 0; idx < 8; idx++)
+    {
+        bufPtr[idx] = (uint8_t)(mag >> (8 * idx));
+    }
+    if (val < 0)
+    {
+        bufPtr[7] |= 0x80;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Build a BSDIFF40 patch from its control tuples, diff and extra data
+ *
+ * @return
+ *      - The length of the patch
+ */
+//--------------------------------------------------------------------------------------------------
+static size_t BuildBsPatch
+(
+    const int64_t* ctrlPtr,     ///< [IN] Control tuples: diff length, extra length, source seek
+    int nbCtrl,                 ///< [IN] Number of control tuples
+    const uint8_t* diffPtr,     ///< [IN] Diff data
+    size_t diffLen,             ///< [IN] Diff data length
+    const uint8_t* extraPtr,    ///< [IN] Extra data
+    size_t extraLen,            ///< [IN] Extra data length
+    int64_t newLen,             ///< [IN] Length of the patched data
+    uint8_t* patchPtr           ///< [OUT] Patch of BSPATCH_MAX_SIZE bytes
+)
+{
+    uint8_t ctrlBuf[3 * 3 * 8];
+    const uint8_t* blockPtr[3] = { ctrlBuf, diffPtr, extraPtr };
+    size_t blockLen[3] = { nbCtrl * 3 * 8, diffLen, extraLen };
+    size_t patchLen = 32;
+    int idx;
+
+    LE_TEST_ASSERT(nbCtrl <= 3, "Too many control tuples");
+    for (idx = 0; idx < (3 * nbCtrl); idx++)
+    {
+        BsOfftOut(ctrlPtr[idx], ctrlBuf + (idx * 8));
+    }
+
+    memcpy(patchPtr, "BSDIFF40", 8);
+    for (idx = 0; idx < 3; idx++)
+    {
+        unsigned int compLen = BSPATCH_MAX_SIZE - patchLen;
+
+        LE_TEST_ASSERT(BZ_OK == BZ2_bzBuffToBuffCompress((char*)patchPtr + patchLen, &compLen,
+                                                         (char*)blockPtr[idx], blockLen[idx],
+                                                         9, 0, 0),
+                       "Compress patch block %d", idx);
+        if (idx < 2)
+        {
+            // Lengths of the control and diff blocks
+            BsOfftOut(compLen, patchPtr + 8 + (idx * 8));
+        }
+        patchLen += compLen;
+    }
+    BsOfftOut(newLen, patchPtr + 24);
+
+    return patchLen;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This test checks the BsPatchBuffer API with a valid patch and with corrupted ones
+ *
+ * API Tested:
+ *  BsPatchBuffer().
+ */
+//--------------------------------------------------------------------------------------------------
+static void TestBsPatchBuffer
+(
+    void
+)
+{
+    // New data: old[0..32] + 1, 8 bytes of extra data, then old[0..16] unchanged
+    const int64_t ctrl[] = { 32, 8, -32, 16, 0, 0 };
+    const uint8_t extra[8] = "EXTRADAT";
+    uint8_t oldBuf[BSPATCH_OLD_SIZE], newBuf[BSPATCH_NEW_SIZE], diff[48];
+    uint8_t outBuf[BSPATCH_NEW_SIZE];
+    uint8_t patch[BSPATCH_MAX_SIZE], badPatch[BSPATCH_MAX_SIZE];
+    size_t patchLen, badLen, outLen;
+    int idx;
+
+    LE_TEST_INFO ("======== Test: BsPatchBuffer ========");
+
+    for (idx = 0; idx < BSPATCH_OLD_SIZE; idx++)
+    {
+        oldBuf[idx] = (uint8_t)(idx * 7);
+    }
+    memset(diff, 1, 32);
+    memset(diff + 32, 0, 16);
+    for (idx = 0; idx < 32; idx++)
+    {
+        newBuf[idx] = oldBuf[idx] + 1;
+    }
+    memcpy(newBuf + 32, extra, sizeof(extra));
+    memcpy(newBuf + 40, oldBuf, 16);
+
+    // Valid patch
+    patchLen = BuildBsPatch(ctrl, 2, diff, sizeof(diff), extra, sizeof(extra), BSPATCH_NEW_SIZE,
+                            patch);
+    memset(outBuf, 0, sizeof(outBuf));
+    LE_TEST(LE_OK == BsPatchBuffer(oldBuf, sizeof(oldBuf), patch, patchLen,
+                                   outBuf, sizeof(outBuf), &outLen));
+    LE_TEST(BSPATCH_NEW_SIZE == outLen);
+    LE_TEST(0 == memcmp(outBuf, newBuf, sizeof(newBuf)));
+    LE_TEST(LE_OVERFLOW == BsPatchBuffer(oldBuf, sizeof(oldBuf), patch, patchLen,
+                                         outBuf, sizeof(outBuf) - 1, &outLen));
+
+    // Bad magic
+    memcpy(badPatch, patch, patchLen);
+    badPatch[7] = '1';
+    LE_TEST(LE_FAULT == BsPatchBuffer(oldBuf, sizeof(oldBuf), badPatch, patchLen,
+                                      outBuf, sizeof(outBuf), &outLen));
+    LE_TEST(LE_FAULT == BsPatchBuffer(oldBuf, sizeof(oldBuf), patch, 31,
+                                      outBuf, sizeof(outBuf), &outLen));
+
+    // Negative lengths of the control and diff blocks, and of the patched data
+    for (idx = 0; idx < 3; idx++)
+    {
+        memcpy(badPatch, patch, patchLen);
+        badPatch[15 + (idx * 8)] |= 0x80;
+        LE_TEST(LE_FAULT == BsPatchBuffer(oldBuf, sizeof(oldBuf), badPatch, patchLen,
+                                          outBuf, sizeof(outBuf), &outLen));
+    }
+
+    // Lengths of the control and diff blocks overflowing the patch
+    memcpy(badPatch, patch, patchLen);
+    BsOfftOut(patchLen, badPatch + 8);
+    LE_TEST(LE_FAULT == BsPatchBuffer(oldBuf, sizeof(oldBuf), badPatch, patchLen,
+                                      outBuf, sizeof(outBuf), &outLen));
+    memcpy(badPatch, patch, patchLen);
+    BsOfftOut(INT64_MAX, badPatch + 16);
+    LE_TEST(LE_FAULT == BsPatchBuffer(oldBuf, sizeof(oldBuf), badPatch, patchLen,
+                                      outBuf, sizeof(outBuf), &outLen));
+    memcpy(badPatch, patch, patchLen);
+    BsOfftOut(INT64_MAX, badPatch + 24);
+    LE_TEST(LE_OK != BsPatchBuffer(oldBuf, sizeof(oldBuf), badPatch, patchLen,
+                                   outBuf, sizeof(outBuf), &outLen));
+
+    // Control entries producing more data than the patched data length
+    badLen = BuildBsPatch(ctrl, 2, diff, sizeof(diff), extra, sizeof(extra),
+                          BSPATCH_NEW_SIZE - 8, badPatch);
+    LE_TEST(LE_FAULT == BsPatchBuffer(oldBuf, sizeof(oldBuf), badPatch, badLen,
+                                      outBuf, sizeof(outBuf), &outLen));
+
+    // Seeks outside of the source data, before its start and beyond its end
+    {
+        const int64_t ctrlBefore[] = { 32, 8, -33, 16, 0, 0 };
+        const int64_t ctrlAfter[] = { 32, 8, 17, 16, 0, 0 };
+
+        badLen = BuildBsPatch(ctrlBefore, 2, diff, sizeof(diff), extra, sizeof(extra),
+                              BSPATCH_NEW_SIZE, badPatch);
+        LE_TEST(LE_FAULT == BsPatchBuffer(oldBuf, sizeof(oldBuf), badPatch, badLen,
+                                          outBuf, sizeof(outBuf), &outLen));
+        badLen = BuildBsPatch(ctrlAfter, 2, diff, sizeof(diff), extra, sizeof(extra),
+                              BSPATCH_NEW_SIZE, badPatch);
+        LE_TEST(LE_FAULT == BsPatchBuffer(oldBuf, sizeof(oldBuf), badPatch, badLen,
+                                          outBuf, sizeof(outBuf), &outLen));
+    }
+
+    // A diff beyond the end of the source data
+    LE_TEST(LE_FAULT == BsPatchBuffer(oldBuf, 31, patch, patchLen,
+                                      outBuf, sizeof(outBuf), &outLen));
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Open the SWIFOTA MTD device and get its geometry.
+ *
+ * @return
+ *      - The file descriptor of the MTD device
+ */
+//--------------------------------------------------------------------------------------------------
+static int OpenSwifotaMtd
+(
+    int flags,                        ///< [IN] Flags given to open()
+    uint32_t* eraseSizePtr,           ///< [OUT] Erase block size
+    uint32_t* mtdSizePtr              ///< [OUT] Size of the partition
+)
+{
+    char path[PATH_MAX], *mtdNamePtr;
+    FILE* fdPtr;
+    int mtdNum, fd, rc;
+
+    mtdNum = partition_GetMtdFromImageTypeOrName(0, "swifota", &mtdNamePtr);
+    LE_TEST_ASSERT(-1 != mtdNum, "swifota MTD %d", mtdNum);
+    snprintf(path, sizeof(path), "/sys/class/mtd/mtd%d/erasesize", mtdNum);
+    fdPtr = fopen(path, "r");
+    LE_TEST_ASSERT(fdPtr, "");
+    rc = fscanf(fdPtr, "%u", eraseSizePtr);
+    LE_TEST_ASSERT(rc == 1, "");
+    fclose(fdPtr);
+    snprintf(path, sizeof(path), "/sys/class/mtd/mtd%d/size", mtdNum);
+    fdPtr = fopen(path, "r");
+    LE_TEST_ASSERT(fdPtr, "");
+    rc = fscanf(fdPtr, "%u", mtdSizePtr);
+    LE_TEST_ASSERT(rc == 1, "");
+    fclose(fdPtr);
+
+    snprintf(path, sizeof(path), "/dev/mtd%d", mtdNum);
+    fd = open(path, flags);
+    LE_TEST_ASSERT(-1 != fd, "open %s: %m", path);
+    return fd;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Fill the whole SWIFOTA partition with programmed pages, as left by a previous package.
+ */
+//--------------------------------------------------------------------------------------------------
+static void FillSwifota
+(
+    void
+)
+{
+    uint32_t eraseSize, mtdSize;
+    uint8_t* bufPtr;
+    int fd;
+
+    fd = OpenSwifotaMtd(O_RDWR, &eraseSize, &mtdSize);
+    bufPtr = malloc(mtdSize);
+    LE_TEST_ASSERT(bufPtr, "");
+    memset(bufPtr, 0, mtdSize);
+    LE_TEST_ASSERT((ssize_t)mtdSize == write(fd, bufPtr, mtdSize), "");
+    close(fd);
+    free(bufPtr);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Check that the SWIFOTA partition is erased from the given offset up to its end.
+ *
+ * @return
+ *      - true if all the bytes are erased
+ */
+//--------------------------------------------------------------------------------------------------
+static bool IsSwifotaErasedFrom
+(
+    off_t offset                      ///< [IN] Offset of the first byte to check
+)
+{
+    uint32_t eraseSize, mtdSize;
+    uint8_t* bufPtr;
+    size_t len, off;
+    int fd;
+
+    fd = OpenSwifotaMtd(O_RDONLY, &eraseSize, &mtdSize);
+    LE_TEST_ASSERT(offset <= (off_t)mtdSize, "");
+    len = mtdSize - offset;
+    bufPtr = malloc(len + 1);
+    LE_TEST_ASSERT(bufPtr, "");
+    LE_TEST_ASSERT(-1 != lseek(fd, offset, SEEK_SET), "");
+    LE_TEST_ASSERT((ssize_t)len == read(fd, bufPtr, len), "");
+    close(fd);
+    for (off = 0; (off < len) && (0xFF == bufPtr[off]); off++)
+    {
+    }
+    if (off < len)
+    {
+        LE_TEST_INFO("Programmed byte at offset %jd", (intmax_t)(offset + off));
+    }
+    free(bufPtr);
+    return (off == len);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This test checks that a download starting at offset 0 erases the SWIFOTA partition on demand:
+ * partition_OpenSwifotaPartition erases only the meta data blocks and the first block of the
+ * image, and the erase-ahead worker started by the first write erases the next ones before they
+ * are written. The partition is filled with data first: the emulated flash rejects the
+ * programming of a page which is not erased. Once closed, the SWIFOTA is erased up to its end.
+ *
+ * API Tested:
+ *  partition_OpenSwifotaPartition().
+ *  partition_WriteSwifotaPartition().
+ *  partition_CloseSwifotaPartition().
+ */
+//--------------------------------------------------------------------------------------------------
+static void Testpartition_OpenSwifotaOnDemand
+(
+    void
+)
+{
+    partition_Ctx_t ctx;
+    cwe_Header_t hdr;
+    sys_flash_Stats_t stats;
+    uint8_t *imagePtr, *readPtr;
+    uint32_t eraseSize, mtdSize;
+    size_t imageSize, off, len;
+    off_t imageOffset;
+    int fd, rc;
+
+    LE_TEST_INFO ("======== Test: partition_OpenSwifotaPartition on demand ========");
+
+    memset(&ctx, 0, sizeof(ctx));
+    sys_flash_ResetBadBlock( "swifota" );
+    (void)partition_CloseSwifotaPartition(&ctx, 0, true, NULL);
+
+    fd = OpenSwifotaMtd(O_RDONLY, &eraseSize, &mtdSize);
+    close(fd);
+
+    imageSize = (SWIFOTA_IMAGE_BLOCKS * eraseSize) + (eraseSize / 2);
+    imagePtr = malloc(imageSize);
+    readPtr = malloc(imageSize);
+    LE_TEST_ASSERT(imagePtr && readPtr, "");
+    for (off = 0; off < imageSize; off++)
+    {
+        imagePtr[off] = (uint8_t)((off * 13) ^ (off >> 9));
+    }
+
+    FillSwifota();
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.imageType = CWE_IMAGE_TYPE_APPS;
+    hdr.imageSize = imageSize;
+    ctx.cweHdrPtr = &hdr;
+    ctx.fullImageSize = imageSize;
+
+    sys_flash_SetLatency(0, SWIFOTA_ERASE_US, 0, 0);
+    sys_flash_ResetStats();
+    LE_TEST(LE_OK == partition_OpenSwifotaPartition(&ctx, 0));
+    LE_TEST(2 == ctx.phyBlock);
+    // Until the first write, only the meta data blocks and the first block of the image are erased
+    usleep(4 * SWIFOTA_ERASE_US);
+    sys_flash_GetStats(&stats);
+    LE_TEST_INFO("%"PRIu64" blocks erased at open, phyBlock %u", stats.blocksErased, ctx.phyBlock);
+    LE_TEST((ctx.phyBlock + 1) == stats.blocksErased);
+
+    for (off = 0; off < imageSize; off += len)
+    {
+        len = ((imageSize - off) > SWIFOTA_CHUNK_SIZE) ? SWIFOTA_CHUNK_SIZE : (imageSize - off);
+        rc = partition_WriteSwifotaPartition(&ctx, &len, imagePtr + off, false, NULL);
+        LE_TEST_ASSERT(LE_OK == rc, "Write at %zu: %d", off, rc);
+    }
+    LE_TEST(LE_OK == partition_CloseSwifotaPartition(&ctx, imageSize, false, NULL));
+    sys_flash_SetLatency(0, 0, 0, 0);
+
+    // The image is programmed from phyBlock, over the blocks erased by the worker
+    imageOffset = (off_t)ctx.phyBlock * eraseSize;
+    fd = OpenSwifotaMtd(O_RDONLY, &eraseSize, &mtdSize);
+    LE_TEST_ASSERT(-1 != lseek(fd, imageOffset, SEEK_SET), "");
+    LE_TEST_ASSERT((ssize_t)imageSize == read(fd, readPtr, imageSize), "");
+    close(fd);
+    LE_TEST(0 == memcmp(readPtr, imagePtr, imageSize));
+
+    // The end of the last block of the image and all the blocks after it are erased
+    LE_TEST(IsSwifotaErasedFrom(imageOffset + imageSize));
+
+    free(readPtr);
+    free(imagePtr);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This test checks a delta download of an UBI image over a SWIFOTA partition which holds a
+ * previous package: the UBI partition created in SWIFOTA by the patch must not see the headers
+ * nor the pages left by this package. The previous package is either another UBI package or
+ * programmed pages all over the partition.
+ *
+ * API Tested:
+ *  pa_fwupdate_Download().
+ */
+//--------------------------------------------------------------------------------------------------
+static void Testpa_fwupdate_DownloadUbiOverPreviousPackage
+(
+    void
+)
+{
+    uint32_t eraseSize, mtdSize;
+    int fd;
+
+    LE_TEST_INFO ("======== Test: pa_fwupdate_Download UBI over a previous package ========");
+
+    sys_flash_ResetBadBlock( "swifota" );
+    fd = OpenSwifotaMtd(O_RDONLY, &eraseSize, &mtdSize);
+    close(fd);
+
+    LE_TEST_INFO ("======== Test: Donwload CP_UBI ========");
+    LE_TEST(LE_OK == pa_fwupdate_InitDownload());
+    fd = open(CP_UBI_CWE, O_RDONLY);
+    LE_TEST_ASSERT(fd >= 0, "");
+    LE_TEST(LE_OK == pa_fwupdate_Download(fd));
+    close(fd);
+    (void)pa_fwupdate_Install(true);
+    ApplySwifotaToBootPartition();
+
+    LE_TEST_INFO ("======== Test: Donwload LS_UBI, not installed ========");
+    LE_TEST(LE_OK == pa_fwupdate_InitDownload());
+    fd = open(LS_UBI_CWE, O_RDONLY);
+    LE_TEST_ASSERT(fd >= 0, "");
+    LE_TEST(LE_OK == pa_fwupdate_Download(fd));
+    close(fd);
+
+    LE_TEST_INFO ("======== Test: Patch CP_UBI to LS_UBI over LS_UBI ========");
+    LE_TEST(LE_OK == pa_fwupdate_InitDownload());
+    fd = open(CP2LS_UBI_CWE, O_RDONLY);
+    LE_TEST_ASSERT(fd >= 0, "");
+    LE_TEST(LE_OK == pa_fwupdate_Download(fd));
+    close(fd);
+
+    LE_TEST_INFO ("======== Test: Patch CP_UBI to LS_UBI over programmed pages ========");
+    FillSwifota();
+    LE_TEST(LE_OK == pa_fwupdate_InitDownload());
+    fd = open(CP2LS_UBI_CWE, O_RDONLY);
+    LE_TEST_ASSERT(fd >= 0, "");
+    LE_TEST(LE_OK == pa_fwupdate_Download(fd));
+    close(fd);
+    // The package lies in the first half of the SWIFOTA: the blocks after it are erased
+    LE_TEST(IsSwifotaErasedFrom(mtdSize / 2));
+    (void)pa_fwupdate_Install(true);
+    ApplySwifotaToBootPartition();
+}
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Component init of the unit test
@@ -452,6 +906,10 @@ COMPONENT_INIT
     }
     while( bbMask != (-1ULL) );
 
+    TestBsPatchBuffer();
+    Testpartition_OpenSwifotaOnDemand();
+    Testpa_fwupdate_DownloadUbiOverPreviousPackage();
+
     LE_TEST_INFO("======== FW Update Singlesys tests end ========");
     LE_TEST_EXIT;
 }
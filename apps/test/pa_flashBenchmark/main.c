@@ -0,0 +1,469 @@
+ /**
+  * This module implements the flash performance benchmarks. It runs the update hot paths against
+  * the emulated NAND of sys_flash with a latency model and reports for each of them the
+  * throughput, the number of system calls per MB and the peak RSS of the process.
+  *
+  * The benchmark is not run with the tests, it has to be launched manually.
+  *
+  * The latency model may be changed with the environment variable SYS_FLASH_LATENCY set to
+  * "<page program us>,<block erase us>,<page read us>,<syscall us>". The number of loops of the
+  * raw MTD benchmarks may be changed with the environment variable BENCH_LOOPS.
+  *
+  * Copyright (C) Sierra Wireless Inc.
+  *
+  */
+
+#include "legato.h"
+#include <sys/resource.h>
+#include <endian.h>
+#include "pa_fwupdate.h"
+#include "cwe_local.h"
+#include "partition_local.h"
+#include "pa_flash.h"
+#include "pa_flash_local.h"
+#include "crc32_local.h"
+#include "sys_flash.h"
+
+#define LS_CWE         "../data/ls.cwe"
+#define LS2CP_CWE      "../data/ls2cp.cwe"
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Default latency model: typical SLC NAND timings
+ */
+//--------------------------------------------------------------------------------------------------
+#define BENCH_PAGE_PROGRAM_US  200
+#define BENCH_BLOCK_ERASE_US  1500
+#define BENCH_PAGE_READ_US      25
+#define BENCH_SYSCALL_US         2
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Default number of loops for the raw MTD benchmarks
+ */
+//--------------------------------------------------------------------------------------------------
+#define BENCH_LOOPS              3
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Meta data structure
+ */
+//--------------------------------------------------------------------------------------------------
+typedef struct __attribute__((__packed__))
+{
+    uint8_t   cweHeaderRaw[CWE_HEADER_SIZE];  ///< Raw CWE header copied from image
+    uint32_t  magicBegin;                     ///< Magic number
+    uint32_t  version;                        ///< Version of the structure
+    uint32_t  offset;                         ///< Offset of partition to store image
+    uint32_t  logicalBlock;                   ///< Logical start block number to store image
+    uint32_t  phyBlock;                       ///< Physical start block number to store image
+    uint32_t  imageSize;                      ///< Size of the image including CWE header
+    uint32_t  dldSource;                      ///< Image download source, local or FOTA
+    uint32_t  nbComponents;                   ///< Number of component images in slot
+    uint8_t   reserved[108];                  ///< Reserved for future use
+    uint32_t  magicEnd;                       ///< Magic number
+    uint32_t  crc32;                          ///< CRC of the structure
+}
+Metadata_t;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Measure of a benchmark
+ */
+//--------------------------------------------------------------------------------------------------
+typedef struct
+{
+    const char*   namePtr;  ///< Name of the benchmark
+    le_clk_Time_t start;    ///< Time when the benchmark was started
+}
+Measure_t;
+
+//==================================================================================================
+//                                       Static variables
+//==================================================================================================
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Memory Pool for flash temporary image blocks
+ */
+//--------------------------------------------------------------------------------------------------
+static le_mem_PoolRef_t   FlashImgPool;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Number of loops for the raw MTD benchmarks
+ */
+//--------------------------------------------------------------------------------------------------
+static int BenchLoops = BENCH_LOOPS;
+
+//==================================================================================================
+//                                       Private Functions
+//==================================================================================================
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Start a measure: reset the sys_flash statistics and take the start time.
+ */
+//--------------------------------------------------------------------------------------------------
+static void StartMeasure
+(
+    Measure_t* measurePtr,
+    const char* namePtr
+)
+{
+    measurePtr->namePtr = namePtr;
+    sys_flash_ResetStats();
+    measurePtr->start = le_clk_GetRelativeTime();
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Stop a measure and report the throughput on the given size, the system calls per MB and the
+ * peak RSS. The peak RSS is the one of the whole process since it started (ru_maxrss), not the one
+ * of the measure.
+ */
+//--------------------------------------------------------------------------------------------------
+static void StopMeasure
+(
+    Measure_t* measurePtr,
+    size_t size
+)
+{
+    le_clk_Time_t elapsed = le_clk_Sub(le_clk_GetRelativeTime(), measurePtr->start);
+    uint64_t elapsedUs = (uint64_t)elapsed.sec * 1000000 + elapsed.usec;
+    sys_flash_Stats_t stats;
+    struct rusage usage;
+    double mb = (double)size / (1024 * 1024);
+
+    sys_flash_GetStats(&stats);
+    memset(&usage, 0, sizeof(usage));
+    (void)getrusage(RUSAGE_SELF, &usage);
+
+    if( 0 == elapsedUs )
+    {
+        elapsedUs = 1;
+    }
+
+    LE_TEST_INFO("BENCH %-24s %8zu bytes %8.3f s %8.2f MB/s %10.1f syscalls/MB",
+                 measurePtr->namePtr, size, (double)elapsedUs / 1000000,
+                 mb * 1000000 / elapsedUs, (mb > 0) ? stats.syscalls / mb : 0.0);
+    LE_TEST_INFO("BENCH %-24s read %" PRIu64 " pages, programmed %" PRIu64 " pages,"
+                 " erased %" PRIu64 " PEBs, device busy %.1f%%, process peak RSS %ld KB",
+                 measurePtr->namePtr, stats.pagesRead, stats.pagesWritten, stats.blocksErased,
+                 100.0 * stats.latencyUs / elapsedUs, usage.ru_maxrss);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This function copies the CWE body image from SWIFOTA to BOOT partition (Single systems). This
+ * is required to have a valid origin image before applying a delta.
+ */
+//--------------------------------------------------------------------------------------------------
+static void ApplySwifotaToBootPartition
+(
+    void
+)
+{
+    int rc;
+    int fdSwifota, fdDest;
+    int mtdSwifota = -1, mtdDest = -1;
+    pa_flash_Info_t flashInfo;
+    char line[PATH_MAX];
+    off_t offset;
+
+    LE_TEST_ASSERT(LE_OK == pa_flash_GetMtdFromName("swifota", &mtdSwifota), "");
+    LE_TEST_ASSERT(LE_OK == pa_flash_GetInfo(mtdSwifota, &flashInfo, false, false), "");
+
+    Metadata_t md;
+    uint8_t buffer[flashInfo.eraseSize];
+    snprintf(line, sizeof(line), "/dev/mtd%d", mtdSwifota);
+    fdSwifota = open(line, O_RDONLY);
+    LE_TEST_ASSERT(fdSwifota != -1, "");
+
+    rc = sys_flashReadSkipBadBlock(fdSwifota, &md, sizeof(md));
+    LE_TEST_ASSERT(rc == sizeof(md), "");
+
+    offset = md.phyBlock * flashInfo.eraseSize;
+    rc = lseek(fdSwifota, offset, SEEK_SET);
+    LE_TEST_ASSERT(rc == offset, "");
+
+    rc = read(fdSwifota, buffer, 2 * CWE_HEADER_SIZE);
+    LE_TEST_ASSERT(rc == (2 * CWE_HEADER_SIZE), "");
+
+    // Skip the first header;
+    cwe_Header_t* cwePtr = (cwe_Header_t*)(buffer + CWE_HEADER_SIZE);
+    uint32_t cweType = (cwePtr->imageType);
+    uint32_t cweSize = be32toh(cwePtr->imageSize);
+    uint32_t size = 0;
+
+    if( memcmp(&cweType, "APPS", 4) == 0 )
+    {
+        LE_TEST_ASSERT(LE_OK == pa_flash_GetMtdFromName("boot", &mtdDest), "");
+    }
+    else if( memcmp(&cweType, "USER", 4) == 0 )
+    {
+        LE_TEST_ASSERT(LE_OK == pa_flash_GetMtdFromName("lefwkro", &mtdDest), "");
+    }
+    LE_TEST_ASSERT(mtdDest != -1, "Unsupported partition");
+
+    snprintf(line, sizeof(line), "/dev/mtd%d", mtdDest);
+    fdDest = open(line, O_WRONLY);
+    LE_TEST_ASSERT(fdDest != -1, "");
+    while( size < cweSize )
+    {
+        int rdsz;
+        rdsz = sys_flashReadSkipBadBlock(fdSwifota, buffer, flashInfo.eraseSize);
+        LE_TEST_ASSERT(rdsz > 0, "");
+        rc = write(fdDest, buffer, rdsz);
+        LE_TEST_ASSERT(rc == rdsz, "");
+        size += rdsz;
+    }
+    close(fdSwifota);
+    close(fdDest);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Benchmark the raw MTD services: pa_flash_EraseBlock, pa_flash_Write, pa_flash_Read and the
+ * check of the written data by partition_CheckData.
+ */
+//--------------------------------------------------------------------------------------------------
+static void Bench_pa_flash_Mtd
+(
+    int mtdNum
+)
+{
+    pa_flash_Desc_t desc;
+    pa_flash_Info_t* infoPtr;
+    Measure_t measure;
+    uint32_t blk, page;
+    uint32_t crc = LE_CRC_START_CRC32;
+    int loop;
+    bool isOk;
+
+    LE_TEST_INFO("======== Bench: pa_flash MTD ========");
+
+    LE_TEST_ASSERT(LE_OK == pa_flash_Open(mtdNum, PA_FLASH_OPENMODE_READWRITE, &desc, &infoPtr),
+                   "");
+
+    uint8_t* blockPtr = le_mem_ForceAlloc(FlashImgPool);
+    size_t size = infoPtr->nbBlk * infoPtr->eraseSize;
+
+    StartMeasure(&measure, "pa_flash_EraseBlock");
+    for( isOk = true, loop = 0; loop < BenchLoops; loop++ )
+    {
+        for( blk = 0; blk < infoPtr->nbBlk; blk++ )
+        {
+            isOk = isOk && (LE_OK == pa_flash_EraseBlock(desc, blk));
+        }
+    }
+    StopMeasure(&measure, size * BenchLoops);
+    LE_TEST(isOk);
+
+    StartMeasure(&measure, "pa_flash_Write");
+    for( isOk = true, loop = 0; loop < BenchLoops; loop++ )
+    {
+        if( loop )
+        {
+            // The blocks have to be erased before being programmed again
+            for( blk = 0; blk < infoPtr->nbBlk; blk++ )
+            {
+                isOk = isOk && (LE_OK == pa_flash_EraseBlock(desc, blk));
+            }
+        }
+        isOk = isOk && (LE_OK == pa_flash_SeekAtBlock(desc, 0));
+        for( crc = LE_CRC_START_CRC32, blk = 0; blk < infoPtr->nbBlk; blk++ )
+        {
+            for( page = 0; page < infoPtr->eraseSize; page += infoPtr->writeSize )
+            {
+                memset(blockPtr + page, (uint8_t)(blk + page / infoPtr->writeSize),
+                       infoPtr->writeSize);
+            }
+            crc = crc32_Compute(blockPtr, infoPtr->eraseSize, crc);
+            isOk = isOk && (LE_OK == pa_flash_Write(desc, blockPtr, infoPtr->eraseSize));
+        }
+    }
+    StopMeasure(&measure, size * BenchLoops);
+    LE_TEST(isOk);
+
+    StartMeasure(&measure, "pa_flash_Read");
+    for( isOk = true, loop = 0; loop < BenchLoops; loop++ )
+    {
+        isOk = isOk && (LE_OK == pa_flash_SeekAtBlock(desc, 0));
+        for( blk = 0; blk < infoPtr->nbBlk; blk++ )
+        {
+            isOk = isOk && (LE_OK == pa_flash_Read(desc, blockPtr, infoPtr->eraseSize));
+        }
+    }
+    StopMeasure(&measure, size * BenchLoops);
+    LE_TEST(isOk);
+
+    le_mem_Release(blockPtr);
+    LE_TEST(LE_OK == pa_flash_Close(desc));
+
+    StartMeasure(&measure, "partition_CheckData");
+    for( isOk = true, loop = 0; loop < BenchLoops; loop++ )
+    {
+        isOk = isOk && (LE_OK == partition_CheckData(mtdNum, size, 0, crc, FlashImgPool, false));
+    }
+    StopMeasure(&measure, size * BenchLoops);
+    LE_TEST(isOk);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Benchmark the UBI write service pa_flash_WriteUbiAtBlock on a freshly created UBI volume
+ */
+//--------------------------------------------------------------------------------------------------
+static void Bench_pa_flash_WriteUbiAtBlock
+(
+    int mtdNum
+)
+{
+    pa_flash_Desc_t desc;
+    pa_flash_Info_t* infoPtr;
+    Measure_t measure;
+    uint32_t leb, nbLeb;
+    bool isOk = true;
+
+    LE_TEST_INFO("======== Bench: pa_flash UBI ========");
+
+    LE_TEST_ASSERT(LE_OK == pa_flash_Open(mtdNum, PA_FLASH_OPENMODE_READWRITE, &desc, &infoPtr),
+                   "");
+    LE_TEST_ASSERT(LE_OK == pa_flash_CreateUbi(desc, true), "");
+
+    // A LEB is a PEB without the EC and VID header pages. Keep some PEBs for the UBI internals
+    size_t lebSize = infoPtr->eraseSize - 2 * infoPtr->writeSize;
+    nbLeb = infoPtr->nbBlk / 2;
+
+    LE_TEST_ASSERT(LE_OK == pa_flash_CreateUbiVolumeWithFlags(desc, 0, "bench",
+                                                              PA_FLASH_VOLUME_DYNAMIC,
+                                                              nbLeb * lebSize, 0), "");
+    LE_TEST_ASSERT(LE_OK == pa_flash_ScanUbi(desc, 0), "");
+
+    uint8_t* blockPtr = le_mem_ForceAlloc(FlashImgPool);
+
+    StartMeasure(&measure, "pa_flash_WriteUbiAtBlock");
+    for( leb = 0; leb < nbLeb; leb++ )
+    {
+        memset(blockPtr, (uint8_t)leb, lebSize);
+        isOk = isOk && (LE_OK == pa_flash_WriteUbiAtBlock(desc, leb, blockPtr, lebSize, true));
+    }
+    isOk = isOk && (LE_OK == pa_flash_AdjustUbiSize(desc, nbLeb * lebSize));
+    StopMeasure(&measure, nbLeb * lebSize);
+    LE_TEST(isOk);
+
+    le_mem_Release(blockPtr);
+    LE_TEST(LE_OK == pa_flash_Close(desc));
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Benchmark a full pa_fwupdate_Download of a package
+ */
+//--------------------------------------------------------------------------------------------------
+static void Bench_pa_fwupdate_Download
+(
+    const char* namePtr,
+    const char* pathPtr
+)
+{
+    Measure_t measure;
+    struct stat st;
+    int fd;
+
+    LE_TEST_INFO("======== Bench: %s (%s) ========", namePtr, pathPtr);
+
+    fd = open(pathPtr, O_RDONLY);
+    LE_TEST_ASSERT(fd >= 0, "Unable to open %s", pathPtr);
+    LE_TEST_ASSERT(0 == fstat(fd, &st), "");
+
+    StartMeasure(&measure, namePtr);
+    LE_TEST(LE_OK == pa_fwupdate_Download(fd));
+    StopMeasure(&measure, st.st_size);
+    close(fd);
+
+    (void)pa_fwupdate_Install(true);
+    ApplySwifotaToBootPartition();
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Main of the benchmark.
+ */
+//--------------------------------------------------------------------------------------------------
+COMPONENT_INIT
+{
+    int mtdNum;
+    pa_flash_Info_t flashInfo;
+    uint32_t pageProgramUs = BENCH_PAGE_PROGRAM_US;
+    uint32_t blockEraseUs = BENCH_BLOCK_ERASE_US;
+    uint32_t pageReadUs = BENCH_PAGE_READ_US;
+    uint32_t syscallUs = BENCH_SYSCALL_US;
+    char thisPath[PATH_MAX], *ptr;
+
+    LE_TEST_PLAN(LE_TEST_NO_PLAN);
+
+    // The packages are relative to the path of the executable
+    snprintf(thisPath, sizeof(thisPath), "/proc/%d/cmdline", getpid());
+    FILE* fdPtr = fopen( thisPath, "r" );
+    memset(thisPath, 0, sizeof(thisPath));
+    fscanf(fdPtr, "%s", thisPath);
+    fclose(fdPtr);
+    ptr = strrchr(thisPath, '/');
+    if( ptr )
+    {
+        *ptr = '\0';
+    }
+    chdir(thisPath);
+
+    char *envPtr = getenv("SYS_FLASH_LATENCY");
+    if( envPtr && *envPtr )
+    {
+        if( 4 != sscanf(envPtr, "%u,%u,%u,%u",
+                        &pageProgramUs, &blockEraseUs, &pageReadUs, &syscallUs) )
+        {
+            LE_TEST_FATAL("Bad latency string \"%s\"", envPtr);
+        }
+    }
+    envPtr = getenv("BENCH_LOOPS");
+    if( envPtr && *envPtr )
+    {
+        BenchLoops = atoi(envPtr);
+        if( BenchLoops <= 0 )
+        {
+            LE_TEST_FATAL("Bad loop count \"%s\"", envPtr);
+        }
+    }
+
+    if( LE_OK != pa_flash_GetMtdFromName( "swifota", &mtdNum ) )
+    {
+        LE_TEST_FATAL("Unable to find a valid MTD for \"swifota\"");
+    }
+
+    if( LE_OK != pa_flash_GetInfo( mtdNum, &flashInfo, false, false ) )
+    {
+        LE_TEST_FATAL("Unable to get MTD informations for \"swifota\"");
+    }
+
+    // Allocate a pool for the blocks to be flashed and checked
+    FlashImgPool = le_mem_CreatePool("FlashImagePool", flashInfo.eraseSize);
+    le_mem_ExpandPool(FlashImgPool, 3);
+
+    LE_TEST_INFO("======== Start flash benchmarks [%u blocks of %u bytes, %d loops] ========",
+                 flashInfo.nbBlk, flashInfo.eraseSize, BenchLoops);
+
+    sys_flash_SetLatency(pageProgramUs, blockEraseUs, pageReadUs, syscallUs);
+
+    Bench_pa_flash_Mtd(mtdNum);
+    Bench_pa_flash_WriteUbiAtBlock(mtdNum);
+
+    LE_TEST(LE_OK == pa_fwupdate_InitDownload());
+    Bench_pa_fwupdate_Download("pa_fwupdate_Download", LS_CWE);
+    Bench_pa_fwupdate_Download("delta apply", LS2CP_CWE);
+
+    sys_flash_SetLatency(0, 0, 0, 0);
+
+    LE_TEST_INFO("======== Flash benchmarks end ========");
+    LE_TEST_EXIT;
+}
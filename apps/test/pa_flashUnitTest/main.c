@@ -8,9 +8,11 @@
 #include "legato.h"
 #include <pthread.h>
 #include "cwe_local.h"
+#include "crc32_local.h"
 #include "pa_fwupdate.h"
 #include "partition_local.h"
 #include "pa_flash.h"
+#include "pa_flash_local.h"
 #include "log.h"
 #include "sys_flash.h"
 
@@ -717,6 +719,173 @@ static void Test_pa_flash_ResumeWriteDeltaCwe
     LE_TEST_ASSERT(DeltaCweFullCrc == fullCrc, "");
 }
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * This test checks that pa_flash_Write does not program the erased pages of a block, unless the
+ * skip is disabled on the descriptor
+ *
+ */
+//--------------------------------------------------------------------------------------------------
+static void Test_pa_flash_WriteErasedPages
+(
+    void
+)
+{
+    pa_flash_Desc_t desc;
+    pa_flash_Info_t *flashInfoPtr;
+    sys_flash_Stats_t stats;
+    uint8_t *blockPtr, *readPtr;
+    uint32_t nbPages, page;
+    int mtdNum;
+
+    LE_TEST_INFO ("======== Test: pa_flash_WriteErasedPages ========");
+
+    mtdNum = partition_GetMtdFromImageTypeOrName( 0, "swifota", NULL );
+    LE_TEST_ASSERT(-1 != mtdNum, "Get MTD of \"swifota\"");
+    LE_TEST_ASSERT(LE_OK == pa_flash_Open( mtdNum, PA_FLASH_OPENMODE_READWRITE, &desc,
+                                           &flashInfoPtr ),
+                   "Open MTD %d", mtdNum);
+
+    // One page out of four holds data, the others are erased
+    blockPtr = le_mem_ForceAlloc(FlashImgPool);
+    readPtr = le_mem_ForceAlloc(FlashImgPool);
+    nbPages = flashInfoPtr->eraseSize / flashInfoPtr->writeSize;
+    memset( blockPtr, PA_FLASH_ERASED_VALUE, flashInfoPtr->eraseSize );
+    for (page = 0; page < nbPages; page += 4)
+    {
+        memset( blockPtr + (page * flashInfoPtr->writeSize), (uint8_t)page,
+                flashInfoPtr->writeSize / 2 );
+    }
+
+    LE_TEST(LE_OK == pa_flash_EraseBlock( desc, 0 ));
+    LE_TEST(LE_OK == pa_flash_SeekAtBlock( desc, 0 ));
+    sys_flash_ResetStats();
+    LE_TEST(LE_OK == pa_flash_Write( desc, blockPtr, flashInfoPtr->eraseSize ));
+    sys_flash_GetStats( &stats );
+    LE_TEST_INFO("%"PRIu64" pages programmed out of %u", stats.pagesWritten, nbPages);
+    LE_TEST(((nbPages + 3) / 4) == stats.pagesWritten);
+    LE_TEST(LE_OK == pa_flash_ReadAtBlock( desc, 0, readPtr, flashInfoPtr->eraseSize ));
+    LE_TEST(0 == memcmp( blockPtr, readPtr, flashInfoPtr->eraseSize ));
+
+    // Without skip, all the pages are programmed
+    LE_TEST(LE_OK == pa_flash_SetSkipErasedPages( desc, false ));
+    LE_TEST(LE_OK == pa_flash_EraseBlock( desc, 0 ));
+    LE_TEST(LE_OK == pa_flash_SeekAtBlock( desc, 0 ));
+    sys_flash_ResetStats();
+    LE_TEST(LE_OK == pa_flash_Write( desc, blockPtr, flashInfoPtr->eraseSize ));
+    sys_flash_GetStats( &stats );
+    LE_TEST(nbPages == stats.pagesWritten);
+    LE_TEST(LE_OK == pa_flash_ReadAtBlock( desc, 0, readPtr, flashInfoPtr->eraseSize ));
+    LE_TEST(0 == memcmp( blockPtr, readPtr, flashInfoPtr->eraseSize ));
+
+    le_mem_Release(readPtr);
+    le_mem_Release(blockPtr);
+    LE_TEST(LE_OK == pa_flash_Close( desc ));
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This test injects a write error after a run of erased pages. The pages already handled are
+ * skipped and the position is moved beyond them, so pa_flash_Write must go back to the block start
+ * before it retries on the next good block.
+ *
+ */
+//--------------------------------------------------------------------------------------------------
+static void Test_pa_flash_WriteFailureAfterErasedPages
+(
+    void
+)
+{
+    pa_flash_Desc_t desc;
+    pa_flash_Info_t *flashInfoPtr;
+    uint8_t *blockPtr, *readPtr;
+    uint32_t nbPages, page;
+    bool isBad;
+    int mtdNum;
+
+    LE_TEST_INFO ("======== Test: pa_flash_WriteFailureAfterErasedPages ========");
+
+    mtdNum = partition_GetMtdFromImageTypeOrName( 0, "swifota", NULL );
+    LE_TEST_ASSERT(-1 != mtdNum, "Get MTD of \"swifota\"");
+    LE_TEST_ASSERT(LE_OK == pa_flash_Open( mtdNum,
+                                           PA_FLASH_OPENMODE_READWRITE | PA_FLASH_OPENMODE_MARKBAD,
+                                           &desc, &flashInfoPtr ),
+                   "Open MTD %d", mtdNum);
+
+    // The first quarter of the block is erased, each other page holds its own data
+    blockPtr = le_mem_ForceAlloc(FlashImgPool);
+    readPtr = le_mem_ForceAlloc(FlashImgPool);
+    nbPages = flashInfoPtr->eraseSize / flashInfoPtr->writeSize;
+    memset( blockPtr, PA_FLASH_ERASED_VALUE, flashInfoPtr->eraseSize );
+    for (page = nbPages / 4; page < nbPages; page++)
+    {
+        memset( blockPtr + (page * flashInfoPtr->writeSize), (uint8_t)page,
+                flashInfoPtr->writeSize );
+    }
+
+    LE_TEST(LE_OK == pa_flash_EraseBlock( desc, 0 ));
+    LE_TEST(LE_OK == pa_flash_EraseBlock( desc, 1 ));
+    LE_TEST(LE_OK == pa_flash_SeekAtBlock( desc, 0 ));
+
+    // The write to block 0 fails, and so does its erase: the block is written again in block 1
+    sys_flash_SetBadBlockWrite( "swifota", 1ULL );
+    LE_TEST(LE_OK == pa_flash_Write( desc, blockPtr, flashInfoPtr->eraseSize ));
+    LE_TEST(LE_OK == pa_flash_CheckBadBlock( desc, 0, &isBad ));
+    LE_TEST(isBad);
+    LE_TEST(LE_OK == pa_flash_ReadAtBlock( desc, 1, readPtr, flashInfoPtr->eraseSize ));
+    LE_TEST(0 == memcmp( blockPtr, readPtr, flashInfoPtr->eraseSize ));
+
+    le_mem_Release(readPtr);
+    le_mem_Release(blockPtr);
+    LE_TEST(LE_OK == pa_flash_Close( desc ));
+    sys_flash_ResetBadBlock( "swifota" );
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This test checks that the CRC32 engine gives the same result as le_crc_Crc32(), whatever the
+ * alignment and the length of the buffer, and that CRC32 of chunks can be combined
+ *
+ */
+//--------------------------------------------------------------------------------------------------
+static void Test_crc32_Compute
+(
+    void
+)
+{
+    static uint8_t buf[3*CHUNK_SIZE];
+    uint32_t crc, chunkCrc;
+    size_t len, off, i;
+
+    LE_TEST_INFO ("======== Test: crc32_Compute ========");
+
+    for (i = 0; i < sizeof(buf); i++)
+    {
+        buf[i] = (uint8_t)rand();
+    }
+
+    for (off = 0; off < 8; off++)
+    {
+        for (len = 0; len < 300; len++)
+        {
+            if (le_crc_Crc32(buf + off, len, LE_CRC_START_CRC32) !=
+                crc32_Compute(buf + off, len, LE_CRC_START_CRC32))
+            {
+                break;
+            }
+        }
+        LE_TEST(300 == len);
+    }
+    LE_TEST(le_crc_Crc32(buf + 1, sizeof(buf) - 1, LE_CRC_START_CRC32) ==
+            crc32_Compute(buf + 1, sizeof(buf) - 1, LE_CRC_START_CRC32));
+
+    crc = crc32_Compute(buf, CHUNK_SIZE + 3, LE_CRC_START_CRC32);
+    chunkCrc = crc32_Compute(buf + CHUNK_SIZE + 3, sizeof(buf) - (CHUNK_SIZE + 3),
+                             CRC32_START_CHUNK);
+    crc = crc32_Combine(crc, chunkCrc, sizeof(buf) - (CHUNK_SIZE + 3));
+    LE_TEST(le_crc_Crc32(buf, sizeof(buf), LE_CRC_START_CRC32) == crc);
+}
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Main of the test.
@@ -762,6 +931,10 @@ COMPONENT_INIT
 
     partition_Initialize();
 
+    Test_crc32_Compute();
+    Test_pa_flash_WriteErasedPages();
+    Test_pa_flash_WriteFailureAfterErasedPages();
+
     char *bbPtr = getenv("BAD_BLOCK_SWIFOTA");
     if( bbPtr && *bbPtr )
     {
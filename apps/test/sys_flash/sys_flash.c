@@ -30,7 +30,10 @@
 #include <memory.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <time.h>
+#include <pthread.h>
 #include "legato.h"
+#include "sys_flash.h"
 
 //--------------------------------------------------------------------------------------------------
 /**
@@ -136,6 +139,91 @@ SysFlashMtd[] =
 //--------------------------------------------------------------------------------------------------
 static bool IsEccStateFailed = false;
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Latency model of the emulated NAND, in micro-seconds. All costs are 0 by default so that the
+ * unitary tests are not slowed down. This may be changed by sys_flash_SetLatency().
+ */
+//--------------------------------------------------------------------------------------------------
+static struct
+{
+    uint32_t pageProgramUs;    ///< Cost to program one page (writesize)
+    uint32_t blockEraseUs;     ///< Cost to erase one PEB (erasesize)
+    uint32_t pageReadUs;       ///< Cost to read one page (writesize)
+    uint32_t syscallUs;        ///< Cost of any call to an emulated system service
+}
+SysFlashLatency;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Statistics on the emulated flash accesses. They may be read by sys_flash_GetStats() and reset
+ * by sys_flash_ResetStats(). The mutex protects them as pa_flash may access the flash from
+ * several threads.
+ */
+//--------------------------------------------------------------------------------------------------
+static sys_flash_Stats_t SysFlashStats;
+static pthread_mutex_t SysFlashStatsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Account a system service call and the pages and blocks it accessed, and wait for the simulated
+ * device latency.
+ */
+//--------------------------------------------------------------------------------------------------
+static void sys_flashAccount
+(
+    uint32_t pagesRead,
+    uint32_t pagesWritten,
+    uint32_t blocksErased,
+    size_t bytesRead,
+    size_t bytesWritten
+)
+{
+    uint64_t latencyUs = (uint64_t)SysFlashLatency.syscallUs +
+                         (uint64_t)pagesRead * SysFlashLatency.pageReadUs +
+                         (uint64_t)pagesWritten * SysFlashLatency.pageProgramUs +
+                         (uint64_t)blocksErased * SysFlashLatency.blockEraseUs;
+
+    pthread_mutex_lock(&SysFlashStatsMutex);
+    SysFlashStats.syscalls++;
+    SysFlashStats.pagesRead += pagesRead;
+    SysFlashStats.pagesWritten += pagesWritten;
+    SysFlashStats.blocksErased += blocksErased;
+    SysFlashStats.bytesRead += bytesRead;
+    SysFlashStats.bytesWritten += bytesWritten;
+    SysFlashStats.latencyUs += latencyUs;
+    pthread_mutex_unlock(&SysFlashStatsMutex);
+
+    if( latencyUs )
+    {
+        // Sleep instead of spinning: the device is busy, not the CPU. This lets the threads of
+        // pa_flash overlap their accesses as they would on a real NAND controller.
+        struct timespec ts = { .tv_sec = latencyUs / 1000000,
+                               .tv_nsec = (latencyUs % 1000000) * 1000 };
+        while( (-1 == nanosleep(&ts, &ts)) && (EINTR == errno) )
+        {
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Compute the number of pages touched by an access of count bytes at offset here.
+ */
+//--------------------------------------------------------------------------------------------------
+static uint32_t sys_flashNbPages
+(
+    off_t here,
+    size_t count
+)
+{
+    if( 0 == count )
+    {
+        return 0;
+    }
+    return ((here + count - 1) / SYS_FLASH_WRITESIZE) - (here / SYS_FLASH_WRITESIZE) + 1;
+}
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Build the "real" absolute pathname according to the given one. If the given path refers to entry
@@ -238,25 +326,21 @@ static int sys_flashErase
         return -1;
     }
 
-    if( eraseMePtr->start != lseek(fd, eraseMePtr->start, SEEK_SET))
-    {
-        return -1;
-    }
-
     int nb;
     int peb;
     char erased[SYS_FLASH_ERASESIZE];
 
+    // As MEMERASE on a MTD, the erase does not move the current position of the descriptor
     memset(erased, 0xFF, sizeof(erased));
     for(nb = 0; nb < eraseMePtr->length; nb += sizeof(erased))
     {
-        peb = (eraseMePtr->start / SYS_FLASH_ERASESIZE);
+        peb = ((eraseMePtr->start + nb) / SYS_FLASH_ERASESIZE);
         if( (peb < 64) && ((1ULL << peb) & SysFlashMtd[mtdNum].badBlockErase) )
         {
             errno = EIO;
             return -1;
         }
-        if(sizeof(erased) != write(fd, erased, sizeof(erased)))
+        if(sizeof(erased) != pwrite(fd, erased, sizeof(erased), eraseMePtr->start + nb))
         {
             errno = EIO;
             return -1;
@@ -541,6 +625,7 @@ FILE* sys_flashFOpen
     const char *mode
 )
 {
+    sys_flashAccount(0, 0, 0, 0, 0);
     return fopen(sys_FlashBuildPathName(pathname), mode);
 }
 
@@ -567,6 +652,7 @@ int sys_flashOpen
     mode = va_arg (ap, int);
     va_end(ap);
 
+    sys_flashAccount(0, 0, 0, 0, 0);
     return open(sys_FlashBuildPathName(pathname), flags, mode);
 }
 
@@ -585,19 +671,61 @@ int sys_flashAccess
     int mode
 )
 {
+    sys_flashAccount(0, 0, 0, 0, 0);
     return access(sys_FlashBuildPathName(namePtr), mode);
 }
 
 //--------------------------------------------------------------------------------------------------
 /**
- * Write to a partition or to a file.
+ * Check that the pages to be programmed are erased. A NAND page can only be programmed once after
+ * its PEB has been erased.
+ *
+ * @return
+ *      - true         All the pages are erased
+ *      - false        A page is already programmed or it cannot be read
+ */
+//--------------------------------------------------------------------------------------------------
+static bool sys_flashIsErased
+(
+    int fd,
+    off_t here,
+    size_t count
+)
+{
+    uint8_t page[SYS_FLASH_WRITESIZE];
+    size_t offset;
+    int i;
+
+    for( offset = 0; offset < count; offset += SYS_FLASH_WRITESIZE )
+    {
+        if( SYS_FLASH_WRITESIZE != pread(fd, page, SYS_FLASH_WRITESIZE, here + offset) )
+        {
+            return false;
+        }
+        for( i = 0; i < SYS_FLASH_WRITESIZE; i++ )
+        {
+            if( 0xFF != page[i] )
+            {
+                LE_ERROR("Page at 0x%llx is programmed without being erased",
+                         (unsigned long long)(here + offset));
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Write to a partition or to a file. The pages of a partition need to be erased to be written.
  *
  * @return   (errno)
  *      - >= 0         On success
- *      - -1           The write(2) has failed (errno set by write(2))
+ *      - -1           The write(2) has failed (errno set by write(2)) or a page is not erased
+ *                     (EIO)
  */
 //--------------------------------------------------------------------------------------------------
-int sys_flashWrite
+ssize_t sys_flashWrite
 (
     int fd,
     const void* buf,
@@ -607,9 +735,11 @@ int sys_flashWrite
     off_t here = lseek(fd, 0, SEEK_CUR);
     int mtdNum = sys_FlashGetMtdNum( fd );
     int peb;
+    ssize_t rc;
 
     if( -1 == mtdNum )
     {
+        sys_flashAccount(0, 0, 0, 0, 0);
         return ENOTTY == errno ? write(fd, buf, count) : -1;
     }
 
@@ -632,7 +762,14 @@ int sys_flashWrite
         errno = EIO;
         return -1;
     }
-    return write(fd, buf, count);
+    if( !sys_flashIsErased(fd, here, count) )
+    {
+        errno = EIO;
+        return -1;
+    }
+    rc = write(fd, buf, count);
+    sys_flashAccount(0, (rc > 0) ? sys_flashNbPages(here, rc) : 0, 0, 0, (rc > 0) ? rc : 0);
+    return rc;
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -645,7 +782,7 @@ int sys_flashWrite
  *      - -1           The read(2) has failed (errno set by read(2))
  */
 //--------------------------------------------------------------------------------------------------
-int sys_flashRead
+ssize_t sys_flashRead
 (
     int fd,
     void* buf,
@@ -657,6 +794,7 @@ int sys_flashRead
 
     if( -1 == mtdNum )
     {
+        sys_flashAccount(0, 0, 0, 0, 0);
         return ENOTTY == errno ? read(fd, buf, count) : -1;
     }
 
@@ -703,6 +841,7 @@ int sys_flashRead
         }
     }
 
+    sys_flashAccount(sys_flashNbPages(here, rdCount), 0, 0, rdCount, 0);
     return rc;
 }
 
@@ -728,6 +867,7 @@ int sys_flashReadSkipBadBlock
 
     if( -1 == mtdNum )
     {
+        sys_flashAccount(0, 0, 0, 0, 0);
         return ENOTTY == errno ? read(fd, buf, count) : -1;
     }
 
@@ -780,6 +920,7 @@ int sys_flashReadSkipBadBlock
         }
     }
 
+    sys_flashAccount(sys_flashNbPages(0, rdCount), 0, 0, rdCount, 0);
     return rc;
 }
 
@@ -806,11 +947,18 @@ int sys_flashIoctl
     arg = va_arg (ap, void *);
     va_end(ap);
 
+    if( MEMERASE == request )
+    {
+        struct erase_info_user *eraseMePtr = (struct erase_info_user *)arg;
+        int rc = sys_flashErase(fd, arg);
+
+        sys_flashAccount(0, 0, (0 == rc) ? eraseMePtr->length / SYS_FLASH_ERASESIZE : 0, 0, 0);
+        return rc;
+    }
+
+    sys_flashAccount(0, 0, 0, 0, 0);
     switch(request)
     {
-        case MEMERASE:
-            return sys_flashErase(fd, arg);
-            break;
         case MEMGETBADBLOCK:
             return sys_flashGetBadBlock(fd, arg);
             break;
@@ -835,6 +983,7 @@ DIR *sys_flashOpendir
     const char *name
 )
 {
+    sys_flashAccount(0, 0, 0, 0, 0);
     return opendir(sys_FlashBuildPathName(name));
 }
 
@@ -848,6 +997,7 @@ int sys_flashUnlink
     const char *name
 )
 {
+    sys_flashAccount(0, 0, 0, 0, 0);
     return unlink(sys_FlashBuildPathName(name));
 }
 
@@ -863,6 +1013,7 @@ int sys_flashRename
 )
 {
     char oldpath[PATH_MAX];
+    sys_flashAccount(0, 0, 0, 0, 0);
     snprintf(oldpath, sizeof(oldpath), "%s", sys_FlashBuildPathName(oldname));
     return rename(oldpath, sys_FlashBuildPathName(newname));
 }
@@ -1226,3 +1377,61 @@ void sys_flash_ResetSize
         }
     }
 }
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Set the latency model of the emulated NAND. Each access to the flash will sleep for the cost of
+ * the pages and blocks it accesses plus the cost of the system call. Set all to 0 to disable it.
+ *
+ * @return None
+ */
+//--------------------------------------------------------------------------------------------------
+void sys_flash_SetLatency
+(
+    uint32_t pageProgramUs,
+    uint32_t blockEraseUs,
+    uint32_t pageReadUs,
+    uint32_t syscallUs
+)
+{
+    LE_INFO("Set latency: program %u us, erase %u us, read %u us, syscall %u us",
+            pageProgramUs, blockEraseUs, pageReadUs, syscallUs);
+    SysFlashLatency.pageProgramUs = pageProgramUs;
+    SysFlashLatency.blockEraseUs = blockEraseUs;
+    SysFlashLatency.pageReadUs = pageReadUs;
+    SysFlashLatency.syscallUs = syscallUs;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Get the statistics on the emulated flash accesses since the last sys_flash_ResetStats()
+ *
+ * @return None
+ */
+//--------------------------------------------------------------------------------------------------
+void sys_flash_GetStats
+(
+    sys_flash_Stats_t *statsPtr
+)
+{
+    pthread_mutex_lock(&SysFlashStatsMutex);
+    *statsPtr = SysFlashStats;
+    pthread_mutex_unlock(&SysFlashStatsMutex);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Reset the statistics on the emulated flash accesses
+ *
+ * @return None
+ */
+//--------------------------------------------------------------------------------------------------
+void sys_flash_ResetStats
+(
+    void
+)
+{
+    pthread_mutex_lock(&SysFlashStatsMutex);
+    memset(&SysFlashStats, 0, sizeof(SysFlashStats));
+    pthread_mutex_unlock(&SysFlashStatsMutex);
+}
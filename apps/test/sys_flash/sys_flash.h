@@ -6,6 +6,26 @@
  * Copyright (C) Sierra Wireless Inc.
  */
 
+#ifndef LEGATO_SYS_FLASH_INCLUDE_GUARD
+#define LEGATO_SYS_FLASH_INCLUDE_GUARD
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Statistics on the emulated flash accesses
+ */
+//--------------------------------------------------------------------------------------------------
+typedef struct
+{
+    uint64_t syscalls;      ///< Number of calls to the emulated system services
+    uint64_t pagesRead;     ///< Number of pages read from MTD
+    uint64_t pagesWritten;  ///< Number of pages programmed into MTD
+    uint64_t blocksErased;  ///< Number of PEBs erased
+    uint64_t bytesRead;     ///< Number of bytes read from MTD
+    uint64_t bytesWritten;  ///< Number of bytes programmed into MTD
+    uint64_t latencyUs;     ///< Total latency spent by the simulated device, in micro-seconds
+}
+sys_flash_Stats_t;
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Set the ECC failed state for pa_flash_GetEccStats API
@@ -150,3 +170,45 @@ void sys_flashInit
     void
 );
 #endif
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Set the latency model of the emulated NAND. Each access to the flash will sleep for the cost of
+ * the pages and blocks it accesses plus the cost of the system call. Set all to 0 to disable it.
+ *
+ * @return None
+ */
+//--------------------------------------------------------------------------------------------------
+void sys_flash_SetLatency
+(
+    uint32_t pageProgramUs,
+    uint32_t blockEraseUs,
+    uint32_t pageReadUs,
+    uint32_t syscallUs
+);
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Get the statistics on the emulated flash accesses since the last sys_flash_ResetStats()
+ *
+ * @return None
+ */
+//--------------------------------------------------------------------------------------------------
+void sys_flash_GetStats
+(
+    sys_flash_Stats_t *statsPtr
+);
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Reset the statistics on the emulated flash accesses
+ *
+ * @return None
+ */
+//--------------------------------------------------------------------------------------------------
+void sys_flash_ResetStats
+(
+    void
+);
+
+#endif // LEGATO_SYS_FLASH_INCLUDE_GUARD
@@ -0,0 +1,509 @@
+/**
+ * @file crc32.c
+ *
+ * CRC32 engine and helper functions
+ *
+ * crc32_Compute() computes the same CRC32 register as le_crc_Crc32(). The implementation is
+ * selected at first use according to the CPU: ARMv8 CRC32 instructions, x86 PCLMULQDQ folding, or
+ * a slicing-by-8 table lookup as fallback.
+ *
+ * The CRC32 register computed by le_crc_Crc32() is linear: the CRC32 of a chunk starting from a
+ * value crc is the CRC32 of the chunk starting from 0 xored with crc multiplied by x^(8*length)
+ * modulo the CRC32 polynomial. This allows a single pass on a chunk to update several running
+ * CRC32.
+ *
+ * Copyright (C) Sierra Wireless Inc.
+ *
+ */
+
+#include "legato.h"
+#include "crc32_local.h"
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CRC32_X86_PCLMUL
+#include <immintrin.h>
+#elif defined(__aarch64__) || (defined(__arm__) && defined(__ARM_FEATURE_CRC32))
+#define CRC32_ARM_CRC
+#include <sys/auxv.h>
+#endif
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * CRC32 polynomial, reflected
+ */
+//--------------------------------------------------------------------------------------------------
+#define CRC32_POLY  0xEDB88320
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Number of tables used by the slicing-by-8 algorithm
+ */
+//--------------------------------------------------------------------------------------------------
+#define SLICING_TABLE_COUNT 8
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Minimum length to use the PCLMULQDQ folding. Shorter buffers are handled by slicing-by-8.
+ */
+//--------------------------------------------------------------------------------------------------
+#define PCLMUL_MIN_LENGTH   64
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * ARM hardware capabilities for CRC32 instructions, if not provided by the C library
+ */
+//--------------------------------------------------------------------------------------------------
+#if defined(__aarch64__) && !defined(HWCAP_CRC32)
+#define HWCAP_CRC32     (1 << 7)
+#endif
+#if defined(__arm__) && !defined(HWCAP2_CRC32)
+#define HWCAP2_CRC32    (1 << 4)
+#endif
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Operands of the ARM CRC32 instructions: 32-bit registers are named differently on AArch64
+ */
+//--------------------------------------------------------------------------------------------------
+#ifdef __aarch64__
+#define CRC32_ARM_OPERANDS  " %w0, %w0, %w1"
+#else
+#define CRC32_ARM_OPERANDS  " %0, %0, %1"
+#endif
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Prototype of the CRC32 implementations
+ */
+//--------------------------------------------------------------------------------------------------
+typedef uint32_t (*Crc32Func_t)
+(
+    const uint8_t* dataPtr,
+    size_t size,
+    uint32_t crc
+);
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Slicing-by-8 tables. Table 0 is the classic byte-wise table.
+ */
+//--------------------------------------------------------------------------------------------------
+static uint32_t SlicingTable[SLICING_TABLE_COUNT][256];
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * CRC32 implementation selected for this CPU
+ */
+//--------------------------------------------------------------------------------------------------
+static Crc32Func_t Crc32Func = NULL;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Ensure the engine is initialized once, whatever the calling thread
+ */
+//--------------------------------------------------------------------------------------------------
+static pthread_once_t Crc32InitOnce = PTHREAD_ONCE_INIT;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Number of powers of x kept in X2nTable
+ */
+//--------------------------------------------------------------------------------------------------
+#define X2N_TABLE_SIZE  32
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Table of x^(2^n) modulo CRC32_POLY, for n in [0..X2N_TABLE_SIZE-1]. Filled with the engine.
+ */
+//--------------------------------------------------------------------------------------------------
+static uint32_t X2nTable[X2N_TABLE_SIZE];
+
+//==================================================================================================
+//                                       Private Functions
+//==================================================================================================
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Compute the CRC32 by slicing-by-8: 8 bytes are processed per table lookup round.
+ *
+ * @return
+ *          the updated CRC32
+ */
+//--------------------------------------------------------------------------------------------------
+static uint32_t Crc32Slicing8
+(
+    const uint8_t* dataPtr,     ///< [IN] data buffer
+    size_t size,                ///< [IN] data length
+    uint32_t crc                ///< [IN] CRC32 to update
+)
+{
+    // Process bytes until the buffer is aligned on 4 bytes
+    while (size && ((uintptr_t)dataPtr & 3))
+    {
+        crc = SlicingTable[0][(crc ^ *dataPtr++) & 0xFF] ^ (crc >> 8);
+        size--;
+    }
+
+    while (size >= 8)
+    {
+        uint32_t low = le32toh(*(const uint32_t*)dataPtr) ^ crc;
+        uint32_t high = le32toh(*(const uint32_t*)(dataPtr + 4));
+
+        crc = SlicingTable[7][low & 0xFF] ^
+              SlicingTable[6][(low >> 8) & 0xFF] ^
+              SlicingTable[5][(low >> 16) & 0xFF] ^
+              SlicingTable[4][low >> 24] ^
+              SlicingTable[3][high & 0xFF] ^
+              SlicingTable[2][(high >> 8) & 0xFF] ^
+              SlicingTable[1][(high >> 16) & 0xFF] ^
+              SlicingTable[0][high >> 24];
+        dataPtr += 8;
+        size -= 8;
+    }
+
+    while (size--)
+    {
+        crc = SlicingTable[0][(crc ^ *dataPtr++) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#ifdef CRC32_X86_PCLMUL
+//--------------------------------------------------------------------------------------------------
+/**
+ * Compute the CRC32 by folding 64 bytes at a time with the carry-less multiplication, then reduce
+ * it with a Barrett reduction ("Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ * Instruction", Intel). The tail not multiple of 16 bytes is handled by slicing-by-8.
+ *
+ * @return
+ *          the updated CRC32
+ */
+//--------------------------------------------------------------------------------------------------
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t Crc32Pclmul
+(
+    const uint8_t* dataPtr,     ///< [IN] data buffer
+    size_t size,                ///< [IN] data length
+    uint32_t crc                ///< [IN] CRC32 to update
+)
+{
+    // Folding constants in the bit-reflected domain
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442BD4, 0x01C6E41596 };
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997D0, 0x00CCAA009E };
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163CD6124, 0x0000000000 };
+    static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01DB710641, 0x01F7011641 };
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+    size_t tailSize;
+
+    if (size < PCLMUL_MIN_LENGTH)
+    {
+        return Crc32Slicing8(dataPtr, size, crc);
+    }
+    tailSize = size & 15;
+    size -= tailSize;
+
+    x1 = _mm_loadu_si128((const __m128i*)(dataPtr + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(dataPtr + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(dataPtr + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(dataPtr + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i*)k1k2);
+    dataPtr += 64;
+    size -= 64;
+
+    // Fold by 4 x 128 bits
+    while (size >= 64)
+    {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i*)(dataPtr + 0x00));
+        y6 = _mm_loadu_si128((const __m128i*)(dataPtr + 0x10));
+        y7 = _mm_loadu_si128((const __m128i*)(dataPtr + 0x20));
+        y8 = _mm_loadu_si128((const __m128i*)(dataPtr + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        dataPtr += 64;
+        size -= 64;
+    }
+
+    // Fold the 4 x 128 bits into 128 bits
+    x0 = _mm_load_si128((const __m128i*)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Fold the remaining 128 bits blocks
+    while (size >= 16)
+    {
+        x2 = _mm_loadu_si128((const __m128i*)dataPtr);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        dataPtr += 16;
+        size -= 16;
+    }
+
+    // Fold 128 bits into 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i*)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    crc = (uint32_t)_mm_extract_epi32(x1, 1);
+
+    return Crc32Slicing8(dataPtr, tailSize, crc);
+}
+#endif /* CRC32_X86_PCLMUL */
+
+#ifdef CRC32_ARM_CRC
+//--------------------------------------------------------------------------------------------------
+/**
+ * Compute the CRC32 with the ARMv8 CRC32 instructions
+ *
+ * @return
+ *          the updated CRC32
+ */
+//--------------------------------------------------------------------------------------------------
+#ifdef __aarch64__
+__attribute__((target("+crc")))
+#endif
+static uint32_t Crc32ArmCrc
+(
+    const uint8_t* dataPtr,     ///< [IN] data buffer
+    size_t size,                ///< [IN] data length
+    uint32_t crc                ///< [IN] CRC32 to update
+)
+{
+    while (size && ((uintptr_t)dataPtr & 3))
+    {
+        __asm__("crc32b" CRC32_ARM_OPERANDS : "+r"(crc) : "r"(*dataPtr));
+        dataPtr++;
+        size--;
+    }
+
+#ifdef __aarch64__
+    while (size >= 8)
+    {
+        uint64_t data = *(const uint64_t*)dataPtr;
+        __asm__("crc32x %w0, %w0, %x1" : "+r"(crc) : "r"(data));
+        dataPtr += 8;
+        size -= 8;
+    }
+#endif
+
+    while (size >= 4)
+    {
+        uint32_t data = *(const uint32_t*)dataPtr;
+        __asm__("crc32w" CRC32_ARM_OPERANDS : "+r"(crc) : "r"(data));
+        dataPtr += 4;
+        size -= 4;
+    }
+
+    while (size--)
+    {
+        __asm__("crc32b" CRC32_ARM_OPERANDS : "+r"(crc) : "r"(*dataPtr));
+        dataPtr++;
+    }
+
+    return crc;
+}
+#endif /* CRC32_ARM_CRC */
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Multiply two polynomials modulo CRC32_POLY. The value a must not be 0.
+ *
+ * @return
+ *          a * b modulo CRC32_POLY
+ */
+//--------------------------------------------------------------------------------------------------
+static uint32_t MultModP
+(
+    uint32_t a,     ///< [IN] first polynomial, not 0
+    uint32_t b      ///< [IN] second polynomial
+)
+{
+    uint32_t m = (uint32_t)1 << 31;
+    uint32_t p = 0;
+
+    for (;;)
+    {
+        if (a & m)
+        {
+            p ^= b;
+            if (0 == (a & (m - 1)))
+            {
+                break;
+            }
+        }
+        m >>= 1;
+        b = (b & 1) ? ((b >> 1) ^ CRC32_POLY) : (b >> 1);
+    }
+
+    return p;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Build the slicing-by-8 tables and the table of powers of x, and select the CRC32 implementation
+ * for this CPU
+ */
+//--------------------------------------------------------------------------------------------------
+static void InitCrc32Engine
+(
+    void
+)
+{
+    uint32_t i, k, crc, x;
+
+    for (i = 0; i < 256; i++)
+    {
+        crc = i;
+        for (k = 0; k < 8; k++)
+        {
+            crc = (crc & 1) ? ((crc >> 1) ^ CRC32_POLY) : (crc >> 1);
+        }
+        SlicingTable[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++)
+    {
+        crc = SlicingTable[0][i];
+        for (k = 1; k < SLICING_TABLE_COUNT; k++)
+        {
+            crc = SlicingTable[0][crc & 0xFF] ^ (crc >> 8);
+            SlicingTable[k][i] = crc;
+        }
+    }
+
+    x = (uint32_t)1 << 30; // x^1
+    X2nTable[0] = x;
+    for (i = 1; i < X2N_TABLE_SIZE; i++)
+    {
+        x = MultModP(x, x);
+        X2nTable[i] = x;
+    }
+
+    Crc32Func = Crc32Slicing8;
+
+#if defined(CRC32_X86_PCLMUL)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+    {
+        Crc32Func = Crc32Pclmul;
+    }
+#elif defined(CRC32_ARM_CRC) && defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+    {
+        Crc32Func = Crc32ArmCrc;
+    }
+#elif defined(CRC32_ARM_CRC)
+    if (getauxval(AT_HWCAP2) & HWCAP2_CRC32)
+    {
+        Crc32Func = Crc32ArmCrc;
+    }
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Compute x^(8 * length) modulo CRC32_POLY
+ *
+ * @return
+ *          the polynomial x^(8 * length)
+ */
+//--------------------------------------------------------------------------------------------------
+static uint32_t X8nModP
+(
+    size_t length   ///< [IN] length in bytes
+)
+{
+    uint32_t p = (uint32_t)1 << 31;     // x^0
+    uint32_t k = 3;                     // 8 * length = length * 2^3
+
+    while (length)
+    {
+        if (length & 1)
+        {
+            p = MultModP(X2nTable[k % X2N_TABLE_SIZE], p);
+        }
+        length >>= 1;
+        k++;
+    }
+
+    return p;
+}
+
+//==================================================================================================
+//  PUBLIC API FUNCTIONS
+//==================================================================================================
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This function computes the CRC32 of a data buffer. It is a drop-in replacement of
+ * le_crc_Crc32(), using the fastest implementation available on the CPU.
+ *
+ * @return
+ *          the updated CRC32
+ */
+//--------------------------------------------------------------------------------------------------
+uint32_t crc32_Compute
+(
+    const uint8_t* dataPtr,     ///< [IN] data buffer
+    size_t size,                ///< [IN] data length
+    uint32_t crc                ///< [IN] CRC32 to update, LE_CRC_START_CRC32 for a new one
+)
+{
+    pthread_once(&Crc32InitOnce, InitCrc32Engine);
+
+    return Crc32Func(dataPtr, size, crc);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This function combines a running CRC32 with the CRC32 of the chunk which follows it. The chunk
+ * CRC32 must have been computed with crc32_Compute() starting from CRC32_START_CHUNK.
+ *
+ * @return
+ *          the CRC32 as if crc32_Compute() was called on the chunk starting from crc
+ */
+//--------------------------------------------------------------------------------------------------
+uint32_t crc32_Combine
+(
+    uint32_t crc,           ///< [IN] running CRC32 before the chunk
+    uint32_t chunkCrc,      ///< [IN] CRC32 of the chunk computed from CRC32_START_CHUNK
+    size_t   chunkLength    ///< [IN] length of the chunk in bytes
+)
+{
+    pthread_once(&Crc32InitOnce, InitCrc32Engine);
+
+    return MultModP(X8nModP(chunkLength), crc) ^ chunkCrc;
+}
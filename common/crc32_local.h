@@ -0,0 +1,55 @@
+/**
+ * @file crc32_local.h
+ *
+ * CRC32 engine and helper functions header file
+ *
+ * Copyright (C) Sierra Wireless Inc.
+ *
+ */
+
+#ifndef LEGATO_CRC32LOCAL_INCLUDE_GUARD
+#define LEGATO_CRC32LOCAL_INCLUDE_GUARD
+
+#include "legato.h"
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Start value to compute the CRC32 of a chunk alone, in order to combine it later with a running
+ * CRC32 using crc32_Combine()
+ */
+//--------------------------------------------------------------------------------------------------
+#define CRC32_START_CHUNK   0
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This function computes the CRC32 of a data buffer. It is a drop-in replacement of
+ * le_crc_Crc32(), using the fastest implementation available on the CPU.
+ *
+ * @return
+ *          the updated CRC32
+ */
+//--------------------------------------------------------------------------------------------------
+uint32_t crc32_Compute
+(
+    const uint8_t* dataPtr,     ///< [IN] data buffer
+    size_t size,                ///< [IN] data length
+    uint32_t crc                ///< [IN] CRC32 to update, LE_CRC_START_CRC32 for a new one
+);
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This function combines a running CRC32 with the CRC32 of the chunk which follows it. The chunk
+ * CRC32 must have been computed with crc32_Compute() starting from CRC32_START_CHUNK.
+ *
+ * @return
+ *          the CRC32 as if crc32_Compute() was called on the chunk starting from crc
+ */
+//--------------------------------------------------------------------------------------------------
+uint32_t crc32_Combine
+(
+    uint32_t crc,           ///< [IN] running CRC32 before the chunk
+    uint32_t chunkCrc,      ///< [IN] CRC32 of the chunk computed from CRC32_START_CHUNK
+    size_t   chunkLength    ///< [IN] length of the chunk in bytes
+);
+
+#endif /* LEGATO_CRC32LOCAL_INCLUDE_GUARD */
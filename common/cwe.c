@@ -11,6 +11,7 @@
 #include "legato.h"
 #include "cwe_local.h"
 #include "utils_local.h"
+#include "crc32_local.h"
 
 //==================================================================================================
 //                                       Static variables
@@ -363,7 +364,7 @@ le_result_t cwe_LoadHeader
             }
 
             /* validate PSB CRC */
-            if (le_crc_Crc32((uint8_t*)startPtr, CWE_CRC_PROD_BUF_OFST, LE_CRC_START_CRC32) !=
+            if (crc32_Compute((uint8_t*)startPtr, CWE_CRC_PROD_BUF_OFST, LE_CRC_START_CRC32) !=
                 hdpPtr->crcProdBuf)
             {
                 LE_ERROR( "error PSB CRC32");
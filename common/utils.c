@@ -9,6 +9,8 @@
  */
 
 #include "legato.h"
+#include <sys/syscall.h>
+#include "utils_local.h"
 
 //==================================================================================================
 //  PUBLIC API FUNCTIONS
@@ -68,3 +70,112 @@ void utils_CopyAndIncrPtr
     *packetPtrPtr = packetPtr;
 }
 
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Open a new patch source. Nothing is done if the patch source is already open.
+ *
+ * @return
+ *      - LE_OK            on success
+ *      - LE_FAULT         on failure
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t utils_OpenPatchSource
+(
+    utils_PatchSource_t* srcPtr,   ///< [INOUT] Patch source
+    const char* filePathPtr        ///< [IN] Path of the file to use if no memory file is available
+)
+{
+    int fd = -1;
+
+    if (-1 != srcPtr->fd)
+    {
+        return LE_OK;
+    }
+
+#ifdef SYS_memfd_create
+    // The anonymous memory file is backed by shmem like a tmpfs file, so it uses as much RAM as
+    // the /tmp file. It is only not bound to the size of the /tmp mount, has no name to leave
+    // behind, and its pages are released as soon as it is closed, even if the process dies.
+    fd = syscall(SYS_memfd_create, "fwupdate_patch", 0);
+#endif
+    if (-1 != fd)
+    {
+        snprintf(srcPtr->path, sizeof(srcPtr->path), "/proc/self/fd/%d", fd);
+        srcPtr->isMemory = true;
+    }
+    else
+    {
+        fd = open( filePathPtr, O_TRUNC | O_CREAT | O_WRONLY, S_IRUSR|S_IWUSR );
+        if (-1 == fd)
+        {
+            LE_CRIT("Failed to create patch file: %m");
+            return LE_FAULT;
+        }
+        le_utf8_Copy(srcPtr->path, filePathPtr, sizeof(srcPtr->path), NULL);
+        srcPtr->isMemory = false;
+    }
+    srcPtr->fd = fd;
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Append data received to a patch source
+ *
+ * @return
+ *      - LE_OK            on success
+ *      - LE_FAULT         on failure
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t utils_WritePatchSource
+(
+    utils_PatchSource_t* srcPtr,   ///< [IN] Patch source
+    const uint8_t* dataPtr,        ///< [IN] Data to append
+    size_t length                  ///< [IN] Data length
+)
+{
+    ssize_t rc;
+
+    while (length)
+    {
+        rc = write( srcPtr->fd, dataPtr, length );
+        if (-1 == rc)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            LE_ERROR("Write to patch fails: %m");
+            return LE_FAULT;
+        }
+        dataPtr += rc;
+        length -= rc;
+    }
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Close a patch source and release its data. Nothing is done if the patch source is not open.
+ */
+//--------------------------------------------------------------------------------------------------
+void utils_ClosePatchSource
+(
+    utils_PatchSource_t* srcPtr    ///< [INOUT] Patch source
+)
+{
+    if (-1 == srcPtr->fd)
+    {
+        return;
+    }
+
+    close(srcPtr->fd);
+    if (!srcPtr->isMemory)
+    {
+        unlink(srcPtr->path);
+    }
+    srcPtr->fd = -1;
+    srcPtr->isMemory = false;
+    srcPtr->path[0] = '\0';
+}
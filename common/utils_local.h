@@ -43,4 +43,71 @@ void utils_CopyAndIncrPtr
     size_t numfields        ///< [IN] number of 8-bit fields to be copied
 );
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Source of a patch slice given to the patch engine. The slice is written into an anonymous memory
+ * file as it is received, and the patch engine reads it through the path of this file. If an
+ * anonymous memory file cannot be created, a regular file is used instead.
+ *
+ * @note This only changes the backing store of the slice: an anonymous memory file takes RAM as a
+ * tmpfs file does, and the patch engine still reads the whole slice once it is received, because
+ * bsPatch() only accepts a file path.
+ */
+//--------------------------------------------------------------------------------------------------
+typedef struct
+{
+    int  fd;                   ///< File descriptor of the patch slice, -1 if not open
+    bool isMemory;             ///< true if the slice is kept into an anonymous memory file
+    char path[PATH_MAX];       ///< Path to give to the patch engine to read the slice
+}
+utils_PatchSource_t;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Initializer of a patch source not open
+ */
+//--------------------------------------------------------------------------------------------------
+#define UTILS_PATCH_SOURCE_INIT  { .fd = -1, .isMemory = false, .path = "" }
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Open a new patch source. Nothing is done if the patch source is already open.
+ *
+ * @return
+ *      - LE_OK            on success
+ *      - LE_FAULT         on failure
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t utils_OpenPatchSource
+(
+    utils_PatchSource_t* srcPtr,   ///< [INOUT] Patch source
+    const char* filePathPtr        ///< [IN] Path of the file to use if no memory file is available
+);
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Append data received to a patch source
+ *
+ * @return
+ *      - LE_OK            on success
+ *      - LE_FAULT         on failure
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t utils_WritePatchSource
+(
+    utils_PatchSource_t* srcPtr,   ///< [IN] Patch source
+    const uint8_t* dataPtr,        ///< [IN] Data to append
+    size_t length                  ///< [IN] Data length
+);
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Close a patch source and release its data. Nothing is done if the patch source is not open.
+ */
+//--------------------------------------------------------------------------------------------------
+void utils_ClosePatchSource
+(
+    utils_PatchSource_t* srcPtr    ///< [INOUT] Patch source
+);
+
 #endif /* LEGATO_UTILSLOCAL_INCLUDE_GUARD */
\ No newline at end of file
@@ -17,10 +17,11 @@
 #include "partition_local.h"
 #include "pa_flash_local.h"
 #include "imgpatch.h"
+#include "crc32_local.h"
 
 //--------------------------------------------------------------------------------------------------
 /**
- * Define the temporary patch path
+ * Define the temporary patch path, used if the patch cannot be kept into an anonymous memory file
  */
 //--------------------------------------------------------------------------------------------------
 #define TMP_PATCH_PATH "/tmp/.tmp.patch"
@@ -91,7 +92,7 @@ static le_result_t CheckUbiData
             goto error;
         }
 
-        crc32 = le_crc_Crc32( checkBlockPtr, size, crc32);
+        crc32 = crc32_Compute( checkBlockPtr, size, crc32);
         imageSize += size;
     }
     if (crc32 != crc32ToCheck)
@@ -671,7 +672,7 @@ le_result_t deltaUpdate_ApplyUbiImgPatch
     static int MtdOrigNum = -1;
     static bool InPatch = false;
     static char *MtdNamePtr;
-    static int PatchFd = -1;
+    static utils_PatchSource_t PatchSrc = UTILS_PATCH_SOURCE_INIT;
     static pa_flash_Desc_t desc;
 
     size_t wrLen;
@@ -761,6 +762,12 @@ le_result_t deltaUpdate_ApplyUbiImgPatch
         InPatch = true;
     }
 
+    // Stream the patch body into the patch source as it is received
+    if (LE_OK != utils_OpenPatchSource( &PatchSrc, TMP_PATCH_PATH ))
+    {
+        goto ubierror;
+    }
+
     size_t *patchRemLenPtr = &ctxPtr->patchRemLen;
     if (0 == length)   // This is copy case for imgdiff, must be handled properly
     {
@@ -768,33 +775,12 @@ le_result_t deltaUpdate_ApplyUbiImgPatch
     }
     else
     {
-        if (-1 == PatchFd)
-        {
-            // Create a new file containing the patch body
-            PatchFd = open( TMP_PATCH_PATH, O_TRUNC|O_CREAT|O_WRONLY, S_IRUSR|S_IWUSR );
-            if (-1 == PatchFd)
-            {
-                LE_CRIT("Failed to create patch file: %m");
-                goto ubierror;
-            }
-        }
-
-
         size_t patchRemLen = *patchRemLenPtr;
         wrLen = (length > patchRemLen) ? patchRemLen : length;
 
-        size_t nLen = 0;
-        int rc;
-
-        while( nLen < wrLen )
+        if (LE_OK != utils_WritePatchSource( &PatchSrc, dataPtr, wrLen ))
         {
-            rc = write( PatchFd, dataPtr, wrLen );
-            if( rc < 0 )
-            {
-                LE_ERROR("Write to patch fails: %m");
-                goto ubierror;
-            }
-            nLen += rc;
+            goto ubierror;
         }
 
         *patchRemLenPtr -= wrLen;
@@ -802,19 +788,12 @@ le_result_t deltaUpdate_ApplyUbiImgPatch
     // Patch is complete. So apply it using bspatch
     if (0 == *patchRemLenPtr)
     {
-
-        if (PatchFd > 0)
-        {
-            close(PatchFd);
-            PatchFd = -1;
-        }
-
-
         // Check the delta image type and apply patch depending on patch type
         // Only two types of image will be handled here NODIFF and IMGDIFF2
         // BSDIFF40 will be handled by bspatch section.
-        if (LE_OK != ApplyUbiPatch(MtdOrigNum, ctxPtr, TMP_PATCH_PATH,
-                                   desc, partitionCtxPtr, wrLenPtr))
+        res = ApplyUbiPatch(MtdOrigNum, ctxPtr, PatchSrc.path, desc, partitionCtxPtr, wrLenPtr);
+        utils_ClosePatchSource( &PatchSrc );
+        if (LE_OK != res)
         {
             LE_ERROR("Failed to apply ubi patch");
             goto ubierror;
@@ -862,13 +841,8 @@ le_result_t deltaUpdate_ApplyUbiImgPatch
 ubierror:
     InPatch = false;
     MtdOrigNum = -1;
-    if (-1 != PatchFd)
-    {
-        close(PatchFd);
-        PatchFd = -1;
-    }
+    utils_ClosePatchSource( &PatchSrc );
     pa_flash_Close(desc);
-    unlink(TMP_PATCH_PATH);
 
     return LE_FAULT;
 }
@@ -901,7 +875,7 @@ le_result_t deltaUpdate_ApplyPatch
     static int MtdOrigNum = -1;
     static bool InPatch = false;
     static char *MtdNamePtr;
-    static int PatchFd = -1;
+    static utils_PatchSource_t PatchSrc = UTILS_PATCH_SOURCE_INIT;
     static uint32_t PatchCrc32;
 
     size_t wrLen;
@@ -973,15 +947,10 @@ le_result_t deltaUpdate_ApplyPatch
         InPatch = true;
     }
 
-    if (-1 == PatchFd)
+    // Stream the patch body into the patch source as it is received
+    if (LE_OK != utils_OpenPatchSource( &PatchSrc, TMP_PATCH_PATH ))
     {
-        // Create a new file containing the patch body
-        PatchFd = open( TMP_PATCH_PATH, O_TRUNC | O_CREAT | O_WRONLY, S_IRUSR|S_IWUSR );
-        if (-1 == PatchFd)
-        {
-            LE_CRIT("Failed to create patch file: %m");
-            goto error;
-        }
+        goto error;
     }
 
     size_t *patchRemLenPtr = &ctxPtr->patchRemLen;
@@ -990,21 +959,12 @@ le_result_t deltaUpdate_ApplyPatch
 
     LE_DEBUG("Patch %u: Writing to patch file %d: wrLen = %zu, "
              "Patch.size %u, PatchRemLen %zu\n",
-             patchHdrPtr->number, PatchFd, wrLen,
+             patchHdrPtr->number, PatchSrc.fd, wrLen,
              patchHdrPtr->size, patchRemLen);
 
-    size_t nLen = 0;
-    int rc;
-
-    while( nLen < wrLen )
+    if (LE_OK != utils_WritePatchSource( &PatchSrc, dataPtr, wrLen ))
     {
-        rc = write( PatchFd, dataPtr, wrLen );
-        if( rc < 0 )
-        {
-            LE_ERROR("Write to patch fails: %m");
-            goto error;
-        }
-        nLen += rc;
+        goto error;
     }
 
     *patchRemLenPtr -= wrLen;
@@ -1015,8 +975,6 @@ le_result_t deltaUpdate_ApplyPatch
         pa_patch_Context_t ctx;
         le_result_t res;
 
-        close(PatchFd);
-        PatchFd = -1;
         if (isFlashedPtr)
         {
             *isFlashedPtr = true;
@@ -1047,11 +1005,11 @@ le_result_t deltaUpdate_ApplyPatch
         ctx.destArg2 = (void*)wrLenPtr;
 
         res = bsPatch( &ctx,
-                       TMP_PATCH_PATH,
+                       PatchSrc.path,
                        &PatchCrc32,
                        patchMetaHdrPtr->numPatches == patchHdrPtr->number,
                        false);
-        unlink(TMP_PATCH_PATH);
+        utils_ClosePatchSource( &PatchSrc );
 
         if (patchMetaHdrPtr->numPatches == patchHdrPtr->number)
         {
@@ -1079,12 +1037,7 @@ le_result_t deltaUpdate_ApplyPatch
 error:
     InPatch = false;
     MtdOrigNum = -1;
-    if (-1 != PatchFd)
-    {
-        close(PatchFd);
-        PatchFd = -1;
-    }
-    unlink(TMP_PATCH_PATH);
+    utils_ClosePatchSource( &PatchSrc );
     res = bsPatch( NULL, NULL, NULL, true, true );
     return (forceClose ? res : LE_FAULT);
 }
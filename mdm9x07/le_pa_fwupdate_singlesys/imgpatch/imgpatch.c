@@ -23,19 +23,12 @@
 #include "legato.h"
 
 #define MAX_CHUNK_LEN           1024*1024
-#define BUFFER_SIZE             32768
-
-#define COMMAND_SIZE            4096
-#define BSPATCH                 "bspatch"
-
-#define IMGDIFF_TEST_TMP_DIR    "/tmp/"
 
 // zlib default windowBits
 #define ZLIB_WINDOWS_BITS       15
 
-#define TMP_SRC_CHUNK           IMGDIFF_TEST_TMP_DIR"imgdiff-src-chunk"
-#define TMP_PATCHED_CHUNK       IMGDIFF_TEST_TMP_DIR"imgdiff-patched-chunk"
-#define TMP_INFLATE_CHUNK       IMGDIFF_TEST_TMP_DIR"imgdiff-tgt-chunk-inflate"
+// Size of the windows used to stream a deflate chunk through bspatch and deflate
+#define STREAM_WINDOW_LEN       32768
 
 //--------------------------------------------------------------------------------------------------
 /**
@@ -44,6 +37,21 @@
 //--------------------------------------------------------------------------------------------------
 static uint8_t ChunkBuffer[MAX_CHUNK_LEN];
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Chunk to store the patched chunk built by the in-process bspatch
+ */
+//--------------------------------------------------------------------------------------------------
+static uint8_t PatchedBuffer[MAX_CHUNK_LEN];
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Windows to stream the patched data of a deflate chunk and its deflated output
+ */
+//--------------------------------------------------------------------------------------------------
+static uint8_t PatchWindow[STREAM_WINDOW_LEN];
+static uint8_t DeflateWindow[STREAM_WINDOW_LEN];
+
 
 static le_result_t ReadFile
 (
@@ -88,6 +96,231 @@ static le_result_t ReadFile
     return LE_OK;
 }
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Load a BSDIFF40 patch file in memory. The returned buffer must be released with free().
+ *
+ * @return
+ *      - LE_OK            On success.
+ *      - LE_FAULT         On failure
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t LoadPatch
+(
+    const char* patchFilePtr,       ///< [IN] File containing the BSDIFF40 patch
+    uint8_t** patchBufPtr,          ///< [OUT] Buffer holding the patch
+    size_t* patchLenPtr             ///< [OUT] Length of the patch
+)
+{
+    struct stat st;
+    uint8_t* bufPtr;
+    int fd;
+
+    fd = open(patchFilePtr, O_RDONLY);
+    if (-1 == fd)
+    {
+        LE_ERROR("Failed to open patch file '%s' (%m)", patchFilePtr);
+        return LE_FAULT;
+    }
+    if (fstat(fd, &st) < 0)
+    {
+        LE_ERROR("Failed to stat patch file '%s' (%m)", patchFilePtr);
+        close(fd);
+        return LE_FAULT;
+    }
+
+    bufPtr = malloc(st.st_size);
+    if (NULL == bufPtr)
+    {
+        LE_CRIT("Failed to allocate %zu bytes for patch", (size_t)st.st_size);
+        close(fd);
+        return LE_FAULT;
+    }
+
+    ssize_t readLen = 0;
+    while (readLen < st.st_size)
+    {
+        ssize_t rc = read(fd, bufPtr + readLen, st.st_size - readLen);
+        if ((-1 == rc) && (EINTR == errno))
+        {
+            continue;
+        }
+        if (rc <= 0)
+        {
+            LE_ERROR("Failed to read patch file '%s' (%m)", patchFilePtr);
+            free(bufPtr);
+            close(fd);
+            return LE_FAULT;
+        }
+        readLen += rc;
+    }
+    close(fd);
+
+    *patchBufPtr = bufPtr;
+    *patchLenPtr = st.st_size;
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Apply the BSDIFF40 patch stored in a file to a source buffer. The patch is loaded in memory and
+ * applied in-process.
+ *
+ * @return
+ *      - LE_OK            On success.
+ *      - LE_FAULT         On failure
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t BsPatchChunk
+(
+    const uint8_t* srcBufPtr,       ///< [IN] Source chunk
+    size_t srcLen,                  ///< [IN] Length of source chunk
+    const char* patchFilePtr,       ///< [IN] File containing the BSDIFF40 patch
+    uint8_t* outBufPtr,             ///< [OUT] Buffer to store the patched chunk
+    size_t outMaxLen,               ///< [IN] Size of the output buffer
+    size_t* outLenPtr               ///< [OUT] Length of the patched chunk
+)
+{
+    uint8_t* patchBufPtr;
+    size_t patchLen;
+    le_result_t result;
+
+    if (LE_OK != LoadPatch(patchFilePtr, &patchBufPtr, &patchLen))
+    {
+        return LE_FAULT;
+    }
+
+    result = BsPatchBuffer(srcBufPtr, srcLen, patchBufPtr, patchLen,
+                           outBufPtr, outMaxLen, outLenPtr);
+    free(patchBufPtr);
+    if (LE_OK != result)
+    {
+        LE_ERROR("bspatch of '%s' failed: %s", patchFilePtr, LE_RESULT_TXT(result));
+        return LE_FAULT;
+    }
+
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Patch an expanded source chunk and deflate the patched data on the fly to the target partition.
+ * The patched data is produced and compressed by windows of STREAM_WINDOW_LEN bytes, so the memory
+ * used does not depend on the size of the expanded target chunk.
+ *
+ * @return
+ *      - LE_OK            On success.
+ *      - LE_FAULT         On failure
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t BsPatchDeflateChunk
+(
+    const uint8_t* srcBufPtr,       ///< [IN] Expanded source chunk
+    size_t srcLen,                  ///< [IN] Length of expanded source chunk
+    const char* patchFilePtr,       ///< [IN] File containing the BSDIFF40 patch
+    const imgpatch_meta_t* metaPtr, ///< [IN] Deflate chunk meta data
+    partition_Ctx_t* partCtxPtr,    ///< [IN] Partition where data should be written
+    size_t* wrLenPtr                ///< [OUT] Length of deflated data written to partition
+)
+{
+    size_t tgtExpandedLen = metaPtr->deflMeta.tgt_expand_len;
+    uint8_t* patchBufPtr = NULL;
+    size_t patchLen, newLen, readLen;
+    size_t wrLen = 0;
+    BsPatch_Ctx_t bsCtx;
+    bool isBsOpen = false;
+    bool isDeflateInit = false;
+    le_result_t result = LE_FAULT;
+    z_stream strm;
+    int ret;
+
+    if (LE_OK != LoadPatch(patchFilePtr, &patchBufPtr, &patchLen))
+    {
+        return LE_FAULT;
+    }
+
+    if (LE_OK != BsPatchOpen(&bsCtx, srcBufPtr, srcLen, patchBufPtr, patchLen, &newLen))
+    {
+        LE_ERROR("bspatch of '%s' failed", patchFilePtr);
+        goto end;
+    }
+    isBsOpen = true;
+
+    if (newLen != tgtExpandedLen)
+    {
+        LE_ERROR("Error: target chunk expanded length mismatch. Expected: %zu, original: %zu",
+                 tgtExpandedLen, newLen);
+        goto end;
+    }
+
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    ret = deflateInit2(&strm,
+                       metaPtr->deflMeta.gzip_level,
+                       metaPtr->deflMeta.gzip_method,
+                       metaPtr->deflMeta.gzip_windowBits,
+                       metaPtr->deflMeta.gzip_memlevel,
+                       metaPtr->deflMeta.gzip_strategy);
+    if (ret != Z_OK)
+    {
+        LE_ERROR("failed to init target deflation: %d", ret);
+        goto end;
+    }
+    isDeflateInit = true;
+
+    do
+    {
+        // Produce the next window of patched data
+        if (LE_OK != BsPatchRead(&bsCtx, PatchWindow, sizeof(PatchWindow), &readLen))
+        {
+            LE_ERROR("bspatch of '%s' failed", patchFilePtr);
+            goto end;
+        }
+        int flush = (readLen < sizeof(PatchWindow)) ? Z_FINISH : Z_NO_FLUSH;
+
+        // Compress it and flush every full deflate window to the partition
+        strm.avail_in = readLen;
+        strm.next_in = PatchWindow;
+        do
+        {
+            strm.avail_out = sizeof(DeflateWindow);
+            strm.next_out = DeflateWindow;
+            ret = deflate(&strm, flush);
+            if (Z_STREAM_ERROR == ret)
+            {
+                LE_CRIT("Deflate() failed.");
+                goto end;
+            }
+
+            size_t have = sizeof(DeflateWindow) - strm.avail_out;
+            if (have && (LE_OK != WriteChunk(DeflateWindow, wrLen, have, partCtxPtr)))
+            {
+                LE_ERROR("Failed to write chunk on target partition");
+                goto end;
+            }
+            wrLen += have;
+        }
+        while (0 == strm.avail_out);
+    }
+    while (ret != Z_STREAM_END);
+
+    *wrLenPtr = wrLen;
+    result = LE_OK;
+
+end:
+    if (isDeflateInit)
+    {
+        deflateEnd(&strm);
+    }
+    if (isBsOpen)
+    {
+        BsPatchClose(&bsCtx);
+    }
+    free(patchBufPtr);
+    return result;
+}
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Write a patch chunk directly to target partition
@@ -211,41 +444,16 @@ le_result_t imgpatch_ApplyImgPatch
             return LE_FAULT;
         }
 
-        FILE* srcChunkFile = fopen(TMP_SRC_CHUNK, "w");
-        if (NULL == srcChunkFile)
-        {
-            LE_ERROR("Imgpatch failed to create a temporary file: %s", TMP_SRC_CHUNK);
-            return LE_FAULT;
-        }
-        int result = fwrite(ChunkBuffer, 1, srcLen, srcChunkFile);
-        if (result < srcLen)
-        {
-            LE_ERROR("Imgpatch failed to write on temporary file: %s", TMP_SRC_CHUNK);
-            fclose(srcChunkFile);
-            return LE_FAULT;
-        }
-        fclose(srcChunkFile);
-
-        char bspatchCmd[COMMAND_SIZE] = "";
-        snprintf(bspatchCmd, sizeof(bspatchCmd), BSPATCH" %s %s %s",
-                 TMP_SRC_CHUNK, TMP_PATCHED_CHUNK, patchFilePtr);
-        // TODO: Use library that will be given by toolchain
-        LE_DEBUG("bspatch cmd: '%s'", bspatchCmd);
-        if (system(bspatchCmd) < 0)
-        {
-            LE_CRIT("Failed: '%s'", bspatchCmd);
-            return LE_FAULT;
-        }
-
         size_t patchedLen = 0;
 
-        if (LE_OK != ReadFile(TMP_PATCHED_CHUNK, ChunkBuffer, &patchedLen))
+        if (LE_OK != BsPatchChunk(ChunkBuffer, srcLen, patchFilePtr,
+                                  PatchedBuffer, sizeof(PatchedBuffer), &patchedLen))
         {
-            LE_ERROR("Error while reading file "TMP_PATCHED_CHUNK);
+            LE_ERROR("Failed to patch source chunk");
             return LE_FAULT;
         }
 
-        if (LE_OK != WriteChunk(ChunkBuffer, 0, patchedLen, partCtxPtr))
+        if (LE_OK != WriteChunk(PatchedBuffer, 0, patchedLen, partCtxPtr))
         {
             LE_ERROR("Failed to write chunk on target partition");
             return LE_FAULT;
@@ -255,8 +463,6 @@ le_result_t imgpatch_ApplyImgPatch
         {
             *wrLenToFlash = patchedLen;
         }
-        unlink(TMP_SRC_CHUNK);
-        unlink(TMP_PATCHED_CHUNK);
     }
     else if (CHUNK_RAW == type)
     {
@@ -312,17 +518,8 @@ le_result_t imgpatch_ApplyImgPatch
         size_t srcStart = imgpatchMeta.deflMeta.src_start;
         size_t srcLen = imgpatchMeta.deflMeta.src_len;
         size_t srcExpandedLen = imgpatchMeta.deflMeta.src_expand_len;
-        size_t tgtExpandedLen = imgpatchMeta.deflMeta.tgt_expand_len;
-        int level = imgpatchMeta.deflMeta.gzip_level;
-        int method = imgpatchMeta.deflMeta.gzip_method;
-        int windowBits = imgpatchMeta.deflMeta.gzip_windowBits;
-        int memLevel = imgpatchMeta.deflMeta.gzip_memlevel;
-        int strategy = imgpatchMeta.deflMeta.gzip_strategy;
         unsigned char* expandedSource = NULL;
-        unsigned char* inflatedTgtData = NULL;
-        unsigned char* tempData = NULL;
         le_result_t result = LE_OK;
-        int sourceReuse = 0;
 
         // Decompress the source data; the chunk header tells us exactly
         // how big we expect it to be when decompressed.
@@ -365,170 +562,19 @@ le_result_t imgpatch_ApplyImgPatch
         ret = inflate(&strm, Z_SYNC_FLUSH);
         if (ret != Z_STREAM_END) {
             LE_ERROR("source inflation returned %d", ret);
+            inflateEnd(&strm);
             result = LE_FAULT;
             goto error;
         }
 
         inflateEnd(&strm);
 
-        FILE* srcChunkFile = fopen(TMP_SRC_CHUNK, "w");
-        if (NULL == srcChunkFile)
-        {
-            LE_ERROR("Imgpatch failed to create a temporary file: %s", TMP_SRC_CHUNK);
-            result = LE_FAULT;
-            goto error;
-        }
-        int len = fwrite(expandedSource, 1, srcExpandedLen, srcChunkFile);
-        if (len < srcExpandedLen)
-        {
-            LE_ERROR("Imgpatch failed to write temporary file: %s", TMP_SRC_CHUNK);
-            result = LE_FAULT;
-            fclose(srcChunkFile);
-            goto error;
-        }
-        fclose(srcChunkFile);
-
-        char bspatchCmd[COMMAND_SIZE] = "";
-        snprintf(bspatchCmd, sizeof(bspatchCmd), BSPATCH" %s %s %s",
-                 TMP_SRC_CHUNK, TMP_INFLATE_CHUNK, patchFilePtr);
-        LE_DEBUG("bspatch cmd: '%s'", bspatchCmd);
-        // TODO: Use library that will be given by toolchain
-        int rc = system(bspatchCmd);
-        if (rc != 0)
-        {
-            LE_ERROR("Failed: '%s', rc: %d", bspatchCmd, rc);
-            result = LE_FAULT;
-            //exit(1);
-            goto error;
-        }
-
-        struct stat stTgtInflate;
-        if (stat(TMP_INFLATE_CHUNK, &stTgtInflate) != 0)
-        {
-          LE_ERROR("Failed to stat '%s'. %m", TMP_INFLATE_CHUNK);
-          result = LE_FAULT;
-          goto error;
-        }
-
-        size_t inflatedTgtSize = stTgtInflate.st_size;
-        if (inflatedTgtSize != tgtExpandedLen)
-        {
-            LE_ERROR("Error: target chunk expanded length mismatch. Expected: %zu, original: %zu",
-                   tgtExpandedLen,
-                   inflatedTgtSize);
-            result = LE_FAULT;
-            goto error;
-        }
-
-        inflatedTgtData = malloc(inflatedTgtSize);
-        if (NULL == inflatedTgtData)
-        {
-            LE_CRIT("malloc() failed");
-            result = LE_FAULT;
-            goto error;
-        }
-
-        FILE *tgtInflatedFile = fopen(TMP_INFLATE_CHUNK, "rb");
-
-        if (NULL == tgtInflatedFile)
-        {
-            LE_ERROR("Imgpatch failed to open a temporary file: "TMP_INFLATE_CHUNK);
-            result = LE_FAULT;
-            goto error;
-        }
-
-        len = fread(inflatedTgtData, 1, inflatedTgtSize, tgtInflatedFile);
-        if (len < inflatedTgtSize)
-        {
-            LE_ERROR("Imgpatch failed to read temporary file: %s", TMP_INFLATE_CHUNK);
-            result = LE_FAULT;
-            fclose(tgtInflatedFile);
-            goto error;
-        }
-
-        fclose(tgtInflatedFile);
-
-        // Now compress the target data and append it to the output.
-        // we're done with the expanded_source data buffer, so we'll
-        // reuse that memory to receive the output of deflate.
-        tempData = expandedSource;
-        sourceReuse = 1;
-        ssize_t tempSize = srcExpandedLen;
-        if (tempSize < BUFFER_SIZE)
-        {
-            // unless the buffer is too small, in which case we'll
-            // allocate a fresh one.
-            free(tempData);
-            tempData = malloc(BUFFER_SIZE);
-
-            if (NULL == tempData)
-            {
-                LE_CRIT("malloc() failed");
-                result = LE_FAULT;
-                goto error;
-            }
-
-            tempSize = BUFFER_SIZE;
-        }
-
-        FILE *tgtFile = fopen(TMP_PATCHED_CHUNK, "wb");
-        if (NULL == tgtFile)
-        {
-            LE_ERROR("Fail to open tgt file: %s", TMP_PATCHED_CHUNK);
-            result = LE_FAULT;
-            goto error;
-        }
-
-        // now the deflate stream
-        strm.zalloc = Z_NULL;
-        strm.zfree = Z_NULL;
-        strm.opaque = Z_NULL;
-        strm.avail_in = inflatedTgtSize;
-        strm.next_in = inflatedTgtData;
-        ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
-        do
-        {
-            strm.avail_out = tempSize;
-            strm.next_out = tempData;
-            ret = deflate(&strm, Z_FINISH);
-
-            if (Z_STREAM_ERROR == ret)
-            {
-                LE_CRIT("Deflate() failed.");
-                result = LE_FAULT;
-                deflateEnd(&strm);
-                fclose(tgtFile);
-                goto error;
-            }
-
-            ssize_t have = tempSize - strm.avail_out;
-            len = fwrite(tempData, 1, have, tgtFile);
-            if (len < have)
-            {
-                LE_ERROR("Failed to write file: %s", TMP_PATCHED_CHUNK);
-                result = LE_FAULT;
-                deflateEnd(&strm);
-                fclose(tgtFile);
-                goto error;
-            }
-        }
-        while (ret != Z_STREAM_END);
-        deflateEnd(&strm);
-        fclose(tgtFile);
-
-        // Now write the patched chunk to swifota partition
+        // Patch the expanded source and deflate the expanded target on the fly
         size_t patchedLen = 0;
-
-        if (LE_OK != ReadFile(TMP_PATCHED_CHUNK, ChunkBuffer, &patchedLen))
+        if (LE_OK != BsPatchDeflateChunk(expandedSource, srcExpandedLen, patchFilePtr,
+                                         &imgpatchMeta, partCtxPtr, &patchedLen))
         {
-            LE_ERROR("Error while reading file "TMP_PATCHED_CHUNK);
-            result = LE_FAULT;
-            goto error;
-        }
-
-        if (LE_OK != WriteChunk(ChunkBuffer, 0, patchedLen, partCtxPtr))
-        {
-            LE_ERROR("Failed to write chunk on target partition");
+            LE_ERROR("Failed to patch deflate chunk");
             result = LE_FAULT;
             goto error;
         }
@@ -538,21 +584,7 @@ le_result_t imgpatch_ApplyImgPatch
             *wrLenToFlash = patchedLen;
         }
 error:
-        if (!sourceReuse)
-        {
-            free(expandedSource);
-        }
-        if (NULL != tempData)
-        {
-            free(tempData);
-        }
-        if (NULL != inflatedTgtData)
-        {
-            free(inflatedTgtData);
-        }
-        unlink(TMP_SRC_CHUNK);
-        unlink(TMP_PATCHED_CHUNK);
-        unlink(TMP_INFLATE_CHUNK);
+        free(expandedSource);
         return result;
     }
     else
@@ -575,7 +607,5 @@ void imgpatch_clean
     void
 )
 {
-    unlink(TMP_SRC_CHUNK);
-    unlink(TMP_PATCHED_CHUNK);
-    unlink(TMP_INFLATE_CHUNK);
+    // Chunks are patched in memory: no temporary file to remove
 }
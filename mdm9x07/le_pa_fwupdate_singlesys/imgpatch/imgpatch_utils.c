@@ -17,6 +17,299 @@
 #include "imgpatch_utils.h"
 #include "pa_flash_local.h"
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * BSDIFF40 patch header: magic, length of control block, length of diff block and new size
+ */
+//--------------------------------------------------------------------------------------------------
+#define BSDIFF_MAGIC            "BSDIFF40"
+#define BSDIFF_MAGIC_LEN        8
+#define BSDIFF_HEADER_LEN       32
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Size of the buffer filled by a decoder thread ahead of BsPatchRead()
+ */
+//--------------------------------------------------------------------------------------------------
+#define BSPATCH_DECODER_BUFFER_SIZE  (64 * 1024)
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Decoder of a bzip2 block of the patch. The decoder thread decompresses the block into a ring
+ * buffer and the caller of BsPatchRead() consumes it. A decompression failure or the end of the
+ * block stops the decoder: the caller gets an error when it needs more data than decoded.
+ */
+//--------------------------------------------------------------------------------------------------
+struct BsPatch_Decoder
+{
+    bz_stream*      streamPtr;       ///< bzip2 stream of the block
+    le_thread_Ref_t threadRef;       ///< Decoder thread
+    le_mutex_Ref_t  mutexRef;        ///< Mutex protecting the fields below
+    le_sem_Ref_t    dataSem;         ///< Posted by the decoder when data is added or it stops
+    le_sem_Ref_t    spaceSem;        ///< Posted by the consumer when data is removed or on abort
+    size_t          readIdx;         ///< Index of the first decoded byte in the buffer
+    size_t          count;           ///< Number of decoded bytes in the buffer
+    bool            isEnd;           ///< The decoder has stopped
+    bool            isFailed;        ///< The decoder has stopped on a decompression failure
+    bool            isAborted;       ///< Request the decoder to exit
+    uint8_t         buffer[BSPATCH_DECODER_BUFFER_SIZE]; ///< Ring buffer of decoded data
+};
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Pool for the decoders. It is created by BsPatchInit() when the component starts, as the patches
+ * may be applied from several threads.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_mem_PoolRef_t BsPatchDecoderPool = NULL;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Get a BSDIFF signed 64 bits value. It is stored as little-endian magnitude with the sign in the
+ * most significant bit of the last byte.
+ *
+ * @return
+ *          the translated value
+ */
+//--------------------------------------------------------------------------------------------------
+static int64_t BsOfftIn
+(
+    const uint8_t* bufPtr ///< [IN] Buffer holding the 8 bytes of the value
+)
+{
+    int64_t val = bufPtr[7] & 0x7F;
+    int idx;
+
+    for (idx = 6; idx >= 0; idx--)
+    {
+        val = (val << 8) + bufPtr[idx];
+    }
+
+    return (bufPtr[7] & 0x80) ? -val : val;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Decompress exactly len bytes from a bzip2 block of the BSDIFF patch
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t BsReadBlock
+(
+    bz_stream* streamPtr,            ///< [IN] bzip2 stream of the block
+    uint8_t* outBufPtr,              ///< [OUT] Buffer to store the decompressed data
+    size_t len                       ///< [IN] Length of data to decompress
+)
+{
+    while (len)
+    {
+        unsigned int chunkLen = (len > UINT_MAX) ? UINT_MAX : (unsigned int)len;
+        int rc;
+
+        streamPtr->next_out = (char*)outBufPtr;
+        streamPtr->avail_out = chunkLen;
+        rc = BZ2_bzDecompress(streamPtr);
+        if ((BZ_OK != rc) && (BZ_STREAM_END != rc))
+        {
+            LE_ERROR("bzip2 decompression failed: %d", rc);
+            return LE_FAULT;
+        }
+        chunkLen -= streamPtr->avail_out;
+        if ((0 == chunkLen) && ((BZ_STREAM_END == rc) || (0 == streamPtr->avail_in)))
+        {
+            LE_ERROR("Truncated bzip2 block, %zu bytes missing", len);
+            return LE_FAULT;
+        }
+        outBufPtr += chunkLen;
+        len -= chunkLen;
+    }
+
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Decoder thread: decompress a bzip2 block into the free part of the ring buffer until the end of
+ * the block, a failure or an abort.
+ */
+//--------------------------------------------------------------------------------------------------
+static void* BsDecoderThread
+(
+    void* contextPtr ///< [IN] Decoder
+)
+{
+    BsPatch_Decoder_t* decPtr = (BsPatch_Decoder_t*)contextPtr;
+    bz_stream* streamPtr = decPtr->streamPtr;
+    bool isFailed = false;
+    bool isEnd = false;
+
+    while (!isEnd)
+    {
+        size_t writeIdx, freeLen;
+        unsigned int chunkLen;
+        int rc;
+
+        le_mutex_Lock(decPtr->mutexRef);
+        if (decPtr->isAborted)
+        {
+            le_mutex_Unlock(decPtr->mutexRef);
+            return NULL;
+        }
+        if (BSPATCH_DECODER_BUFFER_SIZE == decPtr->count)
+        {
+            le_mutex_Unlock(decPtr->mutexRef);
+            le_sem_Wait(decPtr->spaceSem);
+            continue;
+        }
+        // Only the decoder fills the free part, it may be written out of the mutex
+        writeIdx = (decPtr->readIdx + decPtr->count) % BSPATCH_DECODER_BUFFER_SIZE;
+        freeLen = BSPATCH_DECODER_BUFFER_SIZE - decPtr->count;
+        le_mutex_Unlock(decPtr->mutexRef);
+
+        if (freeLen > (BSPATCH_DECODER_BUFFER_SIZE - writeIdx))
+        {
+            freeLen = BSPATCH_DECODER_BUFFER_SIZE - writeIdx;
+        }
+        streamPtr->next_out = (char*)&decPtr->buffer[writeIdx];
+        streamPtr->avail_out = (unsigned int)freeLen;
+        rc = BZ2_bzDecompress(streamPtr);
+        chunkLen = (unsigned int)freeLen - streamPtr->avail_out;
+        if ((BZ_OK != rc) && (BZ_STREAM_END != rc))
+        {
+            LE_ERROR("bzip2 decompression failed: %d", rc);
+            isFailed = true;
+        }
+
+        le_mutex_Lock(decPtr->mutexRef);
+        decPtr->count += chunkLen;
+        isEnd = isFailed || (BZ_STREAM_END == rc) ||
+                ((0 == chunkLen) && (0 == streamPtr->avail_in));
+        decPtr->isEnd = isEnd;
+        decPtr->isFailed = isFailed;
+        le_mutex_Unlock(decPtr->mutexRef);
+        le_sem_Post(decPtr->dataSem);
+    }
+
+    return NULL;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Start a decoder thread on an initialized bzip2 stream
+ *
+ * @return
+ *          the decoder
+ */
+//--------------------------------------------------------------------------------------------------
+static BsPatch_Decoder_t* BsDecoderStart
+(
+    bz_stream* streamPtr             ///< [IN] bzip2 stream of the block
+)
+{
+    BsPatch_Decoder_t* decPtr;
+
+    decPtr = le_mem_ForceAlloc(BsPatchDecoderPool);
+    memset(decPtr, 0, offsetof(BsPatch_Decoder_t, buffer));
+    decPtr->streamPtr = streamPtr;
+    decPtr->mutexRef = le_mutex_CreateNonRecursive("BsPatchDecoder");
+    decPtr->dataSem = le_sem_Create("BsPatchDecData", 0);
+    decPtr->spaceSem = le_sem_Create("BsPatchDecSpace", 0);
+
+    decPtr->threadRef = le_thread_Create("BsPatchDecoder", BsDecoderThread, decPtr);
+    le_thread_SetJoinable(decPtr->threadRef);
+    le_thread_Start(decPtr->threadRef);
+
+    return decPtr;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Abort a decoder thread and release the decoder
+ */
+//--------------------------------------------------------------------------------------------------
+static void BsDecoderStop
+(
+    BsPatch_Decoder_t* decPtr        ///< [IN] Decoder
+)
+{
+    le_mutex_Lock(decPtr->mutexRef);
+    decPtr->isAborted = true;
+    le_mutex_Unlock(decPtr->mutexRef);
+    le_sem_Post(decPtr->spaceSem);
+
+    le_thread_Join(decPtr->threadRef, NULL);
+    le_sem_Delete(decPtr->dataSem);
+    le_sem_Delete(decPtr->spaceSem);
+    le_mutex_Delete(decPtr->mutexRef);
+    le_mem_Release(decPtr);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Get exactly len decompressed bytes from a decoder, waiting for the decoder thread if needed
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t BsDecoderRead
+(
+    BsPatch_Decoder_t* decPtr,       ///< [IN] Decoder of the block
+    uint8_t* outBufPtr,              ///< [OUT] Buffer to store the decompressed data
+    size_t len                       ///< [IN] Length of data to get
+)
+{
+    while (len)
+    {
+        size_t chunkLen;
+
+        le_mutex_Lock(decPtr->mutexRef);
+        if (0 == decPtr->count)
+        {
+            bool isEnd = decPtr->isEnd;
+            bool isFailed = decPtr->isFailed;
+
+            le_mutex_Unlock(decPtr->mutexRef);
+            if (isEnd)
+            {
+                if (!isFailed)
+                {
+                    LE_ERROR("Truncated bzip2 block, %zu bytes missing", len);
+                }
+                return LE_FAULT;
+            }
+            le_sem_Wait(decPtr->dataSem);
+            continue;
+        }
+        // Only the consumer empties the decoded part, it may be read out of the mutex
+        chunkLen = decPtr->count;
+        le_mutex_Unlock(decPtr->mutexRef);
+
+        if (chunkLen > (BSPATCH_DECODER_BUFFER_SIZE - decPtr->readIdx))
+        {
+            chunkLen = BSPATCH_DECODER_BUFFER_SIZE - decPtr->readIdx;
+        }
+        if (chunkLen > len)
+        {
+            chunkLen = len;
+        }
+        memcpy(outBufPtr, &decPtr->buffer[decPtr->readIdx], chunkLen);
+        outBufPtr += chunkLen;
+        len -= chunkLen;
+
+        le_mutex_Lock(decPtr->mutexRef);
+        decPtr->readIdx = (decPtr->readIdx + chunkLen) % BSPATCH_DECODER_BUFFER_SIZE;
+        decPtr->count -= chunkLen;
+        le_mutex_Unlock(decPtr->mutexRef);
+        le_sem_Post(decPtr->spaceSem);
+    }
+
+    return LE_OK;
+}
 
 //--------------------------------------------------------------------------------------------------
 /**
@@ -135,3 +428,299 @@ le_result_t WriteChunk
 
     return LE_OK;
 }
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This function initializes the BSDIFF40 patch decoders. It must be called once before any call to
+ * BsPatchOpen() or BsPatchBuffer().
+ */
+//--------------------------------------------------------------------------------------------------
+void BsPatchInit
+(
+    void
+)
+{
+    BsPatchDecoderPool = le_mem_CreatePool("BsPatchDecoderPool", sizeof(BsPatch_Decoder_t));
+    le_mem_ExpandPool(BsPatchDecoderPool, 2);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This function starts a streamed application of a BSDIFF40 patch held in memory. The source and
+ * patch buffers must remain valid until BsPatchClose() is called.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_FAULT on failure (bad parameters or corrupted patch)
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t BsPatchOpen
+(
+    BsPatch_Ctx_t* ctxPtr,                 ///< [OUT] Patch context
+    const uint8_t* srcBufPtr,              ///< [IN] Source (old) data
+    size_t srcLen,                         ///< [IN] Length of source data
+    const uint8_t* patchBufPtr,            ///< [IN] BSDIFF40 patch data
+    size_t patchLen,                       ///< [IN] Length of patch data
+    size_t* newLenPtr                      ///< [OUT] Length of the patched data
+)
+{
+    int64_t ctrlLen, diffLen, newLen;
+
+    if ((NULL == ctxPtr) || ((NULL == srcBufPtr) && srcLen) || (NULL == patchBufPtr)
+        || (NULL == newLenPtr))
+    {
+        LE_CRIT("Bad input ctxPtr: %p, srcBufPtr: %p, patchBufPtr: %p, newLenPtr: %p",
+                ctxPtr, srcBufPtr, patchBufPtr, newLenPtr);
+        return LE_FAULT;
+    }
+
+    memset(ctxPtr, 0, sizeof(*ctxPtr));
+
+    if ((patchLen < BSDIFF_HEADER_LEN) || memcmp(patchBufPtr, BSDIFF_MAGIC, BSDIFF_MAGIC_LEN))
+    {
+        LE_ERROR("Not a BSDIFF40 patch (length %zu)", patchLen);
+        return LE_FAULT;
+    }
+
+    ctrlLen = BsOfftIn(patchBufPtr + 8);
+    diffLen = BsOfftIn(patchBufPtr + 16);
+    newLen = BsOfftIn(patchBufPtr + 24);
+    if ((ctrlLen < 0) || (diffLen < 0) || (newLen < 0) || ((uint64_t)newLen > SIZE_MAX) ||
+        (ctrlLen > (patchLen - BSDIFF_HEADER_LEN)) ||
+        (diffLen > (patchLen - BSDIFF_HEADER_LEN - ctrlLen)))
+    {
+        LE_ERROR("Corrupted patch header: ctrl %"PRId64" diff %"PRId64" new %"PRId64,
+                 ctrlLen, diffLen, newLen);
+        return LE_FAULT;
+    }
+
+    const uint8_t* blockPtr[3] =
+    {
+        patchBufPtr + BSDIFF_HEADER_LEN,
+        patchBufPtr + BSDIFF_HEADER_LEN + ctrlLen,
+        patchBufPtr + BSDIFF_HEADER_LEN + ctrlLen + diffLen,
+    };
+    size_t blockLen[3] =
+    {
+        ctrlLen,
+        diffLen,
+        patchLen - BSDIFF_HEADER_LEN - ctrlLen - diffLen,
+    };
+
+    for (ctxPtr->nbStreams = 0; ctxPtr->nbStreams < 3; ctxPtr->nbStreams++)
+    {
+        bz_stream* streamPtr = &ctxPtr->streams[ctxPtr->nbStreams];
+
+        if (BZ_OK != BZ2_bzDecompressInit(streamPtr, 0, 0))
+        {
+            LE_ERROR("Failed to init bzip2 stream %d", ctxPtr->nbStreams);
+            BsPatchClose(ctxPtr);
+            return LE_FAULT;
+        }
+        streamPtr->next_in = (char*)blockPtr[ctxPtr->nbStreams];
+        streamPtr->avail_in = blockLen[ctxPtr->nbStreams];
+    }
+
+    // The diff and extra blocks are the largest ones: decompress them ahead of BsPatchRead()
+    ctxPtr->decoderPtr[0] = BsDecoderStart(&ctxPtr->streams[1]);
+    ctxPtr->decoderPtr[1] = BsDecoderStart(&ctxPtr->streams[2]);
+
+    ctxPtr->srcBufPtr = srcBufPtr;
+    ctxPtr->srcLen = srcLen;
+    ctxPtr->newLen = newLen;
+    *newLenPtr = newLen;
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This function produces the next bytes of patched data. A read length lower than requested
+ * means that the whole patched data has been produced.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_FAULT on failure (corrupted patch)
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t BsPatchRead
+(
+    BsPatch_Ctx_t* ctxPtr,                 ///< [IN] Patch context
+    uint8_t* outBufPtr,                    ///< [OUT] Buffer to store the patched data
+    size_t len,                            ///< [IN] Size of the output buffer
+    size_t* readLenPtr                     ///< [OUT] Length of patched data produced
+)
+{
+    size_t produced = 0;
+
+    if ((NULL == ctxPtr) || (NULL == outBufPtr) || (NULL == readLenPtr))
+    {
+        LE_CRIT("Bad input ctxPtr: %p, outBufPtr: %p, readLenPtr: %p",
+                ctxPtr, outBufPtr, readLenPtr);
+        return LE_FAULT;
+    }
+
+    while ((produced < len) && (ctxPtr->newPos < ctxPtr->newLen))
+    {
+        size_t chunkLen = len - produced;
+        int64_t idx;
+
+        if ((0 == ctxPtr->diffLeft) && (0 == ctxPtr->extraLeft))
+        {
+            uint8_t ctrlBuf[24];
+
+            // Control tuple: diff length, extra length and source seek
+            ctxPtr->srcPos += ctxPtr->srcSeek;
+            if (LE_OK != BsReadBlock(&ctxPtr->streams[0], ctrlBuf, sizeof(ctrlBuf)))
+            {
+                return LE_FAULT;
+            }
+            ctxPtr->diffLeft = BsOfftIn(ctrlBuf);
+            ctxPtr->extraLeft = BsOfftIn(ctrlBuf + 8);
+            ctxPtr->srcSeek = BsOfftIn(ctrlBuf + 16);
+            if ((ctxPtr->diffLeft < 0) || (ctxPtr->extraLeft < 0) ||
+                (ctxPtr->diffLeft > (ctxPtr->newLen - ctxPtr->newPos)) ||
+                (ctxPtr->extraLeft > (ctxPtr->newLen - ctxPtr->newPos - ctxPtr->diffLeft)))
+            {
+                LE_ERROR("Corrupted patch control: %"PRId64" %"PRId64,
+                         ctxPtr->diffLeft, ctxPtr->extraLeft);
+                return LE_FAULT;
+            }
+            // The diff block is added to source data: it must not go outside of the source
+            if (ctxPtr->diffLeft &&
+                ((ctxPtr->srcPos < 0) || (ctxPtr->srcPos > (int64_t)ctxPtr->srcLen) ||
+                 (ctxPtr->diffLeft > ((int64_t)ctxPtr->srcLen - ctxPtr->srcPos))))
+            {
+                LE_ERROR("Corrupted patch seek: source %"PRId64" length %"PRId64" size %zu",
+                         ctxPtr->srcPos, ctxPtr->diffLeft, ctxPtr->srcLen);
+                return LE_FAULT;
+            }
+            continue;
+        }
+
+        if (ctxPtr->diffLeft)
+        {
+            // Add the diff block to the source data
+            if (chunkLen > ctxPtr->diffLeft)
+            {
+                chunkLen = ctxPtr->diffLeft;
+            }
+            if (LE_OK != BsDecoderRead(ctxPtr->decoderPtr[0], outBufPtr + produced, chunkLen))
+            {
+                return LE_FAULT;
+            }
+            for (idx = 0; idx < chunkLen; idx++)
+            {
+                outBufPtr[produced + idx] += ctxPtr->srcBufPtr[ctxPtr->srcPos + idx];
+            }
+            ctxPtr->srcPos += chunkLen;
+            ctxPtr->diffLeft -= chunkLen;
+        }
+        else
+        {
+            // Copy the extra block
+            if (chunkLen > ctxPtr->extraLeft)
+            {
+                chunkLen = ctxPtr->extraLeft;
+            }
+            if (LE_OK != BsDecoderRead(ctxPtr->decoderPtr[1], outBufPtr + produced, chunkLen))
+            {
+                return LE_FAULT;
+            }
+            ctxPtr->extraLeft -= chunkLen;
+        }
+        ctxPtr->newPos += chunkLen;
+        produced += chunkLen;
+    }
+
+    *readLenPtr = produced;
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This function releases a patch context opened by BsPatchOpen()
+ */
+//--------------------------------------------------------------------------------------------------
+void BsPatchClose
+(
+    BsPatch_Ctx_t* ctxPtr                  ///< [IN] Patch context
+)
+{
+    int idx;
+
+    if (NULL == ctxPtr)
+    {
+        return;
+    }
+    // The decoder threads use the streams: stop them before releasing the streams
+    for (idx = 0; idx < (int)NUM_ARRAY_MEMBERS(ctxPtr->decoderPtr); idx++)
+    {
+        if (ctxPtr->decoderPtr[idx])
+        {
+            BsDecoderStop(ctxPtr->decoderPtr[idx]);
+            ctxPtr->decoderPtr[idx] = NULL;
+        }
+    }
+    for (idx = 0; idx < ctxPtr->nbStreams; idx++)
+    {
+        BZ2_bzDecompressEnd(&ctxPtr->streams[idx]);
+    }
+    ctxPtr->nbStreams = 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This function applies a BSDIFF40 patch held in memory to a source buffer and builds the patched
+ * data into the output buffer, without any temporary file nor external bspatch process.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_OVERFLOW if the patched data does not fit into the output buffer
+ *      - LE_FAULT on failure (bad parameters or corrupted patch)
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t BsPatchBuffer
+(
+    const uint8_t* srcBufPtr,              ///< [IN] Source (old) data
+    size_t srcLen,                         ///< [IN] Length of source data
+    const uint8_t* patchBufPtr,            ///< [IN] BSDIFF40 patch data
+    size_t patchLen,                       ///< [IN] Length of patch data
+    uint8_t* outBufPtr,                    ///< [OUT] Buffer to store the patched (new) data
+    size_t outMaxLen,                      ///< [IN] Size of the output buffer
+    size_t* outLenPtr                      ///< [OUT] Length of the patched data
+)
+{
+    BsPatch_Ctx_t ctx;
+    size_t newLen, readLen;
+    le_result_t result;
+
+    if ((NULL == outBufPtr) || (NULL == outLenPtr))
+    {
+        LE_CRIT("Bad input outBufPtr: %p, outLenPtr: %p", outBufPtr, outLenPtr);
+        return LE_FAULT;
+    }
+
+    if (LE_OK != BsPatchOpen(&ctx, srcBufPtr, srcLen, patchBufPtr, patchLen, &newLen))
+    {
+        return LE_FAULT;
+    }
+    if (newLen > outMaxLen)
+    {
+        LE_ERROR("Patched data too large. Max allowed: %zu, Length: %zu", outMaxLen, newLen);
+        BsPatchClose(&ctx);
+        return LE_OVERFLOW;
+    }
+
+    result = BsPatchRead(&ctx, outBufPtr, newLen, &readLen);
+    BsPatchClose(&ctx);
+    if ((LE_OK == result) && (readLen != newLen))
+    {
+        LE_ERROR("Patched data truncated. Expected: %zu, Length: %zu", newLen, readLen);
+        result = LE_FAULT;
+    }
+    if (LE_OK == result)
+    {
+        *outLenPtr = newLen;
+    }
+    return result;
+}
@@ -20,6 +20,39 @@
 #include "legato.h"
 #include "pa_flash.h"
 #include "partition_local.h"
+#include <bzlib.h>
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Decoder of a bzip2 block of the patch, running ahead of BsPatchRead() in its own thread
+ */
+//--------------------------------------------------------------------------------------------------
+typedef struct BsPatch_Decoder BsPatch_Decoder_t;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Context of a streamed BSDIFF40 patch application. The patched data is produced incrementally by
+ * BsPatchRead() so that the caller only needs a small output window. The diff and extra blocks are
+ * decompressed by two decoder threads while the control block is decompressed by the caller.
+ * It applies the BSDIFF40 chunks of the IMGDIFF2 patches. The BSDIFF40 slices of a delta package
+ * are applied by bsPatch() and do not use it.
+ */
+//--------------------------------------------------------------------------------------------------
+typedef struct
+{
+    const uint8_t* srcBufPtr;        ///< Source (old) data
+    size_t         srcLen;           ///< Length of source data
+    bz_stream      streams[3];       ///< bzip2 streams of control, diff and extra blocks
+    int            nbStreams;        ///< Number of initialized streams
+    BsPatch_Decoder_t* decoderPtr[2];///< Decoders of the diff and extra blocks
+    int64_t        srcPos;           ///< Current position in source data
+    int64_t        newPos;           ///< Current position in patched data
+    int64_t        newLen;           ///< Length of patched data
+    int64_t        diffLeft;         ///< Bytes left to read from the diff block for this control
+    int64_t        extraLeft;        ///< Bytes left to read from the extra block for this control
+    int64_t        srcSeek;          ///< Source seek to apply once this control is done
+}
+BsPatch_Ctx_t;
 
 //--------------------------------------------------------------------------------------------------
 /**
@@ -69,4 +102,85 @@ le_result_t WriteChunk
     partition_Ctx_t* destPartPtr           ///< [IN] Partition where data should be written buffer
 );
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * This function initializes the BSDIFF40 patch decoders. It must be called once before any call to
+ * BsPatchOpen() or BsPatchBuffer().
+ */
+//--------------------------------------------------------------------------------------------------
+void BsPatchInit
+(
+    void
+);
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This function starts a streamed application of a BSDIFF40 patch held in memory. The source and
+ * patch buffers must remain valid until BsPatchClose() is called.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_FAULT on failure (bad parameters or corrupted patch)
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t BsPatchOpen
+(
+    BsPatch_Ctx_t* ctxPtr,                 ///< [OUT] Patch context
+    const uint8_t* srcBufPtr,              ///< [IN] Source (old) data
+    size_t srcLen,                         ///< [IN] Length of source data
+    const uint8_t* patchBufPtr,            ///< [IN] BSDIFF40 patch data
+    size_t patchLen,                       ///< [IN] Length of patch data
+    size_t* newLenPtr                      ///< [OUT] Length of the patched data
+);
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This function produces the next bytes of patched data. A read length lower than requested
+ * means that the whole patched data has been produced.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_FAULT on failure (corrupted patch)
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t BsPatchRead
+(
+    BsPatch_Ctx_t* ctxPtr,                 ///< [IN] Patch context
+    uint8_t* outBufPtr,                    ///< [OUT] Buffer to store the patched data
+    size_t len,                            ///< [IN] Size of the output buffer
+    size_t* readLenPtr                     ///< [OUT] Length of patched data produced
+);
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This function releases a patch context opened by BsPatchOpen()
+ */
+//--------------------------------------------------------------------------------------------------
+void BsPatchClose
+(
+    BsPatch_Ctx_t* ctxPtr                  ///< [IN] Patch context
+);
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This function applies a BSDIFF40 patch held in memory to a source buffer and builds the patched
+ * data into the output buffer, without any temporary file nor external bspatch process.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_OVERFLOW if the patched data does not fit into the output buffer
+ *      - LE_FAULT on failure (bad parameters or corrupted patch)
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t BsPatchBuffer
+(
+    const uint8_t* srcBufPtr,              ///< [IN] Source (old) data
+    size_t srcLen,                         ///< [IN] Length of source data
+    const uint8_t* patchBufPtr,            ///< [IN] BSDIFF40 patch data
+    size_t patchLen,                       ///< [IN] Length of patch data
+    uint8_t* outBufPtr,                    ///< [OUT] Buffer to store the patched (new) data
+    size_t outMaxLen,                      ///< [IN] Size of the output buffer
+    size_t* outLenPtr                      ///< [OUT] Length of the patched data
+);
+
 #endif //  _BUILD_TOOLS_APPLYPATCH_UTILS_H
@@ -12,6 +12,25 @@
 #ifndef LEGATO_LEPAFLASHLOCAL_INCLUDE_GUARD
 #define LEGATO_LEPAFLASHLOCAL_INCLUDE_GUARD
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Maximum size of a NAND page (write size) supported
+ */
+//--------------------------------------------------------------------------------------------------
+#define PA_FLASH_MAX_WRITE_SIZE  8192
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Entry of the free PEB pool of an UBI partition
+ */
+//--------------------------------------------------------------------------------------------------
+typedef struct
+{
+    uint64_t ec;             ///< Erase counter of the free PEB, 0 if the PEB is blank
+    uint32_t peb;            ///< Free PEB
+}
+pa_flash_UbiFreePeb_t;
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Internal flash MTD descriptor. To be valid, the magic should be its own address
@@ -29,6 +48,8 @@ typedef struct
                              ///< erase operation fails
     uint32_t lebToPeb[PA_FLASH_MAX_LEB]; ///< LEB to PEB translstion array (if scanDone)
     uint32_t ubiLebToMtdLeb[PA_FLASH_MAX_LEB]; ///< LEB to MTD LEB translstion array (if UBI volume)
+    uint32_t badBlkKnown[(PA_FLASH_MAX_LEB + 31) / 32]; ///< Bitmap of the PEBs already classified
+    uint32_t badBlkMap[(PA_FLASH_MAX_LEB + 31) / 32];   ///< Bitmap of the bad PEBs
     uint32_t ubiVolumeId;    ///< UBI volume ID if UBI, 0xFFFFFFFFU otherwise
     uint32_t ubiVolumeSize;  ///< UBI volume Size if UBI and static volume, 0xFFFFFFFFU otherwise
     off_t ubiDataOffset;     ///< Offset of UBI data in the PEB
@@ -36,14 +57,110 @@ typedef struct
     struct ubi_vtbl_record *vtblPtr; ///< Pointer to VTBL if UBI
     uint32_t vtblPeb[2];     ///< PEB containing the VTBL if UBI
     uint32_t ubiBadBlkCnt;   ///< counter of bad blocks
+    pa_flash_UbiFreePeb_t ubiFreePeb[PA_FLASH_MAX_LEB]; ///< Free PEBs of the UBI partition, kept as
+                                                        ///< a min-heap on the erase counter
+    uint32_t ubiFreePebCnt;  ///< Number of PEBs into the free PEB pool
+    bool isUbiFreePebPool;   ///< true if the free PEB pool was built by the UBI scan
     off_t ubiAbsOffset;      ///< Absolute offset for UBI
     off_t ubiOffsetInPeb;    ///< Offset in block for UBI
     uint32_t ubiBasePeb;     ///< Base PEB for UBI
     uint32_t ubiImageSeq;    ///< UBI image sequence number
     bool isUbiImageSeq;      ///< true if UBI image sequence number is meaningfull
+    struct pa_flash_EraseAhead *eraseAheadPtr; ///< Erase-ahead worker, NULL if not started
+    bool skipErasedPages;    ///< Do not program the pages holding only PA_FLASH_ERASED_VALUE
+    uint8_t padBlock[PA_FLASH_MAX_WRITE_SIZE]; ///< Buffer to pad the last page to write
 }
 pa_flash_MtdDesc_t;
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Enable or disable the skip of the erased pages by pa_flash_Write. It is enabled when the
+ * descriptor is open. A flash whose erased pages must be programmed, for example to write their
+ * ECC or OOB data, should disable it.
+ *
+ * @return
+ *      - LE_OK            On success
+ *      - LE_BAD_PARAMETER If desc is NULL
+ */
+//--------------------------------------------------------------------------------------------------
+LE_SHARED le_result_t pa_flash_SetSkipErasedPages
+(
+    pa_flash_Desc_t desc,     ///< [IN] Private flash descriptor
+    bool isSkipped            ///< [IN] false to program the erased pages as the other ones
+);
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Start an erase-ahead worker on a flash descriptor. From the current position up to the given
+ * block, a worker thread keeps the next blocks erased while the current one is written by
+ * pa_flash_Write: the writer only waits when it overtakes the worker. The caller should not erase
+ * these blocks itself. The blocks beyond the window are erased while the writer is idle.
+ * If the descriptor is open with PA_FLASH_OPENMODE_MARKBAD, a block whose erase fails is marked
+ * bad by pa_flash_Write and the next good block is used, as for pa_flash_EraseBlock.
+ *
+ * @return
+ *      - LE_OK            On success
+ *      - LE_BAD_PARAMETER If desc is NULL or nbBlocks is 0
+ *      - LE_BUSY          If an erase-ahead worker is already running on this descriptor
+ *      - LE_OUT_OF_RANGE  If the block is outside the partition
+ *      - LE_FAULT         On failure
+ */
+//--------------------------------------------------------------------------------------------------
+LE_SHARED le_result_t pa_flash_StartEraseAhead
+(
+    pa_flash_Desc_t desc,     ///< [IN] Private flash descriptor
+    uint32_t nbBlocks,        ///< [IN] Number of blocks kept erased ahead of the written one
+    uint32_t endBlockIndex    ///< [IN] Logical or physical block after the last one to erase
+);
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Stop the erase-ahead worker of a flash descriptor. If isFlushed is set, all the blocks up to the
+ * end given to pa_flash_StartEraseAhead are erased before. pa_flash_Close stops the worker
+ * without flush.
+ *
+ * @return
+ *      - LE_OK            On success or if no erase-ahead worker is running
+ *      - LE_BAD_PARAMETER If desc is NULL
+ *      - LE_FAULT         On failure
+ *      - LE_IO_ERROR      If a flash IO error occurs while flushing
+ */
+//--------------------------------------------------------------------------------------------------
+LE_SHARED le_result_t pa_flash_StopEraseAhead
+(
+    pa_flash_Desc_t desc,     ///< [IN] Private flash descriptor
+    bool isFlushed            ///< [IN] true to erase the remaining blocks before stopping
+);
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Get the MTD number of a partition from its name. The MTD partition table is read once and kept
+ * into the MTD topology cache.
+ *
+ * @return
+ *      - LE_OK            On success
+ *      - LE_BAD_PARAMETER If a parameter is NULL
+ *      - LE_NOT_FOUND     If no MTD partition has this name
+ *      - LE_FAULT         If the MTD partition table cannot be read
+ */
+//--------------------------------------------------------------------------------------------------
+LE_SHARED le_result_t pa_flash_GetMtdFromName
+(
+    const char *namePtr,      ///< [IN] Name of the MTD partition
+    int *mtdNumPtr            ///< [OUT] MTD number, -1 if not found
+);
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Invalidate the MTD topology cache. The MTD partition table and the geometry of the partitions
+ * are read again at the next lookup. This is only needed if the MTD partitions have changed.
+ */
+//--------------------------------------------------------------------------------------------------
+LE_SHARED void pa_flash_InvalidateMtdCache
+(
+    void
+);
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Get the current logical or physical block and position and the absolute offset in the flash
@@ -16,7 +16,9 @@
 #include "pa_fwupdate_singlesys.h"
 #include "cwe_local.h"
 #include "deltaUpdate_local.h"
+#include "imgpatch_utils.h"
 #include "partition_local.h"
+#include "crc32_local.h"
 #include "interfaces.h"
 #include "watchdogChain.h"
 #include "fwupdate_local.h"
@@ -38,6 +40,14 @@
 //--------------------------------------------------------------------------------------------------
 #define RESUME_CTX_FILENAME "/fwupdate/fwupdate_ResumeCtx_"
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Define the maximum number of delta records appended to a resume context file. When it is
+ * reached, the journal is compacted: the full resume context is written into the other file.
+ */
+//--------------------------------------------------------------------------------------------------
+#define RESUME_CTX_JOURNAL_MAX  64
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Record the download status
@@ -157,6 +167,28 @@ typedef struct
 }
 ResumeCtxSave_t;
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Resume context delta record. It is appended after the full resume context each time data have
+ * been flashed and only holds the fields updated at this checkpoint. It is followed by the
+ * partition context.
+ */
+//--------------------------------------------------------------------------------------------------
+typedef struct
+{
+    uint32_t ctxCounter;            ///< Context counter, must follow the previous one
+    uint32_t currentImageCrc;       ///< Current image component CRC
+    uint32_t currentGlobalCrc;      ///< Current global CRC
+    size_t   totalRead;             ///< Total read from the beginning of the package
+    uint32_t currentInImageOffset;  ///< Offset in the current partition
+    uint32_t fullImageCrc;          ///< Current CRC of the full image (used in partition layer)
+    off_t    partitionOffset;       ///< Partition offset
+    uint32_t partitionCtxCrc;       ///< CRC for partition resume data.
+    uint32_t recCrc;                ///< Record CRC, Computed on all previous fields of this struct
+                                    ///< and on the partition context
+}
+ResumeCtxDelta_t;
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Resume context to save
@@ -166,6 +198,8 @@ typedef struct
 {
     ResumeCtxSave_t saveCtx;    ///< Context to save
     uint32_t fileIndex;         ///< File index to use to save the above context [0..1]
+    ResumeCtxSave_t baseCtx;    ///< Context as rebuilt from the file not pointed by fileIndex
+    uint32_t journalCount;      ///< Number of delta records appended after the full context
 }
 ResumeCtx_t;
 
@@ -297,7 +331,8 @@ static le_result_t UpdateResumeCtx
 
         LE_DEBUG("Input fileIndex=%d filename %s", resumeCtxPtr->fileIndex, str);
 
-        result = le_fs_Open(str, LE_FS_WRONLY|LE_FS_CREAT, &fd);
+        // Truncate the file to drop the delta records appended after the previous context
+        result = le_fs_Open(str, LE_FS_WRONLY|LE_FS_CREAT|LE_FS_TRUNC, &fd);
         if (result != LE_OK)
         {
             LE_ERROR("Error when opening %s", str);
@@ -308,14 +343,14 @@ static le_result_t UpdateResumeCtx
             // Swap the fileIndex
             resumeCtxPtr->fileIndex ^= 1UL;
             resumeCtxPtr->saveCtx.ctxCounter++;
-            resumeCtxPtr->saveCtx.partitionCtxCrc = le_crc_Crc32(PartitionContextPtr,
+            resumeCtxPtr->saveCtx.partitionCtxCrc = crc32_Compute(PartitionContextPtr,
                                                            resumeCtxPtr->saveCtx.partitionCtxSize,
                                                            LE_CRC_START_CRC32);
 
-            resumeCtxPtr->saveCtx.ctxCrc = le_crc_Crc32((uint8_t*)&resumeCtxPtr->saveCtx,
-                                                        sizeof(resumeCtxPtr->saveCtx) -
-                                                        sizeof(resumeCtxPtr->saveCtx.ctxCrc),
-                                                        LE_CRC_START_CRC32);
+            resumeCtxPtr->saveCtx.ctxCrc = crc32_Compute((uint8_t*)&resumeCtxPtr->saveCtx,
+                                                         sizeof(resumeCtxPtr->saveCtx) -
+                                                         sizeof(resumeCtxPtr->saveCtx.ctxCrc),
+                                                         LE_CRC_START_CRC32);
 
             LE_DEBUG("resumeCtx: ctxCounter %d, imageType %d, imageSize %d, imageCrc 0x%x,",
                      resumeCtxPtr->saveCtx.ctxCounter, resumeCtxPtr->saveCtx.imageType,
@@ -347,11 +382,233 @@ static le_result_t UpdateResumeCtx
         }
     }
 
+    if (LE_OK == result)
+    {
+        // The journal restarts from this context
+        memcpy(&resumeCtxPtr->baseCtx, &resumeCtxPtr->saveCtx, sizeof(resumeCtxPtr->baseCtx));
+        resumeCtxPtr->journalCount = 0;
+    }
+    else
+    {
+        // The file may be corrupted: the next update needs to write the full context
+        resumeCtxPtr->journalCount = RESUME_CTX_JOURNAL_MAX;
+    }
+
     LE_DEBUG("Result %s, Output fileIndex=%d", LE_RESULT_TXT(result), resumeCtxPtr->fileIndex);
 
     return result;
 }
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Fill a resume context delta record from the resume context. The record CRC is not computed.
+ */
+//--------------------------------------------------------------------------------------------------
+static void SetResumeCtxDelta
+(
+    ResumeCtxDelta_t* deltaPtr,             ///< [OUT] Delta record
+    const ResumeCtxSave_t* saveCtxPtr       ///< [IN] Resume context
+)
+{
+    // Clear the padding bytes as they are part of the record CRC
+    memset(deltaPtr, 0, sizeof(*deltaPtr));
+    deltaPtr->ctxCounter = saveCtxPtr->ctxCounter;
+    deltaPtr->currentImageCrc = saveCtxPtr->currentImageCrc;
+    deltaPtr->currentGlobalCrc = saveCtxPtr->currentGlobalCrc;
+    deltaPtr->totalRead = saveCtxPtr->totalRead;
+    deltaPtr->currentInImageOffset = saveCtxPtr->currentInImageOffset;
+    deltaPtr->fullImageCrc = saveCtxPtr->fullImageCrc;
+    deltaPtr->partitionOffset = saveCtxPtr->partitionOffset;
+    deltaPtr->partitionCtxCrc = saveCtxPtr->partitionCtxCrc;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Apply a resume context delta record to the resume context
+ */
+//--------------------------------------------------------------------------------------------------
+static void ApplyResumeCtxDelta
+(
+    ResumeCtxSave_t* saveCtxPtr,            ///< [INOUT] Resume context
+    const ResumeCtxDelta_t* deltaPtr        ///< [IN] Delta record
+)
+{
+    saveCtxPtr->ctxCounter = deltaPtr->ctxCounter;
+    saveCtxPtr->currentImageCrc = deltaPtr->currentImageCrc;
+    saveCtxPtr->currentGlobalCrc = deltaPtr->currentGlobalCrc;
+    saveCtxPtr->totalRead = deltaPtr->totalRead;
+    saveCtxPtr->currentInImageOffset = deltaPtr->currentInImageOffset;
+    saveCtxPtr->fullImageCrc = deltaPtr->fullImageCrc;
+    saveCtxPtr->partitionOffset = deltaPtr->partitionOffset;
+    saveCtxPtr->partitionCtxCrc = deltaPtr->partitionCtxCrc;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Check if the resume context only differs from the latest saved one by the fields held in a
+ * delta record
+ *
+ * @return
+ *      - true              if a delta record is enough to save the resume context
+ *      - false             otherwise
+ */
+//--------------------------------------------------------------------------------------------------
+static bool IsResumeCtxDelta
+(
+    const ResumeCtx_t* resumeCtxPtr     ///< [IN] The resume context
+)
+{
+    ResumeCtxSave_t saveCtx;
+    ResumeCtxDelta_t delta;
+
+    // Restore the delta fields of the latest saved context, all the fields should then be equal
+    memcpy(&saveCtx, &resumeCtxPtr->saveCtx, sizeof(saveCtx));
+    SetResumeCtxDelta(&delta, &resumeCtxPtr->baseCtx);
+    ApplyResumeCtxDelta(&saveCtx, &delta);
+
+    return (0 == memcmp(&saveCtx, &resumeCtxPtr->baseCtx, sizeof(saveCtx)));
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Append a delta record and the partition context to the latest resume context file. The full
+ * resume context is written into the other file instead if the journal is full or if other
+ * fields have been updated.
+ *
+ * @return
+ *      - LE_OK             on success
+ *      - LE_FAULT          on failure
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t AppendResumeCtx
+(
+    ResumeCtx_t* resumeCtxPtr   ///< [INOUT] The resume context, ctxCounter will be updated
+)
+{
+    ResumeCtxSave_t *saveCtxPtr = &resumeCtxPtr->saveCtx;
+    ResumeCtxDelta_t delta;
+    le_fs_FileRef_t fd;
+    le_result_t result;
+    char str[LE_FS_PATH_MAX_LEN];
+
+    if ((resumeCtxPtr->journalCount >= RESUME_CTX_JOURNAL_MAX) ||
+        (!IsResumeCtxDelta(resumeCtxPtr)))
+    {
+        return UpdateResumeCtx(resumeCtxPtr);
+    }
+
+    // The latest context has been written in the file not pointed by fileIndex
+    if (snprintf(str, sizeof(str), RESUME_CTX_FILENAME "%d", resumeCtxPtr->fileIndex ^ 1U) < 0)
+    {
+        LE_ERROR("Error when creating filename (fileIndex=%d)", resumeCtxPtr->fileIndex ^ 1U);
+        return LE_FAULT;
+    }
+
+    result = le_fs_Open(str, LE_FS_WRONLY|LE_FS_APPEND, &fd);
+    if (result != LE_OK)
+    {
+        LE_WARN("Error when opening %s, write the full context", str);
+        return UpdateResumeCtx(resumeCtxPtr);
+    }
+
+    saveCtxPtr->ctxCounter++;
+    saveCtxPtr->partitionCtxCrc = crc32_Compute(PartitionContextPtr, saveCtxPtr->partitionCtxSize,
+                                                LE_CRC_START_CRC32);
+    SetResumeCtxDelta(&delta, saveCtxPtr);
+    delta.recCrc = crc32_Compute((uint8_t*)&delta, sizeof(delta) - sizeof(delta.recCrc),
+                                 LE_CRC_START_CRC32);
+    delta.recCrc = crc32_Compute(PartitionContextPtr, saveCtxPtr->partitionCtxSize,
+                                 delta.recCrc);
+
+    result = le_fs_Write(fd, (uint8_t*)&delta, sizeof(delta));
+    result |= le_fs_Write(fd, PartitionContextPtr, saveCtxPtr->partitionCtxSize);
+    le_fs_Close(fd);
+    if (result != LE_OK)
+    {
+        // The record may be partially written: next records can not be appended after it
+        LE_WARN("Error while appending to %s, write the full context", str);
+        return UpdateResumeCtx(resumeCtxPtr);
+    }
+
+    resumeCtxPtr->journalCount++;
+
+    LE_DEBUG("resumeCtx record #%d: ctxCounter %d, currentImageCrc 0x%x totalRead %" PRIuS
+             " currentInImageOffset 0x%x", resumeCtxPtr->journalCount, delta.ctxCounter,
+             delta.currentImageCrc, delta.totalRead, delta.currentInImageOffset);
+
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Read the delta records following a valid full resume context and apply them. The partition
+ * context of the latest valid record is copied into the partition context buffer. The journal
+ * stops at the first record whose CRC is wrong or whose counter does not follow the previous one.
+ *
+ * @return
+ *      - the number of delta records applied
+ */
+//--------------------------------------------------------------------------------------------------
+static uint32_t ReadResumeCtxJournal
+(
+    le_fs_FileRef_t fd,             ///< [IN] File descriptor, located after the partition context
+    ResumeCtxSave_t* saveCtxPtr,    ///< [INOUT] Resume context to update
+    bool* isCorruptedPtr            ///< [OUT] True if the file ends with an invalid record
+)
+{
+    ResumeCtxDelta_t delta;
+    uint8_t* partitionCtxPtr = le_mem_ForceAlloc(PartitionContextPool);
+    uint32_t count = 0;
+    uint32_t crc32;
+    size_t readSize;
+
+    *isCorruptedPtr = false;
+    for (;;)
+    {
+        readSize = sizeof(delta);
+        if (LE_OK != le_fs_Read(fd, (uint8_t*)&delta, &readSize))
+        {
+            *isCorruptedPtr = true;
+            break;
+        }
+        if (0 == readSize)
+        {
+            break;
+        }
+        if (readSize == sizeof(delta))
+        {
+            readSize = saveCtxPtr->partitionCtxSize;
+            if ((LE_OK != le_fs_Read(fd, partitionCtxPtr, &readSize)) ||
+                (readSize != saveCtxPtr->partitionCtxSize))
+            {
+                readSize = 0;
+            }
+            else
+            {
+                readSize = sizeof(delta);
+            }
+        }
+
+        crc32 = crc32_Compute((uint8_t*)&delta, sizeof(delta) - sizeof(delta.recCrc),
+                              LE_CRC_START_CRC32);
+        crc32 = crc32_Compute(partitionCtxPtr, saveCtxPtr->partitionCtxSize, crc32);
+        if ((readSize != sizeof(delta)) || (crc32 != delta.recCrc) ||
+            (delta.ctxCounter != (saveCtxPtr->ctxCounter + 1)))
+        {
+            LE_WARN("Invalid resume context record #%d", count);
+            *isCorruptedPtr = true;
+            break;
+        }
+
+        ApplyResumeCtxDelta(saveCtxPtr, &delta);
+        memcpy(PartitionContextPtr, partitionCtxPtr, saveCtxPtr->partitionCtxSize);
+        count++;
+    }
+
+    le_mem_Release(partitionCtxPtr);
+    return count;
+}
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Erase the resume context
@@ -492,9 +749,9 @@ static le_result_t GetResumeCtx
             for (i = 2; i--;)
             {
                 currentCtxSave = &ctx[idx];
-                crc32 = le_crc_Crc32((uint8_t*)currentCtxSave,
-                                     sizeof(*currentCtxSave) - sizeof(currentCtxSave->ctxCrc),
-                                     LE_CRC_START_CRC32);
+                crc32 = crc32_Compute((uint8_t*)currentCtxSave,
+                                      sizeof(*currentCtxSave) - sizeof(currentCtxSave->ctxCrc),
+                                      LE_CRC_START_CRC32);
                 size_t readSize = currentCtxSave->partitionCtxSize;
 
                 memset(PartitionContextPtr, 0, readSize);
@@ -511,9 +768,9 @@ static le_result_t GetResumeCtx
                    continue;
                 }
 
-                partitionCtxCrc32 = le_crc_Crc32(PartitionContextPtr,
-                                                 currentCtxSave->partitionCtxSize,
-                                                 LE_CRC_START_CRC32);
+                partitionCtxCrc32 = crc32_Compute(PartitionContextPtr,
+                                                  currentCtxSave->partitionCtxSize,
+                                                  LE_CRC_START_CRC32);
 
                 if ((crc32 != currentCtxSave->ctxCrc) ||
                         (partitionCtxCrc32 != currentCtxSave->partitionCtxCrc))
@@ -535,11 +792,26 @@ static le_result_t GetResumeCtx
 
             if (LE_OK == result)
             {
-                // A valid context has been found, save the current fileIndex
-                resumeCtxPtr->fileIndex = idx;
+                bool isCorrupted;
+
+                // A valid context has been found, the next full context is written into the
+                // other file
+                resumeCtxPtr->fileIndex = idx ^ 1UL;
 
                 memcpy(&resumeCtxPtr->saveCtx, currentCtxSave, sizeof(resumeCtxPtr->saveCtx));
 
+                // Apply the delta records appended after the full context
+                resumeCtxPtr->journalCount = ReadResumeCtxJournal(fd[idx],
+                                                                  &resumeCtxPtr->saveCtx,
+                                                                  &isCorrupted);
+                if (isCorrupted)
+                {
+                    // Records can not be appended after an invalid one
+                    resumeCtxPtr->journalCount = RESUME_CTX_JOURNAL_MAX;
+                }
+                memcpy(&resumeCtxPtr->baseCtx, &resumeCtxPtr->saveCtx,
+                       sizeof(resumeCtxPtr->baseCtx));
+
                 LE_DEBUG("resumeCtx: ctxCounter %d, imageType %d, imageSize %d, imageCrc 0x%x,",
                          resumeCtxPtr->saveCtx.ctxCounter, resumeCtxPtr->saveCtx.imageType,
                          resumeCtxPtr->saveCtx.imageSize, resumeCtxPtr->saveCtx.imageCrc);
@@ -804,7 +1076,7 @@ static void StoreCurrentPosition
     memcpy(PartitionContextPtr, contextPtr, saveCtxPtr->partitionCtxSize);
     partition_GetSwifotaOffsetPartition(&(saveCtxPtr->partitionOffset));
 
-    if (UpdateResumeCtx(resumeCtxPtr) != LE_OK)
+    if (AppendResumeCtx(resumeCtxPtr) != LE_OK)
     {
         LE_WARN("Failed to update Resume context");
     }
@@ -852,13 +1124,13 @@ static le_result_t ProcessMetaImgData
     memcpy(saveCtxPtr->metaImgData.metaCweHdrRaw, chunkPtr, length);
 
     // Parsing complete, update and store context
-    CurrentGlobalCrc32 = le_crc_Crc32((uint8_t*)chunkPtr,
-                                       length,
-                                       CurrentGlobalCrc32);
+    CurrentGlobalCrc32 = crc32_Compute((uint8_t*)chunkPtr,
+                                        length,
+                                        CurrentGlobalCrc32);
 
-    CurrentImageCrc32 = le_crc_Crc32((uint8_t*)chunkPtr,
-                                     length,
-                                     CurrentImageCrc32);
+    CurrentImageCrc32 = crc32_Compute((uint8_t*)chunkPtr,
+                                      length,
+                                      CurrentImageCrc32);
 
     LE_INFO("Image data write: CRC in header: 0x%x, calculated CRC 0x%x",
              resumeCtxPtr->saveCtx.imageCrc, CurrentImageCrc32);
@@ -932,9 +1204,9 @@ static size_t WriteCweHeader
                                wrLenPtr,
                                false))
         {
-            CurrentGlobalCrc32 = le_crc_Crc32((uint8_t*)chunkPtr + writtenLength,
-                                              tmpLength,
-                                              CurrentGlobalCrc32);
+            CurrentGlobalCrc32 = crc32_Compute((uint8_t*)chunkPtr + writtenLength,
+                                               tmpLength,
+                                               CurrentGlobalCrc32);
 
             writtenLength += tmpLength;
             CurrentReadPackageOffset += tmpLength;
@@ -1042,13 +1314,13 @@ static le_result_t WriteImageData
         {
             LE_INFO("chunk length: %" PRIuS, length);
 
-            CurrentGlobalCrc32 = le_crc_Crc32((uint8_t*)chunkPtr + writtenLength,
-                                              tmpLength,
-                                              CurrentGlobalCrc32);
+            CurrentGlobalCrc32 = crc32_Compute((uint8_t*)chunkPtr + writtenLength,
+                                               tmpLength,
+                                               CurrentGlobalCrc32);
 
-            CurrentImageCrc32 = le_crc_Crc32((uint8_t*)chunkPtr+ writtenLength,
-                                             tmpLength,
-                                             CurrentImageCrc32);
+            CurrentImageCrc32 = crc32_Compute((uint8_t*)chunkPtr+ writtenLength,
+                                              tmpLength,
+                                              CurrentImageCrc32);
 
             LE_INFO("Image data write: CRC in header: 0x%x, calculated CRC 0x%x",
                     cweHeaderPtr->crc32, CurrentImageCrc32);
@@ -1205,7 +1477,7 @@ static le_result_t ParseCweHeader
     else
     {
         // Update the current global CRC with the current header
-        CurrentGlobalCrc32 = le_crc_Crc32((uint8_t*)chunkPtr, CWE_HEADER_SIZE, CurrentGlobalCrc32);
+        CurrentGlobalCrc32 = crc32_Compute((uint8_t*)chunkPtr, CWE_HEADER_SIZE, CurrentGlobalCrc32);
         saveCtxPtr->currentGlobalCrc = CurrentGlobalCrc32;
     }
 
@@ -1252,8 +1524,8 @@ static void UpdateCtxOnMetaRead
 {
     CurrentInImageOffset += length;
     CurrentReadPackageOffset += length;
-    CurrentImageCrc32 = le_crc_Crc32((uint8_t*)chunkPtr, length, CurrentImageCrc32);
-    CurrentGlobalCrc32 = le_crc_Crc32((uint8_t*)chunkPtr, length, CurrentGlobalCrc32);
+    CurrentImageCrc32 = crc32_Compute((uint8_t*)chunkPtr, length, CurrentImageCrc32);
+    CurrentGlobalCrc32 = crc32_Compute((uint8_t*)chunkPtr, length, CurrentGlobalCrc32);
     LE_DEBUG ( "patch header: CRC in header: 0x%x, calculated CRC 0x%x",
                CurrentCweHeader.crc32, CurrentImageCrc32 );
 }
@@ -2052,9 +2324,9 @@ static le_result_t BuildMetaData
     metaDataPtr->nbComponents  = 1;
     metaDataPtr->magicEnd      = SLOT_MAGIC_END;
 
-    metaDataPtr->crc32 = le_crc_Crc32((uint8_t*)metaDataPtr,
-                                       sizeof(Metadata_t) - sizeof(metaDataPtr->crc32),
-                                       LE_CRC_START_CRC32);
+    metaDataPtr->crc32 = crc32_Compute((uint8_t*)metaDataPtr,
+                                        sizeof(Metadata_t) - sizeof(metaDataPtr->crc32),
+                                        LE_CRC_START_CRC32);
 
     LE_INFO("Image length: %" PRIdS, PartitionCtx.fullImageSize);
     LE_INFO("Logical block: %x, Physical block: %x",
@@ -2502,6 +2774,9 @@ le_result_t pa_fwupdate_InitDownload
     void
 )
 {
+    // A new package may follow a change of the MTD partitions: read them again
+    pa_flash_InvalidateMtdCache();
+
     return EraseResumeCtx(&ResumeCtx);
 }
 
@@ -2592,6 +2867,9 @@ COMPONENT_INIT
     ChunkPool = le_mem_CreatePool("ChunkPool", CHUNK_LENGTH);
     le_mem_ExpandPool(ChunkPool, 1);
 
+    // Allocate the pool for the patch decoders
+    BsPatchInit();
+
     int mtdNum;
     pa_flash_Info_t flashInfo;
     le_result_t result;
@@ -14,6 +14,7 @@
 #include "partition_local.h"
 #include "pa_flash.h"
 #include "pa_flash_local.h"
+#include "crc32_local.h"
 
 #define LE_DEBUG3 LE_DEBUG
 
@@ -33,17 +34,17 @@
 
 //--------------------------------------------------------------------------------------------------
 /**
- * "/sys/class/mtd" access path
+ * Full image start block offset
  */
 //--------------------------------------------------------------------------------------------------
-#define PROC_MTD_PATH          "/proc/mtd"
+#define IMG_BLOCK_OFFSET      2
 
 //--------------------------------------------------------------------------------------------------
 /**
- * Full image start block offset
+ * Number of blocks kept erased ahead of the one being written in the SWIFOTA partition
  */
 //--------------------------------------------------------------------------------------------------
-#define IMG_BLOCK_OFFSET      2
+#define ERASE_AHEAD_BLOCKS    2
 
 //--------------------------------------------------------------------------------------------------
 /**
@@ -166,6 +167,7 @@ typedef struct
     uint32_t ubiNbPeb;       ///< Total number of PEB belonging to the UBI partition
     uint32_t ubiImageSeq;    ///< UBI image sequence number
     bool isUbiImageSeq;      ///< true is UBI image sequence number is meaningfull
+    bool isTailErased;       ///< true if the SWIFOTA is erased from the write position to its end
     uint8_t dataPtr[0];      ///< Buffer to copy data (size of an erase block)
 }
 Partition_t;
@@ -205,9 +207,76 @@ static void partition_Reset
     PartitionPtr->ubiNbPeb = 0;
     PartitionPtr->ubiImageSeq = 0;
     PartitionPtr->isUbiImageSeq = false;
+    PartitionPtr->isTailErased = false;
     memset(PartitionPtr->ubiVolName, 0, sizeof(PartitionPtr->ubiVolName));
 }
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Start the erase-ahead worker from the write position up to the end of the SWIFOTA partition,
+ * unless this part is already erased or the worker is already running.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t StartEraseAhead
+(
+    void
+)
+{
+    le_result_t res;
+
+    if (PartitionPtr->isTailErased)
+    {
+        return LE_OK;
+    }
+    res = pa_flash_StartEraseAhead(MtdFd, ERASE_AHEAD_BLOCKS, FlashInfoPtr->nbLeb);
+    if ((LE_OK != res) && (LE_BUSY != res))
+    {
+        LE_ERROR("Fails to start erase-ahead: %d", res);
+        return LE_FAULT;
+    }
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Erase the SWIFOTA partition from the write position up to its end and stop the erase-ahead
+ * worker. The UBI layer reads, writes and scans the blocks beyond the write position, so they
+ * need to be erased before an UBI partition is used in SWIFOTA.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t FlushEraseAhead
+(
+    void
+)
+{
+    le_result_t res;
+
+    if (PartitionPtr->isTailErased)
+    {
+        return LE_OK;
+    }
+    if (LE_OK != StartEraseAhead())
+    {
+        return LE_FAULT;
+    }
+    res = pa_flash_StopEraseAhead(MtdFd, true);
+    if (LE_OK != res)
+    {
+        LE_ERROR("Fails to erase up to the end of SWIFOTA: %d", res);
+        return LE_FAULT;
+    }
+    PartitionPtr->isTailErased = true;
+    return LE_OK;
+}
+
 //==================================================================================================
 //  PUBLIC API FUNCTIONS
 //==================================================================================================
@@ -230,9 +299,7 @@ int partition_GetMtdFromImageTypeOrName
     char** mtdNamePtr                 ///< [OUT] Pointer to the real MTD partition name
 )
 {
-    FILE* flashFdPtr;
-    char mtdBuf[100], mtdFetchName[16];
-    int mtdNum = -1, l;
+    int mtdNum = -1;
 
     char* mtdPartNamePtr;
 
@@ -262,41 +329,16 @@ int partition_GetMtdFromImageTypeOrName
         }
     }
 
-    // Build the partition name to fetch into the /proc/mtd
-    snprintf( mtdFetchName, sizeof(mtdFetchName), "\"%s\"", mtdPartNamePtr );
-    l = strlen( mtdFetchName );
-
-    // Open the /proc/mtd partition
-    if (NULL == (flashFdPtr = fopen(PROC_MTD_PATH, "r")))
-    {
-        LE_ERROR( "fopen on /proc/mtd failed: %m" );
-        return -1;
-    }
-
-    // Read all entries until the partition names match
-    while (fgets(mtdBuf, sizeof(mtdBuf), flashFdPtr ))
+    // Look for the partition name into the MTD partition table
+    if (LE_OK == pa_flash_GetMtdFromName( mtdPartNamePtr, &mtdNum ))
     {
-        // This is the fetched partition
-        if (0 == strncmp( mtdBuf + strlen( mtdBuf ) - l - 1, mtdFetchName, l ))
+        // Output MTD partition name and MTD number
+        if (mtdNamePtr)
         {
-            // Get the MTD number
-            if (1 != sscanf( mtdBuf, "mtd%d", &mtdNum ))
-            {
-                LE_ERROR( "Unable to scan the mtd number in %s", mtdBuf );
-            }
-            else
-            {
-                // Output MTD partition name and MTD number
-                if (mtdNamePtr)
-                {
-                    *mtdNamePtr = mtdPartNamePtr;
-                    LE_DEBUG( "Partition %s is mtd%d", *mtdNamePtr, mtdNum );
-                }
-            }
-            break;
+            *mtdNamePtr = mtdPartNamePtr;
+            LE_DEBUG( "Partition %s is mtd%d", *mtdNamePtr, mtdNum );
         }
     }
-    fclose( flashFdPtr );
 
     // Return the MTD number
     return mtdNum;
@@ -631,7 +673,7 @@ le_result_t partition_CheckData
             }
         }
 
-        crc32 = le_crc_Crc32( checkBlockPtr, size, crc32);
+        crc32 = crc32_Compute( checkBlockPtr, size, crc32);
         offset += size;
         imageSize += size;
     }
@@ -762,7 +804,7 @@ le_result_t partition_CheckUbiVolumeData
             (void)partition_CalculateDataLength(checkBlockPtr, &size);
             LE_DEBUG("pa_flash_CalculateDataLength -> %zu", size);
         }
-        crc32 = le_crc_Crc32( checkBlockPtr, size, crc32);
+        crc32 = crc32_Compute( checkBlockPtr, size, crc32);
     }
 
     // Check for unrecoverable ECC errors on active partition and abort if some.
@@ -1046,13 +1088,15 @@ le_result_t partition_OpenSwifotaPartition
             ctxPtr->logicalBlock = 0;
             ctxPtr->phyBlock = 0;
             *fullImageCrc32Ptr = LE_CRC_START_CRC32;
+            PartitionPtr->isTailErased = false;
             iblk = 0;
 
             // Go back physical access as we really need to deal with "real" PEB
             (void)pa_flash_Unscan(MtdFd);
 
-            // Erase blocks
-            for (; iblk < FlashInfoPtr->nbLeb; iblk++)
+            // Erase the Meta data blocks and the first block of the image. The next blocks are
+            // erased on demand by the erase-ahead worker, just ahead of the write position.
+            for (; (iblk < FlashInfoPtr->nbLeb) && (!ctxPtr->phyBlock); iblk++)
             {
                 bool isBad;
 
@@ -1111,6 +1155,10 @@ le_result_t partition_OpenSwifotaPartition
             LE_ERROR("Fails to seek block at %d", iblk);
             goto error;
         }
+
+        // From the write position, the blocks are erased in the background by a worker started
+        // by the first write. On resume, the partition internals are not restored yet: an UBI
+        // partition may lie beyond the write position and must not be erased.
     }
     else
     {
@@ -1178,11 +1226,17 @@ le_result_t partition_CloseSwifotaPartition
             LE_ERROR("fwrite to nandwrite fails: %m" );
             goto error;
         }
-        *fullImageCrc32Ptr = le_crc_Crc32(PartitionPtr->dataPtr,
+        *fullImageCrc32Ptr = crc32_Compute(PartitionPtr->dataPtr,
                                           PartitionPtr->inOffset,
                                           *fullImageCrc32Ptr);
     }
 
+    // Leave the blocks after the image erased
+    if (LE_OK != FlushEraseAhead())
+    {
+        goto error;
+    }
+
     pa_flash_Close(MtdFd);
     MtdFd = NULL;
     LE_INFO("Update for partiton %s done with return %d", MtdNamePtr, ret);
@@ -1340,7 +1394,7 @@ le_result_t partition_ComputeDataCrc32SwifotaPartition
         LE_DEBUG3("%hhX %hhX %hhX %hhX %hhX %hhX %hhX %hhX",
                   blockPtr[0x2000+0], blockPtr[0x2000+1], blockPtr[0x2000+2], blockPtr[0x2000+3],
                   blockPtr[0x2000+4], blockPtr[0x2000+5], blockPtr[0x2000+6], blockPtr[0x2000+7]);
-        crc32 = le_crc_Crc32( blockPtr, crcsize, crc32 );
+        crc32 = crc32_Compute( blockPtr, crcsize, crc32 );
     }
 
 out:
@@ -1416,6 +1470,12 @@ le_result_t partition_WriteSwifotaPartition
         goto error;
     }
 
+    // The blocks ahead of the write position are erased in the background from the first write
+    if (LE_OK != StartEraseAhead())
+    {
+        goto error;
+    }
+
     if (((uint32_t)(*lengthPtr + PartitionPtr->inOffset)) >= FlashInfoPtr->eraseSize)
     {
         size_t inOffsetSave = FlashInfoPtr->eraseSize - PartitionPtr->inOffset;
@@ -1432,7 +1492,7 @@ le_result_t partition_WriteSwifotaPartition
             LE_ERROR( "fwrite to nandwrite fails: %m" );
             goto error;
         }
-        *fullImageCrc32Ptr = le_crc_Crc32(PartitionPtr->dataPtr,
+        *fullImageCrc32Ptr = crc32_Compute(PartitionPtr->dataPtr,
                                           FlashInfoPtr->eraseSize,
                                           *fullImageCrc32Ptr);
         PartitionPtr->inOffset = 0;
@@ -1479,6 +1539,11 @@ le_result_t partition_OpenUbiSwifotaPartition
     off_t mtdOffset;
     le_result_t res;
 
+    res = FlushEraseAhead();
+    if( LE_OK != res )
+    {
+        return res;
+    }
     res = pa_flash_Tell(MtdFd, NULL, &mtdOffset);
     if( LE_OK != res )
     {
@@ -1531,7 +1596,7 @@ le_result_t partition_OpenUbiSwifotaPartition
                 LE_ERROR("fwrite to nandwrite fails: %m" );
                 return res;
             }
-            *fullImageCrc32Ptr = le_crc_Crc32(PartitionPtr->dataPtr,
+            *fullImageCrc32Ptr = crc32_Compute(PartitionPtr->dataPtr,
                                               PartitionPtr->inOffset,
                                               *fullImageCrc32Ptr);
         }
@@ -1700,7 +1765,7 @@ le_result_t partition_ComputeUbiCrc32SwifotaPartition
         LE_DEBUG3("%hhX %hhX %hhX %hhX %hhX %hhX %hhX %hhX",
                   blockPtr[0x2000+0], blockPtr[0x2000+1], blockPtr[0x2000+2], blockPtr[0x2000+3],
                   blockPtr[0x2000+4], blockPtr[0x2000+5], blockPtr[0x2000+6], blockPtr[0x2000+7]);
-        crc32 = le_crc_Crc32( blockPtr, FlashInfoPtr->eraseSize, crc32 );
+        crc32 = crc32_Compute( blockPtr, FlashInfoPtr->eraseSize, crc32 );
     }
     le_mem_Release( blockPtr );
 
@@ -1937,7 +2002,7 @@ le_result_t partition_WriteUbiSwifotaPartition
                      PartitionPtr->ubiWriteLeb, ubiDataSize, res);
             return res;
         }
-        *fullImageCrc32Ptr = le_crc_Crc32(PartitionPtr->dataPtr, ubiDataSize, *fullImageCrc32Ptr);
+        *fullImageCrc32Ptr = crc32_Compute(PartitionPtr->dataPtr, ubiDataSize, *fullImageCrc32Ptr);
         PartitionPtr->inOffset = 0;
         *lengthPtr = inOffsetSave;
         PartitionPtr->ubiWriteLeb++;
@@ -2029,13 +2094,13 @@ le_result_t partition_ComputeUbiVolumeCrc32SwifotaPartition
                   blockPtr[0x2000+0], blockPtr[0x2000+1], blockPtr[0x2000+2], blockPtr[0x2000+3],
                   blockPtr[0x2000+4], blockPtr[0x2000+5], blockPtr[0x2000+6], blockPtr[0x2000+7]);
         fullSize += size;
-        fullCrc32 = le_crc_Crc32( blockPtr, size, fullCrc32 );
+        fullCrc32 = crc32_Compute( blockPtr, size, fullCrc32 );
         if( (volPeb - 1) == iPeb )
         {
             (void)partition_CalculateDataLength( blockPtr, &size );
         }
         volSize += size;
-        crc32 = le_crc_Crc32( blockPtr, size, crc32 );
+        crc32 = crc32_Compute( blockPtr, size, crc32 );
     }
     le_mem_Release( blockPtr );
 
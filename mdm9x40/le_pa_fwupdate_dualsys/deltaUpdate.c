@@ -15,6 +15,7 @@
 #include "cwe_local.h"
 #include "utils_local.h"
 #include "partition_local.h"
+#include "crc32_local.h"
 
 //--------------------------------------------------------------------------------------------------
 /**
@@ -25,7 +26,7 @@
 
 //--------------------------------------------------------------------------------------------------
 /**
- * Define the temporary patch path
+ * Define the temporary patch path, used if the patch cannot be kept into an anonymous memory file
  */
 //--------------------------------------------------------------------------------------------------
 #define TMP_PATCH_PATH "/tmp/.tmp.patch"
@@ -89,7 +90,7 @@ static le_result_t CheckUbiData
             goto error;
         }
 
-        crc32 = le_crc_Crc32( checkBlockPtr, size, crc32);
+        crc32 = crc32_Compute( checkBlockPtr, size, crc32);
         imageSize += size;
     }
     if (crc32 != crc32ToCheck)
@@ -310,8 +311,10 @@ le_result_t deltaUpdate_ApplyPatch
     static bool InPatch = false;
     static bool IsOrigLogical, IsOrigDual, IsDestLogical, IsDestDual;
     static char *MtdNamePtr = NULL;
-    static int PatchFd = -1;
+    static utils_PatchSource_t PatchSrc = UTILS_PATCH_SOURCE_INIT;
     static uint32_t PatchCrc32;
+    // Descriptor opened by bsPatch() for the current patch, set through the patch context
+    static pa_patch_Desc_t PatchDesc = NULL;
 
     const cwe_Header_t *cweHdrPtr = ctxPtr->cweHdrPtr;
     const deltaUpdate_PatchHdr_t *patchHdrPtr = ctxPtr->hdrPtr;
@@ -433,15 +436,10 @@ le_result_t deltaUpdate_ApplyPatch
         InPatch = true;
     }
 
-    if (-1 == PatchFd)
+    // Stream the patch body into the patch source as it is received
+    if (LE_OK != utils_OpenPatchSource( &PatchSrc, TMP_PATCH_PATH ))
     {
-        // Create a new file containing the patch body
-        PatchFd = open( TMP_PATCH_PATH, O_TRUNC | O_CREAT | O_WRONLY, S_IRUSR|S_IWUSR );
-        if (-1 == PatchFd)
-        {
-            LE_CRIT("Failed to create patch file: %m");
-            goto error;
-        }
+        goto error;
     }
 
     size_t *patchRemLenPtr = &ctxPtr->patchRemLen;
@@ -450,11 +448,10 @@ le_result_t deltaUpdate_ApplyPatch
 
     LE_DEBUG("Patch %u: Writing to patch file %d: wrLen = %zu, "
              "Patch.size %u, PatchRemLen %zu\n",
-             patchHdrPtr->number, PatchFd, wrLen,
+             patchHdrPtr->number, PatchSrc.fd, wrLen,
              patchHdrPtr->size, patchRemLen);
-    if (wrLen != write( PatchFd, dataPtr, wrLen ))
+    if (LE_OK != utils_WritePatchSource( &PatchSrc, dataPtr, wrLen ))
     {
-        LE_ERROR("Write to patch fails: %m");
         goto error;
     }
 
@@ -464,12 +461,11 @@ le_result_t deltaUpdate_ApplyPatch
     if (0 == *patchRemLenPtr)
     {
         pa_flash_Desc_t desc;
+        pa_flash_EccStats_t origEccStats, eccStats;
         pa_patch_Context_t ctx;
         le_result_t res;
-        bool isUbiPatch = false, isUbiPartition;
+        bool isUbiPatch = false, isUbiPartition, isOrigEccStats = false;
 
-        close(PatchFd);
-        PatchFd = -1;
         if (isFlashedPtr)
         {
             *isFlashedPtr = true;
@@ -503,6 +499,7 @@ le_result_t deltaUpdate_ApplyPatch
         ctx.destImageDesc.flash.ubiVolId = patchMetaHdrPtr->ubiVolId;
         ctx.destImageDesc.flash.isLogical = IsDestLogical;
         ctx.destImageDesc.flash.isDual = IsDestDual;
+        ctx.descPtr = &PatchDesc;
 
         if (isUbiPatch)
         {
@@ -526,19 +523,38 @@ le_result_t deltaUpdate_ApplyPatch
                           MtdOrigNum, res, isUbiPartition);
                  goto error;
              }
+             // The origin was fully checked when the patch started. Snapshot the ECC statistics
+             // to detect any unrecoverable ECC error while this slice reads the origin.
+             isOrigEccStats = (LE_OK == pa_flash_GetEccStats( desc, &origEccStats ));
         }
         res = bsPatch( &ctx,
-                       TMP_PATCH_PATH,
+                       PatchSrc.path,
                        &PatchCrc32,
                        patchMetaHdrPtr->numPatches == patchHdrPtr->number,
                        false);
-        unlink(TMP_PATCH_PATH);
+        utils_ClosePatchSource( &PatchSrc );
         if (LE_OK == res)
         {
-            if (isUbiPatch)
+            // The segments of this slice may still be written in background: they must be in
+            // flash before the slice is reported as flashed and the resume context is updated.
+            res = (PatchDesc ? pa_patch_Flush(PatchDesc) : LE_OK);
+            if (LE_OK != res)
             {
-                // In this case, we need to recompute the checksum of the MTD to ensure that
+                LE_ERROR("Failed to write patch %d: %d", patchHdrPtr->number, res);
+            }
+        }
+        if (LE_OK == res)
+        {
+            if ((isUbiPatch) &&
+                ((!isOrigEccStats) ||
+                 (LE_OK != pa_flash_GetEccStats( desc, &eccStats )) ||
+                 (eccStats.failed != origEccStats.failed)))
+            {
+                // Unrecoverable ECC errors may have occurred while reading the origin, or they
+                // cannot be tracked: we need to recompute the checksum of the MTD to ensure that
                 // it is conform to what we read during the patch.
+                LE_WARN("MTD %d: ECC failures may have altered the origin, check it again",
+                        MtdOrigNum);
                 res = CheckUbiData( MtdOrigNum,
                                     patchMetaHdrPtr->ubiVolId,
                                     patchMetaHdrPtr->origSize,
@@ -567,8 +583,7 @@ le_result_t deltaUpdate_ApplyPatch
         // The whole patch segments were applied to destination image
         InPatch = false;
         LE_INFO( "Patch applied\n");
-        close(PatchFd);
-        PatchFd = -1;
+        utils_ClosePatchSource( &PatchSrc );
 
         // Check if destination CRC is the expected one
         if (PA_PATCH_INVALID_UBI_VOL_ID != patchMetaHdrPtr->ubiVolId)
@@ -622,12 +637,7 @@ error:
     InPatch = false;
     MtdDestNum = -1;
     MtdOrigNum = -1;
-    if (-1 != PatchFd)
-    {
-        close(PatchFd);
-        PatchFd = -1;
-    }
-    unlink(TMP_PATCH_PATH);
+    utils_ClosePatchSource( &PatchSrc );
     res = bsPatch( NULL, NULL, NULL, true, true );
     return (forceClose ? res : LE_FAULT);
 }
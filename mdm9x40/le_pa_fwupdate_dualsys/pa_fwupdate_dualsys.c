@@ -12,16 +12,20 @@
 
 #include "legato.h"
 #include "pa_flash.h"
+#include "pa_flash_local.h"
 #include "pa_fwupdate.h"
 #include "pa_fwupdate_dualsys.h"
+#include "pa_fwupdate_dualsys_local.h"
 #include "cwe_local.h"
 #include "deltaUpdate_local.h"
 #include "partition_local.h"
+#include "crc32_local.h"
 #include "interfaces.h"
 #include "watchdogChain.h"
 #include "fwupdate_local.h"
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 #include "flash-ubi.h"
 #include <openssl/sha.h>
@@ -44,6 +48,25 @@
 #define NO_SWAP                 0x00000000
 #define SWAP_BY_LEGATO          0x00000004
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Differential synchronization: if set to 1, each block of the dual partition is compared to the
+ * active one and only the blocks which differ are erased and programmed
+ */
+//--------------------------------------------------------------------------------------------------
+#ifndef PA_FWUPDATE_DIFF_SYNC
+#define PA_FWUPDATE_DIFF_SYNC   1
+#endif
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Maximum number of partitions synchronized in parallel by pa_fwupdate_MarkGood()
+ */
+//--------------------------------------------------------------------------------------------------
+#ifndef PA_FWUPDATE_SYNC_MAX_THREADS
+#define PA_FWUPDATE_SYNC_MAX_THREADS   3
+#endif
+
 //--------------------------------------------------------------------------------------------------
 /**
  * File hosting the last download status
@@ -93,6 +116,22 @@ static char* CusgPathPtr = NULL;
 //--------------------------------------------------------------------------------------------------
 #define CHUNK_LENGTH 65536
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Define the number of data chunks in the download ring. The reader thread may be this number of
+ * chunks ahead of the chunk being parsed and flashed.
+ */
+//--------------------------------------------------------------------------------------------------
+#define CHUNK_RING_COUNT 4
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Define the length of the sub-blocks of a data chunk used to compute the digests. The CRC32 and
+ * the SHA256 are computed on each sub-block while it stays in the data cache.
+ */
+//--------------------------------------------------------------------------------------------------
+#define DIGEST_BLOCK_LENGTH 4096
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Maximum UBI volumes for DM-verity checks
@@ -159,6 +198,25 @@ typedef struct
 }
 ResumeCtxSave_t;
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Resume context delta record. It is appended after the full resume context each time data have
+ * been flashed and only holds the fields updated at this checkpoint.
+ */
+//--------------------------------------------------------------------------------------------------
+typedef struct
+{
+    uint32_t ctxCounter;            ///< Context counter, must follow the previous one
+    uint32_t currentImageCrc;       ///< current image CRC
+    uint32_t currentGlobalCrc;      ///< current global CRC
+    size_t   totalRead;             ///< total read from the beginning of the package
+    uint32_t currentOffset;         ///< offset in the current partition
+    bool     isImageToBeRead;       ///< Boolean to know if data concerns header or component image
+    SHA256_CTX sha256Ctx;           ///< buffer to save sha256 context
+    uint32_t recCrc;                ///< record CRC, Computed on all previous fields of this struct
+}
+ResumeCtxDelta_t;
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Resume context to save
@@ -169,9 +227,108 @@ typedef struct
     ResumeCtxSave_t saveCtx;    ///< context to save
     uint32_t fileIndex;         ///< file index to use to save the above context [0..1]
     SHA256_CTX  *sha256CtxPtr;  ///< sha256 context pointer used for calculating
+    ResumeCtxSave_t baseCtx;    ///< context as rebuilt from the file not pointed by fileIndex
+    uint32_t journalCount;      ///< number of delta records appended after the full context
 }
 ResumeCtx_t;
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Resume checkpoint policy and the statistics used to apply it
+ */
+//--------------------------------------------------------------------------------------------------
+typedef struct
+{
+    pa_fwupdate_CheckpointPolicy_t policy;  ///< policy to decide when a checkpoint is written
+    uint32_t      value;                    ///< policy value: bytes, milliseconds or percent
+    size_t        pendingLen;               ///< length flashed since the latest checkpoint
+    le_clk_Time_t lastTime;                 ///< time of the latest checkpoint
+    uint64_t      writeCostUs;              ///< average time to write a checkpoint, in us
+}
+Checkpoint_t;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Data chunk filled by the download reader thread
+ */
+//--------------------------------------------------------------------------------------------------
+typedef struct
+{
+    uint8_t*    bufferPtr;      ///< Chunk buffer allocated from the ChunkPool
+    ssize_t     length;         ///< Length of the data read into the buffer
+    le_result_t result;         ///< Read result. If not LE_OK, the reader thread has stopped
+}
+ChunkSlot_t;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Ring of data chunks shared between the download reader thread and the download thread
+ */
+//--------------------------------------------------------------------------------------------------
+typedef struct
+{
+    int             fd;                         ///< File descriptor of the package
+    int             efd;                        ///< Event file descriptor, -1 for regular file
+    int             abortFd;                    ///< Event used to abort a pending read
+    le_mutex_Ref_t  mutex;                      ///< Mutex protecting isAborted and the offsets
+    bool            isAborted;                  ///< Set by the download thread to stop the reader
+    size_t          rdPkgOffset;                ///< Offset in the package read by the reader
+    size_t          endPkgOffset;               ///< Offset in the package the reader may reach
+    le_thread_Ref_t readerRef;                  ///< Reader thread
+    le_sem_Ref_t    freeSem;                    ///< Number of chunks available to the reader
+    le_sem_Ref_t    fullSem;                    ///< Number of chunks available to the parser
+    le_sem_Ref_t    endSem;                     ///< Posted when endPkgOffset moves or on abort
+    ChunkSlot_t     slot[CHUNK_RING_COUNT];     ///< Chunks of the ring
+    uint32_t        wrIdx;                      ///< Next chunk filled by the reader
+    uint32_t        rdIdx;                      ///< Chunk being consumed by the parser
+    size_t          rdOffset;                   ///< Consumed length of the chunk rdIdx
+    bool            isRdSlotHeld;               ///< true if the chunk rdIdx is owned by the parser
+}
+ChunkRing_t;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Partition to be synchronized by a synchronization worker
+ */
+//--------------------------------------------------------------------------------------------------
+typedef struct
+{
+    cwe_ImageType_t imageType;      ///< Image type of the partition
+    int             mtdSrc;         ///< MTD of the active partition
+    int             mtdDst;         ///< MTD of the dual partition
+    char*           mtdSrcNamePtr;  ///< Name of the active partition
+    char*           mtdDstNamePtr;  ///< Name of the dual partition
+    bool            isLogicalSrc;   ///< Active partition is a logical partition
+    bool            isDualSrc;      ///< Active partition is the second logical partition
+    bool            isLogicalDst;   ///< Dual partition is a logical partition
+    bool            isDualDst;      ///< Dual partition is the second logical partition
+    uint8_t         srcSystem;      ///< Active system of the sub system
+    uint8_t         dstSystem;      ///< Dual system of the sub system
+    uint32_t        size;           ///< Size of the active partition
+    int             nextJob;        ///< Next job sharing a MTD with this one, -1 if none
+    le_result_t     result;         ///< Result of the synchronization
+}
+SyncJob_t;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Scheduler of the synchronization workers. The jobs sharing a MTD are chained and synchronized
+ * one after the other by the same worker. The chains are taken by the workers largest first.
+ */
+//--------------------------------------------------------------------------------------------------
+typedef struct
+{
+    SyncJob_t*     jobPtr;          ///< Partitions to be synchronized
+    int            nbJobs;          ///< Number of partitions to be synchronized
+    int*           chainPtr;        ///< First job of each chain, largest chain first
+    int            nbChains;        ///< Number of chains
+    int            nextChain;       ///< Next chain to be taken by a worker
+    bool           isAborted;       ///< Set when a synchronization fails to stop the workers
+    le_mutex_Ref_t mutex;           ///< Mutex protecting nextChain and isAborted
+    le_sem_Ref_t   doneSem;         ///< Posted by each worker when it exits
+}
+SyncSched_t;
+
 //==================================================================================================
 //                                       Static variables
 //==================================================================================================
@@ -263,6 +420,13 @@ static partition_Ctx_t PartitionCtx = {
 //--------------------------------------------------------------------------------------------------
 static bool IsSyncBeforeUpdateDisabled = false;
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Resume checkpoint policy (default: checkpoint at every flushed erase block)
+ */
+//--------------------------------------------------------------------------------------------------
+static Checkpoint_t Checkpoint = { .policy = PA_FWUPDATE_CHECKPOINT_BLOCK };
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Running a secure boot version
@@ -326,7 +490,8 @@ static le_result_t UpdateResumeCtx
 
         LE_DEBUG("Input fileIndex=%d filename %s", resumeCtxPtr->fileIndex, str);
 
-        result = le_fs_Open(str, LE_FS_WRONLY|LE_FS_CREAT, &fd);
+        // truncate the file to drop the delta records appended after the previous context
+        result = le_fs_Open(str, LE_FS_WRONLY|LE_FS_CREAT|LE_FS_TRUNC, &fd);
         if (result != LE_OK)
         {// an error is occurred
             LE_ERROR("Error when opening %s", str);
@@ -337,10 +502,10 @@ static le_result_t UpdateResumeCtx
             // swap the fileIndex
             resumeCtxPtr->fileIndex ^= 1UL;
             resumeCtxPtr->saveCtx.ctxCounter++;
-            resumeCtxPtr->saveCtx.ctxCrc = le_crc_Crc32((uint8_t*)&resumeCtxPtr->saveCtx,
-                                                        sizeof(resumeCtxPtr->saveCtx) -
-                                                        sizeof(resumeCtxPtr->saveCtx.ctxCrc),
-                                                        LE_CRC_START_CRC32);
+            resumeCtxPtr->saveCtx.ctxCrc = crc32_Compute((uint8_t*)&resumeCtxPtr->saveCtx,
+                                                         sizeof(resumeCtxPtr->saveCtx) -
+                                                         sizeof(resumeCtxPtr->saveCtx.ctxCrc),
+                                                         LE_CRC_START_CRC32);
             LE_DEBUG("resumeCtx: ctxCounter %d, imageType %d, imageSize %d, imageCrc 0x%x,",
                      resumeCtxPtr->saveCtx.ctxCounter, resumeCtxPtr->saveCtx.imageType,
                      resumeCtxPtr->saveCtx.imageSize, resumeCtxPtr->saveCtx.imageCrc);
@@ -364,11 +529,204 @@ static le_result_t UpdateResumeCtx
         }
     }
 
+    if (LE_OK == result)
+    {
+        // the journal restarts from this context
+        memcpy(&resumeCtxPtr->baseCtx, &resumeCtxPtr->saveCtx, sizeof(resumeCtxPtr->baseCtx));
+        resumeCtxPtr->journalCount = 0;
+    }
+    else
+    {
+        // the file may be corrupted: the next update needs to write the full context
+        resumeCtxPtr->journalCount = RESUME_CTX_JOURNAL_MAX;
+    }
+
     LE_DEBUG("Result %s, Output fileIndex=%d", LE_RESULT_TXT(result), resumeCtxPtr->fileIndex);
 
     return result;
 }
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Fill a resume context delta record from the resume context. The record CRC is not computed.
+ */
+//--------------------------------------------------------------------------------------------------
+static void SetResumeCtxDelta
+(
+    ResumeCtxDelta_t* deltaPtr,             ///< [OUT] delta record
+    const ResumeCtxSave_t* saveCtxPtr       ///< [IN] resume context
+)
+{
+    // clear the padding bytes as they are part of the record CRC
+    memset(deltaPtr, 0, sizeof(*deltaPtr));
+    deltaPtr->ctxCounter = saveCtxPtr->ctxCounter;
+    deltaPtr->currentImageCrc = saveCtxPtr->currentImageCrc;
+    deltaPtr->currentGlobalCrc = saveCtxPtr->currentGlobalCrc;
+    deltaPtr->totalRead = saveCtxPtr->totalRead;
+    deltaPtr->currentOffset = saveCtxPtr->currentOffset;
+    deltaPtr->isImageToBeRead = saveCtxPtr->isImageToBeRead;
+    memcpy(&deltaPtr->sha256Ctx, &saveCtxPtr->sha256Ctx, sizeof(deltaPtr->sha256Ctx));
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Apply a resume context delta record to the resume context
+ */
+//--------------------------------------------------------------------------------------------------
+static void ApplyResumeCtxDelta
+(
+    ResumeCtxSave_t* saveCtxPtr,            ///< [INOUT] resume context
+    const ResumeCtxDelta_t* deltaPtr        ///< [IN] delta record
+)
+{
+    saveCtxPtr->ctxCounter = deltaPtr->ctxCounter;
+    saveCtxPtr->currentImageCrc = deltaPtr->currentImageCrc;
+    saveCtxPtr->currentGlobalCrc = deltaPtr->currentGlobalCrc;
+    saveCtxPtr->totalRead = deltaPtr->totalRead;
+    saveCtxPtr->currentOffset = deltaPtr->currentOffset;
+    saveCtxPtr->isImageToBeRead = deltaPtr->isImageToBeRead;
+    memcpy(&saveCtxPtr->sha256Ctx, &deltaPtr->sha256Ctx, sizeof(saveCtxPtr->sha256Ctx));
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Check if the resume context only differs from the latest saved one by the fields held in a
+ * delta record
+ *
+ * @return
+ *      - true              if a delta record is enough to save the resume context
+ *      - false             otherwise
+ */
+//--------------------------------------------------------------------------------------------------
+static bool IsResumeCtxDelta
+(
+    const ResumeCtx_t* resumeCtxPtr     ///< [IN] the resume context
+)
+{
+    ResumeCtxSave_t saveCtx;
+    ResumeCtxDelta_t delta;
+
+    // restore the delta fields of the latest saved context, all the fields should then be equal
+    memcpy(&saveCtx, &resumeCtxPtr->saveCtx, sizeof(saveCtx));
+    SetResumeCtxDelta(&delta, &resumeCtxPtr->baseCtx);
+    ApplyResumeCtxDelta(&saveCtx, &delta);
+
+    return (0 == memcmp(&saveCtx, &resumeCtxPtr->baseCtx, sizeof(saveCtx)));
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Append a delta record to the latest resume context file. The full resume context is written
+ * into the other file instead if the journal is full or if other fields have been updated.
+ *
+ * @return
+ *      - LE_OK             on success
+ *      - LE_FAULT          on failure
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t AppendResumeCtx
+(
+    ResumeCtx_t* resumeCtxPtr   ///< [INOUT] the resume context, ctxCounter will be updated
+)
+{
+    ResumeCtxDelta_t delta;
+    le_fs_FileRef_t fd;
+    le_result_t result;
+    char str[LE_FS_PATH_MAX_LEN];
+
+    if ((resumeCtxPtr->journalCount >= RESUME_CTX_JOURNAL_MAX) ||
+        (!IsResumeCtxDelta(resumeCtxPtr)))
+    {
+        return UpdateResumeCtx(resumeCtxPtr);
+    }
+
+    // the latest context has been written in the file not pointed by fileIndex
+    if (snprintf(str, sizeof(str), RESUME_CTX_FILENAME "%d", resumeCtxPtr->fileIndex ^ 1U) < 0)
+    {
+        LE_ERROR("error when creating filename (fileIndex=%d)", resumeCtxPtr->fileIndex ^ 1U);
+        return LE_FAULT;
+    }
+
+    result = le_fs_Open(str, LE_FS_WRONLY|LE_FS_APPEND, &fd);
+    if (result != LE_OK)
+    {
+        LE_WARN("Error when opening %s, write the full context", str);
+        return UpdateResumeCtx(resumeCtxPtr);
+    }
+
+    resumeCtxPtr->saveCtx.ctxCounter++;
+    SetResumeCtxDelta(&delta, &resumeCtxPtr->saveCtx);
+    delta.recCrc = crc32_Compute((uint8_t*)&delta, sizeof(delta) - sizeof(delta.recCrc),
+                                 LE_CRC_START_CRC32);
+
+    result = le_fs_Write(fd, (uint8_t*)&delta, sizeof(delta));
+    le_fs_Close(fd);
+    if (result != LE_OK)
+    {
+        // the record may be partially written: next records can not be appended after it
+        LE_WARN("Error while appending to %s, write the full context", str);
+        return UpdateResumeCtx(resumeCtxPtr);
+    }
+
+    resumeCtxPtr->journalCount++;
+
+    LE_DEBUG("resumeCtx record #%d: ctxCounter %d, currentImageCrc 0x%x totalRead %zu "
+             "currentOffset 0x%x", resumeCtxPtr->journalCount, delta.ctxCounter,
+             delta.currentImageCrc, delta.totalRead, delta.currentOffset);
+
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Read the delta records following a valid full resume context and apply them. The journal stops
+ * at the first record whose CRC is wrong or whose counter does not follow the previous one.
+ *
+ * @return
+ *      - the number of delta records applied
+ */
+//--------------------------------------------------------------------------------------------------
+static uint32_t ReadResumeCtxJournal
+(
+    le_fs_FileRef_t fd,             ///< [IN] file descriptor, located after the full context
+    ResumeCtxSave_t* saveCtxPtr,    ///< [INOUT] resume context to update
+    bool* isCorruptedPtr            ///< [OUT] true if the file ends with an invalid record
+)
+{
+    ResumeCtxDelta_t delta;
+    uint32_t count = 0;
+    size_t readSize;
+
+    *isCorruptedPtr = false;
+    for (;;)
+    {
+        readSize = sizeof(delta);
+        if (LE_OK != le_fs_Read(fd, (uint8_t*)&delta, &readSize))
+        {
+            *isCorruptedPtr = true;
+            break;
+        }
+        if (0 == readSize)
+        {
+            break;
+        }
+        if ((readSize != sizeof(delta)) ||
+            (delta.recCrc != crc32_Compute((uint8_t*)&delta,
+                                           sizeof(delta) - sizeof(delta.recCrc),
+                                           LE_CRC_START_CRC32)) ||
+            (delta.ctxCounter != (saveCtxPtr->ctxCounter + 1)))
+        {
+            LE_WARN("Invalid resume context record #%d", count);
+            *isCorruptedPtr = true;
+            break;
+        }
+        ApplyResumeCtxDelta(saveCtxPtr, &delta);
+        count++;
+    }
+
+    return count;
+}
+
 //--------------------------------------------------------------------------------------------------
 /**
  * erase the resume context
@@ -543,6 +901,54 @@ static le_result_t ProcessSha256
     return LE_OK;
 }
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Update the global CRC32, the image CRC32 and the SHA256 digest with image data in a single pass.
+ * The data are walked by sub-blocks of DIGEST_BLOCK_LENGTH: the CRC32 of the chunk is computed once
+ * and then combined into both running CRC32.
+ *
+ * @return
+ *      - LE_OK             on success
+ *      - LE_FAULT          on failure
+ *      - LE_BAD_PARAMETER  on parameter invalid
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t ProcessImageDigests
+(
+    SHA256_CTX*    sha256CtxPtr,     ///< [IN] SHA256 context pointer, NULL if SHA256 is not needed
+    const uint8_t* bufPtr,           ///< [IN] Data buffer to hash
+    size_t         len               ///< [IN] Data buffer length
+)
+{
+    uint32_t chunkCrc32 = CRC32_START_CHUNK;
+    size_t offset, blockLen;
+    le_result_t result;
+
+    for (offset = 0; offset < len; offset += blockLen)
+    {
+        blockLen = len - offset;
+        if (blockLen > DIGEST_BLOCK_LENGTH)
+        {
+            blockLen = DIGEST_BLOCK_LENGTH;
+        }
+
+        chunkCrc32 = crc32_Compute((uint8_t*)bufPtr + offset, blockLen, chunkCrc32);
+        if (sha256CtxPtr)
+        {
+            result = ProcessSha256(sha256CtxPtr, (uint8_t*)bufPtr + offset, blockLen);
+            if (LE_OK != result)
+            {
+                return result;
+            }
+        }
+    }
+
+    CurrentGlobalCrc32 = crc32_Combine(CurrentGlobalCrc32, chunkCrc32, len);
+    CurrentImageCrc32 = crc32_Combine(CurrentImageCrc32, chunkCrc32, len);
+
+    return LE_OK;
+}
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Finish the SHA256 calculation and get the digest
@@ -710,9 +1116,9 @@ static le_result_t GetResumeCtx
             for (i = 2; i--;)
             {
                 currentCtxSave = &ctx[idx];
-                crc32 = le_crc_Crc32((uint8_t*)currentCtxSave,
-                                     sizeof(*currentCtxSave) - sizeof(currentCtxSave->ctxCrc),
-                                     LE_CRC_START_CRC32);
+                crc32 = crc32_Compute((uint8_t*)currentCtxSave,
+                                      sizeof(*currentCtxSave) - sizeof(currentCtxSave->ctxCrc),
+                                      LE_CRC_START_CRC32);
                 if (crc32 != currentCtxSave->ctxCrc)
                 {
                     LE_ERROR("file #%d Bad CRC32: expected 0x%x, get 0x%x",
@@ -730,11 +1136,25 @@ static le_result_t GetResumeCtx
 
             if (LE_OK == result)
             {// a valid context has been found
-                // save the current fileIndex
-                resumeCtxPtr->fileIndex = idx;
+                bool isCorrupted;
+
+                // the next full context is written into the other file
+                resumeCtxPtr->fileIndex = idx ^ 1UL;
 
                 memcpy(&resumeCtxPtr->saveCtx, currentCtxSave, sizeof(resumeCtxPtr->saveCtx));
 
+                // apply the delta records appended after the full context
+                resumeCtxPtr->journalCount = ReadResumeCtxJournal(fd[idx],
+                                                                  &resumeCtxPtr->saveCtx,
+                                                                  &isCorrupted);
+                if (isCorrupted)
+                {
+                    // records can not be appended after an invalid one
+                    resumeCtxPtr->journalCount = RESUME_CTX_JOURNAL_MAX;
+                }
+                memcpy(&resumeCtxPtr->baseCtx, &resumeCtxPtr->saveCtx,
+                       sizeof(resumeCtxPtr->baseCtx));
+
                 LE_DEBUG("resumeCtx: ctxCounter %d, imageType %d, imageSize %d, imageCrc 0x%x,",
                          resumeCtxPtr->saveCtx.ctxCounter, resumeCtxPtr->saveCtx.imageType,
                          resumeCtxPtr->saveCtx.imageSize, resumeCtxPtr->saveCtx.imageCrc);
@@ -1083,59 +1503,156 @@ static le_result_t WriteData
 
 //--------------------------------------------------------------------------------------------------
 /**
- * This function is to initialize internal variables to initiate a new package download
+ * Get the time elapsed since a given relative time
+ *
+ * @return
+ *      - the elapsed time in us
  */
 //--------------------------------------------------------------------------------------------------
-static void InitParameters
+static uint64_t GetElapsedUs
 (
-    bool isResume,                  ///< [IN] true if we're a resuming
-    ResumeCtxSave_t *saveCtxPtr     ///< [INOUT] resume context
+    le_clk_Time_t startTime     ///< [IN] relative time of the beginning
 )
 {
-    LE_DEBUG ("InitParameters, isResume=%d", isResume);
-    if (isResume)
-    {
-        DeltaUpdateCtx.patchRemLen = saveCtxPtr->patchHdr.size;
-        CurrentImageOffset = saveCtxPtr->currentOffset;
-        CurrentImageCrc32 = saveCtxPtr->currentImageCrc;
-        CurrentGlobalCrc32 = saveCtxPtr->currentGlobalCrc;
-        CurrentCweHeader.imageType = saveCtxPtr->imageType;
-        CurrentCweHeader.imageSize = saveCtxPtr->imageSize;
-        CurrentCweHeader.crc32 = saveCtxPtr->imageCrc;
-        CurrentCweHeader.miscOpts = saveCtxPtr->miscOpts;
-        IsFirstDataWritten = true;
-        RestoreSha256(&(saveCtxPtr->sha256Ctx), sizeof(saveCtxPtr->sha256Ctx),
-                      &ResumeCtx.sha256CtxPtr);
-    }
-    else
-    {
-        CurrentImageOffset = 0;
-        CurrentImageCrc32 = LE_CRC_START_CRC32;
-        CurrentGlobalCrc32 = LE_CRC_START_CRC32;
-        memset(&CurrentCweHeader, 0, sizeof(CurrentCweHeader));
-        saveCtxPtr->isImageToBeRead = false;
-        IsFirstDataWritten = false;
-        saveCtxPtr->fullImageLength = -1;
-        // erase the diffType to allow to detect a new Patch Meta header
-        memset(saveCtxPtr->patchMetaHdr.diffType, 0, sizeof(saveCtxPtr->patchMetaHdr.diffType));
-    }
+    le_clk_Time_t diffTime = le_clk_Sub(le_clk_GetRelativeTime(), startTime);
+
+    return ((uint64_t)diffTime.sec * 1000000) + diffTime.usec;
 }
 
 //--------------------------------------------------------------------------------------------------
 /**
- * This function indicates the data length to be read according to data type to be read
+ * Reset the checkpoint statistics, the next checkpoint is counted from now
+ */
+//--------------------------------------------------------------------------------------------------
+static void ResetCheckpoint
+(
+    void
+)
+{
+    Checkpoint.pendingLen = 0;
+    Checkpoint.lastTime = le_clk_GetRelativeTime();
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Check if a resume checkpoint needs to be written after some data have been flashed, according
+ * to the checkpoint policy
  *
  * @return
- *      - data length to be read
- *      - -1 on error
+ *      - true              if the resume context needs to be written
+ *      - false             otherwise
  */
 //--------------------------------------------------------------------------------------------------
-static ssize_t LengthToRead
+static bool IsCheckpointNeeded
 (
-    ResumeCtxSave_t *saveCtxPtr     ///< [IN] resume context
+    size_t flushedLen       ///< [IN] length flashed since the previous call
 )
 {
-    ssize_t readCount = 0;
+    Checkpoint.pendingLen += flushedLen;
+
+    switch (Checkpoint.policy)
+    {
+        case PA_FWUPDATE_CHECKPOINT_BYTES:
+            return (Checkpoint.pendingLen >= Checkpoint.value);
+
+        case PA_FWUPDATE_CHECKPOINT_TIME:
+            return (GetElapsedUs(Checkpoint.lastTime) >= ((uint64_t)Checkpoint.value * 1000));
+
+        case PA_FWUPDATE_CHECKPOINT_ADAPTIVE:
+            // the checkpoint cost is spread over the time elapsed since the previous one
+            return ((GetElapsedUs(Checkpoint.lastTime) * Checkpoint.value) >=
+                    (Checkpoint.writeCostUs * 100));
+
+        default:
+            return true;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Write a resume checkpoint and update the checkpoint statistics
+ *
+ * @return
+ *      - LE_OK             on success
+ *      - LE_FAULT          on failure
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t WriteCheckpoint
+(
+    ResumeCtx_t* resumeCtxPtr   ///< [INOUT] the resume context
+)
+{
+    le_clk_Time_t startTime = le_clk_GetRelativeTime();
+    le_result_t result;
+    uint64_t costUs;
+
+    result = AppendResumeCtx(resumeCtxPtr);
+
+    // smooth the write cost as a single EFS write may be delayed by a garbage collection
+    costUs = GetElapsedUs(startTime);
+    Checkpoint.writeCostUs = Checkpoint.writeCostUs ?
+                             ((3 * Checkpoint.writeCostUs) + costUs) / 4 : costUs;
+    ResetCheckpoint();
+
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This function is to initialize internal variables to initiate a new package download
+ */
+//--------------------------------------------------------------------------------------------------
+static void InitParameters
+(
+    bool isResume,                  ///< [IN] true if we're a resuming
+    ResumeCtxSave_t *saveCtxPtr     ///< [INOUT] resume context
+)
+{
+    LE_DEBUG ("InitParameters, isResume=%d", isResume);
+    ResetCheckpoint();
+    if (isResume)
+    {
+        DeltaUpdateCtx.patchRemLen = saveCtxPtr->patchHdr.size;
+        CurrentImageOffset = saveCtxPtr->currentOffset;
+        CurrentImageCrc32 = saveCtxPtr->currentImageCrc;
+        CurrentGlobalCrc32 = saveCtxPtr->currentGlobalCrc;
+        CurrentCweHeader.imageType = saveCtxPtr->imageType;
+        CurrentCweHeader.imageSize = saveCtxPtr->imageSize;
+        CurrentCweHeader.crc32 = saveCtxPtr->imageCrc;
+        CurrentCweHeader.miscOpts = saveCtxPtr->miscOpts;
+        IsFirstDataWritten = true;
+        RestoreSha256(&(saveCtxPtr->sha256Ctx), sizeof(saveCtxPtr->sha256Ctx),
+                      &ResumeCtx.sha256CtxPtr);
+    }
+    else
+    {
+        CurrentImageOffset = 0;
+        CurrentImageCrc32 = LE_CRC_START_CRC32;
+        CurrentGlobalCrc32 = LE_CRC_START_CRC32;
+        memset(&CurrentCweHeader, 0, sizeof(CurrentCweHeader));
+        saveCtxPtr->isImageToBeRead = false;
+        IsFirstDataWritten = false;
+        saveCtxPtr->fullImageLength = -1;
+        // erase the diffType to allow to detect a new Patch Meta header
+        memset(saveCtxPtr->patchMetaHdr.diffType, 0, sizeof(saveCtxPtr->patchMetaHdr.diffType));
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * This function indicates the data length to be read according to data type to be read
+ *
+ * @return
+ *      - data length to be read
+ *      - -1 on error
+ */
+//--------------------------------------------------------------------------------------------------
+static ssize_t LengthToRead
+(
+    ResumeCtxSave_t *saveCtxPtr     ///< [IN] resume context
+)
+{
+    ssize_t readCount = 0;
 
     if (CurrentCweHeader.miscOpts & CWE_MISC_OPTS_DELTAPATCH)
     {
@@ -1241,32 +1758,30 @@ static size_t WriteImageData
                                 false,
                                 &isFlashed))
         {
-            CurrentGlobalCrc32 = le_crc_Crc32((uint8_t*)chunkPtr, length, CurrentGlobalCrc32);
-            CurrentImageCrc32 = le_crc_Crc32((uint8_t*)chunkPtr, length, CurrentImageCrc32);
+            // SHA256 digest is updated with all image data except CUSG and FILE
+            bool isSha256Needed = (cweHeaderPtr->imageType != CWE_IMAGE_TYPE_CUSG)
+                               && (cweHeaderPtr->imageType != CWE_IMAGE_TYPE_FILE);
+
+            // CRC32 and SHA256 are updated in a single pass on the data
+            if (LE_OK != ProcessImageDigests(isSha256Needed ? resumeCtxPtr->sha256CtxPtr : NULL,
+                                             chunkPtr, length))
+            {
+                LE_ERROR("Unable to update SHA256 digest");
+                return 0;
+            }
             LE_DEBUG ( "image data write: CRC in header: 0x%x, calculated CRC 0x%x",
                        cweHeaderPtr->crc32, CurrentImageCrc32 );
             CurrentImageOffset += length;
             LenToFlash += length;
             result = length;
 
-            if ((cweHeaderPtr->imageType != CWE_IMAGE_TYPE_CUSG)
-             && (cweHeaderPtr->imageType != CWE_IMAGE_TYPE_FILE))
-            {
-                // SHA256 digest is updated with all image data
-                if (LE_OK != ProcessSha256(resumeCtxPtr->sha256CtxPtr,(uint8_t*)chunkPtr, length))
-                {
-                    LE_ERROR("Unable to update SHA256 digest");
-                    return 0;
-                }
-            }
-
             LE_DEBUG ("CurrentImageOffset %zu", CurrentImageOffset);
             if (isFlashed)
             {// some data have been flashed => update the resume context
-                le_result_t ret;
-
-                LE_DEBUG("Store resume context ...");
+                bool isCheckpointNeeded = IsCheckpointNeeded(LenToFlash);
 
+                // deltaUpdate_ApplyPatch() has flushed the patch segments of the slice: none of
+                // them is still queued for writing when the context is updated
                 if (cweHeaderPtr->miscOpts & CWE_MISC_OPTS_DELTAPATCH)
                 {
                     // a patch has been completely received => wait a new header
@@ -1282,10 +1797,16 @@ static size_t WriteImageData
                 memcpy(&(saveCtxPtr->sha256Ctx), resumeCtxPtr->sha256CtxPtr,
                     sizeof(saveCtxPtr->sha256Ctx));
 
-                ret = UpdateResumeCtx(resumeCtxPtr);
-                if (ret != LE_OK)
+                // the context is kept up to date even if it is not written: the next checkpoint,
+                // or the one written at the next CWE header, saves it at an erase block limit
+                if (isCheckpointNeeded)
                 {
-                    LE_WARN("Failed to update Resume context");
+                    LE_DEBUG("Store resume context ...");
+
+                    if (WriteCheckpoint(resumeCtxPtr) != LE_OK)
+                    {
+                        LE_WARN("Failed to update Resume context");
+                    }
                 }
             }
         }
@@ -1390,7 +1911,7 @@ static le_result_t ParseCweHeader
     else
     {
         // update the current global CRC with the current header
-        CurrentGlobalCrc32 = le_crc_Crc32((uint8_t*)chunkPtr, CWE_HEADER_SIZE, CurrentGlobalCrc32);
+        CurrentGlobalCrc32 = crc32_Compute((uint8_t*)chunkPtr, CWE_HEADER_SIZE, CurrentGlobalCrc32);
         saveCtxPtr->currentGlobalCrc = CurrentGlobalCrc32;
     }
 
@@ -1468,9 +1989,9 @@ static le_result_t ParsePatchHeaders
     ResumeCtxSave_t *saveCtxPtr = &(resumeCtxPtr->saveCtx);
     CurrentImageOffset += length;
     saveCtxPtr->currentOffset = CurrentImageOffset;
-    CurrentImageCrc32 = le_crc_Crc32((uint8_t*)chunkPtr, length, CurrentImageCrc32);
+    CurrentImageCrc32 = crc32_Compute((uint8_t*)chunkPtr, length, CurrentImageCrc32);
     saveCtxPtr->currentImageCrc = CurrentImageCrc32;
-    CurrentGlobalCrc32 = le_crc_Crc32((uint8_t*)chunkPtr, length, CurrentGlobalCrc32);
+    CurrentGlobalCrc32 = crc32_Compute((uint8_t*)chunkPtr, length, CurrentGlobalCrc32);
     saveCtxPtr->currentGlobalCrc = CurrentGlobalCrc32;
     LE_DEBUG ( "patch header: CRC in header: 0x%x, calculated CRC 0x%x",
                CurrentCweHeader.crc32, CurrentImageCrc32 );
@@ -1713,7 +2234,7 @@ static void CheckSyncAtStartup
  * @return
  *      - LE_OK             On success
  *      - LE_TIMEOUT        After DEFAULT_TIMEOUT without data received
- *      - LE_CLOSED         The file descriptor has been closed
+ *      - LE_CLOSED         The file descriptor has been closed or the wait has been aborted
  *      - LE_FAULT          On failure
  */
 //--------------------------------------------------------------------------------------------------
@@ -1721,6 +2242,7 @@ static le_result_t EpollinRead
 (
     int fd,             ///< [IN] file descriptor
     int efd,            ///< [IN] event file descriptor
+    int abortFd,        ///< [IN] event file descriptor used to abort the wait, -1 if not used
     void* bufferPtr,    ///< [OUT] pointer where to store data
     ssize_t *lengthPtr  ///< [INOUT] input: max length to read,
                         ///<         output: read length (if LE_OK)
@@ -1756,6 +2278,11 @@ static le_result_t EpollinRead
                 {
                     LE_DEBUG("events[%d] .data.fd=%d .events=0x%x",
                              n, events[n].data.fd, events[n].events);
+                    if ((-1 != abortFd) && (events[n].data.fd == abortFd))
+                    {
+                        LE_DEBUG("Read on fd %d aborted", fd);
+                        return LE_CLOSED;
+                    }
                     if (events[n].data.fd == fd)
                     {
                         uint32_t evts = events[n].events;
@@ -1801,7 +2328,7 @@ static le_result_t EpollinRead
  * @return
  *      - LE_OK             On success
  *      - LE_TIMEOUT        After DEFAULT_TIMEOUT without data received
- *      - LE_CLOSED         The file descriptor has been closed
+ *      - LE_CLOSED         The file descriptor has been closed or the read has been aborted
  *      - LE_FAULT          On failure
  */
 //--------------------------------------------------------------------------------------------------
@@ -1809,6 +2336,7 @@ static le_result_t ReadSync
 (
     int fd,             ///< [IN] file descriptor
     int efd,            ///< [IN] event file descriptor
+    int abortFd,        ///< [IN] event file descriptor used to abort the wait, -1 if not used
     void* bufferPtr,    ///< [OUT] pointer where to store data
     ssize_t *lengthPtr  ///< [INOUT] input: max length to read,
                         ///<         output: read length (if LE_OK),
@@ -1818,7 +2346,7 @@ static le_result_t ReadSync
     ssize_t size = read(fd, bufferPtr, *lengthPtr);
     if (((-1 == size) && (EAGAIN == errno)) || (0 == size))
     {
-        return EpollinRead(fd, efd, bufferPtr, lengthPtr);
+        return EpollinRead(fd, efd, abortFd, bufferPtr, lengthPtr);
     }
     *lengthPtr = size;
 
@@ -1972,148 +2500,964 @@ static le_result_t CheckFdType
 
 //--------------------------------------------------------------------------------------------------
 /**
- * Check DM verity integrity of a MTD partition.
+ * Check if the download reader thread is requested to stop
  *
  * @return
- *      - LE_OK             The DM-verity integrity succeeded
- *      - LE_FORMAT_ERROR   The partition is not an UBI container. Cannot check DM-verity integrity
- *      - LE_NOT_PERMITTED  The DM-verity integrity check failed or cannot authentify the root hash
- *      - others            Depending on the MTD/UBI PA access
+ *      - true if the reader is aborted
  */
 //--------------------------------------------------------------------------------------------------
-static le_result_t CheckDmVerityIntegrity
+static bool IsChunkReaderAborted
 (
-    int mtdSrc   ///< [IN] MTD number to be checked
+    ChunkRing_t* ringPtr    ///< [IN] Chunk ring
 )
 {
-    le_result_t res;
-    int ubiId, nbUbiVol;
+    bool isAborted;
 
-    res = partition_CheckIfUbiAndGetUbiVolumes( mtdSrc, &ubiId, &nbUbiVol );
-    // Do not test for other error code. Just report them to the caller
-    if (LE_OK != res)
+    le_mutex_Lock(ringPtr->mutex);
+    isAborted = ringPtr->isAborted;
+    le_mutex_Unlock(ringPtr->mutex);
+    return isAborted;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Wait until the download reader thread is allowed to read more of the package
+ *
+ * @return
+ *      - The length which may be read into a chunk, 0 if the reader is aborted
+ */
+//--------------------------------------------------------------------------------------------------
+static size_t WaitChunkReaderLength
+(
+    ChunkRing_t* ringPtr    ///< [IN] Chunk ring
+)
+{
+    size_t length;
+
+    for (;;)
     {
-        return res;
+        le_mutex_Lock(ringPtr->mutex);
+        length = ringPtr->endPkgOffset - ringPtr->rdPkgOffset;
+        if (ringPtr->isAborted)
+        {
+            length = 0;
+            le_mutex_Unlock(ringPtr->mutex);
+            break;
+        }
+        le_mutex_Unlock(ringPtr->mutex);
+        if (length)
+        {
+            break;
+        }
+        // The end of the package is reached or not yet known: wait for the parser
+        le_sem_Wait(ringPtr->endSem);
     }
 
-    if (MAX_UBI_VOL_FOR_DM_VERITY <= nbUbiVol)
+    return (length > CHUNK_LENGTH) ? CHUNK_LENGTH : length;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Download reader thread: read the package into the free chunks of the ring until an error, the
+ * closure of the file descriptor or an abort request. The reader never reads beyond the end of
+ * the package given by SetChunkReaderEnd().
+ */
+//--------------------------------------------------------------------------------------------------
+static void* ChunkReaderThread
+(
+    void* contextPtr    ///< [IN] Chunk ring
+)
+{
+    ChunkRing_t* ringPtr = (ChunkRing_t*)contextPtr;
+    le_result_t result;
+
+    do
     {
-        // Assume that if there are at least 3 volumes, the image belongs in volume 0
-        // with a volume name "....", the hash into volume 1 with a name "...._hs" and
-        // the root hash in volume 2 with a name "...._rhs"
-        char ubiTmpStr[PATH_MAX];
-        char ubiVol0Str[PATH_MAX];
-        FILE* ubiNameFdPtr;
-        int ubiDmVerity = 0, ubiVol0NameLen = 0, ubiTmpNameLen, ubiIndex;
-        int rc;
-        char* ubiVolSuffix[MAX_UBI_VOL_FOR_DM_VERITY] = { NULL, "_hs", "_rhs" };
-        char* rcPtr;
+        ChunkSlot_t* slotPtr;
+        size_t length;
 
-        snprintf(ubiTmpStr, sizeof(ubiTmpStr), SYS_UBI_VOLUME_NAME_PATH, ubiId, 0);
-        ubiNameFdPtr = fopen(ubiTmpStr, "r");
-        *ubiVol0Str = '\0';
-        if (ubiNameFdPtr)
+        le_sem_Wait(ringPtr->freeSem);
+        length = WaitChunkReaderLength(ringPtr);
+        if (0 == length)
         {
-            rcPtr = fgets(ubiVol0Str, sizeof(ubiVol0Str), ubiNameFdPtr);
-            fclose(ubiNameFdPtr);
-            if (rcPtr)
-            {
-                ubiDmVerity++;
-                ubiVol0NameLen = strlen(ubiVol0Str);
-                if ((ubiVol0NameLen > 1) && ('\n' == ubiVol0Str[ubiVol0NameLen - 1]))
-                {
-                    ubiVol0Str[ubiVol0NameLen - 1] = '\0';
-                    ubiVol0NameLen--;
-                }
-            }
+            break;
         }
-        else
+
+        slotPtr = &ringPtr->slot[ringPtr->wrIdx];
+        do
         {
-            // Do not raise error if the UBI volume name entry could not be opened as
-            // the volume index may be any integer between 0 and 127
+            slotPtr->length = length;
+            result = ReadSync(ringPtr->fd, ringPtr->efd, ringPtr->abortFd,
+                              slotPtr->bufferPtr, &slotPtr->length);
         }
+        while ((LE_OK == result) && (-1 == slotPtr->length) &&
+               ((EINTR == errno) || (EAGAIN == errno)) && (!IsChunkReaderAborted(ringPtr)));
 
-        for (ubiIndex = 1;
-             (ubiDmVerity) && (ubiIndex < MAX_UBI_VOL_FOR_DM_VERITY);
-             ubiIndex++)
+        if ((LE_OK == result) && (slotPtr->length < 0))
         {
-            snprintf(ubiTmpStr, sizeof(ubiTmpStr), SYS_UBI_VOLUME_NAME_PATH,
-                     ubiId, ubiIndex);
-            ubiNameFdPtr = fopen(ubiTmpStr, "r");
-            *ubiTmpStr = '\0';
-            if (ubiNameFdPtr)
-            {
-                rcPtr = fgets(ubiTmpStr, sizeof(ubiTmpStr), ubiNameFdPtr);
-                fclose(ubiNameFdPtr);
-                if (rcPtr)
-                {
-                    ubiTmpNameLen = strlen(ubiTmpStr);
-                    if ((ubiTmpNameLen > 1) && ('\n' == ubiTmpStr[ubiTmpNameLen - 1]))
-                    {
-                        ubiTmpStr[ubiTmpNameLen - 1] = '\0';
-                        ubiTmpNameLen--;
-                    }
-                    if ((ubiVol0NameLen < ubiTmpNameLen) &&
-                        (0 == strncmp(ubiVol0Str, ubiTmpStr, ubiVol0NameLen)) &&
-                        (0 == strcmp(ubiTmpStr + ubiVol0NameLen, ubiVolSuffix[ubiIndex])))
-                    {
-                        // Naming matches!
-                        ubiDmVerity++;
-                    }
-                }
-            }
-            else
-            {
-                // Do not raise error if the UBI volume name entry could not be opened as
-                // the volume index may be any integer between 0 and 127
-            }
+            LE_ERROR("error during read: %m");
+            result = LE_FAULT;
+        }
+        else if ((LE_OK == result) && (0 == slotPtr->length))
+        {
+            LE_INFO("End of file before the end of the package");
+            result = LE_CLOSED;
+        }
+        else if (LE_OK == result)
+        {
+            le_mutex_Lock(ringPtr->mutex);
+            ringPtr->rdPkgOffset += slotPtr->length;
+            le_mutex_Unlock(ringPtr->mutex);
+        }
+        LE_DEBUG("Read %zd, result %s", slotPtr->length, LE_RESULT_TXT(result));
+
+        slotPtr->result = result;
+        ringPtr->wrIdx = (ringPtr->wrIdx + 1) % CHUNK_RING_COUNT;
+        le_sem_Post(ringPtr->fullSem);
+    }
+    while (LE_OK == result);
+
+    return NULL;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Stop the download reader thread and release the chunk ring resources
+ */
+//--------------------------------------------------------------------------------------------------
+static void StopChunkReader
+(
+    ChunkRing_t* ringPtr    ///< [IN] Chunk ring
+)
+{
+    int i;
+
+    if (ringPtr->readerRef)
+    {
+        // Wake up the reader whether it waits for a free chunk, for the package end or for
+        // incoming data
+        le_mutex_Lock(ringPtr->mutex);
+        ringPtr->isAborted = true;
+        le_mutex_Unlock(ringPtr->mutex);
+        if (-1 == eventfd_write(ringPtr->abortFd, 1))
+        {
+            LE_ERROR("Failed to abort the reader: %m");
+        }
+        le_sem_Post(ringPtr->freeSem);
+        le_sem_Post(ringPtr->endSem);
+        le_thread_Join(ringPtr->readerRef, NULL);
+        ringPtr->readerRef = NULL;
+    }
+    if (ringPtr->endSem)
+    {
+        le_sem_Delete(ringPtr->endSem);
+        ringPtr->endSem = NULL;
+    }
+    if (ringPtr->mutex)
+    {
+        le_mutex_Delete(ringPtr->mutex);
+        ringPtr->mutex = NULL;
+    }
+    if (ringPtr->freeSem)
+    {
+        le_sem_Delete(ringPtr->freeSem);
+        ringPtr->freeSem = NULL;
+    }
+    if (ringPtr->fullSem)
+    {
+        le_sem_Delete(ringPtr->fullSem);
+        ringPtr->fullSem = NULL;
+    }
+    if (-1 != ringPtr->abortFd)
+    {
+        close(ringPtr->abortFd);
+        ringPtr->abortFd = -1;
+    }
+    for (i = 0; i < CHUNK_RING_COUNT; i++)
+    {
+        if (ringPtr->slot[i].bufferPtr)
+        {
+            le_mem_Release(ringPtr->slot[i].bufferPtr);
+            ringPtr->slot[i].bufferPtr = NULL;
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Allocate the chunk ring and start the download reader thread
+ *
+ * @return
+ *      - LE_OK             On success
+ *      - LE_FAULT          On failure
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t StartChunkReader
+(
+    ChunkRing_t* ringPtr,   ///< [OUT] Chunk ring
+    int fd,                 ///< [IN] file descriptor
+    int efd,                ///< [IN] event file descriptor, -1 for a regular file
+    size_t startOffset,     ///< [IN] Offset in the package of the first byte to read
+    size_t endOffset        ///< [IN] Offset in the package the reader may reach
+)
+{
+    int i;
+
+    memset(ringPtr, 0, sizeof(ChunkRing_t));
+    ringPtr->fd = fd;
+    ringPtr->efd = efd;
+    ringPtr->rdPkgOffset = startOffset;
+    ringPtr->endPkgOffset = endOffset;
+    ringPtr->mutex = le_mutex_CreateNonRecursive("ChunkRingMutex");
+    ringPtr->endSem = le_sem_Create("ChunkEndSem", 0);
+
+    ringPtr->abortFd = eventfd(0, EFD_NONBLOCK);
+    if (-1 == ringPtr->abortFd)
+    {
+        LE_ERROR("eventfd error %m");
+        return LE_FAULT;
+    }
+    if (-1 != efd)
+    {
+        struct epoll_event event;
+
+        event.data.fd = ringPtr->abortFd;
+        event.events = EPOLLIN;
+        if (-1 == epoll_ctl(efd, EPOLL_CTL_ADD, ringPtr->abortFd, &event))
+        {
+            LE_ERROR("epoll_ctl error %m");
+            StopChunkReader(ringPtr);
+            return LE_FAULT;
+        }
+    }
+
+    for (i = 0; i < CHUNK_RING_COUNT; i++)
+    {
+        ringPtr->slot[i].bufferPtr = le_mem_ForceAlloc(ChunkPool);
+    }
+    ringPtr->freeSem = le_sem_Create("ChunkFreeSem", CHUNK_RING_COUNT);
+    ringPtr->fullSem = le_sem_Create("ChunkFullSem", 0);
+
+    ringPtr->readerRef = le_thread_Create("FwDwlReader", ChunkReaderThread, ringPtr);
+    le_thread_SetJoinable(ringPtr->readerRef);
+    le_thread_Start(ringPtr->readerRef);
+
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Set the offset in the package the download reader thread may reach, once the package length is
+ * known from the first CWE header
+ */
+//--------------------------------------------------------------------------------------------------
+static void SetChunkReaderEnd
+(
+    ChunkRing_t* ringPtr,   ///< [IN] Chunk ring
+    size_t endOffset        ///< [IN] Offset in the package the reader may reach
+)
+{
+    bool isMoved = false;
+
+    le_mutex_Lock(ringPtr->mutex);
+    if (endOffset > ringPtr->endPkgOffset)
+    {
+        ringPtr->endPkgOffset = endOffset;
+        isMoved = true;
+    }
+    le_mutex_Unlock(ringPtr->mutex);
+    if (isMoved)
+    {
+        le_sem_Post(ringPtr->endSem);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Get data from the chunk ring. The call is blocked until the requested length has been read by
+ * the reader thread.
+ *
+ * @return
+ *      - LE_OK             On success
+ *      - LE_TIMEOUT        After DEFAULT_TIMEOUT without data received
+ *      - LE_CLOSED         The file descriptor has been closed
+ *      - LE_FAULT          On failure
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t ReadChunkRing
+(
+    ChunkRing_t* ringPtr,   ///< [IN] Chunk ring
+    uint8_t* bufferPtr,     ///< [OUT] pointer where to store data
+    size_t length           ///< [IN] length to read
+)
+{
+    size_t readCount = 0;
+
+    while (readCount < length)
+    {
+        ChunkSlot_t* slotPtr = &ringPtr->slot[ringPtr->rdIdx];
+        size_t lenRead;
+
+        if (!ringPtr->isRdSlotHeld)
+        {
+            le_sem_Wait(ringPtr->fullSem);
+            ringPtr->isRdSlotHeld = true;
+            ringPtr->rdOffset = 0;
+        }
+        if (LE_OK != slotPtr->result)
+        {
+            // The reader thread has stopped: keep this chunk to report the same result again
+            return slotPtr->result;
+        }
+
+        lenRead = slotPtr->length - ringPtr->rdOffset;
+        if (lenRead > (length - readCount))
+        {
+            lenRead = length - readCount;
+        }
+        memcpy(bufferPtr + readCount, slotPtr->bufferPtr + ringPtr->rdOffset, lenRead);
+        readCount += lenRead;
+        ringPtr->rdOffset += lenRead;
+
+        if (ringPtr->rdOffset == slotPtr->length)
+        {
+            // The chunk is fully consumed, give it back to the reader
+            ringPtr->isRdSlotHeld = false;
+            ringPtr->rdIdx = (ringPtr->rdIdx + 1) % CHUNK_RING_COUNT;
+            le_sem_Post(ringPtr->freeSem);
+        }
+    }
+
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Check if a block of the destination already holds the data to be synchronized. Any read failure
+ * on the destination is reported as a difference, so the block will be erased and programmed.
+ *
+ * @return
+ *      - true          The destination block is identical to the source block
+ *      - false         The destination block differs or cannot be read
+ */
+//--------------------------------------------------------------------------------------------------
+static bool IsSameBlock
+(
+    pa_flash_Desc_t flashFdDst,         ///< [IN] Destination flash descriptor
+    int blk,                            ///< [IN] Block to compare
+    const uint8_t* srcBlockPtr,         ///< [IN] Data of the source block
+    uint8_t* dstBlockPtr,               ///< [IN] Buffer to read the destination block
+    size_t blockSize                    ///< [IN] Size of the data to compare from the block start
+)
+{
+    if (LE_OK != pa_flash_ReadAtBlock( flashFdDst, blk, dstBlockPtr, blockSize ))
+    {
+        LE_WARN("Read of DST block %d fails: it will be programmed", blk);
+        return false;
+    }
+
+    return (0 == memcmp( srcBlockPtr, dstBlockPtr, blockSize ));
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Check DM verity integrity of a MTD partition.
+ *
+ * @return
+ *      - LE_OK             The DM-verity integrity succeeded
+ *      - LE_FORMAT_ERROR   The partition is not an UBI container. Cannot check DM-verity integrity
+ *      - LE_NOT_PERMITTED  The DM-verity integrity check failed or cannot authentify the root hash
+ *      - others            Depending on the MTD/UBI PA access
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t CheckDmVerityIntegrity
+(
+    int mtdSrc   ///< [IN] MTD number to be checked
+)
+{
+    le_result_t res;
+    int ubiId, nbUbiVol;
+
+    res = partition_CheckIfUbiAndGetUbiVolumes( mtdSrc, &ubiId, &nbUbiVol );
+    // Do not test for other error code. Just report them to the caller
+    if (LE_OK != res)
+    {
+        return res;
+    }
+
+    if (MAX_UBI_VOL_FOR_DM_VERITY <= nbUbiVol)
+    {
+        // Assume that if there are at least 3 volumes, the image belongs in volume 0
+        // with a volume name "....", the hash into volume 1 with a name "...._hs" and
+        // the root hash in volume 2 with a name "...._rhs"
+        char ubiTmpStr[PATH_MAX];
+        char ubiVol0Str[PATH_MAX];
+        FILE* ubiNameFdPtr;
+        int ubiDmVerity = 0, ubiVol0NameLen = 0, ubiTmpNameLen, ubiIndex;
+        int rc;
+        char* ubiVolSuffix[MAX_UBI_VOL_FOR_DM_VERITY] = { NULL, "_hs", "_rhs" };
+        char* rcPtr;
+
+        snprintf(ubiTmpStr, sizeof(ubiTmpStr), SYS_UBI_VOLUME_NAME_PATH, ubiId, 0);
+        ubiNameFdPtr = fopen(ubiTmpStr, "r");
+        *ubiVol0Str = '\0';
+        if (ubiNameFdPtr)
+        {
+            rcPtr = fgets(ubiVol0Str, sizeof(ubiVol0Str), ubiNameFdPtr);
+            fclose(ubiNameFdPtr);
+            if (rcPtr)
+            {
+                ubiDmVerity++;
+                ubiVol0NameLen = strlen(ubiVol0Str);
+                if ((ubiVol0NameLen > 1) && ('\n' == ubiVol0Str[ubiVol0NameLen - 1]))
+                {
+                    ubiVol0Str[ubiVol0NameLen - 1] = '\0';
+                    ubiVol0NameLen--;
+                }
+            }
+        }
+        else
+        {
+            // Do not raise error if the UBI volume name entry could not be opened as
+            // the volume index may be any integer between 0 and 127
+        }
+
+        for (ubiIndex = 1;
+             (ubiDmVerity) && (ubiIndex < MAX_UBI_VOL_FOR_DM_VERITY);
+             ubiIndex++)
+        {
+            snprintf(ubiTmpStr, sizeof(ubiTmpStr), SYS_UBI_VOLUME_NAME_PATH,
+                     ubiId, ubiIndex);
+            ubiNameFdPtr = fopen(ubiTmpStr, "r");
+            *ubiTmpStr = '\0';
+            if (ubiNameFdPtr)
+            {
+                rcPtr = fgets(ubiTmpStr, sizeof(ubiTmpStr), ubiNameFdPtr);
+                fclose(ubiNameFdPtr);
+                if (rcPtr)
+                {
+                    ubiTmpNameLen = strlen(ubiTmpStr);
+                    if ((ubiTmpNameLen > 1) && ('\n' == ubiTmpStr[ubiTmpNameLen - 1]))
+                    {
+                        ubiTmpStr[ubiTmpNameLen - 1] = '\0';
+                        ubiTmpNameLen--;
+                    }
+                    if ((ubiVol0NameLen < ubiTmpNameLen) &&
+                        (0 == strncmp(ubiVol0Str, ubiTmpStr, ubiVol0NameLen)) &&
+                        (0 == strcmp(ubiTmpStr + ubiVol0NameLen, ubiVolSuffix[ubiIndex])))
+                    {
+                        // Naming matches!
+                        ubiDmVerity++;
+                    }
+                }
+            }
+            else
+            {
+                // Do not raise error if the UBI volume name entry could not be opened as
+                // the volume index may be any integer between 0 and 127
+            }
+        }
+
+        // If all expected volume names match expected naming for DM-verity, perform the
+        // integrity check on the UBI images/hash/root hash
+        if (MAX_UBI_VOL_FOR_DM_VERITY == ubiDmVerity)
+        {
+            // Need another 4th volume on UBI for this authentication
+            if ((IsSecureBootVersion) && (MAX_UBI_VOL_FOR_DM_VERITY < nbUbiVol))
+            {
+                // Secure boot: Need to authentify the root hash of the UBI partition
+                snprintf(ubiTmpStr, sizeof(ubiTmpStr), SWI_AUTH_PATH " nfuse ubi%d",
+                         ubiId);
+                rc = system(ubiTmpStr);
+                if (WIFEXITED(rc) && (SWI_AUTH_SIGNATURE_SUCCEED == WEXITSTATUS(rc)))
+                {
+                    LE_INFO("Root hash authenfication succeed");
+                }
+                else
+                {
+                    LE_ERROR("Unable to authentify the root hash for mtd%d ubi%d: 0x%08x"
+                             " Synchronize aborted.",
+                             mtdSrc, ubiId, rc);
+                    return LE_NOT_PERMITTED;
+                }
+            }
+
+            LE_INFO("Checking DM-verity integrity on ubi%d", ubiId);
+            snprintf(ubiTmpStr, sizeof(ubiTmpStr),
+                     "/usr/sbin/veritysetup verify /dev/ubiblock%d_0 /dev/ubiblock%d_1 "
+                     "$(cat /dev/ubi%d_2)",
+                     ubiId, ubiId, ubiId);
+            rc = system(ubiTmpStr);
+            if ((0 != WEXITSTATUS(rc)) || (0 != WIFSIGNALED(rc)))
+            {
+                LE_ERROR("DM Verity check failed for mtd%d ubi%d: 0x%08x."
+                         " Synchronize aborted.",
+                         mtdSrc, ubiId, rc);
+                return LE_NOT_PERMITTED;
+            }
+        }
+    }
+    return LE_OK;
+}
+
+//==================================================================================================
+//  PUBLIC API FUNCTIONS
+//==================================================================================================
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Synchronize one partition from the active system to the dual system. This is called by the
+ * synchronization workers, so it only touches the MTDs of the given job.
+ *
+ * @return
+ *      - LE_OK             on success
+ *      - LE_FAULT          on failure
+ *      - LE_IO_ERROR       on unrecoverable ECC errors detected on active partition
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t SyncPartition
+(
+    SyncJob_t* jobPtr               ///< [IN] Partition to synchronize
+)
+{
+    int mtdSrc = jobPtr->mtdSrc, mtdDst = jobPtr->mtdDst;
+    char* mtdSrcNamePtr = jobPtr->mtdSrcNamePtr;
+    char* mtdDstNamePtr = jobPtr->mtdDstNamePtr;
+    bool isLogicalSrc = jobPtr->isLogicalSrc, isDualSrc = jobPtr->isDualSrc;
+    bool isLogicalDst = jobPtr->isLogicalDst, isDualDst = jobPtr->isDualDst;
+    pa_flash_Desc_t flashFdSrc = NULL, flashFdDst = NULL;
+    pa_flash_Info_t *flashInfoSrcPtr, *flashInfoDstPtr;
+    pa_flash_EccStats_t flashEccStats;
+    uint8_t* flashBlockPtr = NULL;
+    uint8_t* flashDstBlockPtr = NULL;
+    uint32_t crc32Src, dataLen, readLen;
+    bool isUbiPartition, isRetryNeeded;
+    le_result_t res, result = LE_FAULT;
+
+    res = CheckDmVerityIntegrity(mtdSrc);
+    // In case of LE_FORMAT_ERROR, this is not an UBI container. Skip it
+    if ((LE_OK != res) && (LE_FORMAT_ERROR != res))
+    {
+        LE_ERROR("Error when checking for UBI on mtd%d. Synchronize aborted.", mtdSrc);
+        goto error;
+    }
+
+    LE_INFO( "Synchronizing %s partition \"%s%s\" (mtd%d) from \"%s%s\" (mtd%d)",
+             mtdDst == mtdSrc ? "logical" : "physical",
+             mtdDstNamePtr,
+             mtdDst == mtdSrc && jobPtr->dstSystem ? "2" : "",
+             mtdDst,
+             mtdSrcNamePtr,
+             mtdDst == mtdSrc && jobPtr->srcSystem ? "2" : "",
+             mtdSrc );
+
+    flashBlockPtr = (uint8_t *) le_mem_ForceAlloc(FlashImgPool);
+#if PA_FWUPDATE_DIFF_SYNC
+    flashDstBlockPtr = (uint8_t *) le_mem_ForceAlloc(FlashImgPool);
+#endif
+
+    if ( LE_OK != pa_flash_Open( mtdSrc,
+                                 PA_FLASH_OPENMODE_READONLY |
+                                 (isLogicalSrc
+                                  ? (isDualSrc ? PA_FLASH_OPENMODE_LOGICAL_DUAL
+                                     : PA_FLASH_OPENMODE_LOGICAL)
+                                  : 0),
+                                 &flashFdSrc,
+                                 &flashInfoSrcPtr ))
+    {
+        LE_ERROR("Open of SRC MTD %d fails", mtdSrc);
+        goto error;
+    }
+
+    // Try to check the integrity of UBI. If the isUbiPartition is false, the partition is
+    // not an UBI container
+    res = pa_flash_CheckUbi( flashFdSrc, &isUbiPartition );
+    if (LE_OK != res)
+    {
+        LE_ERROR("CheckUbi of SRC MTD %d fails: res=%d", mtdSrc, res);
+        goto error;
+    }
+
+    // Check for unrecoverable ECC errors on active partition and abort if some.
+    res = pa_flash_GetEccStats( flashFdSrc, &flashEccStats );
+    if( LE_OK != res )
+    {
+        LE_ERROR("Getting ECC stats on SRC MTD %d fails: res=%d", mtdSrc, res);
+        goto error;
+    }
+    // Corrected ECC errors are ignored, because normally the data are valid.
+    // Abort in case of unrecoverable ECC errors.
+    if( flashEccStats.failed )
+    {
+        LE_ERROR("Unrecoverable ECC errors on SRC MTD %d: Corrected %u Unrecoverable %u ",
+                 mtdSrc, flashEccStats.corrected, flashEccStats.failed);
+        result = LE_IO_ERROR;
+        goto error;
+    }
+
+    if ( LE_OK != pa_flash_Open( mtdDst,
+                                 (flashDstBlockPtr ? PA_FLASH_OPENMODE_READWRITE
+                                  : PA_FLASH_OPENMODE_WRITEONLY) |
+                                 PA_FLASH_OPENMODE_MARKBAD |
+                                 (isLogicalDst
+                                  ? (isDualDst ? PA_FLASH_OPENMODE_LOGICAL_DUAL
+                                     : PA_FLASH_OPENMODE_LOGICAL)
+                                  : 0),
+                                 &flashFdDst,
+                                 &flashInfoDstPtr ))
+    {
+        LE_ERROR("Open of DST MTD %d fails", mtdDst);
+        goto error;
+    }
+    if (flashInfoSrcPtr->writeSize != flashInfoDstPtr->writeSize)
+    {
+        LE_ERROR( "Can not copy flash with different page size: source = %d, destination = %d",
+                  flashInfoSrcPtr->writeSize, flashInfoDstPtr->writeSize );
+        goto error;
+    }
+
+    int nbBlk, nbSrcBlkCnt; // Counter to maximum block to be checked
+    int nbSkippedBlk;       // Counter of blocks already identical on destination
+    size_t srcSize;
+    bool onlyChkValidUbiData;
+
+    // In case of UBI partition, a second try will be performed if the checksum of active
+    // changed during the copy.
+    isRetryNeeded = false;
+    onlyChkValidUbiData = isUbiPartition? true:false;
+
+    do
+    {
+        crc32Src = LE_CRC_START_CRC32;
+
+        if (LE_OK != pa_flash_Scan( flashFdSrc, NULL ))
+        {
+            LE_ERROR("Scan of SRC MTD %d fails", mtdSrc);
+            goto error;
+        }
+        if (LE_OK != pa_flash_Scan( flashFdDst, NULL ))
+        {
+            LE_ERROR("Scan of DST MTD %d fails", mtdDst);
+            goto error;
+        }
+
+        if (LE_OK != pa_flash_SeekAtBlock( flashFdSrc, 0 ))
+        {
+            LE_ERROR("Scan of SRC MTD %d fails", mtdSrc);
+            goto error;
+        }
+        if (LE_OK != pa_flash_SeekAtBlock( flashFdDst, 0 ))
+        {
+            LE_ERROR("Scan of DST MTD %d fails", mtdDst);
+            goto error;
+        }
+        nbSkippedBlk = 0;
+        for (nbSrcBlkCnt = nbBlk = 0;
+             (nbBlk < flashInfoSrcPtr->nbLeb) && (nbBlk < flashInfoDstPtr->nbLeb);
+             nbBlk++)
+        {
+            if (isUbiPartition)
+            {
+                // The data of the UBI blocks without VID header are not read: they are not copied
+                res = partition_ReadUbiBlock( flashFdSrc, flashInfoSrcPtr, nbBlk,
+                                              flashBlockPtr, &readLen );
+            }
+            else
+            {
+                readLen = flashInfoSrcPtr->eraseSize;
+                res = pa_flash_ReadAtBlock( flashFdSrc, nbBlk, flashBlockPtr, readLen );
+            }
+            if (LE_OK != res)
+            {
+                LE_ERROR("pa_flash_Read fails for block %d: %m", nbBlk);
+                goto error;
+            }
+
+            dataLen = flashInfoSrcPtr->eraseSize;
+            if (isUbiPartition)
+            {
+                if ( LE_OK != partition_GetUbiBlockValidDataLen(&dataLen,
+                                                                flashInfoSrcPtr->writeSize,
+                                                                flashBlockPtr))
+                {
+                    LE_ERROR("failed to get UBI block valid data length");
+                    goto error;
+                }
+            }
+
+            // The whole block is compared: an empty UBI block of the source must not keep data
+            // beyond its EC header on the destination
+            if ((flashDstBlockPtr) &&
+                (IsSameBlock( flashFdDst, nbBlk, flashBlockPtr, flashDstBlockPtr,
+                              flashInfoSrcPtr->eraseSize )))
+            {
+                // The destination already holds this block: no need to erase and program it
+                crc32Src = crc32_Compute(flashBlockPtr, dataLen, crc32Src);
+                nbSrcBlkCnt ++;
+                nbSkippedBlk ++;
+                continue;
+            }
+
+            // An empty UBI block which differs from the destination is still erased and
+            // programmed with its EC header page, like a block holding volume data
+            if (LE_OK != pa_flash_EraseBlock( flashFdDst, nbBlk ))
+            {
+                LE_ERROR("EraseMtd fails for block %d: %m", nbBlk);
+                goto error;
+            }
+
+            if (LE_OK != pa_flash_WriteAtBlock( flashFdDst,
+                                                nbBlk,
+                                                flashBlockPtr,
+                                                dataLen ))
+            {
+                LE_ERROR("pa_flash_Write fails for block %d: %m", nbBlk);
+                goto error;
+            }
+            else
+            {
+               /* Here calculate the CRC with erase block by erase block, and later
+                * also check CRC again with real data length by real data length.
+                * Skip all data set to 0xFF at the end of erase block.
+                */
+                crc32Src = crc32_Compute(flashBlockPtr, dataLen, crc32Src);
+                nbSrcBlkCnt ++;
+            }
+        }
+        LE_INFO("MTD %d: %d blocks synchronized, %d already identical",
+                mtdDst, nbSrcBlkCnt - nbSkippedBlk, nbSkippedBlk);
+        if (nbBlk < flashInfoSrcPtr->nbLeb)
+        {
+            LE_WARN("Bad block on destination MTD ? Missing %d blocks",
+                    flashInfoSrcPtr->nbLeb - nbBlk);
+        }
+        for (; nbBlk < flashInfoDstPtr->nbLeb; nbBlk++)
+        {
+            // Erase remaing blocks of the destination
+            pa_flash_EraseBlock( flashFdDst, nbBlk );
+        }
+
+        srcSize = nbSrcBlkCnt * flashInfoSrcPtr->eraseSize;
+        // Check the integrity if the partition is expected to be an UBI container
+        if (isUbiPartition)
+        {
+            // In this case, we need to recompute the checksum of the MTD to ensure that it is
+            // conform to what we read first.
+            res = partition_CheckData(mtdSrc, isLogicalSrc, isDualSrc, srcSize, 0,
+                                             crc32Src, FlashImgPool, true, onlyChkValidUbiData);
+            if (LE_OK != res)
+            {
+                // If first try fails, redo another attempt
+                LE_ERROR("Checksum failed after rereading source MTD %d", mtdSrc);
+                isRetryNeeded = !isRetryNeeded;
+            }
+            else
+            {
+                // The copy is good, no do any retry
+                isRetryNeeded = false;
+            }
+            if ((LE_OK != res) && (!isRetryNeeded))
+            {
+                // The second try fails: Abort the sync
+                goto error;
+            }
+            res = LE_OK;
+        }
+
+        if (LE_OK != res)
+        {
+            // The UBI integrity is corrupt.
+            LE_ERROR("IsUbi of SRC MTD %d fails: res=%d", mtdSrc, res);
+            goto error;
+        }
+
+        // Check for unrecoverable ECC errors on active partition and abort if some.
+        res = pa_flash_GetEccStats( flashFdSrc, &flashEccStats );
+        if( LE_OK != res )
+        {
+            LE_ERROR("Getting ECC stats on SRC MTD %d fails: res=%d", mtdSrc, res);
+            goto error;
+        }
+        // Corrected ECC errors are ignored, because normally the data are valid.
+        // Abort in case of unrecoverable ECC errors.
+        if( flashEccStats.failed )
+        {
+            LE_ERROR("Unrecoverable ECC errors on SRC MTD %d: Corrected %u Unrecoverable %u ",
+                     mtdSrc, flashEccStats.corrected, flashEccStats.failed);
+            result = LE_IO_ERROR;
+            goto error;
+        }
+    }
+    while (isRetryNeeded);
+
+    pa_flash_Close(flashFdSrc);
+    flashFdSrc = NULL;
+    pa_flash_Close(flashFdDst);
+    flashFdDst = NULL;
+
+    // Verify the checksum of the destination MTD to ensure it matches the source checksum
+    if (LE_OK != partition_CheckData(mtdDst, isLogicalDst, isDualDst, srcSize, 0, crc32Src,
+                                     FlashImgPool, false, onlyChkValidUbiData))
+    {
+        goto error;
+    }
+
+    result = LE_OK;
+
+error:
+    if (flashBlockPtr)
+    {
+        le_mem_Release(flashBlockPtr);
+    }
+    if (flashDstBlockPtr)
+    {
+        le_mem_Release(flashDstBlockPtr);
+    }
+    if (flashFdSrc)
+    {
+        pa_flash_Close(flashFdSrc);
+    }
+    if (flashFdDst)
+    {
+        pa_flash_Close(flashFdDst);
+    }
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Build the chains of synchronization jobs: the jobs sharing a MTD, like the logical partitions,
+ * cannot be synchronized in parallel. The chains are sorted by decreasing size.
+ */
+//--------------------------------------------------------------------------------------------------
+static void BuildSyncChains
+(
+    SyncSched_t* schedPtr           ///< [IN] Synchronization scheduler
+)
+{
+    SyncJob_t* jobPtr = schedPtr->jobPtr;
+    uint32_t chainSize[schedPtr->nbJobs];
+    int lastJob[schedPtr->nbJobs];
+    int chainOfJob[schedPtr->nbJobs];
+    int idx, jdx, chain;
+
+    schedPtr->nbChains = 0;
+    for (idx = 0; idx < schedPtr->nbJobs; idx++)
+    {
+        jobPtr[idx].nextJob = -1;
+
+        // Look for a previous job using one of the MTDs of this one
+        for (chain = -1, jdx = 0; (-1 == chain) && (jdx < idx); jdx++)
+        {
+            if ((jobPtr[jdx].mtdSrc == jobPtr[idx].mtdSrc) ||
+                (jobPtr[jdx].mtdSrc == jobPtr[idx].mtdDst) ||
+                (jobPtr[jdx].mtdDst == jobPtr[idx].mtdSrc) ||
+                (jobPtr[jdx].mtdDst == jobPtr[idx].mtdDst))
+            {
+                chain = chainOfJob[jdx];
+            }
+        }
+
+        if (-1 == chain)
+        {
+            chain = schedPtr->nbChains++;
+            schedPtr->chainPtr[chain] = idx;
+            chainSize[chain] = 0;
+        }
+        else
+        {
+            jobPtr[lastJob[chain]].nextJob = idx;
+        }
+        chainOfJob[idx] = chain;
+        lastJob[chain] = idx;
+        chainSize[chain] += jobPtr[idx].size;
+    }
+
+    // Sort the chains largest first
+    for (idx = 1; idx < schedPtr->nbChains; idx++)
+    {
+        int head = schedPtr->chainPtr[idx];
+        uint32_t size = chainSize[idx];
+
+        for (jdx = idx; (jdx > 0) && (chainSize[jdx - 1] < size); jdx--)
+        {
+            schedPtr->chainPtr[jdx] = schedPtr->chainPtr[jdx - 1];
+            chainSize[jdx] = chainSize[jdx - 1];
+        }
+        schedPtr->chainPtr[jdx] = head;
+        chainSize[jdx] = size;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Check if the synchronization is aborted
+ *
+ * @return
+ *      - true if a synchronization has failed
+ */
+//--------------------------------------------------------------------------------------------------
+static bool IsSyncAborted
+(
+    SyncSched_t* schedPtr           ///< [IN] Synchronization scheduler
+)
+{
+    bool isAborted;
+
+    le_mutex_Lock(schedPtr->mutex);
+    isAborted = schedPtr->isAborted;
+    le_mutex_Unlock(schedPtr->mutex);
+    return isAborted;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Synchronization worker thread: take the next chain of jobs and synchronize its partitions until
+ * there is no more chain or the synchronization is aborted.
+ */
+//--------------------------------------------------------------------------------------------------
+static void* SyncWorkerThread
+(
+    void* contextPtr                ///< [IN] Synchronization scheduler
+)
+{
+    SyncSched_t* schedPtr = (SyncSched_t*)contextPtr;
+    int jobIdx;
+
+    for (;;)
+    {
+        jobIdx = -1;
+        le_mutex_Lock(schedPtr->mutex);
+        if ((!schedPtr->isAborted) && (schedPtr->nextChain < schedPtr->nbChains))
+        {
+            jobIdx = schedPtr->chainPtr[schedPtr->nextChain++];
+        }
+        le_mutex_Unlock(schedPtr->mutex);
+        if (-1 == jobIdx)
+        {
+            break;
         }
 
-        // If all expected volume names match expected naming for DM-verity, perform the
-        // integrity check on the UBI images/hash/root hash
-        if (MAX_UBI_VOL_FOR_DM_VERITY == ubiDmVerity)
+        for (; (-1 != jobIdx) && (!IsSyncAborted(schedPtr));
+             jobIdx = schedPtr->jobPtr[jobIdx].nextJob)
         {
-            // Need another 4th volume on UBI for this authentication
-            if ((IsSecureBootVersion) && (MAX_UBI_VOL_FOR_DM_VERITY < nbUbiVol))
-            {
-                // Secure boot: Need to authentify the root hash of the UBI partition
-                snprintf(ubiTmpStr, sizeof(ubiTmpStr), SWI_AUTH_PATH " nfuse ubi%d",
-                         ubiId);
-                rc = system(ubiTmpStr);
-                if (WIFEXITED(rc) && (SWI_AUTH_SIGNATURE_SUCCEED == WEXITSTATUS(rc)))
-                {
-                    LE_INFO("Root hash authenfication succeed");
-                }
-                else
-                {
-                    LE_ERROR("Unable to authentify the root hash for mtd%d ubi%d: 0x%08x"
-                             " Synchronize aborted.",
-                             mtdSrc, ubiId, rc);
-                    return LE_NOT_PERMITTED;
-                }
-            }
+            SyncJob_t* jobPtr = &schedPtr->jobPtr[jobIdx];
 
-            LE_INFO("Checking DM-verity integrity on ubi%d", ubiId);
-            snprintf(ubiTmpStr, sizeof(ubiTmpStr),
-                     "/usr/sbin/veritysetup verify /dev/ubiblock%d_0 /dev/ubiblock%d_1 "
-                     "$(cat /dev/ubi%d_2)",
-                     ubiId, ubiId, ubiId);
-            rc = system(ubiTmpStr);
-            if ((0 != WEXITSTATUS(rc)) || (0 != WIFSIGNALED(rc)))
+            jobPtr->result = SyncPartition(jobPtr);
+            if (LE_OK != jobPtr->result)
             {
-                LE_ERROR("DM Verity check failed for mtd%d ubi%d: 0x%08x."
-                         " Synchronize aborted.",
-                         mtdSrc, ubiId, rc);
-                return LE_NOT_PERMITTED;
+                LE_ERROR("Synchronization of mtd%d fails: %s. Synchronize aborted.",
+                         jobPtr->mtdDst, LE_RESULT_TXT(jobPtr->result));
+                le_mutex_Lock(schedPtr->mutex);
+                schedPtr->isAborted = true;
+                le_mutex_Unlock(schedPtr->mutex);
             }
         }
     }
-    return LE_OK;
-}
 
-//==================================================================================================
-//  PUBLIC API FUNCTIONS
-//==================================================================================================
+    le_sem_Post(schedPtr->doneSem);
+    return NULL;
+}
 
 //--------------------------------------------------------------------------------------------------
 /**
@@ -2149,19 +3493,28 @@ le_result_t pa_fwupdate_MarkGood
         CWE_IMAGE_TYPE_CUS0,
     };
     uint8_t iniBootSystem[PA_FWUPDATE_SUBSYSID_MAX], dualBootSystem[PA_FWUPDATE_SUBSYSID_MAX];
+    SyncJob_t syncJob[sizeof( syncPartition )/sizeof(cwe_ImageType_t)];
+    int syncChain[sizeof( syncPartition )/sizeof(cwe_ImageType_t)];
+    le_thread_Ref_t syncWorker[PA_FWUPDATE_SYNC_MAX_THREADS];
+    SyncSched_t sched = {
+        .jobPtr = syncJob,
+        .chainPtr = syncChain,
+    };
     int mtdSrc, mtdDst;
-    int idx;
-    pa_flash_Desc_t flashFdSrc = NULL, flashFdDst = NULL;
-    pa_flash_Info_t *flashInfoSrcPtr, *flashInfoDstPtr;
-    pa_flash_EccStats_t flashEccStats;
+    int idx, nbWorkers = 0, nbDone;
+    le_clk_Time_t kickInterval = { .sec = FWUPDATE_WDOG_KICK_INTERVAL, .usec = 0 };
+    le_clk_Time_t kickTime;
+    pa_flash_Desc_t flashFdSrc;
+    pa_flash_Info_t *flashInfoSrcPtr;
     char* mtdSrcNamePtr;
     char* mtdDstNamePtr;
-    uint8_t* flashBlockPtr = NULL;
-    uint32_t crc32Src, dataLen;
-    bool isLogicalSrc, isLogicalDst, isDualSrc, isDualDst, isUbiPartition, isRetryNeeded;
+    bool isLogicalSrc, isLogicalDst, isDualSrc, isDualDst;
     pa_fwupdate_InternalStatus_t internalUpdateStatus;
     le_result_t res, returnedRes = LE_FAULT;
 
+    // The update partitions are going to be synchronized: their tails must not be erased
+    partition_StopTailScrub(true);
+
     if (LE_OK != partition_GetInitialBootSystem(iniBootSystem))
     {
         return LE_FAULT;
@@ -2208,8 +3561,6 @@ le_result_t pa_fwupdate_MarkGood
         goto error;
     }
 
-    flashBlockPtr = (uint8_t *) le_mem_ForceAlloc(FlashImgPool);
-
     LE_INFO( "Synchronizing from sub system MODEM from %d to %d",
              iniBootSystem[PA_FWUPDATE_SUBSYSID_MODEM] + 1,
              dualBootSystem[PA_FWUPDATE_SUBSYSID_MODEM] + 1);
@@ -2219,6 +3570,8 @@ le_result_t pa_fwupdate_MarkGood
     LE_INFO( "Synchronizing from sub system LINUX from %d to %d",
              iniBootSystem[PA_FWUPDATE_SUBSYSID_LINUX] + 1,
              dualBootSystem[PA_FWUPDATE_SUBSYSID_LINUX] + 1);
+
+    // Prepare the jobs. This is done by this thread, so that any failure is reported here.
     for (idx = 0; idx < sizeof( syncPartition )/sizeof(cwe_ImageType_t); idx++) {
         int subSysId = Partition_Identifier[syncPartition[idx]].subSysId;
 
@@ -2253,23 +3606,6 @@ le_result_t pa_fwupdate_MarkGood
             }
         }
 
-        res = CheckDmVerityIntegrity(mtdSrc);
-        // In case of LE_FORMAT_ERROR, this is not an UBI container. Skip it
-        if ((LE_OK != res) && (LE_FORMAT_ERROR != res))
-        {
-            LE_ERROR("Error when checking for UBI on mtd%d. Synchronize aborted.", mtdSrc);
-            goto error;
-        }
-
-        LE_INFO( "Synchronizing %s partition \"%s%s\" (mtd%d) from \"%s%s\" (mtd%d)",
-                 mtdDst == mtdSrc ? "logical" : "physical",
-                 mtdDstNamePtr,
-                 mtdDst == mtdSrc && dualBootSystem[subSysId] ? "2" : "",
-                 mtdDst,
-                 mtdSrcNamePtr,
-                 mtdDst == mtdSrc && iniBootSystem[subSysId] ? "2" : "",
-                 mtdSrc );
-
         if ( LE_OK != pa_flash_Open( mtdSrc,
                                      PA_FLASH_OPENMODE_READONLY |
                                      (isLogicalSrc
@@ -2283,219 +3619,92 @@ le_result_t pa_fwupdate_MarkGood
             goto error;
         }
 
-        // Try to check the integrity of UBI. If the isUbiPartition is false, the partition is
-        // not an UBI container
-        res = pa_flash_CheckUbi( flashFdSrc, &isUbiPartition );
-        if (LE_OK != res)
-        {
-            LE_ERROR("CheckUbi of SRC MTD %d fails: res=%d", mtdSrc, res);
-            goto error;
-        }
+        SyncJob_t* jobPtr = &syncJob[sched.nbJobs++];
+        jobPtr->imageType = syncPartition[idx];
+        jobPtr->mtdSrc = mtdSrc;
+        jobPtr->mtdDst = mtdDst;
+        jobPtr->mtdSrcNamePtr = mtdSrcNamePtr;
+        jobPtr->mtdDstNamePtr = mtdDstNamePtr;
+        jobPtr->isLogicalSrc = isLogicalSrc;
+        jobPtr->isDualSrc = isDualSrc;
+        jobPtr->isLogicalDst = isLogicalDst;
+        jobPtr->isDualDst = isDualDst;
+        jobPtr->srcSystem = iniBootSystem[subSysId];
+        jobPtr->dstSystem = dualBootSystem[subSysId];
+        jobPtr->size = flashInfoSrcPtr->size;
+        jobPtr->result = LE_FAULT;
+        pa_flash_Close(flashFdSrc);
+    }
 
-        // Check for unrecoverable ECC errors on active partition and abort if some.
-        res = pa_flash_GetEccStats( flashFdSrc, &flashEccStats );
-        if( LE_OK != res )
-        {
-            LE_ERROR("Getting ECC stats on SRC MTD %d fails: res=%d", mtdSrc, res);
-            goto error;
-        }
-        // Corrected ECC errors are ignored, because normally the data are valid.
-        // Abort in case of unrecoverable ECC errors.
-        if( flashEccStats.failed )
-        {
-            LE_ERROR("Unrecoverable ECC errors on SRC MTD %d: Corrected %u Unrecoverable %u ",
-                     mtdSrc, flashEccStats.corrected, flashEccStats.failed);
-            returnedRes = LE_IO_ERROR;
-            goto error;
-        }
+    BuildSyncChains(&sched);
 
-        if ( LE_OK != pa_flash_Open( mtdDst,
-                                     PA_FLASH_OPENMODE_WRITEONLY | PA_FLASH_OPENMODE_MARKBAD |
-                                     (isLogicalDst
-                                      ? (isDualDst ? PA_FLASH_OPENMODE_LOGICAL_DUAL
-                                         : PA_FLASH_OPENMODE_LOGICAL)
-                                      : 0),
-                                     &flashFdDst,
-                                     &flashInfoDstPtr ))
+    // Start the workers, no more than the number of chains
+    sched.mutex = le_mutex_CreateNonRecursive("SyncMutex");
+    sched.doneSem = le_sem_Create("SyncDoneSem", 0);
+    for (nbWorkers = 0;
+         (nbWorkers < PA_FWUPDATE_SYNC_MAX_THREADS) && (nbWorkers < sched.nbChains);
+         nbWorkers++)
+    {
+        char threadName[16];
+
+        snprintf(threadName, sizeof(threadName), "SyncWorker%d", nbWorkers);
+        syncWorker[nbWorkers] = le_thread_Create(threadName, SyncWorkerThread, &sched);
+        le_thread_SetJoinable(syncWorker[nbWorkers]);
+        le_thread_Start(syncWorker[nbWorkers]);
+    }
+
+    // Wait for all workers, kicking the watchdog while the partitions are synchronized. The kicks
+    // depend on the elapsed time: workers exiting one after the other must not delay them.
+    kickTime = le_clk_GetAbsoluteTime();
+    for (nbDone = 0; nbDone < nbWorkers; )
+    {
+        le_clk_Time_t curTime = le_clk_GetAbsoluteTime();
+        le_clk_Time_t diffTime = le_clk_Sub(curTime, kickTime);
+
+        if (diffTime.sec >= FWUPDATE_WDOG_KICK_INTERVAL)
         {
-            LE_ERROR("Open of DST MTD %d fails", mtdDst);
-            goto error;
+            LE_DEBUG("Kicking watchdog");
+            le_wdogChain_Kick(FWUPDATE_WDOG_TIMER);
+            kickTime = curTime;
+            diffTime.sec = 0;
+            diffTime.usec = 0;
         }
-        if (flashInfoSrcPtr->writeSize != flashInfoDstPtr->writeSize)
+        if (LE_OK == le_sem_WaitWithTimeOut(sched.doneSem, le_clk_Sub(kickInterval, diffTime)))
         {
-            LE_ERROR( "Can not copy flash with different page size: source = %d, destination = %d",
-                      flashInfoSrcPtr->writeSize, flashInfoDstPtr->writeSize );
-            goto error;
+            nbDone++;
         }
+    }
+    for (idx = 0; idx < nbWorkers; idx++)
+    {
+        le_thread_Join(syncWorker[idx], NULL);
+    }
+    le_sem_Delete(sched.doneSem);
+    le_mutex_Delete(sched.mutex);
 
-        int nbBlk, nbSrcBlkCnt; // Counter to maximum block to be checked
-        size_t srcSize;
-        bool onlyChkValidUbiData;
-
-        // In case of UBI partition, a second try will be performed if the checksum of active
-        // changed during the copy.
-        isRetryNeeded = false;
-        onlyChkValidUbiData = isUbiPartition? true:false;
-
-        do
+    // Update the bad image flags of the synchronized partitions and report the failures
+    returnedRes = LE_OK;
+    for (idx = 0; idx < sched.nbJobs; idx++)
+    {
+        if (LE_OK == syncJob[idx].result)
         {
-            crc32Src = LE_CRC_START_CRC32;
-
-            if (LE_OK != pa_flash_Scan( flashFdSrc, NULL ))
-            {
-                LE_ERROR("Scan of SRC MTD %d fails", mtdSrc);
-                goto error;
-            }
-            if (LE_OK != pa_flash_Scan( flashFdDst, NULL ))
-            {
-                LE_ERROR("Scan of DST MTD %d fails", mtdDst);
-                goto error;
-            }
-
-            if (LE_OK != pa_flash_SeekAtBlock( flashFdSrc, 0 ))
-            {
-                LE_ERROR("Scan of SRC MTD %d fails", mtdSrc);
-                goto error;
-            }
-            if (LE_OK != pa_flash_SeekAtBlock( flashFdDst, 0 ))
-            {
-                LE_ERROR("Scan of DST MTD %d fails", mtdDst);
-                goto error;
-            }
-            for (nbSrcBlkCnt = nbBlk = 0;
-                 (nbBlk < flashInfoSrcPtr->nbLeb) && (nbBlk < flashInfoDstPtr->nbLeb);
-                 nbBlk++)
-            {
-                if (LE_OK != pa_flash_ReadAtBlock( flashFdSrc,
-                                                   nbBlk,
-                                                   flashBlockPtr,
-                                                   flashInfoSrcPtr->eraseSize ))
-                {
-                    LE_ERROR("pa_flash_Read fails for block %d: %m", nbBlk);
-                    goto error;
-                }
-
-                dataLen = flashInfoSrcPtr->eraseSize;
-                if (isUbiPartition)
-                {
-                    if ( LE_OK != partition_GetUbiBlockValidDataLen(&dataLen,
-                                                                    flashInfoSrcPtr->writeSize,
-                                                                    flashBlockPtr))
-                    {
-                        LE_ERROR("failed to get UBI block valid data length");
-                        goto error;
-                    }
-                }
-
-                if (LE_OK != pa_flash_EraseBlock( flashFdDst, nbBlk ))
-                {
-                    LE_ERROR("EraseMtd fails for block %d: %m", nbBlk);
-                    goto error;
-                }
-
-                if (LE_OK != pa_flash_WriteAtBlock( flashFdDst,
-                                                    nbBlk,
-                                                    flashBlockPtr,
-                                                    dataLen ))
-                {
-                    LE_ERROR("pa_flash_Write fails for block %d: %m", nbBlk);
-                    goto error;
-                }
-                else
-                {
-                   /* Here calculate the CRC with erase block by erase block, and later
-                    * also check CRC again with real data length by real data length.
-                    * Skip all data set to 0xFF at the end of erase block.
-                    */
-                    crc32Src = le_crc_Crc32(flashBlockPtr, dataLen, crc32Src);
-                    nbSrcBlkCnt ++;
-                }
-            }
-            if (nbBlk < flashInfoSrcPtr->nbLeb)
-            {
-                LE_WARN("Bad block on destination MTD ? Missing %d blocks",
-                        flashInfoSrcPtr->nbLeb - nbBlk);
-            }
-            for (; nbBlk < flashInfoDstPtr->nbLeb; nbBlk++)
-            {
-                // Erase remaing blocks of the destination
-                pa_flash_EraseBlock( flashFdDst, nbBlk );
-            }
-
-            srcSize = nbSrcBlkCnt * flashInfoSrcPtr->eraseSize;
-            // Check the integrity if the partition is expected to be an UBI container
-            if (isUbiPartition)
-            {
-                // In this case, we need to recompute the checksum of the MTD to ensure that it is
-                // conform to what we read first.
-                res = partition_CheckData(mtdSrc, isLogicalSrc, isDualSrc, srcSize, 0,
-                                                 crc32Src, FlashImgPool, true, onlyChkValidUbiData);
-                if (LE_OK != res)
-                {
-                    // If first try fails, redo another attempt
-                    LE_ERROR("Checksum failed after rereading source MTD %d", mtdSrc);
-                    isRetryNeeded = !isRetryNeeded;
-                }
-                else
-                {
-                    // The copy is good, no do any retry
-                    isRetryNeeded = false;
-                }
-                if ((LE_OK != res) && (!isRetryNeeded))
-                {
-                    // The second try fails: Abort the sync
-                    goto error;
-                }
-                res = LE_OK;
-            }
-
-            if (LE_OK != res)
-            {
-                // The UBI integrity is corrupt.
-                LE_ERROR("IsUbi of SRC MTD %d fails: res=%d", mtdSrc, res);
-                goto error;
-            }
-
-            // Check for unrecoverable ECC errors on active partition and abort if some.
-            res = pa_flash_GetEccStats( flashFdSrc, &flashEccStats );
-            if( LE_OK != res )
-            {
-                LE_ERROR("Getting ECC stats on SRC MTD %d fails: res=%d", mtdSrc, res);
-                goto error;
-            }
-            // Corrected ECC errors are ignored, because normally the data are valid.
-            // Abort in case of unrecoverable ECC errors.
-            if( flashEccStats.failed )
+            if (LE_OK != partition_SetBadImage(syncJob[idx].imageType, false))
             {
-                LE_ERROR("Unrecoverable ECC errors on SRC MTD %d: Corrected %u Unrecoverable %u ",
-                         mtdSrc, flashEccStats.corrected, flashEccStats.failed);
-                returnedRes = LE_IO_ERROR;
-                goto error;
+                returnedRes = LE_FAULT;
             }
         }
-        while (isRetryNeeded);
-
-        pa_flash_Close(flashFdSrc);
-        flashFdSrc = NULL;
-        pa_flash_Close(flashFdDst);
-        flashFdDst = NULL;
-
-        // Verify the checksum of the destination MTD to ensure it matches the source checksum
-        if (LE_OK != partition_CheckData(mtdDst, isLogicalDst, isDualDst, srcSize, 0, crc32Src,
-                                         FlashImgPool, false, onlyChkValidUbiData))
-        {
-            goto error;
-        }
-        if (LE_OK != partition_SetBadImage(syncPartition[idx], false))
+        else if (LE_IO_ERROR != returnedRes)
         {
-            goto error;
+            // Unrecoverable ECC errors on an active partition take precedence
+            returnedRes = (LE_IO_ERROR == syncJob[idx].result) ? LE_IO_ERROR : LE_FAULT;
         }
     }
+    if (LE_OK != returnedRes)
+    {
+        goto error;
+    }
 
     ReleaseSwUpdate();
 
-    le_mem_Release(flashBlockPtr);
-
     LE_INFO ("done");
     if (LE_OK != pa_fwupdate_SetSyncState())
     {
@@ -2507,18 +3716,6 @@ le_result_t pa_fwupdate_MarkGood
 error:
     ReleaseSwUpdate();
 
-    if (flashBlockPtr)
-    {
-        le_mem_Release(flashBlockPtr);
-    }
-    if (flashFdSrc)
-    {
-        pa_flash_Close(flashFdSrc);
-    }
-    if (flashFdDst)
-    {
-        pa_flash_Close(flashFdDst);
-    }
     LE_DEBUG ("sync failure --> pass SW update to NORMAL");
     pa_fwupdate_SetState (PA_FWUPDATE_STATE_NORMAL);
     /* do not get the result, we must return the previous error */
@@ -2705,6 +3902,7 @@ le_result_t pa_fwupdate_Download
     uint8_t* bufferPtr = le_mem_ForceAlloc (ChunkPool);
     int efd = -1;
     bool isRegularFile;
+    ChunkRing_t chunkRing = { .abortFd = -1 };
 
     LE_DEBUG ("fd %d", fd);
     if ((fd < 0) || (LE_OK != CheckFdType(fd, &isRegularFile)))
@@ -2718,6 +3916,9 @@ le_result_t pa_fwupdate_Download
 
     ResumeCtxSave_t *saveCtxPtr = &ResumeCtx.saveCtx;
 
+    // The tails of a previous download are kept: they are replaced when the partitions are written
+    partition_StopTailScrub(false);
+
     result = RequestSwUpdate();
     if (LE_OK != result)
     {
@@ -2769,6 +3970,16 @@ le_result_t pa_fwupdate_Download
     // Record the download status
     RECORD_DWL_STATUS(updateStatus);
 
+    /* The package is read by a dedicated thread while the data are parsed and flashed here. Until
+     * the package length is known, only the first CWE header is read */
+    result = StartChunkReader(&chunkRing, fd, efd, totalCount,
+                              (saveCtxPtr->fullImageLength > 0) ? saveCtxPtr->fullImageLength
+                                                                : totalCount + CWE_HEADER_SIZE);
+    if (LE_OK != result)
+    {
+        goto error;
+    }
+
     while (true)
     {
         ssize_t dataLenToBeRead;
@@ -2782,52 +3993,17 @@ le_result_t pa_fwupdate_Download
             goto error;
         }
 
-        do
+        /* Get the data already read ahead by the reader thread */
+        result = ReadChunkRing(&chunkRing, bufferPtr, dataLenToBeRead);
+        if (result != LE_OK)
         {
-            readCount = dataLenToBeRead;
-            result = ReadSync(fd, efd, bufferPtr, &readCount);
-            if (result != LE_OK)
-            {
-                goto error;
-            }
-            if ((-1 == readCount) && (EAGAIN == errno))
-            {
-                readCount = 0;
-            }
-            else if ((-1 == readCount) && (EINTR != errno))
-            {
-                LE_ERROR("error during read: %m");
-                goto error;
-            }
-
-            LE_DEBUG ("Read %d", (uint32_t)readCount);
+            goto error;
         }
-        while ((-1 == readCount) && (EINTR == errno));
+        readCount = dataLenToBeRead;
+        LE_DEBUG ("Read %d", (uint32_t)readCount);
 
         if (readCount > 0)
         {
-            ssize_t lenRead = 0;
-
-            /* In case partial data were read */
-            while (readCount != dataLenToBeRead)
-            {
-                lenRead = dataLenToBeRead - readCount;
-                result = ReadSync(fd, efd, bufferPtr + readCount, &lenRead);
-                if (result != LE_OK)
-                {
-                    goto error;
-                }
-                if (lenRead > 0)
-                {
-                    readCount += lenRead;
-                }
-                else if ((-1 == lenRead) && ((EINTR != errno) && (EAGAIN != errno)))
-                {
-                    LE_ERROR("error during read: %m");
-                    goto error;
-                }
-            }
-
             /* Parse the read data and store in partition */
             /* totalCount is in fact the offset */
             result = ParseAndStoreData (readCount, bufferPtr, &ResumeCtx);
@@ -2836,6 +4012,10 @@ le_result_t pa_fwupdate_Download
                 /* Update the totalCount variable (offset) with read data length */
                 totalCount += readCount;
                 LE_DEBUG ("--> update totalCount %d", (uint32_t)totalCount);
+                if (saveCtxPtr->fullImageLength > 0)
+                {
+                    SetChunkReaderEnd(&chunkRing, saveCtxPtr->fullImageLength);
+                }
                 if (totalCount >= saveCtxPtr->fullImageLength)
                 {
                     LE_INFO("End of update: total read %zd, full length expected %zd",
@@ -2848,11 +4028,6 @@ le_result_t pa_fwupdate_Download
                 goto error;
             }
         }
-        else if (readCount < 0)
-        {
-            LE_ERROR ("Error while reading fd=%i : %m", fd);
-            goto error;
-        }
 
         if (!readCount)
         {
@@ -2938,11 +4113,17 @@ le_result_t pa_fwupdate_Download
         }
     }
 
+    StopChunkReader(&chunkRing);
     ReleaseSwUpdate();
 
     // Record the download status
     RECORD_DWL_STATUS(updateStatus);
 
+#if PA_FWUPDATE_TAIL_SCRUB
+    // The update is committed: erase the unused tails of the partitions in the background
+    partition_StartTailScrub();
+#endif
+
     le_mem_Release(bufferPtr);
     close(fd);
     if (efd != -1)
@@ -2957,6 +4138,7 @@ error:
     ReleaseSwUpdate();
 
 error_noswupdatecomplete:
+    StopChunkReader(&chunkRing);
     if (result != LE_CLOSED) // if LE_CLOSED updateStatus is already to ONGOING
     {
         updateStatus = (LE_TIMEOUT == result) ? PA_FWUPDATE_INTERNAL_STATUS_DWL_TIMEOUT :
@@ -3136,6 +4318,8 @@ le_result_t pa_fwupdate_Install
     pa_fwupdate_System_t systemArray[PA_FWUPDATE_SUBSYSID_MAX];
     int ssid;
 
+    partition_StopTailScrub(true);
+
     // Check if a resume is ongoing
     result = pa_fwupdate_GetResumePosition(&position);
     if ((LE_OK != result) || position)
@@ -3203,6 +4387,9 @@ le_result_t pa_fwupdate_InitDownload
     le_result_t result, ret;
     bool isSystemGood = false;
 
+    // A new package may follow a change of the MTD partitions: read them again
+    pa_flash_InvalidateMtdCache();
+
     // Check whether both systems are synchronized and eventually initiate the synchronization.
     result = pa_fwupdate_GetSystemState(&isSystemGood);
     if (LE_OK != result)
@@ -3389,6 +4576,57 @@ le_result_t pa_fwupdate_DisableSyncBeforeUpdate
     return LE_OK;
 }
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Set the policy used to write the resume checkpoints during a download. The data downloaded
+ * since the latest checkpoint are downloaded again when the download is resumed.
+ *
+ * @return
+ *      - LE_OK             on success
+ *      - LE_BAD_PARAMETER  if the policy or its value is invalid
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t pa_fwupdate_SetCheckpointPolicy
+(
+    pa_fwupdate_CheckpointPolicy_t policy,  ///< [IN] checkpoint policy
+    uint32_t value                          ///< [IN] bytes, milliseconds or percent according to
+                                            ///<      the policy. Ignored for the default policy.
+)
+{
+    if ((policy >= PA_FWUPDATE_CHECKPOINT_MAX) ||
+        ((PA_FWUPDATE_CHECKPOINT_BLOCK != policy) && (0 == value)) ||
+        ((PA_FWUPDATE_CHECKPOINT_ADAPTIVE == policy) && (value > 100)))
+    {
+        LE_ERROR("Bad checkpoint policy %d value %" PRIu32, policy, value);
+        return LE_BAD_PARAMETER;
+    }
+
+    Checkpoint.policy = policy;
+    Checkpoint.value = value;
+    ResetCheckpoint();
+    LE_INFO("Checkpoint policy %d value %" PRIu32, policy, value);
+
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Read the resume context from the resume context files again, as done when the component starts.
+ * The resume context in memory is dropped.
+ *
+ * @return
+ *      - LE_OK             on success
+ *      - LE_FAULT          if no valid resume context is found, the files are then reset
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t pa_fwupdate_LoadResumeCtx
+(
+    void
+)
+{
+    return GetResumeCtx(&ResumeCtx);
+}
+
 //--------------------------------------------------------------------------------------------------
 /**
  * This function must be called to initialize the FW UPDATE module.
@@ -3398,7 +4636,8 @@ COMPONENT_INIT
 {
     // Allocate a pool for the data chunk
     ChunkPool = le_mem_CreatePool("ChunkPool", CHUNK_LENGTH);
-    le_mem_ExpandPool(ChunkPool, 1);
+    // One chunk for the parser and CHUNK_RING_COUNT chunks for the reader thread
+    le_mem_ExpandPool(ChunkPool, CHUNK_RING_COUNT + 1);
 
     int mtdNum;
     le_result_t result;
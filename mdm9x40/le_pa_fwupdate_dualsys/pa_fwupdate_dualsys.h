@@ -220,5 +220,39 @@ LE_SHARED le_result_t pa_fwupdate_SetBadImage
     bool isBad              ///< [IN] true to set bad image flag, false to clear it
 );
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Resume checkpoint policies. A checkpoint saves the download resume context. It is only written
+ * after data have been flashed, so the resume offset always lands on an erase block limit.
+ */
+//--------------------------------------------------------------------------------------------------
+typedef enum
+{
+    PA_FWUPDATE_CHECKPOINT_BLOCK,       ///< Checkpoint at every flushed erase block (default)
+    PA_FWUPDATE_CHECKPOINT_BYTES,       ///< Checkpoint when at least value bytes were flushed
+    PA_FWUPDATE_CHECKPOINT_TIME,        ///< Checkpoint when at least value ms have elapsed
+    PA_FWUPDATE_CHECKPOINT_ADAPTIVE,    ///< Keep the time spent writing checkpoints below value
+                                        ///< percent of the download time
+    PA_FWUPDATE_CHECKPOINT_MAX          ///< Number of policies. It has to be the last one.
+}
+pa_fwupdate_CheckpointPolicy_t;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Set the policy used to write the resume checkpoints during a download. The data downloaded
+ * since the latest checkpoint are downloaded again when the download is resumed.
+ *
+ * @return
+ *      - LE_OK             on success
+ *      - LE_BAD_PARAMETER  if the policy or its value is invalid
+ */
+//--------------------------------------------------------------------------------------------------
+LE_SHARED le_result_t pa_fwupdate_SetCheckpointPolicy
+(
+    pa_fwupdate_CheckpointPolicy_t policy,  ///< [IN] checkpoint policy
+    uint32_t value                          ///< [IN] bytes, milliseconds or percent according to
+                                            ///<      the policy. Ignored for the default policy.
+);
+
 #endif /* LEGATO_PASWUPDATEDUALSYS_INCLUDE_GUARD */
 
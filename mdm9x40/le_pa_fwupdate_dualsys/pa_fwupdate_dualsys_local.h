@@ -0,0 +1,38 @@
+/**
+ * @file pa_fwupdate_dualsys_local.h
+ *
+ * Internal definitions of the dualsys FW UPDATE PA, shared with its unit tests
+ *
+ * Copyright (C) Sierra Wireless Inc.
+ *
+ */
+
+#ifndef LEGATO_PAFWUPDATEDUALSYSLOCAL_INCLUDE_GUARD
+#define LEGATO_PAFWUPDATEDUALSYSLOCAL_INCLUDE_GUARD
+
+#include "legato.h"
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Define the maximum number of delta records appended to a resume context file. When it is
+ * reached, the journal is compacted: the full resume context is written into the other file.
+ */
+//--------------------------------------------------------------------------------------------------
+#define RESUME_CTX_JOURNAL_MAX 64
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Read the resume context from the resume context files again, as done when the component starts.
+ * The resume context in memory is dropped. This is used by the unit tests to emulate a restart.
+ *
+ * @return
+ *      - LE_OK             on success
+ *      - LE_FAULT          if no valid resume context is found, the files are then reset
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t pa_fwupdate_LoadResumeCtx
+(
+    void
+);
+
+#endif /* LEGATO_PAFWUPDATEDUALSYSLOCAL_INCLUDE_GUARD */
@@ -15,7 +15,9 @@
 #include "partition_local.h"
 #include "pa_fwupdate_dualsys.h"
 #include "pa_flash.h"
+#include "pa_flash_local.h"
 #include "flash-ubi.h"
+#include "crc32_local.h"
 
 //--------------------------------------------------------------------------------------------------
 /**
@@ -31,20 +33,6 @@
 //--------------------------------------------------------------------------------------------------
 #define SYS_CLASS_UBI_PATH     "/sys/class/ubi"
 
-//--------------------------------------------------------------------------------------------------
-/**
- * "/sys/class/mtd" access path
- */
-//--------------------------------------------------------------------------------------------------
-#define SYS_CLASS_MTD_PATH     "/sys/class/mtd"
-
-//--------------------------------------------------------------------------------------------------
-/**
- * "/sys/class/mtd" access path
- */
-//--------------------------------------------------------------------------------------------------
-#define PROC_MTD_PATH          "/proc/mtd"
-
 //--------------------------------------------------------------------------------------------------
 /**
  * SBL number of passes needed to flash low/high and high/low SBL scrub
@@ -70,13 +58,66 @@
 
 //--------------------------------------------------------------------------------------------------
 /**
- * Delay to wait before running the CRC computation on a erase block. This is to prevent lack
+ * Delay to wait before reading an erase block in partition_CheckData(). This is to prevent lack
  * of CPU resources and hardware watchdog elapses.
  * This 1 milli-second in nano-seconds.
  */
 //--------------------------------------------------------------------------------------------------
 #define SUSPEND_DELAY (1000000)
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Read budget of partition_CheckData() in bytes per second, on top of the SUSPEND_DELAY pause
+ * before each erase block. Throttling the reads further leaves flash bandwidth and CPU to the
+ * running system. 0 means that only the SUSPEND_DELAY pause applies.
+ */
+//--------------------------------------------------------------------------------------------------
+#ifndef PA_FWUPDATE_CHECK_DATA_RATE
+#define PA_FWUPDATE_CHECK_DATA_RATE  0
+#endif
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Compare-before-program: if set to 1, each block of an update partition is read before being
+ * written, and it is neither erased nor programmed when it already holds the data to write
+ */
+//--------------------------------------------------------------------------------------------------
+#ifndef PA_FWUPDATE_COMPARE_BEFORE_WRITE
+#define PA_FWUPDATE_COMPARE_BEFORE_WRITE  0
+#endif
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Number of erase block buffers used by partition_CheckData(): one is read by the reader thread
+ * while the CRC of the other is computed
+ */
+//--------------------------------------------------------------------------------------------------
+#define CHECK_DATA_NB_BUFFERS  2
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Number of good blocks erased beyond the image size when writing an update partition. They are
+ * spare blocks to replace the ones which may become bad while the image is written.
+ */
+//--------------------------------------------------------------------------------------------------
+#define ERASE_SPARE_BLOCKS  2
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Number of blocks kept erased ahead of the one being written in an update partition
+ */
+//--------------------------------------------------------------------------------------------------
+#define ERASE_AHEAD_BLOCKS  2
+
+#if PA_FWUPDATE_TAIL_SCRUB
+//--------------------------------------------------------------------------------------------------
+/**
+ * Maximum number of partition tails which can be recorded for the background scrub
+ */
+//--------------------------------------------------------------------------------------------------
+#define MAX_SCRUB_TAILS     16
+#endif
+
 //==================================================================================================
 //                                       Static variables
 //==================================================================================================
@@ -167,6 +208,88 @@ static int8_t InitialBootSystem[PA_FWUPDATE_SUBSYSID_MAX] =
     -1, -1, -1,
 };
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Erase planner of the update partition being written: the LEBs are erased by the pa_flash
+ * erase-ahead worker, a few blocks ahead of the write cursor, and only up to the image size plus a
+ * spare margin. With compare-before-program, the LEBs holding the image are erased one by one when
+ * they differ, and the worker only erases the spare margin once the image is written.
+ */
+//--------------------------------------------------------------------------------------------------
+typedef struct
+{
+    uint32_t startLeb;      ///< LEB where the write starts
+    uint32_t endLeb;        ///< LEB after the last one to erase for the image
+    uint32_t writeLeb;      ///< LEB written next
+    bool     isStarted;     ///< true if the first block is written
+}
+ErasePlan_t;
+
+#if PA_FWUPDATE_TAIL_SCRUB
+//--------------------------------------------------------------------------------------------------
+/**
+ * Partition tail left unerased after an update, to be scrubbed in the background
+ */
+//--------------------------------------------------------------------------------------------------
+typedef struct
+{
+    bool     isUsed;      ///< true if the entry records a tail
+    int      mtdNum;      ///< MTD number
+    bool     isLogical;   ///< true if the MTD is a logical partition
+    bool     isDual;      ///< true if the MTD is the dual logical partition
+    uint32_t firstLeb;    ///< First LEB not erased by the update
+}
+ScrubTail_t;
+#endif
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Read-ahead context of partition_CheckData(). The reader thread fills the buffers one erase block
+ * at a time, the caller computes the CRC of the filled ones. A buffer with a size of 0 ends the
+ * data to check.
+ */
+//--------------------------------------------------------------------------------------------------
+typedef struct
+{
+    pa_flash_Desc_t  flashFd;                            ///< Flash descriptor to read from
+    pa_flash_Info_t* flashInfoPtr;                       ///< Flash information
+    size_t           sizeToCheck;                        ///< Size of the data to read
+    off_t            atOffset;                           ///< Offset to start from
+    uint8_t*         bufPtr[CHECK_DATA_NB_BUFFERS];      ///< Erase block buffers
+    size_t           bufSize[CHECK_DATA_NB_BUFFERS];     ///< Size of data into the buffers
+    le_result_t      bufRes[CHECK_DATA_NB_BUFFERS];      ///< Read status of the buffers
+    le_sem_Ref_t     readySem;                           ///< Posted when a buffer is filled
+    le_sem_Ref_t     freeSem;                            ///< Posted when a buffer is released
+    bool             isUbiSparse;                        ///< Skip the data of empty UBI blocks
+    volatile bool    isAborted;                          ///< Request the reader thread to stop
+}
+CheckReader_t;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Erase planner of the current update partition
+ */
+//--------------------------------------------------------------------------------------------------
+static ErasePlan_t ErasePlan;
+
+#if PA_FWUPDATE_TAIL_SCRUB
+//--------------------------------------------------------------------------------------------------
+/**
+ * Partition tails to scrub after the update is committed
+ */
+//--------------------------------------------------------------------------------------------------
+static ScrubTail_t ScrubTails[MAX_SCRUB_TAILS];
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Background thread scrubbing the partition tails, and its abort request
+ */
+//--------------------------------------------------------------------------------------------------
+static le_thread_Ref_t ScrubThreadRef = NULL;
+static volatile bool IsScrubAborted = false;
+#endif
+
+//--------------------------------------------------------------------------------------------------
 //==================================================================================================
 //                                       Private Functions
 //==================================================================================================
@@ -234,33 +357,22 @@ static le_result_t GetImageTypeFromMtd
     cwe_ImageType_t* imageTypePtr   ///< [OUT] the partition type
 )
 {
-    FILE* flashFdPtr;
-    char mtdBuf[100], mtdFetchName[16];
+    pa_flash_Info_t flashInfo;
     int partIndex, partSystem;
 
-    // Open the partition name belonging the given MTD number
-    snprintf( mtdBuf, sizeof(mtdBuf), SYS_CLASS_MTD_PATH "/mtd%d/name", mtdNum );
-    if (NULL == (flashFdPtr = fopen( mtdBuf, "r" )))
+    // Get the partition name belonging the given MTD number from the MTD topology cache
+    if (LE_OK != pa_flash_GetInfo( mtdNum, &flashInfo, false, false ))
     {
-        LE_ERROR( "Unable to open %s: %m", mtdBuf );
+        LE_ERROR( "Unable to read mtd%d partition name", mtdNum );
         return LE_FAULT;
     }
-    // Try to read the partition name
-    if (1 != fscanf( flashFdPtr, "%15s", mtdFetchName ))
-    {
-        LE_ERROR( "Unable to read mtd partition name %s: %m", mtdFetchName );
-        fclose( flashFdPtr );
-        return LE_FAULT;
-    }
-    fclose( flashFdPtr );
     // Look for the image type into the both system matrix
-    mtdFetchName[strlen(mtdFetchName)] = '\0';
     for (partSystem = 0; partSystem < 2; partSystem++)
     {
         for (partIndex = CWE_IMAGE_TYPE_MIN; partIndex < CWE_IMAGE_TYPE_COUNT; partIndex++)
         {
             if (Partition_Identifier[ partIndex ].namePtr[ partSystem ] &&
-                (0 == strcmp( mtdFetchName,
+                (0 == strcmp( flashInfo.name,
                               Partition_Identifier[ partIndex ].namePtr[ partSystem ])))
             {
                 // Found: output partition name and return image type
@@ -275,6 +387,354 @@ static le_result_t GetImageTypeFromMtd
     return LE_FAULT;
 }
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Write an erase block of the image into the update partition. The erase-ahead worker is started
+ * with the first block, once the image format is known. If a compare buffer is given, the
+ * erase-ahead worker is not started: the block is read first and it is erased and programmed only
+ * if it differs from the data to write.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t WriteUpdateBlock
+(
+    pa_flash_Desc_t desc,            ///< [IN] Descriptor of the MTD
+    pa_flash_Info_t* flashInfoPtr,   ///< [IN] MTD information
+    uint8_t* dataPtr,                ///< [IN] Erase block to write
+    uint8_t* cmpDataPtr              ///< [IN] Buffer to read the block before writing, or NULL
+)
+{
+    uint32_t leb = ErasePlan.writeLeb;
+
+    if (!ErasePlan.isStarted)
+    {
+        // An UBI image relies on the erased state of the whole partition: the remaining blocks
+        // may hold stale UBI headers which would be attached
+        if ((0 == ErasePlan.startLeb) &&
+            (LE_OK == pa_flash_CheckUbiMagic( dataPtr, UBI_EC_HDR_MAGIC )))
+        {
+            LE_DEBUG("UBI image, the whole partition is erased");
+            ErasePlan.endLeb = flashInfoPtr->nbLeb;
+        }
+        if (ErasePlan.endLeb > flashInfoPtr->nbLeb)
+        {
+            ErasePlan.endLeb = flashInfoPtr->nbLeb;
+        }
+        if ((NULL == cmpDataPtr) &&
+            (LE_OK != pa_flash_StartEraseAhead( desc, ERASE_AHEAD_BLOCKS, ErasePlan.endLeb )))
+        {
+            LE_ERROR("Fails to start erase-ahead up to LEB %"PRIu32, ErasePlan.endLeb);
+            return LE_FAULT;
+        }
+        ErasePlan.isStarted = true;
+    }
+
+    ErasePlan.writeLeb++;
+    if (cmpDataPtr)
+    {
+        if ((LE_OK == pa_flash_ReadAtBlock( desc, leb, cmpDataPtr, flashInfoPtr->eraseSize )) &&
+            (0 == memcmp( dataPtr, cmpDataPtr, flashInfoPtr->eraseSize )))
+        {
+            LE_DEBUG("LEB %"PRIu32" already holds the data", leb);
+            return LE_OK;
+        }
+        if ((LE_OK != pa_flash_EraseBlock( desc, leb )) ||
+            (LE_OK != pa_flash_SeekAtBlock( desc, leb )))
+        {
+            LE_ERROR("Fails to erase LEB %"PRIu32, leb);
+            return LE_FAULT;
+        }
+    }
+    if (LE_OK != pa_flash_Write( desc, dataPtr, flashInfoPtr->eraseSize ))
+    {
+        LE_ERROR( "fwrite to nandwrite fails: %m" );
+        return LE_FAULT;
+    }
+    return LE_OK;
+}
+
+#if PA_FWUPDATE_TAIL_SCRUB
+//--------------------------------------------------------------------------------------------------
+/**
+ * Record the unerased tail of an update partition, to be scrubbed in the background. A tail
+ * previously recorded for the same MTD is replaced.
+ */
+//--------------------------------------------------------------------------------------------------
+static void RecordScrubTail
+(
+    int mtdNum,          ///< [IN] MTD number
+    bool isLogical,      ///< [IN] true if the MTD is a logical partition
+    bool isDual,         ///< [IN] true if the MTD is the dual logical partition
+    uint32_t firstLeb,   ///< [IN] First LEB not erased
+    uint32_t nbLeb       ///< [IN] Number of LEBs of the MTD
+)
+{
+    ScrubTail_t* freePtr = NULL;
+    int idx;
+
+    for (idx = 0; idx < MAX_SCRUB_TAILS; idx++)
+    {
+        ScrubTail_t* tailPtr = &ScrubTails[idx];
+
+        if (tailPtr->isUsed && (tailPtr->mtdNum == mtdNum) &&
+            (tailPtr->isLogical == isLogical) && (tailPtr->isDual == isDual))
+        {
+            freePtr = tailPtr;
+            break;
+        }
+        if ((!tailPtr->isUsed) && (NULL == freePtr))
+        {
+            freePtr = tailPtr;
+        }
+    }
+
+    if (NULL == freePtr)
+    {
+        LE_WARN("No room to record the tail of mtd%d", mtdNum);
+        return;
+    }
+    freePtr->isUsed = (firstLeb < nbLeb);
+    freePtr->mtdNum = mtdNum;
+    freePtr->isLogical = isLogical;
+    freePtr->isDual = isDual;
+    freePtr->firstLeb = firstLeb;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Erase a partition tail
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_TERMINATED if the scrub is aborted
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t ScrubTail
+(
+    const ScrubTail_t* tailPtr   ///< [IN] Tail to erase
+)
+{
+    pa_flash_Desc_t desc = NULL;
+    pa_flash_Info_t* flashInfoPtr;
+    uint32_t leb;
+    le_result_t res = LE_OK;
+
+    if (LE_OK != pa_flash_Open( tailPtr->mtdNum,
+                                PA_FLASH_OPENMODE_WRITEONLY | PA_FLASH_OPENMODE_MARKBAD |
+                                (tailPtr->isLogical
+                                 ? (tailPtr->isDual ? PA_FLASH_OPENMODE_LOGICAL_DUAL
+                                                    : PA_FLASH_OPENMODE_LOGICAL)
+                                 : 0),
+                                &desc,
+                                &flashInfoPtr ))
+    {
+        LE_ERROR("Fails to open MTD %d", tailPtr->mtdNum );
+        return LE_FAULT;
+    }
+    if (LE_OK != pa_flash_Scan( desc, NULL ))
+    {
+        LE_ERROR("Fails to scan MTD");
+        res = LE_FAULT;
+        goto end;
+    }
+
+    for (leb = tailPtr->firstLeb; leb < flashInfoPtr->nbLeb; leb++)
+    {
+        bool isBad;
+
+        if (IsScrubAborted)
+        {
+            res = LE_TERMINATED;
+            break;
+        }
+        res = pa_flash_CheckBadBlock( desc, leb, &isBad );
+        if ((LE_OK == res) && isBad)
+        {
+            continue;
+        }
+        res = pa_flash_EraseBlock( desc, leb );
+        if ((LE_OK != res) && (LE_NOT_PERMITTED != res))
+        {
+            LE_ERROR("Fails to erase block %"PRIu32": res=%d", leb, res);
+            res = LE_FAULT;
+            break;
+        }
+        res = LE_OK;
+    }
+
+end:
+    pa_flash_Close( desc );
+    return res;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Thread erasing the tails of the update partitions left unerased by partition_WriteUpdatePartition
+ */
+//--------------------------------------------------------------------------------------------------
+static void* ScrubThread
+(
+    void* contextPtr   ///< [IN] Unused
+)
+{
+    int idx;
+
+    // The flash is accessed outside of a download: request the SW update access
+    if (LE_OK != pa_fwupdate_RequestUpdate())
+    {
+        LE_WARN("Access to flash not granted, tails are not scrubbed");
+        return NULL;
+    }
+
+    for (idx = 0; (idx < MAX_SCRUB_TAILS) && (!IsScrubAborted); idx++)
+    {
+        ScrubTail_t* tailPtr = &ScrubTails[idx];
+        le_result_t res;
+
+        if (!tailPtr->isUsed)
+        {
+            continue;
+        }
+        res = ScrubTail( tailPtr );
+        if (LE_TERMINATED == res)
+        {
+            break;
+        }
+        if (LE_OK == res)
+        {
+            LE_INFO("Tail of mtd%d scrubbed from LEB %"PRIu32,
+                    tailPtr->mtdNum, tailPtr->firstLeb);
+        }
+        tailPtr->isUsed = false;
+    }
+
+    pa_fwupdate_CompleteUpdate();
+    return NULL;
+}
+#endif
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Pause before the read of the next erase block: wait for SUSPEND_DELAY, or longer until the mean
+ * read rate of the readBytes bytes read since startTime fits into PA_FWUPDATE_CHECK_DATA_RATE
+ */
+//--------------------------------------------------------------------------------------------------
+static void ThrottleCheckRead
+(
+    const struct timespec* startTimePtr,   ///< [IN] Time of the first read
+    uint64_t               readBytes       ///< [IN] Bytes read since startTime
+)
+{
+    struct timespec delay = { 0, SUSPEND_DELAY };
+
+#if PA_FWUPDATE_CHECK_DATA_RATE
+    struct timespec now;
+    uint64_t targetNs, elapsedNs;
+
+    targetNs = (readBytes * 1000000000ULL) / PA_FWUPDATE_CHECK_DATA_RATE;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsedNs = ((uint64_t)(now.tv_sec - startTimePtr->tv_sec) * 1000000000ULL)
+                + now.tv_nsec - startTimePtr->tv_nsec;
+    if ((elapsedNs < targetNs) && ((targetNs - elapsedNs) > SUSPEND_DELAY))
+    {
+        delay.tv_sec = (targetNs - elapsedNs) / 1000000000ULL;
+        delay.tv_nsec = (targetNs - elapsedNs) % 1000000000ULL;
+    }
+#else
+    (void)startTimePtr;
+    (void)readBytes;
+#endif
+
+    while ((-1 == nanosleep(&delay, &delay)) && (EINTR == errno))
+    {
+        // Sleep the remaining time
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Thread reading the data checked by partition_CheckData() one whole erase block at a time, ahead
+ * of the CRC computation
+ */
+//--------------------------------------------------------------------------------------------------
+static void* CheckReaderThread
+(
+    void* contextPtr   ///< [IN] Read-ahead context
+)
+{
+    CheckReader_t* readerPtr = (CheckReader_t*)contextPtr;
+    pa_flash_Info_t* flashInfoPtr = readerPtr->flashInfoPtr;
+    size_t size, imageSize = 0;
+    off_t offset = readerPtr->atOffset;
+    uint64_t readBytes = 0;
+    struct timespec startTime;
+    uint32_t iBuf = 0, nPage, readLen = 0;
+    le_result_t res;
+
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    for (;;)
+    {
+        le_sem_Wait(readerPtr->freeSem);
+        if (readerPtr->isAborted)
+        {
+            break;
+        }
+
+        res = LE_OK;
+        size = 0;
+        if ((imageSize < readerPtr->sizeToCheck) &&
+            (offset < (flashInfoPtr->nbLeb * flashInfoPtr->eraseSize)))
+        {
+            size = (((imageSize + flashInfoPtr->eraseSize) < readerPtr->sizeToCheck)
+                       ? flashInfoPtr->eraseSize
+                       : (readerPtr->sizeToCheck - imageSize));
+            nPage = (size + (flashInfoPtr->writeSize - 1)) / flashInfoPtr->writeSize;
+            ThrottleCheckRead(&startTime, readBytes);
+
+            LE_DEBUG("Read %zu at offset 0x%lx", size, offset);
+            if ((readerPtr->isUbiSparse) && (flashInfoPtr->eraseSize == size))
+            {
+                // Only the EC header page of an empty UBI block is checked: do not read the others
+                res = partition_ReadUbiBlock( readerPtr->flashFd,
+                                              flashInfoPtr,
+                                              (offset / flashInfoPtr->eraseSize),
+                                              readerPtr->bufPtr[iBuf],
+                                              &readLen );
+            }
+            else
+            {
+                readLen = nPage * flashInfoPtr->writeSize;
+                res = pa_flash_ReadAtBlock( readerPtr->flashFd,
+                                            (offset / flashInfoPtr->eraseSize),
+                                            readerPtr->bufPtr[iBuf],
+                                            readLen );
+            }
+            readBytes += readLen;
+            if (LE_OK != res)
+            {
+                LE_ERROR("read fails for offset 0x%lx: %d", offset, res);
+            }
+        }
+
+        readerPtr->bufSize[iBuf] = size;
+        readerPtr->bufRes[iBuf] = res;
+        le_sem_Post(readerPtr->readySem);
+        if ((0 == size) || (LE_OK != res))
+        {
+            break;
+        }
+        iBuf = (iBuf + 1) % CHECK_DATA_NB_BUFFERS;
+        offset += size;
+        imageSize += size;
+    }
+
+    return NULL;
+}
+
 //==================================================================================================
 //  PUBLIC API FUNCTIONS
 //==================================================================================================
@@ -416,9 +876,7 @@ int partition_GetMtdFromImageType
                                       ///<       RPM2), false in case of lower partition
 )
 {
-    FILE* flashFdPtr;
-    char mtdBuf[100], mtdFetchName[16];
-    int mtdNum = -1, l;
+    int mtdNum = -1;
     pa_fwupdate_SubSysId_t subSysId;
     uint8_t iniBootSystem[PA_FWUPDATE_SUBSYSID_MAX], dualBootSystem[PA_FWUPDATE_SUBSYSID_MAX];
 
@@ -462,41 +920,16 @@ int partition_GetMtdFromImageType
         return -1;
     }
 
-    // Build the partition name to fetch into the /proc/mtd
-    snprintf( mtdFetchName, sizeof(mtdFetchName), "\"%s\"", mtdPartNamePtr );
-    l = strlen( mtdFetchName );
-
-    // Open the /proc/mtd partition
-    if (NULL == (flashFdPtr = fopen(PROC_MTD_PATH, "r")))
-    {
-        LE_ERROR( "fopen on /proc/mtd failed: %m" );
-        return -1;
-    }
-
-    // Read all entries until the partition names match
-    while (fgets(mtdBuf, sizeof(mtdBuf), flashFdPtr ))
+    // Look for the partition name into the MTD partition table
+    if (LE_OK == pa_flash_GetMtdFromName( mtdPartNamePtr, &mtdNum ))
     {
-        // This is the fetched partition
-        if (0 == strncmp( mtdBuf + strlen( mtdBuf ) - l - 1, mtdFetchName, l ))
+        // Output MTD partition name and MTD number
+        if (mtdNamePtr)
         {
-            // Get the MTD number
-            if (1 != sscanf( mtdBuf, "mtd%d", &mtdNum ))
-            {
-                LE_ERROR( "Unable to scan the mtd number in %s", mtdBuf );
-            }
-            else
-            {
-                // Output MTD partition name and MTD number
-                if (mtdNamePtr)
-                {
-                    *mtdNamePtr = mtdPartNamePtr;
-                    LE_DEBUG( "Partition %s is mtd%d", *mtdNamePtr, mtdNum );
-                }
-            }
-            break;
+            *mtdNamePtr = mtdPartNamePtr;
+            LE_DEBUG( "Partition %s is mtd%d", *mtdNamePtr, mtdNum );
         }
     }
-    fclose( flashFdPtr );
 
     if (isLogical)
     {
@@ -774,6 +1207,55 @@ le_result_t partition_GetUbiBlockValidDataLen
     return LE_OK;
 }
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Read an UBI partition's block. The EC and VID header pages are read first: if there is no VID
+ * header, the block does not hold any volume data: the remaining pages are not read and are set
+ * to 0xFF into the buffer.
+ *
+ * @return
+ *      - LE_OK       on success
+ *      - others      depending of the flash functions return
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t partition_ReadUbiBlock
+(
+    pa_flash_Desc_t flashFd,             ///< [IN] flash descriptor
+    pa_flash_Info_t* flashInfoPtr,       ///< [IN] flash information
+    int blk,                             ///< [IN] block to read
+    uint8_t* flashBlockPtr,              ///< [OUT] flash data pointer, one erase block size
+    uint32_t* readLenPtr                 ///< [OUT] length of data read into flashBlockPtr
+)
+{
+    uint32_t hdrLen = 2 * flashInfoPtr->writeSize;
+    le_result_t res;
+
+    if (hdrLen < flashInfoPtr->eraseSize)
+    {
+        res = pa_flash_ReadAtBlock( flashFd, blk, flashBlockPtr, hdrLen );
+        if (LE_OK != res)
+        {
+            return res;
+        }
+        // An empty block in UBI is all 0xFF except the EC header page. The rest of the buffer is
+        // filled as such so that the whole block can be used by the caller.
+        if (LE_NOT_FOUND == pa_flash_CheckUbiMagic(flashBlockPtr + flashInfoPtr->writeSize,
+                                                   UBI_VID_HDR_MAGIC))
+        {
+            memset(flashBlockPtr + hdrLen, 0xFF, flashInfoPtr->eraseSize - hdrLen);
+            *readLenPtr = hdrLen;
+            return LE_OK;
+        }
+    }
+
+    res = pa_flash_ReadAtBlock( flashFd, blk, flashBlockPtr, flashInfoPtr->eraseSize );
+    if (LE_OK == res)
+    {
+        *readLenPtr = flashInfoPtr->eraseSize;
+    }
+    return res;
+}
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Check if data flashed into a partition are correctly written
@@ -798,16 +1280,15 @@ le_result_t partition_CheckData
 )
 {
     pa_flash_Desc_t flashFd = NULL;
-    uint8_t* checkBlockPtr = NULL;
+    CheckReader_t reader;
+    le_thread_Ref_t readerThreadRef = NULL;
 
-    size_t size, imageSize = 0;
     uint32_t chkDataLen = 0;
-    off_t offset = atOffset;
     uint32_t crc32 = LE_CRC_START_CRC32;
+    uint32_t iBuf;
     pa_flash_Info_t* flashInfoPtr;
     pa_flash_EccStats_t flashEccStats;
     pa_flash_OpenMode_t mode = PA_FLASH_OPENMODE_READONLY;
-    struct timespec suspendDelay = { 0, SUSPEND_DELAY }; // 1 ms.
     le_result_t res;
 
     if (isLogical)
@@ -817,7 +1298,11 @@ le_result_t partition_CheckData
 
     LE_DEBUG( "Size=%zu, Crc32=0x%08X", sizeToCheck, crc32ToCheck);
 
-    checkBlockPtr = (uint8_t *) le_mem_ForceAlloc(flashImgPool);
+    memset(&reader, 0, sizeof(reader));
+    for (iBuf = 0; iBuf < CHECK_DATA_NB_BUFFERS; iBuf++)
+    {
+        reader.bufPtr[iBuf] = (uint8_t *) le_mem_ForceAlloc(flashImgPool);
+    }
 
     if (LE_OK != pa_flash_Open( mtdNum, mode, &flashFd, &flashInfoPtr ))
     {
@@ -830,56 +1315,48 @@ le_result_t partition_CheckData
         goto error;
     }
 
-    while ((imageSize < sizeToCheck) && (offset < (flashInfoPtr->nbLeb * flashInfoPtr->eraseSize)))
+    // The erase blocks are read by a thread while the CRC of the previous one is computed. As we
+    // will compute a CRC for a big amount of memory, the reads are throttled to give time for
+    // others processes to schedule and also to prevent the hardware watchdog to elapse.
+    reader.flashFd = flashFd;
+    reader.flashInfoPtr = flashInfoPtr;
+    reader.sizeToCheck = sizeToCheck;
+    reader.atOffset = atOffset;
+    reader.isUbiSparse = onlyChkValidUbiData;
+    reader.readySem = le_sem_Create("CheckReadySem", 0);
+    reader.freeSem = le_sem_Create("CheckFreeSem", CHECK_DATA_NB_BUFFERS);
+    readerThreadRef = le_thread_Create("FwCheckReader", CheckReaderThread, &reader);
+    le_thread_SetJoinable(readerThreadRef);
+    le_thread_Start(readerThreadRef);
+
+    for (iBuf = 0; ; iBuf = (iBuf + 1) % CHECK_DATA_NB_BUFFERS)
     {
-        off_t blkOff = offset;
-        uint32_t iBlk, nBlk;
-
-        size = (((imageSize + flashInfoPtr->eraseSize) < sizeToCheck)
-                   ? flashInfoPtr->eraseSize
-                   : (sizeToCheck - imageSize));
-
-        // As we will compute a CRC for a big amount of memory, we need to give time for others
-        // processes to schedule and also to prevent the hardware watchdog to elapse.
-        if ((-1 == nanosleep(&suspendDelay, NULL)) && (EINTR != errno))
-        {
-            LE_ERROR("nanosleep(%ld.%ld) fails: %m", suspendDelay.tv_sec, suspendDelay.tv_nsec);
-        }
-
-        LE_DEBUG("Read %zu at offset 0x%lx, block offset 0x%lx", size, offset, blkOff);
-        if (LE_OK != pa_flash_SeekAtBlock( flashFd,
-                                           (blkOff / flashInfoPtr->eraseSize) ))
+        le_sem_Wait(reader.readySem);
+        if (LE_OK != reader.bufRes[iBuf])
         {
-            LE_ERROR("seek fails for offset 0x%lx: %m", blkOff);
             goto error;
         }
-        nBlk = (size + (flashInfoPtr->writeSize - 1)) / flashInfoPtr->writeSize;
-        for (iBlk = 0; iBlk < nBlk; iBlk++)
+        if (0 == reader.bufSize[iBuf])
         {
-            if (LE_OK != pa_flash_Read( flashFd,
-                                        (checkBlockPtr + (iBlk * flashInfoPtr->writeSize)),
-                                        flashInfoPtr->writeSize ))
-            {
-                LE_ERROR("read fails for offset 0x%lx: %m", blkOff);
-                goto error;
-            }
+            break;
         }
 
-        chkDataLen = size;
+        chkDataLen = reader.bufSize[iBuf];
         if (onlyChkValidUbiData)
         {
             if ( LE_OK != partition_GetUbiBlockValidDataLen(&chkDataLen,
                                                             flashInfoPtr->writeSize,
-                                                            checkBlockPtr))
+                                                            reader.bufPtr[iBuf]))
             {
                 LE_ERROR("failed to get UBI block valid data length");
                 goto error;
             }
         }
-        crc32 = le_crc_Crc32( checkBlockPtr, chkDataLen, crc32);
-        offset += size;
-        imageSize += size;
+        crc32 = crc32_Compute( reader.bufPtr[iBuf], chkDataLen, crc32);
+        le_sem_Post(reader.freeSem);
     }
+    le_thread_Join(readerThreadRef, NULL);
+    readerThreadRef = NULL;
 
     // Check for unrecoverable ECC errors on active partition and abort if some.
     res = pa_flash_GetEccStats( flashFd, &flashEccStats );
@@ -912,15 +1389,29 @@ le_result_t partition_CheckData
     }
 
     LE_INFO("CRC32 OK for mtd%d", mtdNum );
-
-    pa_flash_Close( flashFd );
-    le_mem_Release(checkBlockPtr);
-    return LE_OK;
+    res = LE_OK;
+    goto end;
 
 error:
+    res = LE_FAULT;
+end:
+    if (readerThreadRef)
+    {
+        reader.isAborted = true;
+        le_sem_Post(reader.freeSem);
+        le_thread_Join(readerThreadRef, NULL);
+    }
+    if (reader.readySem)
+    {
+        le_sem_Delete(reader.readySem);
+        le_sem_Delete(reader.freeSem);
+    }
     pa_flash_Close( flashFd );
-    le_mem_Release(checkBlockPtr);
-    return LE_FAULT;
+    for (iBuf = 0; iBuf < CHECK_DATA_NB_BUFFERS; iBuf++)
+    {
+        le_mem_Release(reader.bufPtr[iBuf]);
+    }
+    return res;
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -1290,12 +1781,16 @@ le_result_t partition_WriteUpdatePartition
 )
 {
     int mtdNum;
+#if PA_FWUPDATE_TAIL_SCRUB
+    uint32_t nbLeb;
+#endif
     le_result_t ret = LE_OK;
     bool isLogical = false, isDual = false;
 
     // Static variables for WriteData
     static size_t InOffset = 0;          // Current offset in erase block
     static uint8_t *DataPtr = NULL;      // Buffer to copy data (size of an erase block)
+    static uint8_t *CmpDataPtr = NULL;   // Buffer to compare before program, NULL if disabled
     static pa_flash_Info_t *FlashInfoPtr;  // MTD information of the current MTD
     static pa_flash_Desc_t MtdFd = NULL; // File descriptor for MTD operations
     const cwe_Header_t *hdrPtr = ctxPtr->cweHdrPtr;
@@ -1311,7 +1806,6 @@ le_result_t partition_WriteUpdatePartition
 
     if ((NULL == MtdFd) && (0 == ImageSize) )
     {
-        int iblk;
         le_result_t res;
 
         mtdNum = partition_GetMtdFromImageType(hdrPtr->imageType, true, &MtdNamePtr, &isLogical,
@@ -1332,7 +1826,10 @@ le_result_t partition_WriteUpdatePartition
         }
 
         if (LE_OK != pa_flash_Open( mtdNum,
-                                    PA_FLASH_OPENMODE_WRITEONLY | PA_FLASH_OPENMODE_MARKBAD |
+                                    (PA_FWUPDATE_COMPARE_BEFORE_WRITE
+                                     ? PA_FLASH_OPENMODE_READWRITE
+                                     : PA_FLASH_OPENMODE_WRITEONLY) |
+                                    PA_FLASH_OPENMODE_MARKBAD |
                                     (isLogical
                                      ? (isDual ? PA_FLASH_OPENMODE_LOGICAL_DUAL
                                                : PA_FLASH_OPENMODE_LOGICAL)
@@ -1363,36 +1860,26 @@ le_result_t partition_WriteUpdatePartition
             goto error;
         }
 
-        for (iblk = offset / FlashInfoPtr->eraseSize; iblk < FlashInfoPtr->nbLeb; iblk++)
+        // Erase only the blocks needed by the image plus a spare margin, while they are written.
+        // On resume, the remaining part of the partition is erased.
+        ErasePlan.startLeb = offset / FlashInfoPtr->eraseSize;
+        ErasePlan.endLeb = FlashInfoPtr->nbLeb;
+        ErasePlan.writeLeb = ErasePlan.startLeb;
+        ErasePlan.isStarted = false;
+        if (0 == offset)
         {
-            bool isBad;
-
-            if ((LE_OK != (res = pa_flash_CheckBadBlock( MtdFd, iblk, &isBad )))
-                && (res != LE_NOT_PERMITTED))
-            {
-                LE_ERROR("Fails to check bad block %d", iblk);
-                goto error;
-            }
-            if (isBad)
-            {
-                LE_WARN("Skipping bad block %d", iblk);
-            }
-            else
-            {
-                res = pa_flash_EraseBlock( MtdFd, iblk );
-                if ((LE_OK != res) && (res != LE_NOT_PERMITTED))
-                {
-                    LE_ERROR("Fails to erase block %d: res=%d", iblk, res);
-                    goto error;
-                }
-            }
+            ErasePlan.endLeb = ((hdrPtr->imageSize + FlashInfoPtr->eraseSize - 1)
+                                   / FlashInfoPtr->eraseSize) + ERASE_SPARE_BLOCKS;
         }
         if (LE_OK != pa_flash_SeekAtOffset( MtdFd, offset ))
         {
-            LE_ERROR("Fails to seek block at %d", iblk);
+            LE_ERROR("Fails to seek block at %"PRIu32, ErasePlan.startLeb);
             goto error;
         }
         DataPtr = le_mem_ForceAlloc(*ctxPtr->flashPoolPtr);
+#if PA_FWUPDATE_COMPARE_BEFORE_WRITE
+        CmpDataPtr = le_mem_ForceAlloc(*ctxPtr->flashPoolPtr);
+#endif
         InOffset = 0;
         ImageSize = hdrPtr->imageSize;
     }
@@ -1413,18 +1900,16 @@ le_result_t partition_WriteUpdatePartition
         {
             *isFlashedPtr = true;
         }
-        if (LE_OK != pa_flash_Write( MtdFd, DataPtr, FlashInfoPtr->eraseSize ))
+        if (LE_OK != WriteUpdateBlock( MtdFd, FlashInfoPtr, DataPtr, CmpDataPtr ))
         {
-            LE_ERROR( "fwrite to nandwrite fails: %m" );
             goto error;
         }
         InOffset = length - inOffsetSave;
         while( InOffset >= FlashInfoPtr->eraseSize)
         {
             memcpy( DataPtr, dataPtr + inOffsetSave, FlashInfoPtr->eraseSize );
-            if (LE_OK != pa_flash_Write( MtdFd, DataPtr, FlashInfoPtr->eraseSize ))
+            if (LE_OK != WriteUpdateBlock( MtdFd, FlashInfoPtr, DataPtr, CmpDataPtr ))
             {
-                LE_ERROR( "fwrite to nandwrite fails: %m" );
                 goto error;
             }
             inOffsetSave += FlashInfoPtr->eraseSize;
@@ -1454,14 +1939,35 @@ le_result_t partition_WriteUpdatePartition
             {
                 *isFlashedPtr = true;
             }
-            if (LE_OK != pa_flash_Write( MtdFd, DataPtr, FlashInfoPtr->eraseSize))
+            if (LE_OK != WriteUpdateBlock( MtdFd, FlashInfoPtr, DataPtr, CmpDataPtr ))
             {
-                LE_ERROR( "fwrite to nandwrite fails: %m" );
                 goto error;
             }
         }
+        // Erase the spare margin left after the image. With compare-before-program, the
+        // erase-ahead worker is only started for it now
+        if ((CmpDataPtr) && (ErasePlan.isStarted) && (ErasePlan.writeLeb < ErasePlan.endLeb) &&
+            ((LE_OK != pa_flash_SeekAtBlock( MtdFd, ErasePlan.writeLeb )) ||
+             (LE_OK != pa_flash_StartEraseAhead( MtdFd, ERASE_AHEAD_BLOCKS, ErasePlan.endLeb ))))
+        {
+            LE_ERROR("Fails to start erase-ahead up to LEB %"PRIu32, ErasePlan.endLeb);
+            goto error;
+        }
+        if (LE_OK != pa_flash_StopEraseAhead( MtdFd, true ))
+        {
+            LE_ERROR("Fails to erase up to LEB %"PRIu32, ErasePlan.endLeb);
+            goto error;
+        }
+#if PA_FWUPDATE_TAIL_SCRUB
+        nbLeb = FlashInfoPtr->nbLeb;
+#endif
         le_mem_Release(DataPtr);
         DataPtr = NULL;
+        if (CmpDataPtr)
+        {
+            le_mem_Release(CmpDataPtr);
+            CmpDataPtr = NULL;
+        }
         InOffset = 0;
         pa_flash_Close( MtdFd );
         MtdFd = NULL;
@@ -1476,6 +1982,9 @@ le_result_t partition_WriteUpdatePartition
             LE_ERROR( "Unable to find a valid mtd for image type %d", hdrPtr->imageType );
             return LE_FAULT;
         }
+#if PA_FWUPDATE_TAIL_SCRUB
+        RecordScrubTail( mtdNum, isLogical, isDual, ErasePlan.endLeb, nbLeb );
+#endif
         ret = partition_CheckData( mtdNum, isLogical, isDual, hdrPtr->imageSize, 0, hdrPtr->crc32,
                                    *ctxPtr->flashPoolPtr, false, false);
     }
@@ -1495,9 +2004,65 @@ error:
         le_mem_Release(DataPtr);
         DataPtr = NULL;
     }
+    if (CmpDataPtr)
+    {
+        le_mem_Release(CmpDataPtr);
+        CmpDataPtr = NULL;
+    }
     return (forceClose ? ret : LE_FAULT);
 }
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Start the background erase of the update partition tails left unerased by
+ * partition_WriteUpdatePartition. This is to be called once the update is committed.
+ */
+//--------------------------------------------------------------------------------------------------
+void partition_StartTailScrub
+(
+    void
+)
+{
+#if PA_FWUPDATE_TAIL_SCRUB
+    if (ScrubThreadRef)
+    {
+        return;
+    }
+    IsScrubAborted = false;
+    ScrubThreadRef = le_thread_Create("FwTailScrub", ScrubThread, NULL);
+    le_thread_SetJoinable(ScrubThreadRef);
+    le_thread_Start(ScrubThreadRef);
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Stop the background erase of the update partition tails, and wait for its end. This must be
+ * called before any other access to the flash.
+ */
+//--------------------------------------------------------------------------------------------------
+void partition_StopTailScrub
+(
+    bool isForgotten     ///< [IN] true to forget the tails not yet erased: the partitions are
+                         ///<      going to be rewritten
+)
+{
+#if PA_FWUPDATE_TAIL_SCRUB
+    if (ScrubThreadRef)
+    {
+        IsScrubAborted = true;
+        le_thread_Join(ScrubThreadRef, NULL);
+        ScrubThreadRef = NULL;
+    }
+    if (isForgotten)
+    {
+        memset(ScrubTails, 0, sizeof(ScrubTails));
+    }
+#else
+    (void)isForgotten;
+#endif
+}
+
 
 //--------------------------------------------------------------------------------------------------
 /**
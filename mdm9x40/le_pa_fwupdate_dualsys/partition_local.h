@@ -13,7 +13,19 @@
 #include "legato.h"
 #include "cwe_local.h"
 #include "pa_fwupdate.h"
+#include "pa_flash.h"
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Background scrub of the partition tails: if set to 1, the blocks of an update partition left
+ * unerased by partition_WriteUpdatePartition are erased by partition_StartTailScrub once the
+ * update is committed. If set to 0, partition_StartTailScrub and partition_StopTailScrub do
+ * nothing.
+ */
+//--------------------------------------------------------------------------------------------------
+#ifndef PA_FWUPDATE_TAIL_SCRUB
+#define PA_FWUPDATE_TAIL_SCRUB  0
+#endif
 
 //--------------------------------------------------------------------------------------------------
 /**
@@ -143,6 +155,26 @@ le_result_t partition_GetUbiBlockValidDataLen
     uint8_t* flashBlockPtr               ///< [IN] flash data pointer
 );
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Read an UBI partition's block. The EC and VID header pages are read first: if there is no VID
+ * header, the block does not hold any volume data: the remaining pages are not read and are set
+ * to 0xFF into the buffer.
+ *
+ * @return
+ *      - LE_OK       on success
+ *      - others      depending of the flash functions return
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t partition_ReadUbiBlock
+(
+    pa_flash_Desc_t flashFd,             ///< [IN] flash descriptor
+    pa_flash_Info_t* flashInfoPtr,       ///< [IN] flash information
+    int blk,                             ///< [IN] block to read
+    uint8_t* flashBlockPtr,              ///< [OUT] flash data pointer, one erase block size
+    uint32_t* readLenPtr                 ///< [OUT] length of data read into flashBlockPtr
+);
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Check if data flashed into a partition are correctly written
@@ -204,6 +236,29 @@ le_result_t partition_WriteUpdatePartition
     bool *isFlashedPtr                ///< [OUT] true if flash write was done
 );
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Start the background erase of the update partition tails left unerased by
+ * partition_WriteUpdatePartition. This is to be called once the update is committed.
+ */
+//--------------------------------------------------------------------------------------------------
+void partition_StartTailScrub
+(
+    void
+);
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Stop the background erase of the update partition tails, and wait for its end. This must be
+ * called before any other access to the flash.
+ */
+//--------------------------------------------------------------------------------------------------
+void partition_StopTailScrub
+(
+    bool isForgotten     ///< [IN] true to forget the tails not yet erased: the partitions are
+                         ///<      going to be rewritten
+);
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Set bad image flag preventing concurrent partition access
@@ -43,6 +43,27 @@
 //--------------------------------------------------------------------------------------------------
 #define PA_FLASH_DEVICE_LENGTH (4 + 4 + 3 + 1)
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * MTD partition table
+ */
+//--------------------------------------------------------------------------------------------------
+#define PA_FLASH_PROC_MTD      "/proc/mtd"
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Maximum number of MTD partitions kept into the MTD topology cache
+ */
+//--------------------------------------------------------------------------------------------------
+#define PA_FLASH_MAX_MTD       64
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Delay without any write after which the erase-ahead worker goes on beyond its window, in ms
+ */
+//--------------------------------------------------------------------------------------------------
+#define PA_FLASH_ERASE_AHEAD_IDLE_MS  100
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Pool for flash MTD descriptors. It is created by the first call to pa_flash_Open
@@ -50,6 +71,140 @@
 //--------------------------------------------------------------------------------------------------
 static le_mem_PoolRef_t FlashMtdDescPool = NULL;
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Erase-ahead worker of a MTD descriptor. The worker thread erases the PEBs from startPeb to
+ * endPeb, not more than nbBlocks ahead of the PEB being written. When the writer is idle, the
+ * worker goes on with the next PEBs up to endPeb. Every good PEB is erased, even if it reads as
+ * erased: a data area full of PA_FLASH_ERASED_VALUE does not tell if the OOB is clean or if an
+ * erase was interrupted.
+ * The worker never marks a block bad nor touches the LEB to PEB array: an erase failure is
+ * reported to the writer which handles it on its own thread. The end is kept as a LEB, and endPeb
+ * is computed again each time the MTD is rescanned, as a block marked bad shifts the LEBs.
+ */
+//--------------------------------------------------------------------------------------------------
+typedef struct pa_flash_EraseAhead
+{
+    le_thread_Ref_t threadRef;  ///< Worker thread
+    le_mutex_Ref_t  mutexRef;   ///< Mutex protecting the fields below
+    le_sem_Ref_t    workSem;    ///< Posted to the worker when the window moves
+    le_sem_Ref_t    doneSem;    ///< Posted by the worker when a PEB is handled
+    uint32_t        startPeb;   ///< First PEB handled by the worker
+    uint32_t        nextPeb;    ///< Next PEB to erase. The PEBs below are erased
+    uint32_t        endLeb;     ///< LEB after the last one to erase
+    uint32_t        endPeb;     ///< PEB after the last one to erase, linked to endLeb
+    uint32_t        writePeb;   ///< PEB currently written
+    uint32_t        nbBlocks;   ///< Number of blocks to keep erased ahead of writePeb
+    uint32_t        failedPeb;  ///< PEB whose erase has failed, -1 if none
+    int             failedErrno;///< errno of the failed erase
+    bool            isFlushed;  ///< Erase up to endPeb regardless of writePeb
+    bool            isIdle;     ///< No write since the last idle delay: erase beyond the window
+    bool            isAborted;  ///< Request the worker to exit
+}
+pa_flash_EraseAhead_t;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Pool for erase-ahead workers. It is created by the first call to pa_flash_StartEraseAhead
+ */
+//--------------------------------------------------------------------------------------------------
+static le_mem_PoolRef_t FlashEraseAheadPool = NULL;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * MTD topology cache entry. The name is taken from the MTD partition table, the geometry from the
+ * /sys/class/mtd/mtdN entries. The MTD partitions do not change while the system runs, so these
+ * are read once and kept until pa_flash_InvalidateMtdCache is called.
+ */
+//--------------------------------------------------------------------------------------------------
+typedef struct
+{
+    bool     isNameKnown;                   ///< true if name is valid
+    bool     isGeometryKnown;               ///< true if the sizes are valid
+    uint32_t size;                          ///< Size of the MTD partition
+    uint32_t writeSize;                     ///< Write (page) size
+    uint32_t eraseSize;                     ///< Erase (block) size
+    char     name[PA_FLASH_MAX_INFO_NAME];  ///< Name of the MTD partition
+}
+pa_flash_MtdCache_t;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * MTD topology cache, indexed by MTD number, and its lock. The lock is statically initialized as
+ * the cache may be used by several threads before any init function is called.
+ */
+//--------------------------------------------------------------------------------------------------
+static pa_flash_MtdCache_t MtdCache[PA_FLASH_MAX_MTD];
+static bool IsMtdTableLoaded = false;
+static pthread_mutex_t MtdCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Get the bad block state of a PEB. The state is taken from the bad block bitmap of the
+ * descriptor if the PEB is already classified, else it is read with MEMGETBADBLOCK and recorded.
+ *
+ * @return
+ *      - LE_OK            On success
+ *      - LE_FAULT         On failure
+ *      - LE_IO_ERROR      If a flash IO error occurs
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t GetBadBlockState
+(
+    pa_flash_MtdDesc_t *descPtr, ///< [IN] MTD device descriptor
+    uint32_t peb,                ///< [IN] PEB to check
+    bool *isBadPtr               ///< [OUT] true if the PEB is bad
+)
+{
+    uint32_t idx = peb / 32;
+    uint32_t mask = 1U << (peb % 32);
+    loff_t blkOff;
+    int rc;
+
+    if( (peb < PA_FLASH_MAX_LEB) && (descPtr->badBlkKnown[idx] & mask) )
+    {
+        *isBadPtr = (descPtr->badBlkMap[idx] & mask) ? true : false;
+        return LE_OK;
+    }
+
+    blkOff = (((loff_t)peb) * descPtr->mtdInfo.eraseSize) + descPtr->mtdInfo.startOffset;
+    rc = ioctl(descPtr->fd, MEMGETBADBLOCK, &blkOff);
+    if( -1 == rc )
+    {
+        LE_ERROR("MTD %d: MEMGETBADBLOCK fails for peb %u offset %"PRIx64": %m",
+                 descPtr->mtdNum, peb, (uint64_t)blkOff);
+        return (EIO == errno) ? LE_IO_ERROR : LE_FAULT;
+    }
+    *isBadPtr = (rc ? true : false);
+    if( peb < PA_FLASH_MAX_LEB )
+    {
+        descPtr->badBlkKnown[idx] |= mask;
+        if( rc )
+        {
+            descPtr->badBlkMap[idx] |= mask;
+        }
+    }
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Record a PEB as bad in the bad block bitmap of the descriptor
+ */
+//--------------------------------------------------------------------------------------------------
+static void SetBadBlockState
+(
+    pa_flash_MtdDesc_t *descPtr, ///< [IN] MTD device descriptor
+    uint32_t peb                 ///< [IN] PEB marked bad
+)
+{
+    if( peb < PA_FLASH_MAX_LEB )
+    {
+        descPtr->badBlkKnown[peb / 32] |= 1U << (peb % 32);
+        descPtr->badBlkMap[peb / 32] |= 1U << (peb % 32);
+    }
+}
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Get the valid offset and PEB (Physical Erase Block) of inside the current flash
@@ -94,17 +249,14 @@ static le_result_t GetBlock
     {
         while( peb < descPtr->mtdInfo.nbBlk )
         {
-            loff_t blkOff = (((loff_t)peb) * descPtr->mtdInfo.eraseSize)
-                                + descPtr->mtdInfo.startOffset;
+            bool isBad;
+            le_result_t res = GetBadBlockState( descPtr, peb, &isBad );
 
-            rc = ioctl(descPtr->fd, MEMGETBADBLOCK, &blkOff);
-            if( -1 == rc )
+            if( LE_OK != res )
             {
-                LE_ERROR("MTD %d: MEMGETBADBLOCK fails for peb %u offset %"PRIx64": %m",
-                         descPtr->mtdNum, peb, (uint64_t)blkOff);
-                return (EIO == errno) ? LE_IO_ERROR : LE_FAULT;
+                return res;
             }
-            if( rc )
+            if( isBad )
             {
                 LE_WARN("MTD %d: Skipping bad block: %u\n", descPtr->mtdNum, peb );
                 peb++;
@@ -124,45 +276,502 @@ static le_result_t GetBlock
         rc = lseek(descPtr->fd, pOffset, SEEK_SET);
         if( -1 == rc )
         {
-            LE_ERROR("MTD %d: lseek fails for peb %u offset %lx: %m\n",
-                     descPtr->mtdNum, peb, pOffset);
-            return (EIO == errno) ? LE_IO_ERROR : LE_FAULT;
+            LE_ERROR("MTD %d: lseek fails for peb %u offset %lx: %m\n",
+                     descPtr->mtdNum, peb, pOffset);
+            return (EIO == errno) ? LE_IO_ERROR : LE_FAULT;
+        }
+    }
+
+    *pebPtr = peb;
+    *offsetPtr = pOffset;
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Get the block index to give to the pa_flash API for a PEB: the LEB linked to the PEB if the
+ * partition is scanned, the PEB itself otherwise.
+ *
+ * @return
+ *      - LE_OK            On success
+ *      - LE_IO_ERROR      If no LEB is linked to the PEB
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t GetBlockIndexFromPeb
+(
+    pa_flash_MtdDesc_t *descPtr, ///< [IN] MTD device descriptor
+    uint32_t peb,                ///< [IN] PEB
+    uint32_t *blockIndexPtr      ///< [OUT] LEB or PEB to use
+)
+{
+    uint32_t leb;
+
+    if( !descPtr->scanDone )
+    {
+        *blockIndexPtr = peb;
+        return LE_OK;
+    }
+    // Retrieve the LEB from PEB
+    for( leb = 0; leb < descPtr->mtdInfo.nbLeb; leb++ )
+    {
+        if( peb == descPtr->lebToPeb[leb] )
+        {
+            *blockIndexPtr = leb;
+            return LE_OK;
+        }
+    }
+    LE_CRIT("No LEB found for PEB %u", peb);
+    return LE_IO_ERROR;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Check if a page holds only PA_FLASH_ERASED_VALUE. The page is reduced 64 bytes at a time with a
+ * bitwise AND: the inner loop has no branch and is vectorized by the compiler, and a programmed
+ * page is usually rejected by its first chunk.
+ *
+ * @return
+ *      - true             The page is erased
+ *      - false            The page holds data
+ */
+//--------------------------------------------------------------------------------------------------
+static bool IsPageErased
+(
+    const uint8_t *pagePtr,      ///< [IN] Page data
+    size_t pageSize              ///< [IN] Size of the page
+)
+{
+    uint64_t chunk[8];
+    uint64_t acc;
+    size_t off;
+    int idx;
+
+    for( off = 0; (off + sizeof(chunk)) <= pageSize; off += sizeof(chunk) )
+    {
+        memcpy( chunk, pagePtr + off, sizeof(chunk) );
+        acc = UINT64_MAX;
+        for( idx = 0; idx < (int)NUM_ARRAY_MEMBERS(chunk); idx++ )
+        {
+            acc &= chunk[idx];
+        }
+        if( UINT64_MAX != acc )
+        {
+            return false;
+        }
+    }
+    for( ; off < pageSize; off++ )
+    {
+        if( PA_FLASH_ERASED_VALUE != pagePtr[off] )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Move the current position back after a failed write. The errno of the failure is kept.
+ */
+//--------------------------------------------------------------------------------------------------
+static void RewindPosition
+(
+    pa_flash_MtdDesc_t *descPtr, ///< [IN] MTD device descriptor
+    size_t size                  ///< [IN] Number of bytes to move back
+)
+{
+    int savedErrno = errno;
+
+    if( size && (-1 == lseek(descPtr->fd, -(off_t)size, SEEK_CUR)) )
+    {
+        LE_ERROR("MTD %d: lseek fails to rewind %zu bytes: %m", descPtr->mtdNum, size);
+    }
+    errno = savedErrno;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Program consecutive pages at the current position, as write(2) does. If the descriptor skips the
+ * erased pages, the runs of pages holding only PA_FLASH_ERASED_VALUE are not programmed: the
+ * position is moved beyond them. They already match the erased block.
+ * On failure, the position is restored to the first page, so that the caller may retry.
+ *
+ * @return
+ *      - The size of the pages handled, programmed or skipped
+ *      - -1 on failure, errno is set
+ */
+//--------------------------------------------------------------------------------------------------
+static ssize_t WritePages
+(
+    pa_flash_MtdDesc_t *descPtr, ///< [IN] MTD device descriptor
+    const uint8_t *dataPtr,      ///< [IN] Pages to program
+    int32_t nbPages              ///< [IN] Number of pages
+)
+{
+    size_t writeSize = descPtr->mtdInfo.writeSize;
+    size_t totalSize = (size_t)nbPages * writeSize;
+    size_t doneSize = 0, runSize;
+    ssize_t rc;
+    bool isErased, isNextErased;
+
+    if( !descPtr->skipErasedPages )
+    {
+        rc = write(descPtr->fd, dataPtr, totalSize);
+        if( (rc > 0) && (rc != (ssize_t)totalSize) )
+        {
+            RewindPosition( descPtr, (size_t)rc );
+        }
+        return rc;
+    }
+
+    isNextErased = (totalSize) && IsPageErased( dataPtr, writeSize );
+    while( doneSize < totalSize )
+    {
+        // Gather the following pages of the same kind into a single run
+        isErased = isNextErased;
+        for( runSize = writeSize; (doneSize + runSize) < totalSize; runSize += writeSize )
+        {
+            isNextErased = IsPageErased( dataPtr + doneSize + runSize, writeSize );
+            if( isNextErased != isErased )
+            {
+                break;
+            }
+        }
+        if( isErased )
+        {
+            if( -1 == lseek(descPtr->fd, (off_t)runSize, SEEK_CUR) )
+            {
+                RewindPosition( descPtr, doneSize );
+                return -1;
+            }
+        }
+        else
+        {
+            rc = write(descPtr->fd, dataPtr + doneSize, runSize);
+            if( rc != (ssize_t)runSize )
+            {
+                // The position may be beyond a skipped run or a part of this one
+                RewindPosition( descPtr, doneSize + ((rc > 0) ? (size_t)rc : 0) );
+                return (-1 == rc) ? -1 : (ssize_t)(doneSize + rc);
+            }
+        }
+        doneSize += runSize;
+    }
+    return (ssize_t)doneSize;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Get the PEB after the last one to erase from the LEB after the last one to erase
+ *
+ * @return
+ *      - The PEB matching the LEB, or the number of PEBs if the LEB is the end of the partition
+ */
+//--------------------------------------------------------------------------------------------------
+static uint32_t GetEraseAheadEndPeb
+(
+    pa_flash_MtdDesc_t *descPtr, ///< [IN] MTD device descriptor
+    uint32_t endLeb              ///< [IN] LEB after the last one to erase
+)
+{
+    if( !descPtr->scanDone )
+    {
+        return endLeb;
+    }
+    return (endLeb >= descPtr->mtdInfo.nbLeb) ? descPtr->mtdInfo.nbBlk
+                                              : descPtr->lebToPeb[endLeb];
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Update the end of the erase-ahead worker after a scan of the MTD. A block marked bad moves the
+ * following LEBs to the next PEBs: the PEB linked to the end LEB is moved too.
+ */
+//--------------------------------------------------------------------------------------------------
+static void EraseAheadUpdateEnd
+(
+    pa_flash_MtdDesc_t *descPtr  ///< [IN] MTD device descriptor
+)
+{
+    pa_flash_EraseAhead_t *eaPtr = descPtr->eraseAheadPtr;
+
+    le_mutex_Lock( eaPtr->mutexRef );
+    eaPtr->endPeb = GetEraseAheadEndPeb( descPtr, eaPtr->endLeb );
+    le_mutex_Unlock( eaPtr->mutexRef );
+    le_sem_Post( eaPtr->workSem );
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Erase-ahead worker thread: erase the PEBs of the window one by one. The bad PEBs are skipped.
+ * When the writer does not move for PA_FLASH_ERASE_AHEAD_IDLE_MS, the
+ * PEBs beyond the window are erased until the next write.
+ */
+//--------------------------------------------------------------------------------------------------
+static void* EraseAheadThread
+(
+    void* contextPtr ///< [IN] MTD device descriptor
+)
+{
+    pa_flash_MtdDesc_t *descPtr = (pa_flash_MtdDesc_t *)contextPtr;
+    pa_flash_EraseAhead_t *eaPtr = descPtr->eraseAheadPtr;
+    le_clk_Time_t idleTimeout = { .sec = 0, .usec = PA_FLASH_ERASE_AHEAD_IDLE_MS * 1000 };
+    struct erase_info_user eraseMe;
+    loff_t blkOff;
+    uint32_t peb;
+    int rc, err;
+
+    for( ;; )
+    {
+        le_mutex_Lock( eaPtr->mutexRef );
+        if( eaPtr->isAborted )
+        {
+            le_mutex_Unlock( eaPtr->mutexRef );
+            break;
+        }
+        peb = eaPtr->nextPeb;
+        if( ((uint32_t)-1 != eaPtr->failedPeb) || (peb >= eaPtr->endPeb) )
+        {
+            le_mutex_Unlock( eaPtr->mutexRef );
+            le_sem_Wait( eaPtr->workSem );
+            continue;
+        }
+        if( (!eaPtr->isFlushed) && (!eaPtr->isIdle) &&
+            (peb > (eaPtr->writePeb + eaPtr->nbBlocks)) )
+        {
+            // The window is erased: wait for the writer to move. If it does not move for a while,
+            // use this idle time to erase the next PEBs
+            eaPtr->isIdle = true;
+            le_mutex_Unlock( eaPtr->mutexRef );
+            if( LE_TIMEOUT != le_sem_WaitWithTimeOut( eaPtr->workSem, idleTimeout ) )
+            {
+                le_mutex_Lock( eaPtr->mutexRef );
+                eaPtr->isIdle = false;
+                le_mutex_Unlock( eaPtr->mutexRef );
+            }
+            continue;
+        }
+        le_mutex_Unlock( eaPtr->mutexRef );
+
+        err = 0;
+        blkOff = (((loff_t)peb) * descPtr->mtdInfo.eraseSize) + descPtr->mtdInfo.startOffset;
+        rc = ioctl(descPtr->fd, MEMGETBADBLOCK, &blkOff);
+        if( -1 == rc )
+        {
+            err = errno;
+            LE_ERROR("MTD %d: MEMGETBADBLOCK fails for peb %u offset %"PRIx64": %m",
+                     descPtr->mtdNum, peb, (uint64_t)blkOff);
+        }
+        else if( 0 == rc )
+        {
+            eraseMe.start = (uint32_t)blkOff;
+            eraseMe.length = descPtr->mtdInfo.eraseSize;
+            if( -1 == ioctl(descPtr->fd, MEMERASE, &eraseMe) )
+            {
+                err = errno;
+                LE_ERROR("MTD %d: MEMERASE fails for block %u offset %x: %m",
+                         descPtr->mtdNum, peb, eraseMe.start);
+            }
+        }
+        else
+        {
+            // Bad block: nothing to erase, the writer skips it
+        }
+
+        le_mutex_Lock( eaPtr->mutexRef );
+        if( err )
+        {
+            eaPtr->failedPeb = peb;
+            eaPtr->failedErrno = err;
+        }
+        else if( eaPtr->nextPeb == peb )
+        {
+            // The writer may have moved the window while this PEB was erased
+            eaPtr->nextPeb = peb + 1;
+        }
+        le_mutex_Unlock( eaPtr->mutexRef );
+        le_sem_Post( eaPtr->doneSem );
+    }
+
+    return NULL;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Handle an erase failure reported by the erase-ahead worker. If the descriptor is open with
+ * PA_FLASH_OPENMODE_MARKBAD, the PEB is marked bad (and the MTD is rescanned if needed).
+ *
+ * @return
+ *      - LE_UNAVAILABLE   The PEB is now marked bad, the next good one should be used
+ *      - LE_FAULT         On failure
+ *      - LE_IO_ERROR      If a flash IO error occurs
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t EraseAheadFailure
+(
+    pa_flash_MtdDesc_t *descPtr, ///< [IN] MTD device descriptor
+    uint32_t peb,                ///< [IN] PEB whose erase has failed
+    int err                      ///< [IN] errno of the failure
+)
+{
+    uint32_t blockIndex;
+    le_result_t res;
+
+    if( (EIO != err) || (!descPtr->markBad) || descPtr->ubiDontFetchPeb )
+    {
+        return (EIO == err) ? LE_IO_ERROR : LE_FAULT;
+    }
+
+    res = GetBlockIndexFromPeb( descPtr, peb, &blockIndex );
+    if( LE_OK != res )
+    {
+        return res;
+    }
+    res = pa_flash_MarkBadBlock( (pa_flash_Desc_t)descPtr, blockIndex );
+    return (LE_OK == res) ? LE_UNAVAILABLE : res;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Wait for the erase-ahead worker to have erased the given PEB before it is written. The window of
+ * the worker is moved to this PEB: if the writer has jumped ahead, the worker erases the PEBs
+ * skipped before this one. A PEB outside of the range of the worker is not waited for.
+ *
+ * @return
+ *      - LE_OK            On success or if no erase-ahead worker is running
+ *      - LE_UNAVAILABLE   The erase failed and the PEB is now marked bad, the next good one should
+ *                         be used
+ *      - LE_FAULT         On failure
+ *      - LE_IO_ERROR      If a flash IO error occurs
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t EraseAheadWait
+(
+    pa_flash_MtdDesc_t *descPtr, ///< [IN] MTD device descriptor
+    uint32_t peb                 ///< [IN] PEB to be written
+)
+{
+    pa_flash_EraseAhead_t *eaPtr = descPtr->eraseAheadPtr;
+    int err;
+
+    if( !eaPtr )
+    {
+        return LE_OK;
+    }
+
+    le_mutex_Lock( eaPtr->mutexRef );
+    if( (peb < eaPtr->startPeb) || (peb >= eaPtr->endPeb) )
+    {
+        le_mutex_Unlock( eaPtr->mutexRef );
+        return LE_OK;
+    }
+    eaPtr->writePeb = peb;
+    eaPtr->isIdle = false;
+    le_sem_Post( eaPtr->workSem );
+
+    // The PEBs skipped by a jump ahead may be read or written later, by the UBI layer for instance
+    while( peb >= eaPtr->nextPeb )
+    {
+        uint32_t failedPeb = eaPtr->failedPeb;
+        le_result_t res;
+
+        if( (uint32_t)-1 == failedPeb )
+        {
+            le_mutex_Unlock( eaPtr->mutexRef );
+            le_sem_Wait( eaPtr->doneSem );
+            le_mutex_Lock( eaPtr->mutexRef );
+            continue;
+        }
+
+        // Let the worker go on with the next PEB while the failure is handled here
+        err = eaPtr->failedErrno;
+        eaPtr->failedPeb = (uint32_t)-1;
+        eaPtr->nextPeb = failedPeb + 1;
+        le_mutex_Unlock( eaPtr->mutexRef );
+        le_sem_Post( eaPtr->workSem );
+
+        res = EraseAheadFailure( descPtr, failedPeb, err );
+        if( (failedPeb == peb) || (LE_UNAVAILABLE != res) )
+        {
+            return res;
+        }
+        le_mutex_Lock( eaPtr->mutexRef );
+    }
+    le_mutex_Unlock( eaPtr->mutexRef );
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Load the names of the MTD partitions from the MTD partition table into the MTD topology cache.
+ * It has to be called with the MTD cache lock held.
+ *
+ * @return
+ *      - LE_OK            On success
+ *      - LE_FAULT         If the MTD partition table cannot be read
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t LoadMtdTable
+(
+    void
+)
+{
+    FILE *mtdFdPtr;
+    char mtdBuf[100];
+    char *namePtr, *endPtr;
+    int mtdNum;
+
+    mtdFdPtr = fopen( PA_FLASH_PROC_MTD, "r" );
+    if( NULL == mtdFdPtr )
+    {
+        LE_ERROR( "fopen on " PA_FLASH_PROC_MTD " failed: %m" );
+        return LE_FAULT;
+    }
+
+    // Entries are: mtdN: <size> <erasesize> "<name>"
+    while( fgets( mtdBuf, sizeof(mtdBuf), mtdFdPtr ) )
+    {
+        namePtr = strchr( mtdBuf, '"' );
+        endPtr = strrchr( mtdBuf, '"' );
+        if( (1 != sscanf( mtdBuf, "mtd%d", &mtdNum )) || (!namePtr) || (endPtr == namePtr) )
+        {
+            continue;
+        }
+        if( (mtdNum < 0) || (mtdNum >= PA_FLASH_MAX_MTD) )
+        {
+            LE_WARN( "MTD %d is not cached", mtdNum );
+            continue;
         }
+        *endPtr = '\0';
+        le_utf8_Copy( MtdCache[mtdNum].name, namePtr + 1, sizeof(MtdCache[mtdNum].name), NULL );
+        MtdCache[mtdNum].isNameKnown = true;
     }
+    fclose( mtdFdPtr );
 
-    *pebPtr = peb;
-    *offsetPtr = pOffset;
+    IsMtdTableLoaded = true;
     return LE_OK;
 }
 
 //--------------------------------------------------------------------------------------------------
 /**
- * Get flash information
+ * Read the geometry and the name of a MTD partition from /sys/class/mtd/mtdN
  *
  * @return
  *      - LE_OK            On success
- *      - LE_BAD_PARAMETER If infoPtr is NULL
  *      - LE_UNSUPPORTED   If the flash informations cannot be read
  */
 //--------------------------------------------------------------------------------------------------
-le_result_t pa_flash_GetInfo
+static le_result_t ReadMtdGeometry
 (
-    int mtdNum,
-    pa_flash_Info_t *infoPtr,
-    bool isLogical,
-    bool isDual
+    int mtdNum,                     ///< [IN] MTD number
+    pa_flash_MtdCache_t *mtdPtr     ///< [OUT] Geometry and name of the MTD
 )
 {
     FILE *mtdFdPtr;
     char mtd[PA_FLASH_SYS_CLASS_MTD_LENGTH];
     char *crPtr;
 
-    if( !infoPtr )
-    {
-        return LE_BAD_PARAMETER;
-    }
-
-    memset( infoPtr, 0, sizeof(pa_flash_Info_t) );
+    memset( mtdPtr, 0, sizeof(*mtdPtr) );
 
     // If MTD number is valid, try to read the partition size
     snprintf( mtd, sizeof(mtd), PA_FLASH_SYS_CLASS_MTD "size", mtdNum );
@@ -172,7 +781,7 @@ le_result_t pa_flash_GetInfo
         LE_ERROR( "Unable to read page size for mtd %d: %m\n", mtdNum );
         return LE_UNSUPPORTED;
     }
-    fscanf( mtdFdPtr, "%u", &(infoPtr->size) );
+    fscanf( mtdFdPtr, "%u", &(mtdPtr->size) );
     fclose( mtdFdPtr );
 
     // If MTD number is valid, try to read the partition write size
@@ -183,7 +792,7 @@ le_result_t pa_flash_GetInfo
         LE_ERROR( "Unable to read write size for mtd %d: %m\n", mtdNum );
         return LE_UNSUPPORTED;
     }
-    fscanf( mtdFdPtr, "%u", &(infoPtr->writeSize) );
+    fscanf( mtdFdPtr, "%u", &(mtdPtr->writeSize) );
     fclose( mtdFdPtr );
 
     // If MTD number is valid, try to read the partition erase size
@@ -194,7 +803,7 @@ le_result_t pa_flash_GetInfo
         LE_ERROR( "Unable to read erase size for mtd %d: %m\n", mtdNum );
         return LE_UNSUPPORTED;
     }
-    fscanf( mtdFdPtr, "%u", &(infoPtr->eraseSize) );
+    fscanf( mtdFdPtr, "%u", &(mtdPtr->eraseSize) );
     fclose( mtdFdPtr );
 
     // If MTD number is valid, try to read the partition name
@@ -205,14 +814,150 @@ le_result_t pa_flash_GetInfo
         LE_ERROR( "Unable to read partition name for mtd %d: %m\n", mtdNum );
         return LE_UNSUPPORTED;
     }
-    fgets( infoPtr->name, PA_FLASH_MAX_INFO_NAME, mtdFdPtr );
+    fgets( mtdPtr->name, PA_FLASH_MAX_INFO_NAME, mtdFdPtr );
     fclose( mtdFdPtr );
-    crPtr = strchr( infoPtr->name, '\n' );
+    crPtr = strchr( mtdPtr->name, '\n' );
     if( crPtr )
     {
         *crPtr = '\0';
     }
 
+    LE_INFO("MTD %d \"%s\": size %x, writeSize %x, eraseSize %x\n",
+            mtdNum,
+            mtdPtr->name,
+            mtdPtr->size,
+            mtdPtr->writeSize,
+            mtdPtr->eraseSize);
+
+    mtdPtr->isNameKnown = true;
+    mtdPtr->isGeometryKnown = true;
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Get the MTD number of a partition from its name. The MTD partition table is read once and kept
+ * into the MTD topology cache.
+ *
+ * @return
+ *      - LE_OK            On success
+ *      - LE_BAD_PARAMETER If a parameter is NULL
+ *      - LE_NOT_FOUND     If no MTD partition has this name
+ *      - LE_FAULT         If the MTD partition table cannot be read
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t pa_flash_GetMtdFromName
+(
+    const char *namePtr,
+    int *mtdNumPtr
+)
+{
+    le_result_t res;
+    int mtdNum;
+
+    if( (!namePtr) || (!mtdNumPtr) )
+    {
+        return LE_BAD_PARAMETER;
+    }
+
+    *mtdNumPtr = -1;
+    pthread_mutex_lock( &MtdCacheMutex );
+    res = IsMtdTableLoaded ? LE_OK : LoadMtdTable();
+    if( LE_OK == res )
+    {
+        res = LE_NOT_FOUND;
+        for( mtdNum = 0; mtdNum < PA_FLASH_MAX_MTD; mtdNum++ )
+        {
+            if( MtdCache[mtdNum].isNameKnown && (0 == strcmp( MtdCache[mtdNum].name, namePtr )) )
+            {
+                *mtdNumPtr = mtdNum;
+                res = LE_OK;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock( &MtdCacheMutex );
+
+    return res;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Invalidate the MTD topology cache. The MTD partition table and the geometry of the partitions
+ * are read again at the next lookup.
+ */
+//--------------------------------------------------------------------------------------------------
+void pa_flash_InvalidateMtdCache
+(
+    void
+)
+{
+    pthread_mutex_lock( &MtdCacheMutex );
+    memset( MtdCache, 0, sizeof(MtdCache) );
+    IsMtdTableLoaded = false;
+    pthread_mutex_unlock( &MtdCacheMutex );
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Get flash information
+ *
+ * @return
+ *      - LE_OK            On success
+ *      - LE_BAD_PARAMETER If infoPtr is NULL
+ *      - LE_UNSUPPORTED   If the flash informations cannot be read
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t pa_flash_GetInfo
+(
+    int mtdNum,
+    pa_flash_Info_t *infoPtr,
+    bool isLogical,
+    bool isDual
+)
+{
+    pa_flash_MtdCache_t mtdCache;
+    le_result_t res = LE_OK;
+
+    if( !infoPtr )
+    {
+        return LE_BAD_PARAMETER;
+    }
+
+    memset( infoPtr, 0, sizeof(pa_flash_Info_t) );
+
+    // The geometry is read from /sys/class/mtd/mtdN only at the first call for this MTD
+    if( (mtdNum >= 0) && (mtdNum < PA_FLASH_MAX_MTD) )
+    {
+        pthread_mutex_lock( &MtdCacheMutex );
+        if( MtdCache[mtdNum].isGeometryKnown )
+        {
+            mtdCache = MtdCache[mtdNum];
+        }
+        else
+        {
+            res = ReadMtdGeometry( mtdNum, &mtdCache );
+            if( LE_OK == res )
+            {
+                MtdCache[mtdNum] = mtdCache;
+            }
+        }
+        pthread_mutex_unlock( &MtdCacheMutex );
+    }
+    else
+    {
+        res = ReadMtdGeometry( mtdNum, &mtdCache );
+    }
+    if( LE_OK != res )
+    {
+        return res;
+    }
+
+    infoPtr->size = mtdCache.size;
+    infoPtr->writeSize = mtdCache.writeSize;
+    infoPtr->eraseSize = mtdCache.eraseSize;
+    le_utf8_Copy( infoPtr->name, mtdCache.name, sizeof(infoPtr->name), NULL );
+
     if( isLogical )
     {
         infoPtr->size /= 2;
@@ -222,13 +967,13 @@ le_result_t pa_flash_GetInfo
     infoPtr->nbLeb = infoPtr->nbBlk;
     infoPtr->startOffset = (isLogical && isDual) ? infoPtr->size : 0;
 
-    LE_INFO("MTD %d \"%s\": size %x (nbBlk %u), writeSize %x, eraseSize %x\n",
-            mtdNum,
-            infoPtr->name,
-            infoPtr->size,
-            infoPtr->nbBlk,
-            infoPtr->writeSize,
-            infoPtr->eraseSize);
+    LE_DEBUG("MTD %d \"%s\": size %x (nbBlk %u), writeSize %x, eraseSize %x\n",
+             mtdNum,
+             infoPtr->name,
+             infoPtr->size,
+             infoPtr->nbBlk,
+             infoPtr->writeSize,
+             infoPtr->eraseSize);
     if( isLogical )
     {
         LE_INFO("MTD %d: Logical %d Dual %d startOffset %x\n",
@@ -377,7 +1122,13 @@ le_result_t pa_flash_Open
     mtdDescPtr->mtdNum = mtdNum;
     mtdDescPtr->scanDone = false;
     mtdDescPtr->markBad = markBad;
+    mtdDescPtr->skipErasedPages = true;
     rc = pa_flash_GetInfo( mtdNum, &(mtdDescPtr->mtdInfo), isLogical, isDual );
+    if( (LE_OK == rc) && (mtdDescPtr->mtdInfo.writeSize > PA_FLASH_MAX_WRITE_SIZE) )
+    {
+        LE_ERROR("MTD %d: write size %u is not supported", mtdNum, mtdDescPtr->mtdInfo.writeSize);
+        rc = LE_UNSUPPORTED;
+    }
     if( LE_OK != rc )
     {
         close(mtdDescPtr->fd);
@@ -422,6 +1173,8 @@ le_result_t pa_flash_Close
     {
         return LE_BAD_PARAMETER;
     }
+    // Stop the erase-ahead worker if any
+    pa_flash_StopEraseAhead( desc, false );
     // Close and release the MTD descriptor
     descPtr->magic = NULL;
     close(descPtr->fd);
@@ -453,8 +1206,8 @@ le_result_t pa_flash_Scan
 {
     pa_flash_MtdDesc_t *descPtr = (pa_flash_MtdDesc_t *)desc;
     uint32_t peb, leb;
-    loff_t blkOff;
-    int rc;
+    le_result_t res;
+    bool isBad;
 
     if( (!descPtr) || (descPtr->magic != desc) )
     {
@@ -474,20 +1227,16 @@ le_result_t pa_flash_Scan
     leb = 0;
     for( peb = 0; peb < descPtr->mtdInfo.nbBlk; peb++ )
     {
-        blkOff = (peb * descPtr->mtdInfo.eraseSize)
-                     + descPtr->mtdInfo.startOffset;
-
         // For all PEB belonging to the flash partition, check if bad and
-        // register it as LEB if good, skip it if bad
-        rc = ioctl(descPtr->fd, MEMGETBADBLOCK, &blkOff);
-        if( -1 == rc )
+        // register it as LEB if good, skip it if bad. The PEBs already classified are taken
+        // from the bad block bitmap, so a rescan does not access the flash again.
+        res = GetBadBlockState( descPtr, peb, &isBad );
+        if( LE_OK != res )
         {
-            LE_ERROR("MTD %d: MEMGETBADBLOCK fails for block %u, offset %"PRIx64": %m",
-                     descPtr->mtdNum, peb, (uint64_t)blkOff);
             memset( descPtr->lebToPeb, PA_FLASH_ERASED_VALUE, sizeof(descPtr->lebToPeb) );
-            return (EIO == errno) ? LE_IO_ERROR : LE_FAULT;
+            return res;
         }
-        if( 0 == rc )
+        if( !isBad )
         {
             // Register a new LEB on this PEB
             descPtr->lebToPeb[leb] = peb;
@@ -504,6 +1253,12 @@ le_result_t pa_flash_Scan
     descPtr->mtdInfo.nbLeb = leb;
     LE_INFO("MTD %d: LEB %u PEB %u\n", descPtr->mtdNum, leb, peb );
 
+    if( descPtr->eraseAheadPtr )
+    {
+        // A block may have been marked bad: the end of the erase-ahead worker follows its LEB
+        EraseAheadUpdateEnd( descPtr );
+    }
+
     if( lebToPebPtr )
     {
         // If resquested by caller, return a pointer to the LEB to PEB array
@@ -567,9 +1322,7 @@ le_result_t pa_flash_CheckBadBlock
 )
 {
     pa_flash_MtdDesc_t *descPtr = (pa_flash_MtdDesc_t *)desc;
-    loff_t blkOff;
     uint32_t peb = blockIndex;
-    int rc;
 
     if( (!descPtr) || (descPtr->magic != desc) || (!isBadBlock) )
     {
@@ -591,20 +1344,8 @@ le_result_t pa_flash_CheckBadBlock
         }
     }
 
-    // Compute the block offset of the PEB and add the startOffset of the
-    // logical partition
-    blkOff = (peb * descPtr->mtdInfo.eraseSize) + descPtr->mtdInfo.startOffset;
-    rc = ioctl(descPtr->fd, MEMGETBADBLOCK, &blkOff);
-    if( -1 == rc )
-    {
-        LE_ERROR("MTD %d: MEMGETBADBLOCK fails for block %u (peb %u), offset %"PRIx64": %m",
-                 descPtr->mtdNum, blockIndex, peb, (uint64_t)blkOff);
-        return (EIO == errno) ? LE_IO_ERROR : LE_FAULT;
-    }
-    // Update the isBadBlock parameter: 0 = false : good block, 1 = true : bad block
-    *isBadBlock = (rc ? true : false);
-
-    return LE_OK;
+    // Update the isBadBlock parameter: false : good block, true : bad block
+    return GetBadBlockState( descPtr, peb, isBadBlock );
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -664,6 +1405,7 @@ le_result_t pa_flash_MarkBadBlock
         return (EIO == errno) ? LE_IO_ERROR : LE_FAULT;
     }
     LE_INFO("MTD %d: Marked bad block %u (peb %u)\n", descPtr->mtdNum, blockIndex, peb);
+    SetBadBlockState( descPtr, peb );
 
     return ( descPtr->scanDone ) ? pa_flash_Scan( desc, NULL ) : LE_OK;
 }
@@ -965,7 +1707,8 @@ le_result_t pa_flash_Read
 /**
  * Write the data starting at current position. If the write operation fails, try to erase the
  * block and re do the write. If the erase fails, the error LE_IO_ERROR is returned and operation
- * is aborted.
+ * is aborted. The pages holding only PA_FLASH_ERASED_VALUE are not programmed, unless disabled by
+ * pa_flash_SetSkipErasedPages.
  * Note that the block should be erased before the first write (pa_flash_EraseAtBlock)
  * Note that the length should be a multiple of writeSize and should not be greater than eraseSize
  *
@@ -986,10 +1729,10 @@ le_result_t pa_flash_Write
 )
 {
     pa_flash_MtdDesc_t *descPtr = (pa_flash_MtdDesc_t *)desc;
-    uint32_t peb;
+    uint32_t peb, blockIndex;
     off_t pOffset;
-    bool tryWrite;
-    int rc;
+    bool tryWrite, isBulk;
+    ssize_t rc;
     le_result_t res;
 
     if( (!descPtr) || (descPtr->magic != desc) || (!dataPtr) )
@@ -1003,56 +1746,97 @@ le_result_t pa_flash_Write
     }
 
     size_t remain = (dataSize & (descPtr->mtdInfo.writeSize - 1));
-    uint8_t padBlock[ descPtr->mtdInfo.writeSize ];
+    uint8_t *padBlockPtr = descPtr->padBlock;
     int32_t nbWrite = dataSize / descPtr->mtdInfo.writeSize;
     if( remain )
     {
-        memcpy( padBlock, dataPtr + (dataSize & (~(descPtr->mtdInfo.writeSize - 1))), remain );
-        memset( padBlock + remain, 0xFF, descPtr->mtdInfo.writeSize - remain );
+        memcpy( padBlockPtr, dataPtr + (dataSize & (~(descPtr->mtdInfo.writeSize - 1))), remain );
+        memset( padBlockPtr + remain, 0xFF, descPtr->mtdInfo.writeSize - remain );
         remain = descPtr->mtdInfo.writeSize - remain;
     }
 
     tryWrite = false;
+    isBulk = true;
     do
     {
-        res = GetBlock( descPtr, &pOffset, &peb );
+        do
+        {
+            res = GetBlock( descPtr, &pOffset, &peb );
+            if( LE_OK != res )
+            {
+                return res;
+            }
+            if( !((uint32_t)pOffset & (descPtr->mtdInfo.eraseSize - 1)) )
+            {
+                // Wait for the block to be erased by the erase-ahead worker if any. If its erase
+                // has failed and it is now marked bad, fetch the next good block.
+                res = EraseAheadWait( descPtr, peb );
+            }
+        }
+        while( LE_UNAVAILABLE == res );
         if( LE_OK != res )
         {
             return res;
         }
 
+        // When the write starts at an erase block frontier, program all the full pages with a
+        // single write. On failure, the block is erased again and the pages are programmed one by
+        // one, with the per page recovery below.
+        if( isBulk && (nbWrite > 1) &&
+            (!((uint32_t)pOffset & (descPtr->mtdInfo.eraseSize - 1))) )
+        {
+            size_t bulkSize = (size_t)nbWrite * descPtr->mtdInfo.writeSize;
+
+            isBulk = false;
+            rc = WritePages( descPtr, dataPtr, nbWrite );
+            if( rc == (ssize_t)bulkSize )
+            {
+                dataPtr += bulkSize;
+                nbWrite = 0;
+            }
+            else
+            {
+                LE_ERROR("MTD %d: bulk write fails (%zd) at peb %u offset %lx: %m",
+                         descPtr->mtdNum, rc, peb, pOffset);
+                if( (-1 == rc) && (EIO != errno) )
+                {
+                    return LE_FAULT;
+                }
+                // Some pages may be programmed: erase the block before the page per page retry.
+                // WritePages has moved the position back to the block start, so the retry starts
+                // there, or at the next good block if this one is now marked bad.
+                res = GetBlockIndexFromPeb( descPtr, peb, &blockIndex );
+                if( LE_OK == res )
+                {
+                    res = pa_flash_EraseBlock( desc, blockIndex );
+                }
+                if( LE_OK != res )
+                {
+                    return res;
+                }
+                tryWrite = true;
+                continue;
+            }
+        }
+
         do
         {
             while( nbWrite > 0 )
             {
-                rc = write(descPtr->fd, dataPtr, descPtr->mtdInfo.writeSize);
-                if( (-1 == rc) || (rc != descPtr->mtdInfo.writeSize) )
+                rc = WritePages( descPtr, dataPtr, 1 );
+                if( (-1 == rc) || (rc != (ssize_t)descPtr->mtdInfo.writeSize) )
                 {
-                    LE_ERROR("MTD %d: write fails (%d) at peb %u offset %lx: %m",
+                    LE_ERROR("MTD %d: write fails (%zd) at peb %u offset %lx: %m",
                              descPtr->mtdNum, rc, peb, pOffset);
                     if( (-1 == rc) && (EIO == errno) &&
                         (!((uint32_t)pOffset & (descPtr->mtdInfo.eraseSize - 1))) )
                     {
-                        int iLeb, leb = -1;
-
-                        if( descPtr->scanDone )
+                        res = GetBlockIndexFromPeb( descPtr, peb, &blockIndex );
+                        if( LE_OK != res )
                         {
-                            // Retrieve the LEB from PEB
-                            for( iLeb = 0; iLeb < descPtr->mtdInfo.nbLeb; iLeb++ )
-                            {
-                                if( peb == descPtr->lebToPeb[iLeb] )
-                                {
-                                    leb = iLeb;
-                                    break;
-                                }
-                            }
-                            if( -1 == leb )
-                            {
-                                LE_CRIT("No LEB found for PEB %u", peb);
-                                return LE_IO_ERROR;
-                            }
+                            return res;
                         }
-                        res = pa_flash_EraseBlock( desc, (descPtr->scanDone ? leb : peb) );
+                        res = pa_flash_EraseBlock( desc, blockIndex );
                         if( LE_OK != res )
                         {
                             return res;
@@ -1073,7 +1857,7 @@ le_result_t pa_flash_Write
             }
             if( remain )
             {
-                dataPtr = padBlock;
+                dataPtr = padBlockPtr;
                 remain = 0;
                 nbWrite = 1;
             }
@@ -1183,3 +1967,190 @@ le_result_t pa_flash_WriteAtBlock
     return res;
 }
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Enable or disable the skip of the erased pages by pa_flash_Write. It is enabled when the
+ * descriptor is open. A flash whose erased pages must be programmed, for example to write their
+ * ECC or OOB data, should disable it.
+ *
+ * @return
+ *      - LE_OK            On success
+ *      - LE_BAD_PARAMETER If desc is NULL
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t pa_flash_SetSkipErasedPages
+(
+    pa_flash_Desc_t desc,
+    bool isSkipped
+)
+{
+    pa_flash_MtdDesc_t *descPtr = (pa_flash_MtdDesc_t *)desc;
+
+    if( (!descPtr) || (descPtr->magic != desc) )
+    {
+        return LE_BAD_PARAMETER;
+    }
+
+    descPtr->skipErasedPages = isSkipped;
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Start an erase-ahead worker on a flash descriptor. From the current position up to the given
+ * block, a worker thread keeps the next blocks erased while the current one is written by
+ * pa_flash_Write: the writer only waits when it overtakes the worker. The caller should not erase
+ * these blocks itself. The blocks beyond the window are erased while the writer is idle.
+ * If the descriptor is open with PA_FLASH_OPENMODE_MARKBAD, a block whose erase fails is marked
+ * bad by pa_flash_Write and the next good block is used, as for pa_flash_EraseBlock.
+ *
+ * @return
+ *      - LE_OK            On success
+ *      - LE_BAD_PARAMETER If desc is NULL or nbBlocks is 0
+ *      - LE_BUSY          If an erase-ahead worker is already running on this descriptor
+ *      - LE_OUT_OF_RANGE  If the block is outside the partition
+ *      - LE_FAULT         On failure
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t pa_flash_StartEraseAhead
+(
+    pa_flash_Desc_t desc,
+    uint32_t nbBlocks,
+    uint32_t endBlockIndex
+)
+{
+    pa_flash_MtdDesc_t *descPtr = (pa_flash_MtdDesc_t *)desc;
+    pa_flash_EraseAhead_t *eaPtr;
+    uint32_t startPeb, endPeb;
+    off_t pOffset;
+
+    if( (!descPtr) || (descPtr->magic != desc) || (0 == nbBlocks) )
+    {
+        return LE_BAD_PARAMETER;
+    }
+    if( descPtr->eraseAheadPtr )
+    {
+        return LE_BUSY;
+    }
+    if( endBlockIndex > descPtr->mtdInfo.nbLeb )
+    {
+        return LE_OUT_OF_RANGE;
+    }
+
+    pOffset = lseek(descPtr->fd, 0, SEEK_CUR);
+    if( -1 == pOffset )
+    {
+        LE_ERROR("MTD %d: lseek fails for retrieve offset: %m\n", descPtr->mtdNum);
+        return LE_FAULT;
+    }
+    // A block partially written is not erased
+    pOffset -= (off_t)descPtr->mtdInfo.startOffset;
+    startPeb = ((uint32_t)pOffset + descPtr->mtdInfo.eraseSize - 1) / descPtr->mtdInfo.eraseSize;
+    endPeb = GetEraseAheadEndPeb( descPtr, endBlockIndex );
+
+    if( NULL == FlashEraseAheadPool )
+    {
+        FlashEraseAheadPool = le_mem_CreatePool("FlashEraseAheadPool",
+                                                sizeof(pa_flash_EraseAhead_t));
+        le_mem_ExpandPool(FlashEraseAheadPool, 1);
+    }
+    eaPtr = (pa_flash_EraseAhead_t*)le_mem_ForceAlloc(FlashEraseAheadPool);
+    memset(eaPtr, 0, sizeof(pa_flash_EraseAhead_t));
+    eaPtr->startPeb = startPeb;
+    eaPtr->nextPeb = startPeb;
+    eaPtr->writePeb = startPeb;
+    eaPtr->endLeb = endBlockIndex;
+    eaPtr->endPeb = endPeb;
+    eaPtr->nbBlocks = nbBlocks;
+    eaPtr->failedPeb = (uint32_t)-1;
+    eaPtr->mutexRef = le_mutex_CreateNonRecursive("FlashEraseAhead");
+    eaPtr->workSem = le_sem_Create("FlashEraseWork", 0);
+    eaPtr->doneSem = le_sem_Create("FlashEraseDone", 0);
+    descPtr->eraseAheadPtr = eaPtr;
+
+    LE_DEBUG("MTD %d: erase-ahead of %u blocks, PEB %u to %u",
+             descPtr->mtdNum, nbBlocks, startPeb, endPeb);
+    eaPtr->threadRef = le_thread_Create("FlashEraseAhead", EraseAheadThread, descPtr);
+    le_thread_SetJoinable(eaPtr->threadRef);
+    le_thread_Start(eaPtr->threadRef);
+
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Stop the erase-ahead worker of a flash descriptor. If isFlushed is set, all the blocks up to the
+ * end given to pa_flash_StartEraseAhead are erased before.
+ *
+ * @return
+ *      - LE_OK            On success or if no erase-ahead worker is running
+ *      - LE_BAD_PARAMETER If desc is NULL
+ *      - LE_FAULT         On failure
+ *      - LE_IO_ERROR      If a flash IO error occurs while flushing
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t pa_flash_StopEraseAhead
+(
+    pa_flash_Desc_t desc,
+    bool isFlushed
+)
+{
+    pa_flash_MtdDesc_t *descPtr = (pa_flash_MtdDesc_t *)desc;
+    pa_flash_EraseAhead_t *eaPtr;
+    le_result_t res = LE_OK;
+
+    if( (!descPtr) || (descPtr->magic != desc) )
+    {
+        return LE_BAD_PARAMETER;
+    }
+    eaPtr = descPtr->eraseAheadPtr;
+    if( !eaPtr )
+    {
+        return LE_OK;
+    }
+
+    le_mutex_Lock( eaPtr->mutexRef );
+    eaPtr->isFlushed = isFlushed;
+    while( isFlushed )
+    {
+        uint32_t peb;
+        int err;
+
+        le_sem_Post( eaPtr->workSem );
+        while( (eaPtr->nextPeb < eaPtr->endPeb) && ((uint32_t)-1 == eaPtr->failedPeb) )
+        {
+            le_mutex_Unlock( eaPtr->mutexRef );
+            le_sem_Wait( eaPtr->doneSem );
+            le_mutex_Lock( eaPtr->mutexRef );
+        }
+        if( (uint32_t)-1 == eaPtr->failedPeb )
+        {
+            break;
+        }
+        peb = eaPtr->failedPeb;
+        err = eaPtr->failedErrno;
+        eaPtr->failedPeb = (uint32_t)-1;
+        eaPtr->nextPeb = peb + 1;
+        le_mutex_Unlock( eaPtr->mutexRef );
+
+        res = EraseAheadFailure( descPtr, peb, err );
+        le_mutex_Lock( eaPtr->mutexRef );
+        if( LE_UNAVAILABLE != res )
+        {
+            break;
+        }
+        res = LE_OK;
+    }
+    eaPtr->isAborted = true;
+    le_mutex_Unlock( eaPtr->mutexRef );
+    le_sem_Post( eaPtr->workSem );
+
+    le_thread_Join( eaPtr->threadRef, NULL );
+    le_sem_Delete( eaPtr->workSem );
+    le_sem_Delete( eaPtr->doneSem );
+    le_mutex_Delete( eaPtr->mutexRef );
+    descPtr->eraseAheadPtr = NULL;
+    le_mem_Release( eaPtr );
+
+    return res;
+}
@@ -12,6 +12,7 @@
 #include "flash-ubi.h"
 #include "pa_flash.h"
 #include "pa_flash_local.h"
+#include "crc32_local.h"
 
 // Need some internal config values from the kernel configuration
 // Because there is no entry in /sys or /proc to read these values
@@ -114,7 +115,7 @@ static void CreateEcHeader
     ecHdrPtr->vid_hdr_offset = htobe32(infoPtr->writeSize);
     ecHdrPtr->data_offset = htobe32(2 * infoPtr->writeSize);
     ecHdrPtr->image_seq = htobe32(UBI_IMAGE_SEQ_BASE);
-    crc = le_crc_Crc32( (uint8_t *)ecHdrPtr, UBI_EC_HDR_SIZE_CRC, LE_CRC_START_CRC32 );
+    crc = crc32_Compute( (uint8_t *)ecHdrPtr, UBI_EC_HDR_SIZE_CRC, LE_CRC_START_CRC32 );
     ecHdrPtr->hdr_crc = htobe32(crc);
 
 }
@@ -145,14 +146,200 @@ static void CreateVidHeader
     {
         vidHdrPtr->used_ebs = htobe32(reservedPebs);
     }
-    crc = le_crc_Crc32( (uint8_t *)vidHdrPtr, UBI_VID_HDR_SIZE_CRC, LE_CRC_START_CRC32 );
+    crc = crc32_Compute( (uint8_t *)vidHdrPtr, UBI_VID_HDR_SIZE_CRC, LE_CRC_START_CRC32 );
     vidHdrPtr->hdr_crc = htobe32(crc);
 }
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Compare two entries of the free PEB pool: the lowest erase counter first, then the lowest PEB
+ *
+ * @return
+ *      - true             If the entry A should be taken before the entry B
+ *      - false            Otherwise
+ */
+//--------------------------------------------------------------------------------------------------
+static bool IsFreePebBefore
+(
+    const pa_flash_UbiFreePeb_t* aPtr,  ///< [IN] Entry A
+    const pa_flash_UbiFreePeb_t* bPtr   ///< [IN] Entry B
+)
+{
+    return (aPtr->ec < bPtr->ec) || ((aPtr->ec == bPtr->ec) && (aPtr->peb < bPtr->peb));
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Add a PEB into the free PEB pool of the UBI partition. Nothing is done if the pool was not built
+ * by the UBI scan.
+ */
+//--------------------------------------------------------------------------------------------------
+static void PushFreePeb
+(
+    pa_flash_MtdDesc_t* descPtr,   ///< [IN] Private flash descriptor
+    uint32_t            peb,       ///< [IN] Free PEB
+    uint64_t            ec         ///< [IN] Erase counter of the PEB, 0 if the PEB is blank
+)
+{
+    pa_flash_UbiFreePeb_t* heapPtr = descPtr->ubiFreePeb;
+    pa_flash_UbiFreePeb_t entry = { .ec = ec, .peb = peb };
+    uint32_t idx, parent;
+
+    if( (!descPtr->isUbiFreePebPool) || (descPtr->ubiFreePebCnt >= PA_FLASH_MAX_LEB) )
+    {
+        return;
+    }
+
+    idx = descPtr->ubiFreePebCnt++;
+    while( idx > 0 )
+    {
+        parent = (idx - 1) / 2;
+        if( !IsFreePebBefore( &entry, &heapPtr[parent] ) )
+        {
+            break;
+        }
+        heapPtr[idx] = heapPtr[parent];
+        idx = parent;
+    }
+    heapPtr[idx] = entry;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Remove the PEB with the lowest erase counter from the free PEB pool of the UBI partition
+ *
+ * @return
+ *      - true             If a PEB is returned
+ *      - false            If the pool is empty
+ */
+//--------------------------------------------------------------------------------------------------
+static bool PopFreePeb
+(
+    pa_flash_MtdDesc_t*    descPtr,   ///< [IN] Private flash descriptor
+    pa_flash_UbiFreePeb_t* entryPtr   ///< [OUT] Free PEB and its erase counter
+)
+{
+    pa_flash_UbiFreePeb_t* heapPtr = descPtr->ubiFreePeb;
+    pa_flash_UbiFreePeb_t last;
+    uint32_t idx = 0, child;
+
+    if( 0 == descPtr->ubiFreePebCnt )
+    {
+        return false;
+    }
+
+    *entryPtr = heapPtr[0];
+    last = heapPtr[--descPtr->ubiFreePebCnt];
+    while( (child = (2 * idx) + 1) < descPtr->ubiFreePebCnt )
+    {
+        if( ((child + 1) < descPtr->ubiFreePebCnt) &&
+            IsFreePebBefore( &heapPtr[child + 1], &heapPtr[child] ) )
+        {
+            child++;
+        }
+        if( !IsFreePebBefore( &heapPtr[child], &last ) )
+        {
+            break;
+        }
+        heapPtr[idx] = heapPtr[child];
+        idx = child;
+    }
+    heapPtr[idx] = last;
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Get a new block from the free PEB pool built by the UBI scan. Only the headers of the PEB taken
+ * are read: a PEB which became bad or was used since the scan is dropped from the pool.
+ *
+ * @return
+ *      - LE_OK            On success
+ *      - LE_OUT_OF_RANGE  If no free PEB remains
+ *      - others           Depending of the flash operations
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t GetNewBlockFromPool
+(
+    pa_flash_MtdDesc_t* descPtr,   ///< [IN] Private flash descriptor
+    uint8_t*            blockPtr,  ///< [IN] Temporary block buffer to use for reading and return
+                                   ///< [IN] the ec header and vid header
+    uint64_t*           ecPtr,     ///< [OUT] Erase count value of the PEB, 0 if blank
+    uint32_t*           pebPtr     ///< [OUT] PEB found
+)
+{
+    pa_flash_Info_t* infoPtr = &descPtr->mtdInfo;
+    pa_flash_UbiFreePeb_t entry;
+    struct ubi_ec_hdr *ecHdrPtr;
+    struct ubi_vid_hdr *vidHdrPtr;
+    uint64_t pec;
+    bool isBad;
+    le_result_t res;
+
+    while( PopFreePeb( descPtr, &entry ) )
+    {
+        if( (entry.peb == descPtr->vtblPeb[0]) || (entry.peb == descPtr->vtblPeb[1]) )
+        {
+            continue;
+        }
+        res = pa_flash_CheckBadBlock( descPtr, entry.peb, &isBad );
+        if (LE_OK != res)
+        {
+            PushFreePeb( descPtr, entry.peb, entry.ec );
+            return res;
+        }
+        if (isBad)
+        {
+            LE_WARN("Skipping bad block %u", entry.peb);
+            descPtr->ubiBadBlkCnt++;
+            infoPtr->ubiPebFreeCount--;
+            continue;
+        }
+
+        res = pa_flash_ReadAtBlock( descPtr,
+                                    entry.peb,
+                                    blockPtr,
+                                    (infoPtr->writeSize * 2));
+        if (LE_OK != res)
+        {
+            PushFreePeb( descPtr, entry.peb, entry.ec );
+            return res;
+        }
+        ecHdrPtr = (struct ubi_ec_hdr *)blockPtr;
+        if( (ERASED_VALUE_32 == ecHdrPtr->magic) || (0 == be64toh(ecHdrPtr->ec)) )
+        {
+            pec = 0;
+        }
+        else
+        {
+            vidHdrPtr = (struct ubi_vid_hdr *)(blockPtr + be32toh(ecHdrPtr->vid_hdr_offset));
+            if( ERASED_VALUE_32 != vidHdrPtr->magic )
+            {
+                LE_WARN("PEB %u is no longer free", entry.peb);
+                infoPtr->ubiPebFreeCount--;
+                continue;
+            }
+            pec = be64toh(ecHdrPtr->ec);
+        }
+
+        *pebPtr = entry.peb;
+        *ecPtr = pec;
+        infoPtr->ubiPebFreeCount--;
+        UpdateVolFreeSize(infoPtr);
+        LE_INFO("Get block at %u: ec %"PRIu64, entry.peb, pec);
+        return LE_OK;
+    }
+
+    UpdateVolFreeSize(infoPtr);
+    LE_CRIT("No block to add one on volume %d", descPtr->ubiVolumeId);
+    return LE_OUT_OF_RANGE;
+}
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Get a new block into the UBI partition with the lowest eraseCount or at least lower that the
- * given eraseCount
+ * given eraseCount. If the free PEB pool was built by the UBI scan, the block is taken from it.
+ * Else all the PEBs are read to find a free one.
  *
  * @return
  *      - LE_OK            On success
@@ -181,6 +368,11 @@ static le_result_t GetNewBlock
     int32_t badBlkDiff;
     le_result_t res;
 
+    if( descPtr->isUbiFreePebPool )
+    {
+        return GetNewBlockFromPool( descPtr, blockPtr, ecPtr, pebPtr );
+    }
+
     for( ieb = 0; ieb < infoPtr->nbLeb; ieb++ )
     {
         int lebIndex;
@@ -414,7 +606,7 @@ static void UpdateEraseCounter
                 descPtr->mtdNum, descPtr->ubiVolumeId);
     }
     ecHdrPtr->ec = htobe64(ec);
-    crc = le_crc_Crc32( (uint8_t *)ecHdrPtr, UBI_EC_HDR_SIZE_CRC, LE_CRC_START_CRC32 );
+    crc = crc32_Compute( (uint8_t *)ecHdrPtr, UBI_EC_HDR_SIZE_CRC, LE_CRC_START_CRC32 );
     ecHdrPtr->hdr_crc = htobe32(crc);
 }
 
@@ -466,14 +658,14 @@ static le_result_t UpdateVidBlock
         if ((UBI_NO_SIZE != newSize))
         {
             vidHdrPtr->data_size = htobe32(newSize);
-            crc = le_crc_Crc32(blockPtr + be32toh(ecHdrPtr->data_offset),
-                               newSize, LE_CRC_START_CRC32);
+            crc = crc32_Compute(blockPtr + be32toh(ecHdrPtr->data_offset),
+                                newSize, LE_CRC_START_CRC32);
             vidHdrPtr->data_crc = htobe32(crc);
             LE_DEBUG("Update VID Header at PEB %u: DSZ %u (newSize %u)",
                      peb, be32toh(vidHdrPtr->data_size), newSize);
         }
         vidHdrPtr->used_ebs = htobe32(reservedPebs);
-        crc = le_crc_Crc32( (uint8_t *)vidHdrPtr, UBI_VID_HDR_SIZE_CRC, LE_CRC_START_CRC32 );
+        crc = crc32_Compute( (uint8_t *)vidHdrPtr, UBI_VID_HDR_SIZE_CRC, LE_CRC_START_CRC32 );
         vidHdrPtr->hdr_crc = htobe32(crc);
         LE_DEBUG("Update VID Header at %x: used_ebs %x, hdr_crc %x",
                  peb * descPtr->mtdInfo.eraseSize,
@@ -574,6 +766,7 @@ static le_result_t UpdateAllVidBlock
                                descPtr->mtdInfo.writeSize,
                                false);
         // Discard the error code as we just want to write a new EC header
+        PushFreePeb( descPtr, peb, be64toh(((struct ubi_ec_hdr *)blockPtr)->ec) );
     }
     return LE_OK;
 }
@@ -620,9 +813,9 @@ static le_result_t UpdateVtbl
         UpdateEraseCounter( descPtr, ecHdrPtr );
         vtblPtr = (struct ubi_vtbl_record *)(blockPtr + be32toh(ecHdrPtr->data_offset));
         vtblPtr[descPtr->ubiVolumeId].reserved_pebs = htobe32(reservedPebs);
-        crc = le_crc_Crc32( (uint8_t *)&vtblPtr[descPtr->ubiVolumeId],
-                            UBI_VTBL_RECORD_SIZE_CRC,
-                            LE_CRC_START_CRC32 );
+        crc = crc32_Compute( (uint8_t *)&vtblPtr[descPtr->ubiVolumeId],
+                             UBI_VTBL_RECORD_SIZE_CRC,
+                             LE_CRC_START_CRC32 );
         vtblPtr[descPtr->ubiVolumeId].crc = htobe32(crc);
         res = EraseUbiBlock( desc, &peb, blockPtr );
         if (LE_OK != res)
@@ -713,7 +906,7 @@ static le_result_t ReadEcHeader
         return LE_FAULT;
     }
 
-    crc = le_crc_Crc32((uint8_t*)ecHeaderPtr, UBI_EC_HDR_SIZE_CRC, LE_CRC_START_CRC32);
+    crc = crc32_Compute((uint8_t*)ecHeaderPtr, UBI_EC_HDR_SIZE_CRC, LE_CRC_START_CRC32);
     if (be32toh(ecHeaderPtr->hdr_crc) != crc)
     {
         LE_ERROR( "Bad CRC at %lx: Calculated %x, received %x",
@@ -793,7 +986,7 @@ static le_result_t ReadVidHeader
     }
 
     crc = LE_CRC_START_CRC32;
-    crc = le_crc_Crc32((uint8_t*)vidHeaderPtr, UBI_VID_HDR_SIZE_CRC, crc);
+    crc = crc32_Compute((uint8_t*)vidHeaderPtr, UBI_VID_HDR_SIZE_CRC, crc);
     if (be32toh(vidHeaderPtr->hdr_crc) != crc)
     {
         LE_ERROR( "Bad CRC at %lx: Calculated %x, received %x",
@@ -864,7 +1057,7 @@ static le_result_t ReadVtbl
         {
             continue;
         }
-        crc = le_crc_Crc32((uint8_t*)&vtblPtr[i], UBI_VTBL_RECORD_SIZE_CRC, LE_CRC_START_CRC32);
+        crc = crc32_Compute((uint8_t*)&vtblPtr[i], UBI_VTBL_RECORD_SIZE_CRC, LE_CRC_START_CRC32);
         if( be32toh(vtblPtr[i].crc) != crc )
         {
             LE_ERROR("VID %d : Bad CRC %x expected %x", i, crc, be32toh(vtblPtr[i].crc));
@@ -1002,6 +1195,7 @@ le_result_t pa_flash_ScanUbiForVolumes
     {
         return LE_BUSY;
     }
+    descPtr->isUbiFreePebPool = false;
     memset(descPtr->vtbl, 0, sizeof(struct ubi_vtbl_record) * PA_FLASH_UBI_MAX_VOLUMES);
     memset(descPtr->vtblPeb, -1, sizeof(descPtr->vtblPeb));
     memset(descPtr->ubiLebToMtdLeb, -1, sizeof(descPtr->ubiLebToMtdLeb));
@@ -1141,6 +1335,9 @@ le_result_t pa_flash_ScanUbi
     memset(descPtr->vtbl, 0, sizeof(struct ubi_vtbl_record) * PA_FLASH_UBI_MAX_VOLUMES);
     memset(descPtr->vtblPeb, -1, sizeof(descPtr->vtblPeb));
     memset(descPtr->ubiLebToMtdLeb, -1, sizeof(descPtr->ubiLebToMtdLeb));
+    // Build the free PEB pool while scanning, GetNewBlock() takes the new blocks from it
+    descPtr->ubiFreePebCnt = 0;
+    descPtr->isUbiFreePebPool = true;
 
     for( peb = 0; peb < infoPtr->nbBlk; peb++ )
     {
@@ -1162,6 +1359,7 @@ le_result_t pa_flash_ScanUbi
         if (LE_FORMAT_ERROR == res)
         {
             infoPtr->ubiPebFreeCount++;
+            PushFreePeb( descPtr, peb, 0 );
             continue;
         }
         else if (LE_OK != res)
@@ -1172,6 +1370,7 @@ le_result_t pa_flash_ScanUbi
         if (LE_FORMAT_ERROR == res)
         {
             infoPtr->ubiPebFreeCount++;
+            PushFreePeb( descPtr, peb, be64toh(ecHeader.ec) );
             continue;
         }
         if (LE_OK != res)
@@ -1216,6 +1415,7 @@ le_result_t pa_flash_ScanUbi
         else if (ERASED_VALUE_32 == be32toh(vidHeader.vol_id))
         {
             infoPtr->ubiPebFreeCount++;
+            PushFreePeb( descPtr, peb, be64toh(ecHeader.ec) );
         }
         else
         {
@@ -1262,6 +1462,7 @@ le_result_t pa_flash_ScanUbi
     return LE_OK;
 
 error:
+    descPtr->isUbiFreePebPool = false;
     return res;
 }
 
@@ -1300,6 +1501,7 @@ le_result_t pa_flash_UnscanUbi
     memset(descPtr->ubiLebToMtdLeb, -1, sizeof(descPtr->ubiLebToMtdLeb));
     infoPtr->ubiPebFreeCount = 0;
     infoPtr->ubiVolFreeSize = 0;
+    descPtr->isUbiFreePebPool = false;
     return LE_OK;
 }
 
@@ -1589,9 +1791,9 @@ le_result_t pa_flash_WriteUbiAtBlock
     if( descPtr->vtblPtr->vol_type == UBI_VID_STATIC )
     {
         vidHdrPtr->data_size = htobe32(dataSize);
-        crc = le_crc_Crc32( dataPtr, dataSize, LE_CRC_START_CRC32 );
+        crc = crc32_Compute( dataPtr, dataSize, LE_CRC_START_CRC32 );
         vidHdrPtr->data_crc = htobe32(crc);
-        crc = le_crc_Crc32( (uint8_t *)vidHdrPtr, UBI_VID_HDR_SIZE_CRC, LE_CRC_START_CRC32 );
+        crc = crc32_Compute( (uint8_t *)vidHdrPtr, UBI_VID_HDR_SIZE_CRC, LE_CRC_START_CRC32 );
         vidHdrPtr->hdr_crc = htobe32(crc);
     }
     LE_DEBUG("Erase and write blk %d, size %lx at %lx", blk, dataOffset, blkOff);
@@ -1662,6 +1864,10 @@ le_result_t pa_flash_WriteUbiAtBlock
             LE_WARN("Skipping old PEB %u because unavailable", pebErase);
             res = LE_OK;
         }
+        else if( LE_OK == res )
+        {
+            PushFreePeb( descPtr, pebErase, be64toh(ecHdrPtr->ec) );
+        }
     }
 
 error:
@@ -2029,8 +2235,8 @@ le_result_t pa_flash_CreateUbi
             vidHeaderPtr->compat = 5;
             vidHeaderPtr->vol_id = htobe32(UBI_LAYOUT_VOLUME_ID);
             vidHeaderPtr->lnum = htobe32(nbVtblPeb);
-            crc = le_crc_Crc32( (uint8_t *)vidHeaderPtr,
-                                UBI_VID_HDR_SIZE_CRC, LE_CRC_START_CRC32 );
+            crc = crc32_Compute( (uint8_t *)vidHeaderPtr,
+                                 UBI_VID_HDR_SIZE_CRC, LE_CRC_START_CRC32 );
             vidHeaderPtr->hdr_crc = htobe32(crc);
             res = pa_flash_SeekAtOffset( desc, peb * infoPtr->eraseSize
                                                    + be32toh(ecHeaderPtr->vid_hdr_offset) );
@@ -2067,8 +2273,8 @@ le_result_t pa_flash_CreateUbi
             memset(vtblPtr, 0, sizeof(struct ubi_vtbl_record) * UBI_MAX_VOLUMES);
             for( vol = 0; vol < UBI_MAX_VOLUMES; vol++ )
             {
-                crc = le_crc_Crc32( (uint8_t *)&vtblPtr[vol],
-                                    UBI_VTBL_RECORD_SIZE_CRC, LE_CRC_START_CRC32 );
+                crc = crc32_Compute( (uint8_t *)&vtblPtr[vol],
+                                     UBI_VTBL_RECORD_SIZE_CRC, LE_CRC_START_CRC32 );
                 vtblPtr[vol].crc = htobe32(crc);
             }
             res = pa_flash_SeekAtOffset( desc, peb * infoPtr->eraseSize
@@ -2256,8 +2462,8 @@ le_result_t pa_flash_CreateUbiVolume
         // If volume is static, the number of PEBs used for this volume must be set
         // It needs always one PEB, even if no data are in written in the volume
         vidHeaderPtr->used_ebs = htobe32(1);
-        crc = le_crc_Crc32( (uint8_t *)vidHeaderPtr,
-                            UBI_VID_HDR_SIZE_CRC, LE_CRC_START_CRC32 );
+        crc = crc32_Compute( (uint8_t *)vidHeaderPtr,
+                             UBI_VID_HDR_SIZE_CRC, LE_CRC_START_CRC32 );
         vidHeaderPtr->hdr_crc = htobe32(crc);
         res = pa_flash_SeekAtOffset( desc,
                                      volPeb * infoPtr->eraseSize
@@ -2303,9 +2509,9 @@ le_result_t pa_flash_CreateUbiVolume
         vtblPtr[ubiVolId].reserved_pebs = htobe32(volPebs);
         vtblPtr[ubiVolId].alignment = htobe32(1);
         vtblPtr[ubiVolId].vol_type = ubiVolType;
-        crc = le_crc_Crc32( (uint8_t *)&vtblPtr[ubiVolId],
-                            UBI_VTBL_RECORD_SIZE_CRC,
-                            LE_CRC_START_CRC32 );
+        crc = crc32_Compute( (uint8_t *)&vtblPtr[ubiVolId],
+                             UBI_VTBL_RECORD_SIZE_CRC,
+                             LE_CRC_START_CRC32 );
         vtblPtr[ubiVolId].crc = htobe32(crc);
         // Erase the VTBL block
         res = EraseUbiBlock( desc, &peb, blockPtr );
@@ -2483,9 +2689,9 @@ le_result_t pa_flash_DeleteUbiVolume
         vtblPtr = (struct ubi_vtbl_record *)(blockPtr + be32toh(ecHeaderPtr->data_offset));
         // Set all the record bytes to 0 and update the CRC of this record
         memset(&vtblPtr[descPtr->ubiVolumeId], 0, sizeof(struct ubi_vtbl_record));
-        crc = le_crc_Crc32( (uint8_t *)&vtblPtr[descPtr->ubiVolumeId],
-                            UBI_VTBL_RECORD_SIZE_CRC,
-                            LE_CRC_START_CRC32 );
+        crc = crc32_Compute( (uint8_t *)&vtblPtr[descPtr->ubiVolumeId],
+                             UBI_VTBL_RECORD_SIZE_CRC,
+                             LE_CRC_START_CRC32 );
         vtblPtr[descPtr->ubiVolumeId].crc = htobe32(crc);
         // Erase the VTBL block
         res = EraseUbiBlock( desc, &peb, blockPtr );
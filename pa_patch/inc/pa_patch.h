@@ -60,7 +60,16 @@ pa_patch_ImageDesc_t;
 
 //--------------------------------------------------------------------------------------------------
 /**
- * Context for the patch
+ * Opaque patch descriptor for patch access functions
+ */
+//--------------------------------------------------------------------------------------------------
+typedef void *pa_patch_Desc_t;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Context for the patch. If descPtr is not NULL, pa_patch_Open stores the descriptor opened for
+ * this context into it, and pa_patch_Close resets it to NULL. This lets the owner of the context
+ * flush a patch opened by another module, bsPatch() for instance.
  */
 //--------------------------------------------------------------------------------------------------
 typedef struct
@@ -75,16 +84,10 @@ typedef struct
     size_t               destImageSize;  ///< Full size of the image for destination
     uint32_t             destImageCrc32; ///< CRC32 of the image for destination
     pa_patch_ImageDesc_t destImageDesc;  ///< Device description for destination
+    pa_patch_Desc_t     *descPtr;        ///< Descriptor opened for this context, may be NULL
 }
 pa_patch_Context_t;
 
-//--------------------------------------------------------------------------------------------------
-/**
- * Opaque patch descriptor for patch access functions
- */
-//--------------------------------------------------------------------------------------------------
-typedef void *pa_patch_Desc_t;
-
 //--------------------------------------------------------------------------------------------------
 /**
  * Public functions for PATCH access
@@ -114,7 +117,8 @@ le_result_t pa_patch_Open
 
 //--------------------------------------------------------------------------------------------------
 /**
- * Close a patch descriptor
+ * Close a patch descriptor. For a RAW flash destination, the segments not yet written are written
+ * before if update is set, else they are dropped.
  *
  * @return
  *      - LE_OK            On success
@@ -157,6 +161,9 @@ le_result_t pa_patch_ReadSegment
  * the error LE_IO_ERROR is returned and operation is aborted.
  * Note that the block should be erased before the first write (pa_patch_EraseAtBlock)
  * Note that the length should be a multiple of writeSize and should not be greater than eraseSize
+ * For a RAW flash destination, the data are copied and written in background in the order of the
+ * calls: a write failure is returned by pa_patch_Flush or by the next call to pa_patch_WriteSegment
+ * or pa_patch_Close.
  *
  * @return
  *      - LE_OK            On success
@@ -174,4 +181,21 @@ le_result_t pa_patch_WriteSegment
     size_t newSize            ///< [IN] Size of data to write
 );
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Flush a patch descriptor: wait for the segments given to pa_patch_WriteSegment to be written
+ * into the destination. It should be called before the progress of the patch is saved, so that
+ * the saved progress never covers segments which are not in flash yet.
+ *
+ * @return
+ *      - LE_OK            On success
+ *      - LE_BAD_PARAMETER If desc is NULL or not a valid patch descriptor
+ *      - others           The result of the first failed write
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t pa_patch_Flush
+(
+    pa_patch_Desc_t desc      ///< [IN] Private patch descriptor
+);
+
 #endif // LEGATO_PA_PATCH_INCLUDE_GUARD
@@ -9,6 +9,61 @@
 #include "pa_patch.h"
 #include "pa_flash.h"
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Compare-before-program: if set to 1, each block of a RAW flash destination is read before being
+ * written, and it is neither erased nor programmed when it already holds the patched data
+ */
+//--------------------------------------------------------------------------------------------------
+#ifndef PA_FWUPDATE_COMPARE_BEFORE_WRITE
+#define PA_FWUPDATE_COMPARE_BEFORE_WRITE  0
+#endif
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Number of RAW flash segments which may be queued to the flash committer. Each queued segment
+ * holds a copy of PA_PATCH_MAX_SEGMENTSIZE bytes, so this bounds the memory used by the patch to
+ * (2 + PA_PATCH_MAX_PENDING_SEGMENTS) segment buffers, plus one with compare-before-program.
+ */
+//--------------------------------------------------------------------------------------------------
+#define PA_PATCH_MAX_PENDING_SEGMENTS  2
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Segment queued to the flash committer
+ */
+//--------------------------------------------------------------------------------------------------
+typedef struct
+{
+    off_t    offset;   ///< Offset of the segment into the destination
+    uint8_t *dataPtr;  ///< Copy of the segment data, allocated from PatchSegmentPool
+    size_t   size;     ///< Size to write, multiple of the erase size
+}
+pa_patch_PendingSegment_t;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Flash committer of a RAW flash patch. The segments given to pa_patch_WriteSegment are copied and
+ * queued, and the committer thread erases and writes them in order into the destination while the
+ * caller goes on with the next segment. A write failure is sticky: the segments queued after it
+ * are dropped and the error is returned by the next pa_patch_WriteSegment or by pa_patch_Close.
+ * Each patch descriptor with a RAW flash destination owns its committer.
+ */
+//--------------------------------------------------------------------------------------------------
+typedef struct
+{
+    le_thread_Ref_t threadRef;  ///< Committer thread
+    le_mutex_Ref_t  mutexRef;   ///< Mutex protecting the fields below
+    le_sem_Ref_t    workSem;    ///< Posted to the committer when a segment is queued
+    le_sem_Ref_t    doneSem;    ///< Posted by the committer when a segment is handled
+    pa_patch_PendingSegment_t pending[PA_PATCH_MAX_PENDING_SEGMENTS]; ///< Queued segments
+    uint32_t        first;      ///< Index of the oldest queued segment
+    uint32_t        count;      ///< Number of queued segments, including the one being written
+    le_result_t     result;     ///< Result of the first failed write, LE_OK if none
+    bool            isAborted;  ///< Request the committer to exit
+}
+pa_patch_Committer_t;
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Internal descriptor type for patch access
@@ -26,6 +81,8 @@ typedef struct
     pa_flash_LebToPeb_t *flashDestLebToPeb;
     uint8_t *origDataPtr;
     uint8_t *destDataPtr;
+    uint8_t *cmpDataPtr;
+    pa_patch_Committer_t *committerPtr;
 }
 pa_patch_InternalDesc_t;
 
@@ -43,6 +100,308 @@ static le_mem_PoolRef_t PatchDescPool = NULL;
 //--------------------------------------------------------------------------------------------------
 le_mem_PoolRef_t PatchSegmentPool = NULL;
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Pool for the flash committers
+ */
+//--------------------------------------------------------------------------------------------------
+static le_mem_PoolRef_t PatchCommitterPool = NULL;
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Erase and write a segment into a RAW flash destination. With compare-before-program, the blocks
+ * which already hold the data are skipped. Any read failure is reported as a difference.
+ *
+ * @return
+ *      - LE_OK            On success
+ *      - others           Depending of the PA device used
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t WriteRawSegment
+(
+    pa_patch_InternalDesc_t *descPtr, ///< [IN] Internal patch descriptor
+    off_t offset,                     ///< [IN] Offset of the data to be written
+    uint8_t *dataPtr,                 ///< [IN] Pointer to data to be written
+    size_t newSize                    ///< [IN] Size of data to write
+)
+{
+    int blk, maxblk;
+    off_t blkOff;
+    le_result_t res;
+
+    maxblk = (newSize + (descPtr->flashDestInfo->eraseSize - 1))
+             / descPtr->flashDestInfo->eraseSize;
+    for( blk = 0; blk < maxblk; blk++ )
+    {
+        blkOff = (blk * descPtr->flashDestInfo->eraseSize) + offset;
+
+        LE_DEBUG("Erase and write blk %d, size %d at %lx to %x\n",
+                 blk, descPtr->flashDestInfo->eraseSize, blkOff,
+                 blk * descPtr->flashDestInfo->eraseSize );
+        LE_DEBUG("Erase and write blk %d, blkOff=%lx, _ph_offset=%lx\n",
+                 blk, blkOff, offset);
+        if( (descPtr->cmpDataPtr) &&
+            (LE_OK == pa_flash_ReadAtBlock( descPtr->flashDestDesc,
+                                            blkOff / descPtr->flashDestInfo->eraseSize,
+                                            descPtr->cmpDataPtr,
+                                            descPtr->flashDestInfo->eraseSize )) &&
+            (0 == memcmp( descPtr->cmpDataPtr,
+                          &dataPtr[blk * descPtr->flashDestInfo->eraseSize],
+                          descPtr->flashDestInfo->eraseSize )) )
+        {
+            LE_DEBUG("Blk %d at %lx already holds the data\n", blk, blkOff);
+            continue;
+        }
+        res = pa_flash_EraseBlock( descPtr->flashDestDesc,
+                                   blkOff / descPtr->flashDestInfo->eraseSize );
+        if (LE_OK != res)
+        {
+            return res;
+        }
+        res = pa_flash_SeekAtOffset( descPtr->flashDestDesc, blkOff );
+        if (LE_OK != res)
+        {
+            return res;
+        }
+        res = pa_flash_Write( descPtr->flashDestDesc,
+                              &dataPtr[blk * descPtr->flashDestInfo->eraseSize],
+                              descPtr->flashDestInfo->eraseSize);
+        if (LE_OK != res)
+        {
+            return res;
+        }
+    }
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Committer thread: write the queued segments in order. After a failure, the queued segments are
+ * released without being written.
+ */
+//--------------------------------------------------------------------------------------------------
+static void* CommitterThread
+(
+    void* contextPtr ///< [IN] Internal patch descriptor
+)
+{
+    pa_patch_InternalDesc_t *descPtr = (pa_patch_InternalDesc_t *)contextPtr;
+    pa_patch_Committer_t *cPtr = descPtr->committerPtr;
+    pa_patch_PendingSegment_t *segPtr;
+    le_result_t res;
+
+    for( ;; )
+    {
+        le_mutex_Lock( cPtr->mutexRef );
+        if( cPtr->isAborted )
+        {
+            le_mutex_Unlock( cPtr->mutexRef );
+            break;
+        }
+        if( 0 == cPtr->count )
+        {
+            le_mutex_Unlock( cPtr->mutexRef );
+            le_sem_Wait( cPtr->workSem );
+            continue;
+        }
+        segPtr = &cPtr->pending[cPtr->first];
+        res = cPtr->result;
+        le_mutex_Unlock( cPtr->mutexRef );
+
+        if( LE_OK == res )
+        {
+            res = WriteRawSegment( descPtr, segPtr->offset, segPtr->dataPtr, segPtr->size );
+            if( LE_OK != res )
+            {
+                LE_ERROR("Failed to write segment at offset %lx: %d", segPtr->offset, res);
+            }
+        }
+        le_mem_Release( segPtr->dataPtr );
+        segPtr->dataPtr = NULL;
+
+        le_mutex_Lock( cPtr->mutexRef );
+        cPtr->result = res;
+        cPtr->first = (cPtr->first + 1) % PA_PATCH_MAX_PENDING_SEGMENTS;
+        cPtr->count--;
+        le_mutex_Unlock( cPtr->mutexRef );
+        le_sem_Post( cPtr->doneSem );
+    }
+
+    return NULL;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Start the flash committer of a RAW flash patch descriptor
+ */
+//--------------------------------------------------------------------------------------------------
+static void StartCommitter
+(
+    pa_patch_InternalDesc_t *descPtr ///< [IN] Internal patch descriptor
+)
+{
+    pa_patch_Committer_t *cPtr;
+
+    if( (!PatchCommitterPool) )
+    {
+        PatchCommitterPool = le_mem_CreatePool("Patch Committer Pool",
+                                               sizeof(pa_patch_Committer_t) );
+        le_mem_ExpandPool( PatchCommitterPool, 1 );
+    }
+    cPtr = le_mem_ForceAlloc(PatchCommitterPool);
+    memset( cPtr, 0, sizeof(pa_patch_Committer_t) );
+    cPtr->result = LE_OK;
+    cPtr->mutexRef = le_mutex_CreateNonRecursive("PatchCommitter");
+    cPtr->workSem = le_sem_Create("PatchCommitWork", 0);
+    cPtr->doneSem = le_sem_Create("PatchCommitDone", 0);
+    descPtr->committerPtr = cPtr;
+
+    cPtr->threadRef = le_thread_Create("PatchCommitter", CommitterThread, descPtr);
+    le_thread_SetJoinable( cPtr->threadRef );
+    le_thread_Start( cPtr->threadRef );
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Stop the flash committer of a patch descriptor. If isFlushed is set, all the queued segments are
+ * written before. Else they are dropped.
+ *
+ * @return
+ *      - LE_OK            On success or if no committer is running
+ *      - others           The result of the first failed write
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t StopCommitter
+(
+    pa_patch_InternalDesc_t *descPtr, ///< [IN] Internal patch descriptor
+    bool isFlushed                    ///< [IN] Write the queued segments before stopping
+)
+{
+    pa_patch_Committer_t *cPtr = descPtr->committerPtr;
+    le_result_t res;
+
+    if( !cPtr )
+    {
+        return LE_OK;
+    }
+
+    le_mutex_Lock( cPtr->mutexRef );
+    while( isFlushed && cPtr->count )
+    {
+        le_mutex_Unlock( cPtr->mutexRef );
+        le_sem_Wait( cPtr->doneSem );
+        le_mutex_Lock( cPtr->mutexRef );
+    }
+    cPtr->isAborted = true;
+    le_mutex_Unlock( cPtr->mutexRef );
+    le_sem_Post( cPtr->workSem );
+    le_thread_Join( cPtr->threadRef, NULL );
+
+    // The committer has exited: release the segments it did not handle
+    for( ; cPtr->count; cPtr->count-- )
+    {
+        le_mem_Release( cPtr->pending[cPtr->first].dataPtr );
+        cPtr->first = (cPtr->first + 1) % PA_PATCH_MAX_PENDING_SEGMENTS;
+    }
+    res = cPtr->result;
+
+    le_sem_Delete( cPtr->workSem );
+    le_sem_Delete( cPtr->doneSem );
+    le_mutex_Delete( cPtr->mutexRef );
+    descPtr->committerPtr = NULL;
+    le_mem_Release( cPtr );
+
+    return res;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Wait for all the segments queued to the flash committer to be written
+ *
+ * @return
+ *      - LE_OK            On success or if no committer is running
+ *      - others           The result of the first failed write
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t FlushCommitter
+(
+    pa_patch_InternalDesc_t *descPtr ///< [IN] Internal patch descriptor
+)
+{
+    pa_patch_Committer_t *cPtr = descPtr->committerPtr;
+    le_result_t res;
+
+    if( !cPtr )
+    {
+        return LE_OK;
+    }
+
+    le_mutex_Lock( cPtr->mutexRef );
+    while( cPtr->count )
+    {
+        le_mutex_Unlock( cPtr->mutexRef );
+        le_sem_Wait( cPtr->doneSem );
+        le_mutex_Lock( cPtr->mutexRef );
+    }
+    res = cPtr->result;
+    le_mutex_Unlock( cPtr->mutexRef );
+
+    return res;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Copy a segment and queue it to the flash committer. If the queue is full, wait for the oldest
+ * segment to be written.
+ *
+ * @return
+ *      - LE_OK            On success
+ *      - others           The result of a previous failed write
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t QueueRawSegment
+(
+    pa_patch_InternalDesc_t *descPtr, ///< [IN] Internal patch descriptor
+    off_t offset,                     ///< [IN] Offset of the data to be written
+    uint8_t *dataPtr,                 ///< [IN] Pointer to data to be written
+    size_t size                       ///< [IN] Size of data to write, multiple of the erase size
+)
+{
+    pa_patch_Committer_t *cPtr = descPtr->committerPtr;
+    pa_patch_PendingSegment_t *segPtr;
+    uint8_t *copyPtr;
+    le_result_t res;
+
+    le_mutex_Lock( cPtr->mutexRef );
+    while( (PA_PATCH_MAX_PENDING_SEGMENTS == cPtr->count) && (LE_OK == cPtr->result) )
+    {
+        le_mutex_Unlock( cPtr->mutexRef );
+        le_sem_Wait( cPtr->doneSem );
+        le_mutex_Lock( cPtr->mutexRef );
+    }
+    res = cPtr->result;
+    le_mutex_Unlock( cPtr->mutexRef );
+    if( LE_OK != res )
+    {
+        return res;
+    }
+
+    // Only the caller adds segments: a free slot remains free until it is filled below
+    copyPtr = le_mem_ForceAlloc(PatchSegmentPool);
+    memcpy( copyPtr, dataPtr, size );
+
+    le_mutex_Lock( cPtr->mutexRef );
+    segPtr = &cPtr->pending[(cPtr->first + cPtr->count) % PA_PATCH_MAX_PENDING_SEGMENTS];
+    segPtr->offset = offset;
+    segPtr->dataPtr = copyPtr;
+    segPtr->size = size;
+    cPtr->count++;
+    le_mutex_Unlock( cPtr->mutexRef );
+    le_sem_Post( cPtr->workSem );
+
+    return LE_OK;
+}
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Open a patch context and return a patch descriptor
@@ -244,8 +603,19 @@ le_result_t pa_patch_Open
     descPtr->destDataPtr = le_mem_ForceAlloc(PatchSegmentPool);
     *origDataPtr = descPtr->origDataPtr;
     *destDataPtr = descPtr->destDataPtr;
+    if( PA_PATCH_IMAGE_RAWFLASH == descPtr->context.destImage )
+    {
+#if PA_FWUPDATE_COMPARE_BEFORE_WRITE
+        descPtr->cmpDataPtr = le_mem_ForceAlloc(PatchSegmentPool);
+#endif
+        StartCommitter( descPtr );
+    }
     descPtr->magic = (pa_patch_Desc_t *)descPtr;
     *desc = (pa_patch_Desc_t*)descPtr;
+    if( ctx->descPtr )
+    {
+        *ctx->descPtr = *desc;
+    }
     return LE_OK;
 
 erroropen:
@@ -290,7 +660,7 @@ le_result_t pa_patch_Close
 {
     pa_patch_InternalDesc_t *descPtr = (pa_patch_InternalDesc_t *)desc;
     uint32_t blk;
-    le_result_t res = LE_OK;;
+    le_result_t res;
 
     if( (!desc) || (descPtr->magic != desc) )
     {
@@ -298,6 +668,18 @@ le_result_t pa_patch_Close
     }
 
     descPtr->magic = NULL;
+    if( descPtr->context.descPtr )
+    {
+        *descPtr->context.descPtr = NULL;
+    }
+
+    // Without update, the patch is aborted: the segments not yet written are dropped
+    res = StopCommitter( descPtr, update );
+    if( LE_OK != res )
+    {
+        LE_ERROR("Failed to commit the patch segments: %d\n", res);
+        update = false;
+    }
 
     if( update )
     {
@@ -330,6 +712,10 @@ le_result_t pa_patch_Close
     {
         pa_flash_Close( descPtr->flashOrigDesc );
     }
+    if( descPtr->cmpDataPtr )
+    {
+        le_mem_Release(descPtr->cmpDataPtr);
+    }
     if( descPtr->destDataPtr )
     {
         le_mem_Release(descPtr->destDataPtr);
@@ -445,7 +831,6 @@ le_result_t pa_patch_WriteSegment
 {
     pa_patch_InternalDesc_t *descPtr = (pa_patch_InternalDesc_t *)desc;
     int blk, maxblk;
-    off_t blkOff;
     le_result_t res;
 
     if( (!desc) || (descPtr->magic != desc) )
@@ -458,35 +843,17 @@ le_result_t pa_patch_WriteSegment
         case PA_PATCH_IMAGE_RAWFLASH:
             maxblk = (newSize + (descPtr->flashDestInfo->eraseSize - 1))
                      / descPtr->flashDestInfo->eraseSize;
-            for( blk = 0; blk < maxblk; blk++ )
+            if( (maxblk * descPtr->flashDestInfo->eraseSize) > PA_PATCH_MAX_SEGMENTSIZE )
             {
-                blkOff = (blk * descPtr->flashDestInfo->eraseSize) + offset;
-
-                LE_DEBUG("Erase and write blk %d, size %d at %lx to %x\n",
-                         blk, descPtr->flashDestInfo->eraseSize, blkOff,
-                         blk * descPtr->flashDestInfo->eraseSize );
-                LE_DEBUG("Erase and write blk %d, blkOff=%lx, _ph_offset=%lx\n",
-                         blk, blkOff, offset);
-                res = pa_flash_EraseBlock( descPtr->flashDestDesc,
-                                           blkOff / descPtr->flashDestInfo->eraseSize );
-                if (LE_OK != res)
-                {
-                    return res;
-                }
-                res = pa_flash_SeekAtOffset( descPtr->flashDestDesc, blkOff );
-                if (LE_OK != res)
-                {
-                    return res;
-                }
-                res = pa_flash_Write( descPtr->flashDestDesc,
-                                      &dataPtr[blk * descPtr->flashDestInfo->eraseSize],
-                                      descPtr->flashDestInfo->eraseSize);
-                if (LE_OK != res)
-                {
-                    return res;
-                }
+                return LE_OUT_OF_RANGE;
             }
-            break;
+            if( !descPtr->committerPtr )
+            {
+                return WriteRawSegment( descPtr, offset, dataPtr,
+                                        maxblk * descPtr->flashDestInfo->eraseSize );
+            }
+            return QueueRawSegment( descPtr, offset, dataPtr,
+                                    maxblk * descPtr->flashDestInfo->eraseSize );
         case PA_PATCH_IMAGE_UBIFLASH:
              blk = offset / descPtr->context.segmentSize;
              res = pa_flash_WriteUbiAtBlock( descPtr->flashDestDesc,
@@ -499,6 +866,30 @@ le_result_t pa_patch_WriteSegment
         default:
             return LE_UNSUPPORTED;
     }
-    return LE_OK;
 }
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * Flush a patch descriptor: wait for the segments given to pa_patch_WriteSegment to be written
+ * into the destination. It should be called before the progress of the patch is saved, so that
+ * the saved progress never covers segments which are not in flash yet.
+ *
+ * @return
+ *      - LE_OK            On success
+ *      - LE_BAD_PARAMETER If desc is NULL or not a valid patch descriptor
+ *      - others           The result of the first failed write
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t pa_patch_Flush
+(
+    pa_patch_Desc_t desc      ///< [IN] Private patch descriptor
+)
+{
+    pa_patch_InternalDesc_t *descPtr = (pa_patch_InternalDesc_t *)desc;
+
+    if( (!desc) || (descPtr->magic != desc) )
+    {
+        return LE_BAD_PARAMETER;
+    }
+    return FlushCommitter( descPtr );
+}